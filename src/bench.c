@@ -0,0 +1,468 @@
+/*
+* Description: microbenchmarks of the hot paths, without a mount
+*
+* License: BSD-style license
+*
+* Details:
+*	Sets up a union of <branches> directories below a temporary
+*	directory, the first one rw and the others ro, the same way the
+*	options of a mount do, and calls the code of the operations
+*	directly instead of going through FUSE and the kernel:
+*
+*	lookup     find_rorw_branch() of a path at each depth that only the
+*	           lowest branch has, for 1, 2, 4, ... of the branches,
+*	           and of a path no branch has
+*	readdir    unionfs_readdir() of a directory with <entries> names
+*	           on every branch, half of them shared with the branch
+*	           above, and a whiteout of every 100th of them
+*	drm        drmm_rec_insert() and drmm_rec_find_overlaps() on a map
+*	           fragmented by <extents> random extents, and the same on
+*	           a drmm_map
+*	cowolf     random 4k cowolf_read() and cowolf_pwrite() calls on a
+*	           file of <size> MiB copied up with -o cowolf
+*	copyup     cow_cp() of a file of <size> MiB, best of 3
+*
+*	The results are printed as JSON on stdout, one object per
+*	measurement in "results", so that they can be compared between
+*	builds. All files are in the page cache, so the numbers are the CPU
+*	and syscall costs of unionfs itself, not those of the disks.
+*
+*	Usage: unionfs-bench [-b branches] [-d depth] [-e entries]
+*	                     [-m extents] [-n ops] [-s size] [-t dir]
+*/
+
+#define _XOPEN_SOURCE 700	// for nftw()
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "string.h"
+#include "version.h"
+#include "findbranch.h"
+#include "readdir.h"
+#include "drm_mem.h"
+#include "cow.h"
+#include "cowolf.h"
+
+#define BENCH_IO_SIZE 4096
+#define BENCH_COPY_ROUNDS 3
+
+static char root[PATHLEN_MAX];
+static bool first_result = true;
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static uint64_t rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what) {
+	fprintf(stderr, "%s failed: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+/**
+ * Start the JSON object of a measurement, the fields follow as
+ * ", \"key\": value" and result_end() closes it.
+ */
+static void result_begin(const char *bench) {
+	printf("%s\n\t\t{\"bench\": \"%s\"", first_result ? "" : ",", bench);
+	first_result = false;
+}
+
+static void result_end(double seconds, unsigned long ops) {
+	printf(", \"ops\": %lu, \"seconds\": %.6f, \"ns_per_op\": %.1f}",
+		ops, seconds, seconds * 1e9 / ops);
+}
+
+/**
+ * The path of the union path on branch, below root.
+ */
+static void branch_file(char *p, int branch, const char *path) {
+	if (snprintf(p, PATHLEN_MAX, "%s/b%d%s", root, branch, path) >= PATHLEN_MAX) {
+		errno = ENAMETOOLONG;
+		fail(path);
+	}
+}
+
+/**
+ * mkdir -p of the union path on branch
+ */
+static void make_dirs(int branch, const char *path) {
+	char p[PATHLEN_MAX];
+	branch_file(p, branch, path);
+
+	char *slash = p + strlen(root) + 1;
+	while ((slash = strchr(slash + 1, '/')) != NULL) {
+		*slash = '\0';
+		if (mkdir(p, 0755) == -1 && errno != EEXIST) fail(p);
+		*slash = '/';
+	}
+	if (mkdir(p, 0755) == -1 && errno != EEXIST) fail(p);
+}
+
+static void make_file(int branch, const char *path, off_t size) {
+	char p[PATHLEN_MAX];
+	branch_file(p, branch, path);
+
+	int fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) fail(p);
+
+	// real data, so that nothing is copied as a hole
+	char buf[65536];
+	memset(buf, 'x', sizeof(buf));
+	off_t done = 0;
+	while (done < size) {
+		size_t n = size - done < (off_t)sizeof(buf) ? (size_t)(size - done) : sizeof(buf);
+		if (write(fd, buf, n) != (ssize_t)n) fail(p);
+		done += n;
+	}
+
+	close(fd);
+}
+
+static void setup_union(int nbranches) {
+	int i;
+	for (i = 0; i < nbranches; i++) {
+		char p[PATHLEN_MAX];
+		if (snprintf(p, PATHLEN_MAX, "%s/b%d=%s", root, i, i == 0 ? "RW" : "RO") >= PATHLEN_MAX) {
+			errno = ENAMETOOLONG;
+			fail(root);
+		}
+
+		char *dir = strchr(p + strlen(root), '=');
+		*dir = '\0';
+		if (mkdir(p, 0755) == -1) fail(p);
+		*dir = '=';
+
+		add_branch(p);
+	}
+
+	uopt.cow_enabled = true;
+	unionfs_post_opts();
+}
+
+static void bench_lookup(int nbranches, int depth, unsigned long ops) {
+	int total = uopt.nbranches;
+
+	int k = 1;
+	for (;;) {
+		// the union is cut down to the upper k branches
+		uopt.nbranches = k;
+
+		char path[PATHLEN_MAX];
+		int len = snprintf(path, PATHLEN_MAX, "/lookup%d", k);
+
+		int d;
+		for (d = 1; d <= depth; d++) {
+			make_dirs(k - 1, path);
+			len += snprintf(path + len, PATHLEN_MAX - len, "/d%d", d);
+			make_file(k - 1, path, 0);
+
+			if (find_rorw_branch(path) != k - 1) fail("lookup");
+
+			unsigned long i;
+			double t = now();
+			for (i = 0; i < ops; i++) find_rorw_branch(path);
+			t = now() - t;
+
+			result_begin("lookup");
+			printf(", \"branches\": %d, \"depth\": %d", k, d);
+			result_end(t, ops);
+
+			// the next depth is below this one
+			char p[PATHLEN_MAX];
+			branch_file(p, k - 1, path);
+			if (unlink(p) == -1) fail(p);
+		}
+
+		strcat(path, "/missing");
+		unsigned long i;
+		double t = now();
+		for (i = 0; i < ops; i++) find_rorw_branch(path);
+		t = now() - t;
+
+		result_begin("lookup_miss");
+		printf(", \"branches\": %d, \"depth\": %d", k, depth + 1);
+		result_end(t, ops);
+
+		if (k == nbranches) break;
+		k = k * 2 < nbranches ? k * 2 : nbranches;
+	}
+
+	uopt.nbranches = total;
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)name;
+	(void)stbuf;
+	(void)off;
+
+	(*(unsigned long *)buf)++;
+	return 0;
+}
+
+static void bench_readdir(unsigned long entries, unsigned long ops) {
+	const char *path = "/readdir";
+	make_dirs(0, "/" METANAME "/readdir");
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		make_dirs(i, path);
+
+		unsigned long j;
+		for (j = 0; j < entries; j++) {
+			char name[PATHLEN_MAX];
+			unsigned long n = i * entries / 2 + j;
+			snprintf(name, PATHLEN_MAX, "%s/file-%08lu.dat", path, n);
+			make_file(i, name, 0);
+
+			if (i == 0 || n % 100) continue;
+
+			snprintf(name, PATHLEN_MAX, "/%s%s/file-%08lu.dat%s", METANAME, path, n, HIDETAG);
+			make_file(0, name, 0);
+		}
+	}
+
+	unsigned long listed = 0;
+	unsigned long r;
+	double t = now();
+	for (r = 0; r < ops; r++) {
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(fi));
+
+		if (unionfs_opendir(path, &fi)) fail("opendir");
+		listed = 0;
+		if (unionfs_readdir(path, &listed, count_entry, 0, &fi)) fail("readdir");
+		unionfs_releasedir(path, &fi);
+	}
+	t = now() - t;
+
+	result_begin("readdir");
+	printf(", \"branches\": %d, \"entries\": %lu, \"listed\": %lu", uopt.nbranches, entries, listed);
+	result_end(t, ops);
+}
+
+static void bench_drm(unsigned long extents, unsigned long ops) {
+	// leave gaps, so that the extents do not merge
+	uint64_t space = extents * 64;
+
+	struct drmm_rec *ext = malloc(extents * sizeof(struct drmm_rec));
+	struct drmm_rec *recs = malloc((extents + 1) * sizeof(struct drmm_rec));
+	struct drmm_map *map = drmm_map_new();
+	if (ext == NULL || recs == NULL || map == NULL) fail("malloc");
+
+	unsigned long i;
+	for (i = 0; i < extents; i++) {
+		ext[i].off_start = rnd() % space;
+		ext[i].off_end = ext[i].off_start + rnd() % 16;
+	}
+
+	double t = now();
+	unsigned int num_rec = 0;
+	for (i = 0; i < extents; i++) num_rec = drmm_rec_insert(&ext[i], recs, num_rec);
+	t = now() - t;
+
+	result_begin("drmm_rec_insert");
+	printf(", \"extents\": %lu, \"records\": %u", extents, num_rec);
+	result_end(t, extents);
+
+	unsigned long found = 0;
+	t = now();
+	for (i = 0; i < ops; i++) {
+		unsigned int first;
+		found += drmm_rec_find_overlaps(rnd() % space, 256, recs, num_rec, &first);
+	}
+	t = now() - t;
+
+	result_begin("drmm_rec_find_overlaps");
+	printf(", \"records\": %u, \"found\": %lu", num_rec, found);
+	result_end(t, ops);
+
+	t = now();
+	for (i = 0; i < extents; i++) {
+		if (drmm_map_insert(map, &ext[i])) fail("drmm_map_insert");
+	}
+	t = now() - t;
+
+	result_begin("drmm_map_insert");
+	printf(", \"extents\": %lu, \"records\": %lu", extents, drmm_map_count(map));
+	result_end(t, extents);
+
+	found = 0;
+	t = now();
+	for (i = 0; i < ops; i++) {
+		struct drmm_iter iter;
+		if (drmm_map_find(map, rnd() % space, &iter)) found++;
+	}
+	t = now() - t;
+
+	result_begin("drmm_map_find");
+	printf(", \"records\": %lu, \"found\": %lu", drmm_map_count(map), found);
+	result_end(t, ops);
+
+	drmm_map_free(map);
+	free(recs);
+	free(ext);
+}
+
+static void bench_cowolf(off_t size, unsigned long ops) {
+	const char *path = "/cowolf/file";
+	int lowest = uopt.nbranches - 1;
+	if (lowest == 0) return; // nothing to copy up from
+
+	make_dirs(lowest, "/cowolf");
+	make_file(lowest, path, size);
+
+	uopt.cowolf_enabled = true;
+	uopt.cowolf_fsize_th = 0;
+	if (cow_cp(path, lowest, 0, false)) fail("cowolf copy-up");
+
+	int fd = openat(uopt.branches[0].fd, branch_relpath(path), O_RDWR);
+	if (fd == -1) fail("open");
+
+	struct cwf_info cw = CWF_INFO_INITIALIZER;
+	if (cowolf_open(path, 0, O_RDWR, &cw)) fail("cowolf_open");
+
+	char buf[BENCH_IO_SIZE];
+	memset(buf, 'y', sizeof(buf));
+	off_t blocks = size / BENCH_IO_SIZE;
+
+	// all from the lower branch, then from a map fragmented by the writes
+	const char *names[] = { "cowolf_read", "cowolf_pwrite", "cowolf_read_fragmented" };
+	int p;
+	for (p = 0; p < 3; p++) {
+		unsigned long i;
+		double t = now();
+		for (i = 0; i < ops; i++) {
+			off_t off = (rnd() % blocks) * BENCH_IO_SIZE;
+			int res = p == 1 ? cowolf_pwrite(fd, &cw, buf, sizeof(buf), off)
+				: cowolf_read(fd, &cw, buf, sizeof(buf), off);
+			if (res != (int)sizeof(buf)) fail(names[p]);
+		}
+		t = now() - t;
+
+		result_begin(names[p]);
+		printf(", \"size\": %lld, \"io_size\": %d", (long long)size, BENCH_IO_SIZE);
+		result_end(t, ops);
+	}
+
+	cowolf_close(&cw);
+	close(fd);
+
+	uopt.cowolf_enabled = false;
+}
+
+static void bench_copyup(off_t size) {
+	const char *path = "/copyup/file";
+	int lowest = uopt.nbranches - 1;
+	if (lowest == 0) return;
+
+	make_dirs(lowest, "/copyup");
+	make_file(lowest, path, size);
+
+	double best = 0;
+	int r;
+	for (r = 0; r < BENCH_COPY_ROUNDS; r++) {
+		char p[PATHLEN_MAX];
+		branch_file(p, 0, path);
+		unlink(p);
+
+		double t = now();
+		if (cow_cp(path, lowest, 0, false)) fail("copy-up");
+		t = now() - t;
+
+		if (r == 0 || t < best) best = t;
+	}
+
+	result_begin("copyup");
+	printf(", \"size\": %lld, \"mib_per_s\": %.1f", (long long)size, size / best / (1024 * 1024));
+	result_end(best, 1);
+}
+
+static int remove_path(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void)st;
+	(void)flag;
+	(void)ftw;
+
+	return remove(path);
+}
+
+static void usage(const char *progname) {
+	fprintf(stderr, "Usage: %s [-b branches] [-d depth] [-e entries] [-m extents]"
+		" [-n ops] [-s size in MiB] [-t dir]\n", progname);
+	exit(1);
+}
+
+static unsigned long number(const char *arg, const char *progname) {
+	char *end;
+	unsigned long n = strtoul(arg, &end, 0);
+	if (*arg == '\0' || *end != '\0' || n == 0 || n > INT32_MAX) usage(progname);
+	return n;
+}
+
+int main(int argc, char **argv) {
+	int nbranches = 8;
+	int depth = 8;
+	unsigned long entries = 10000;
+	unsigned long extents = 20000;
+	unsigned long ops = 100000;
+	off_t size = 64;
+	const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:d:e:m:n:s:t:")) != -1) {
+		switch (opt) {
+		case 'b': nbranches = number(optarg, argv[0]); break;
+		case 'd': depth = number(optarg, argv[0]); break;
+		case 'e': entries = number(optarg, argv[0]); break;
+		case 'm': extents = number(optarg, argv[0]); break;
+		case 'n': ops = number(optarg, argv[0]); break;
+		case 's': size = number(optarg, argv[0]); break;
+		case 't': tmpdir = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	size *= 1024 * 1024;
+
+	snprintf(root, PATHLEN_MAX, "%s/unionfs-bench.XXXXXX", tmpdir);
+	if (mkdtemp(root) == NULL) fail(root);
+
+	uopt_init();
+	setup_union(nbranches);
+
+	printf("{\n\t\"version\": \"%s\",\n\t\"branches\": %d,\n\t\"results\": [", VERSION, nbranches);
+
+	bench_lookup(nbranches, depth, ops);
+	bench_readdir(entries, ops / 1000 ? ops / 1000 : 1);
+	bench_drm(extents, ops);
+	bench_cowolf(size, ops);
+	bench_copyup(size);
+
+	printf("\n\t]\n}\n");
+
+	nftw(root, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+* Description: benchmark of the in-memory data-range maps
+*
+* License: BSD-style license
+*
+* Details:
+*	Inserts the same random extents into a flat drmm_rec array, as
+*	drm_file.c used to keep it, and into a drmm_map. Prints the time
+*	both took and checks that they ended up with the same records.
+*
+*	Usage: bench_drm [<inserts> [<max extent length>]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "drm_mem.h"
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static uint64_t rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	unsigned long inserts = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	unsigned long max_len = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+
+	if (inserts == 0 || max_len == 0) {
+		fprintf(stderr, "Usage: %s [<inserts> [<max extent length>]]\n", argv[0]);
+		exit(1);
+	}
+
+	/* leave gaps, so that most extents do not merge */
+	uint64_t space = inserts * max_len * 4;
+
+	struct drmm_rec *ext = malloc(inserts * sizeof(struct drmm_rec));
+	struct drmm_rec *recs = malloc((inserts + 1) * sizeof(struct drmm_rec));
+	struct drmm_map *map = drmm_map_new();
+	if (ext == NULL || recs == NULL || map == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	unsigned long i;
+	for (i = 0; i < inserts; i++) {
+		ext[i].off_start = rnd() % space;
+		ext[i].off_end = ext[i].off_start + rnd() % max_len;
+	}
+
+	double t = now();
+	unsigned int num_rec = 0;
+	for (i = 0; i < inserts; i++) {
+		num_rec = drmm_rec_insert(&ext[i], recs, num_rec);
+	}
+	double t_array = now() - t;
+
+	t = now();
+	for (i = 0; i < inserts; i++) {
+		if (drmm_map_insert(map, &ext[i])) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	double t_map = now() - t;
+
+	int bad = drmm_map_count(map) != num_rec;
+	struct drmm_iter iter;
+	const struct drmm_rec *rec = drmm_map_find(map, 0, &iter);
+	for (i = 0; i < num_rec && !bad; i++, rec = drmm_map_next(&iter)) {
+		bad = rec == NULL || rec->off_start != recs[i].off_start
+			|| rec->off_end != recs[i].off_end;
+	}
+
+	printf("%lu inserts, %u records\n", inserts, num_rec);
+	printf("array: %.3fs, %.0f inserts/s\n", t_array, inserts / t_array);
+	printf("map:   %.3fs, %.0f inserts/s\n", t_map, inserts / t_map);
+
+	if (bad) {
+		fprintf(stderr, "The map does not match the array!\n");
+		exit(1);
+	}
+
+	drmm_map_free(map);
+	free(recs);
+	free(ext);
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+* Description: benchmark of the string sets of directory listings
+*
+* License: BSD-style license
+*
+* Details:
+*	Adds the names of a large directory to the chained hashtable with
+*	elfhash() and strdup()ed keys, as readdir.c used to keep them, and
+*	to a strset. Then looks every name up once more, as the next branch
+*	of a union with the same directory would, and frees the set. Prints
+*	the time per entry of both and checks that they found the same.
+*
+*	Usage: bench_strset [<entries>]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "string.h"
+#include "strset.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double t_add, double t_find, double t_free, unsigned long n) {
+	printf("%-10s add %6.1f ns, lookup %6.1f ns, free %6.1f ns per entry\n", name,
+		t_add * 1e9 / n, t_find * 1e9 / n, t_free * 1e9 / n);
+}
+
+int main(int argc, char **argv) {
+	unsigned long entries = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+	if (entries == 0) {
+		fprintf(stderr, "Usage: %s [<entries>]\n", argv[0]);
+		exit(1);
+	}
+
+	// names as written by many programs, which share long prefixes
+	char **names = malloc(entries * sizeof(char *));
+	if (names == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	unsigned long i;
+	for (i = 0; i < entries; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "file-%08lu.dat", i);
+		names[i] = strdup(name);
+		if (names[i] == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	double t = now();
+	struct hashtable *h = create_hashtable(16, string_hash, string_equal);
+	for (i = 0; i < entries; i++) {
+		if (hashtable_search(h, names[i]) != NULL) continue;
+		char *key = strdup(names[i]);
+		hashtable_insert(h, key, key);
+	}
+	double t_add = now() - t;
+
+	t = now();
+	unsigned long found_h = 0;
+	for (i = 0; i < entries; i++) {
+		if (hashtable_search(h, names[i]) != NULL) found_h++;
+	}
+	double t_find = now() - t;
+
+	t = now();
+	hashtable_destroy(h, 0);
+	double t_free = now() - t;
+	report("hashtable", t_add, t_find, t_free, entries);
+
+	t = now();
+	struct strset *set = strset_new();
+	for (i = 0; i < entries; i++) {
+		if (strset_add(set, names[i], NULL) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	t_add = now() - t;
+
+	t = now();
+	unsigned long found_s = 0;
+	for (i = 0; i < entries; i++) {
+		if (strset_find(set, names[i]) != NULL) found_s++;
+	}
+	t_find = now() - t;
+
+	bool bad = strset_count(set) != entries;
+
+	t = now();
+	strset_free(set);
+	t_free = now() - t;
+	report("strset", t_add, t_find, t_free, entries);
+
+	for (i = 0; i < entries; i++) free(names[i]);
+	free(names);
+
+	if (bad || found_h != entries || found_s != entries) {
+		fprintf(stderr, "The sets do not contain all entries!\n");
+		exit(1);
+	}
+
+	return 0;
+}
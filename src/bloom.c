@@ -0,0 +1,364 @@
+/*
+* Description: Bloom filters of the paths on the branches
+*
+* License: BSD-style license
+*
+* Details:
+*	find_branch() stats a path on every branch from the top until it is
+*	found, so a file of the lowest branch costs a failed lstat() on each
+*	branch above it. With -o bloom_filter we walk all branches on mount
+*	and keep a Bloom filter per branch of the paths on it, in the path
+*	format of fuse. A branch whose filter does not have a path certainly
+*	does not have it and is not statted, nor opened by readdir.
+*
+*	The filters of rw branches are built before the mount is used, our
+*	operations add the paths they create there before creating them, so
+*	lookups never miss them, renames of directories all their members.
+*	Paths removed later are only false positives.
+*	The ro branches can be large images, their filters are built in the
+*	background and used once complete. Branches added or made rw while
+*	mounted get a new filter the same way. Files created directly on the
+*	branches while mounted are not noticed. The meta directory is never
+*	filtered, since whiteouts are not added.
+*
+*	A filter has 16 bits per path found on mount, at least 2^20 bits,
+*	and sets 7 bits per path, which gives below 0.1% false positives
+*	until the number of paths on the branch doubled.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "string.h"
+#include "strset.h"
+#include "bloom.h"
+#include "branches.h"
+
+#define BLOOM_HASHES 7
+#define BLOOM_BITS_PER_PATH 16
+#define BLOOM_MIN_BITS (1UL << 20)
+
+struct bloom {
+	uint64_t *words;
+	uint64_t mask;		// number of bits - 1, a power of 2 - 1
+};
+
+// hashes of the paths found while walking a branch
+struct hash_list {
+	uint64_t *hashes;
+	size_t count;
+	size_t size;
+};
+
+// NULL as long as the filter of the branch is not complete
+static struct bloom **filters;
+
+/**
+ * The slashes around path are ignored, so "", "/" and "//" are all the root
+ * and "/dir/" is "dir", like for branch_relpath().
+ */
+static uint64_t path_hash(const char *path) {
+	while (*path == '/') path++;
+
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/') len--;
+
+	return strset_hash(path, len);
+}
+
+static void bloom_set(struct bloom *b, uint64_t hash) {
+	uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+	int i;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		uint64_t bit = (h1 + i * h2) & b->mask;
+		__atomic_fetch_or(&b->words[bit / 64], 1ULL << (bit % 64), __ATOMIC_SEQ_CST);
+	}
+}
+
+static bool bloom_test(const struct bloom *b, uint64_t hash) {
+	uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+	int i;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		uint64_t bit = (h1 + i * h2) & b->mask;
+		uint64_t word = __atomic_load_n(&b->words[bit / 64], __ATOMIC_SEQ_CST);
+		if (!(word & (1ULL << (bit % 64)))) return false;
+	}
+
+	return true;
+}
+
+static int list_add(struct hash_list *l, uint64_t hash) {
+	if (l->count == l->size) {
+		size_t size = l->size ? 2 * l->size : 4096;
+		uint64_t *hashes = realloc(l->hashes, size * sizeof(uint64_t));
+		if (hashes == NULL) RETURN(-ENOMEM);
+		l->hashes = hashes;
+		l->size = size;
+	}
+
+	l->hashes[l->count++] = hash;
+	RETURN(0);
+}
+
+/**
+ * Add the hashes of all paths below the directory path, which is open as
+ * fd, to the list. fd is closed.
+ */
+static int walk(int fd, char *path, struct hash_list *l) {
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		close(fd);
+		RETURN(-errno);
+	}
+
+	size_t len = strlen(path);
+	int res = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		size_t nlen = strlen(de->d_name);
+		if (len + nlen + 2 > PATHLEN_MAX) continue; // cannot be looked up anyway
+
+		if (len > 1) path[len] = '/';
+		memcpy(path + (len > 1 ? len + 1 : len), de->d_name, nlen + 1);
+
+		res = list_add(l, path_hash(path));
+		if (res) break;
+
+		bool dir;
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (de->d_type != DT_UNKNOWN) {
+			dir = de->d_type == DT_DIR;
+		} else
+#endif
+		{
+			struct stat st;
+			dir = fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISDIR(st.st_mode);
+		}
+
+		if (dir) {
+			// the members of a directory we cannot read might
+			// still be found, so the whole filter is useless then
+			int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			res = sub == -1 ? -errno : walk(sub, path, l);
+			if (res) break;
+		}
+
+		path[len] = '\0';
+	}
+	path[len] = '\0';
+
+	closedir(dp);
+	RETURN(res);
+}
+
+/**
+ * Walk a branch and build its filter.
+ */
+static struct bloom *build(int branch) {
+	struct hash_list l = { NULL, 0, 0 };
+	char path[PATHLEN_MAX] = "/";
+	struct bloom *b = NULL;
+
+	int fd = openat(uopt.branches[branch].fd, ".", O_RDONLY | O_DIRECTORY);
+	int res = fd == -1 ? -errno : walk(fd, path, &l);
+	if (res) goto out;
+
+	uint64_t nbits = BLOOM_MIN_BITS;
+	while (nbits < l.count * BLOOM_BITS_PER_PATH) nbits *= 2;
+
+	b = malloc(sizeof(struct bloom));
+	if (b) b->words = calloc(nbits / 64, sizeof(uint64_t));
+	if (b == NULL || b->words == NULL) {
+		free(b);
+		b = NULL;
+		res = -ENOMEM;
+		goto out;
+	}
+	b->mask = nbits - 1;
+
+	bloom_set(b, path_hash("/"));
+	size_t i;
+	for (i = 0; i < l.count; i++) bloom_set(b, l.hashes[i]);
+
+	DBG("branch %d: %zu paths, %llu bits\n", branch, l.count, (unsigned long long)nbits);
+
+out:
+	if (res) {
+		USYSLOG(LOG_WARNING, "Building the Bloom filter of %s failed: %s\n",
+			uopt.branches[branch].path, strerror(-res));
+	}
+	free(l.hashes);
+	return b;
+}
+
+// bumped whenever the filter of a branch is started again, protected by
+// builds_lock, so that an older build does not replace a newer filter
+static unsigned int *builds;
+static pthread_mutex_t builds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct build_arg {
+	int branch;
+	unsigned int gen;
+};
+
+/**
+ * Use b as the filter of branch, unless the filter was started again.
+ */
+static void publish(int branch, unsigned int gen, struct bloom *b) {
+	if (b == NULL) return;
+
+	pthread_mutex_lock(&builds_lock);
+	bool current = builds[branch] == gen;
+	if (current) __atomic_store_n(&filters[branch], b, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&builds_lock);
+
+	if (!current) {
+		free(b->words);
+		free(b);
+	}
+}
+
+static void *build_thread(void *arg) {
+	struct build_arg *a = arg;
+
+	branches_enter();
+	publish(a->branch, a->gen, build(a->branch));
+	branches_leave();
+
+	free(a);
+	return NULL;
+}
+
+/**
+ * Build the filter of branch, the ones of rw branches right away.
+ */
+static void start(int branch, unsigned int gen, bool rw) {
+	if (rw) {
+		// nothing may be created before the filter is complete
+		publish(branch, gen, build(branch));
+		return;
+	}
+
+	struct build_arg *a = malloc(sizeof(struct build_arg));
+	pthread_t thread;
+	if (a) {
+		a->branch = branch;
+		a->gen = gen;
+	}
+	if (a == NULL || pthread_create(&thread, NULL, build_thread, a)) {
+		USYSLOG(LOG_WARNING, "Starting the Bloom filter thread of %s failed\n",
+			uopt.branches[branch].path);
+		free(a);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+int bloom_init(void) {
+	if (!uopt.bloom_filter) RETURN(0);
+
+	filters = calloc(uopt.max_branches, sizeof(struct bloom *));
+	builds = calloc(uopt.max_branches, sizeof(unsigned int));
+	if (filters == NULL || builds == NULL) RETURN(-ENOMEM);
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) start(i, 0, uopt.branches[i].rw);
+
+	RETURN(0);
+}
+
+/**
+ * Build the filter of branch again, it was added while mounted or is going
+ * to become rw. Until the filter is complete the branch is not filtered.
+ */
+void bloom_branch_init(int branch, bool rw) {
+	if (filters == NULL) return;
+
+	pthread_mutex_lock(&builds_lock);
+	unsigned int gen = ++builds[branch];
+	// the old filter might still be in use by other threads, so it is not freed
+	__atomic_store_n(&filters[branch], NULL, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&builds_lock);
+
+	start(branch, gen, rw);
+}
+
+static struct bloom *filter(const char *path, int branch) {
+	if (filters == NULL) return NULL;
+
+	// whiteouts are not added
+	while (*path == '/') path++;
+	if (strncmp(path, METANAME, strlen(METANAME)) == 0) {
+		char c = path[strlen(METANAME)];
+		if (c == '\0' || c == '/') return NULL;
+	}
+
+	return __atomic_load_n(&filters[branch], __ATOMIC_SEQ_CST);
+}
+
+/**
+ * false if branch certainly does not have path.
+ */
+bool bloom_may_have(const char *path, int branch) {
+	struct bloom *b = filter(path, branch);
+	if (b == NULL) return true;
+
+	return bloom_test(b, path_hash(path));
+}
+
+/**
+ * path is going to be created on branch.
+ */
+void bloom_add(const char *path, int branch) {
+	struct bloom *b = filter(path, branch);
+	if (b) bloom_set(b, path_hash(path));
+}
+
+/**
+ * The directory from on branch is going to be renamed to to, add the
+ * paths of its members below to.
+ */
+void bloom_add_tree(const char *from, const char *to, int branch) {
+	struct bloom *b = filter(to, branch);
+	if (b == NULL) return;
+
+	bloom_set(b, path_hash(to));
+
+	char p[PATHLEN_MAX];
+	if (strlen(to) >= PATHLEN_MAX) return;
+	strcpy(p, to);
+
+	int fd = openat(uopt.branches[branch].fd, branch_relpath(from), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1) return; // not a directory
+
+	struct hash_list l = { NULL, 0, 0 };
+	if (walk(fd, p, &l)) {
+		// we cannot tell what is missing, the filter might still be
+		// in use by other threads, so it is not freed
+		USYSLOG(LOG_WARNING, "Adding %s to the Bloom filter failed, not filtering %s anymore\n",
+			to, uopt.branches[branch].path);
+		__atomic_store_n(&filters[branch], NULL, __ATOMIC_SEQ_CST);
+	}
+
+	size_t i;
+	for (i = 0; i < l.count; i++) bloom_set(b, l.hashes[i]);
+	free(l.hashes);
+}
@@ -0,0 +1,16 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+
+int bloom_init(void);
+void bloom_branch_init(int branch, bool rw);
+bool bloom_may_have(const char *path, int branch);
+void bloom_add(const char *path, int branch);
+void bloom_add_tree(const char *from, const char *to, int branch);
+
+#endif
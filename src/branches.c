@@ -0,0 +1,385 @@
+/*
+* Description: add, remove and change branches of a mounted union
+*
+* License: BSD-style license
+*
+* Details:
+*	unionfsctl -a, -r and -m add a branch, remove one or switch one
+*	between ro and rw without remounting, e.g. to put a new image below
+*	a container's union or to freeze its rw branch.
+*
+*	Everything refers to the branches by their index: the per-branch
+*	state of the whiteout index, redirects, Bloom filters, manifests and
+*	copy-up limits, the lookup cache and the open files. So the index of
+*	a branch never changes while mounted. Branches are only added below
+*	the lowest one and only the lowest one can be removed. The per-branch
+*	arrays are allocated once, with room for -o max_branches.
+*
+*	uopt.branches itself is never changed in place. The change is made
+*	to a copy, which is then published with a single pointer store, so
+*	other threads see either the old or the new entry of a branch. An
+*	added branch is set up completely before uopt.nbranches includes it,
+*	a removed one is dropped from uopt.nbranches first.
+*
+*	Whoever reads uopt.branches does so between branches_enter() and
+*	branches_leave(): the timing wrappers of stats.c for all fuse
+*	operations and the background threads for each piece of work. A
+*	thread in between announces the epoch it entered in. The old array
+*	and the descriptor and path of a removed branch are retired, a thread
+*	bumps the epoch and frees them once no thread is in between in an
+*	older epoch anymore, i.e. all operations which might still see them
+*	have returned. The low-level interface reads the branches outside of
+*	these operations, so with -o lowlevel the old arrays are kept.
+*
+*	Adding a branch changes the results of lookups which found nothing
+*	and of listings, removing one those found on it and the listings read
+*	from it, so only these are dropped from the lookup and readdir
+*	caches. The xattr cache checks the branch of each path itself. A
+*	branch switched between ro and rw still has the same files, only its
+*	Bloom filter and manifest are set up again. The kernel's caches time
+*	out as usual. Adding and removing is not available with -o lowlevel,
+*	whose nodes have a descriptor for each branch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "lookup_cache.h"
+#include "dir_cache.h"
+#include "whiteout_index.h"
+#include "redirect.h"
+#include "bloom.h"
+#include "manifest.h"
+#include "copy_qos.h"
+#include "branches.h"
+
+#define RETIRE_POLL_US 1000	// how often retire_thread() checks the readers
+
+// serializes the changes, readers do not lock
+static pthread_mutex_t branches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct branch_reader {
+	unsigned long epoch;	// entered in, 0 if outside, atomic
+	struct branch_reader *prev, *next;
+};
+
+// protects the list, not the epochs of the readers
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct branch_reader *readers;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+static unsigned long epoch = 1;		// atomic
+static unsigned long anonymous;		// readers without an entry, atomic
+
+static __thread struct branch_reader *reader;
+static __thread unsigned int depth;	// nested branches_enter()
+
+static void reader_exit(void *p) {
+	struct branch_reader *r = p;
+
+	pthread_mutex_lock(&readers_lock);
+	if (r->prev) r->prev->next = r->next;
+	else readers = r->next;
+	if (r->next) r->next->prev = r->prev;
+	pthread_mutex_unlock(&readers_lock);
+
+	free(r);
+}
+
+static void reader_key_init(void) {
+	pthread_key_create(&reader_key, reader_exit);
+}
+
+/**
+ * The entry of the calling thread, NULL if it cannot be allocated.
+ */
+static struct branch_reader *reader_get(void) {
+	if (reader) return reader;
+
+	pthread_once(&reader_once, reader_key_init);
+
+	struct branch_reader *r = calloc(1, sizeof(struct branch_reader));
+	if (r == NULL) return NULL;
+	if (pthread_setspecific(reader_key, r)) {
+		free(r);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&readers_lock);
+	r->next = readers;
+	if (readers) readers->prev = r;
+	readers = r;
+	pthread_mutex_unlock(&readers_lock);
+
+	reader = r;
+	return r;
+}
+
+/**
+ * uopt.branches and what it refers to may be read until branches_leave().
+ * Calls may be nested.
+ */
+void branches_enter(void) {
+	if (depth++ > 0) return;
+
+	struct branch_reader *r = reader_get();
+	if (r == NULL) {
+		__atomic_add_fetch(&anonymous, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	// either retire_thread() sees our epoch, or we see its new one
+	unsigned long e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+	while (1) {
+		__atomic_store_n(&r->epoch, e, __ATOMIC_SEQ_CST);
+		unsigned long now = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+		if (now == e) break;
+		e = now;
+	}
+}
+
+void branches_leave(void) {
+	if (--depth > 0) return;
+
+	if (reader) __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	else __atomic_sub_fetch(&anonymous, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Whether a thread is between branches_enter() and branches_leave() since
+ * before epoch e.
+ */
+static bool readers_before(unsigned long e) {
+	if (__atomic_load_n(&anonymous, __ATOMIC_SEQ_CST)) return true;
+
+	bool found = false;
+	pthread_mutex_lock(&readers_lock);
+	struct branch_reader *r;
+	for (r = readers; r && !found; r = r->next) {
+		unsigned long re = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		found = re != 0 && re < e;
+	}
+	pthread_mutex_unlock(&readers_lock);
+
+	return found;
+}
+
+/**
+ * A copy of the branches to change, with room for all of them.
+ */
+static branch_entry_t *copy_branches(void) {
+	branch_entry_t *b = calloc(uopt.max_branches, sizeof(branch_entry_t));
+	if (b) memcpy(b, uopt.branches, uopt.nbranches * sizeof(branch_entry_t));
+	return b;
+}
+
+// what is freed once no operation can see it anymore
+struct retired {
+	branch_entry_t *branches;	// an old array, or NULL
+	int fd;				// of a removed branch, or -1
+	char *path;			// of a removed branch, or NULL
+};
+
+static void *retire_thread(void *arg) {
+	struct retired *r = arg;
+
+	// who enters from now on sees the published changes
+	unsigned long e = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	while (readers_before(e)) usleep(RETIRE_POLL_US);
+
+	if (r->fd != -1) close(r->fd);
+	free(r->path);
+	free(r->branches);
+	free(r);
+	return NULL;
+}
+
+/**
+ * Free what running operations might still use, once they returned. The
+ * caller might be one of them.
+ */
+static void retire(branch_entry_t *branches, int fd, char *path) {
+	struct retired *r = malloc(sizeof(struct retired));
+	pthread_t thread;
+	if (r == NULL) goto err;
+	r->branches = branches;
+	r->fd = fd;
+	r->path = path;
+	if (pthread_create(&thread, NULL, retire_thread, r)) goto err;
+	pthread_detach(thread);
+	return;
+
+err:
+	USYSLOG(LOG_WARNING, "Starting a thread failed, the old branches are kept\n");
+	free(r);
+}
+
+static void publish(branch_entry_t *b) {
+	branch_entry_t *old = uopt.branches;
+	__atomic_store_n(&uopt.branches, b, __ATOMIC_SEQ_CST);
+
+	// the low-level interface reads it outside of branches_enter()
+	if (!uopt.lowlevel) retire(old, -1, NULL);
+}
+
+/**
+ * Add the directory path below the lowest branch. path is absolute, in the
+ * chroot if there is one. Returns the index of the new branch.
+ */
+int branch_add(const char *path, bool rw) {
+	if (uopt.lowlevel) RETURN(-EOPNOTSUPP);
+	if (path[0] != '/') RETURN(-EINVAL);
+
+	size_t len = strlen(path);
+	bool slash = path[len - 1] == '/';
+	if (len + 2 > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
+
+	char *p = malloc(len + 2);
+	if (p == NULL) RETURN(-ENOMEM);
+	snprintf(p, len + 2, "%s%s", path, slash ? "" : "/");
+
+	pthread_mutex_lock(&branches_lock);
+
+	int res;
+	int i = uopt.nbranches;
+	int fd = -1;
+	branch_entry_t *b = NULL;
+	if (i >= uopt.max_branches) {
+		res = -ENOSPC;
+		goto out;
+	}
+
+	fd = open(p, O_RDONLY | O_DIRECTORY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+
+	b = copy_branches();
+	if (b == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	b[i].path = p;
+	b[i].path_len = strlen(p);
+	b[i].fd = fd;
+	b[i].rw = rw;
+	b[i].imm = 0;
+	b[i].dev = st.st_dev;
+	publish(b);
+
+	// the modules read their branch from uopt.branches, it is not in use
+	// before uopt.nbranches includes it
+	res = whiteout_index_branch_init(i);
+	if (res == 0) res = redirect_branch_init(i);
+	if (res) goto out;
+	bloom_branch_init(i, rw);
+	manifest_branch_init(i, rw);
+	copy_qos_branch_init(i);
+
+	__atomic_store_n(&uopt.nbranches, i + 1, __ATOMIC_SEQ_CST);
+
+	// what was not found might be on the new branch
+	redirect_branches_changed();
+	lookup_cache_invalidate_branch(-1);
+	dir_cache_flush();
+
+	USYSLOG(LOG_INFO, "Added branch %d: %s=%s\n", i, p, rw ? "RW" : "RO");
+	res = i;
+
+out:
+	pthread_mutex_unlock(&branches_lock);
+	if (res < 0) {
+		if (fd != -1) close(fd);
+		free(p);
+	}
+	RETURN(res);
+}
+
+/**
+ * Remove branch, which must be the lowest one.
+ */
+int branch_remove(int branch) {
+	if (uopt.lowlevel) RETURN(-EOPNOTSUPP);
+
+	pthread_mutex_lock(&branches_lock);
+
+	int res = 0;
+	int n = uopt.nbranches;
+	if (branch != n - 1) {
+		res = -EINVAL;
+		goto out;
+	}
+	if (n == 1) {
+		res = -EBUSY;
+		goto out;
+	}
+
+	__atomic_store_n(&uopt.nbranches, n - 1, __ATOMIC_SEQ_CST);
+
+	redirect_branches_changed();
+	lookup_cache_invalidate_branch(branch);
+	dir_cache_invalidate_branch(branch);
+
+	// the entry stays in the array, beyond uopt.nbranches
+	USYSLOG(LOG_INFO, "Removed branch %d: %s\n", branch, uopt.branches[branch].path);
+	retire(NULL, uopt.branches[branch].fd, uopt.branches[branch].path);
+
+out:
+	pthread_mutex_unlock(&branches_lock);
+	RETURN(res);
+}
+
+/**
+ * Make branch writable or read-only.
+ */
+int branch_set_mode(int branch, bool rw) {
+	pthread_mutex_lock(&branches_lock);
+
+	int res = 0;
+	if (branch < 0 || branch >= uopt.nbranches) {
+		res = -EINVAL;
+		goto out;
+	}
+	if (uopt.branches[branch].imm) {
+		res = -EPERM;
+		goto out;
+	}
+	if (uopt.branches[branch].rw == rw) goto out;
+
+	branch_entry_t *b = copy_branches();
+	if (b == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	b[branch].rw = rw;
+
+	if (rw) {
+		// both must be ready before the first path is created there
+		manifest_branch_init(branch, true);
+		bloom_branch_init(branch, true);
+		publish(b);
+	} else {
+		publish(b);
+		manifest_branch_init(branch, false);
+	}
+
+	USYSLOG(LOG_INFO, "Branch %d: %s is %s now\n", branch, b[branch].path, rw ? "RW" : "RO");
+
+out:
+	pthread_mutex_unlock(&branches_lock);
+	RETURN(res);
+}
@@ -0,0 +1,16 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef BRANCHES_H
+#define BRANCHES_H
+
+#include <stdbool.h>
+
+int branch_add(const char *path, bool rw);
+int branch_remove(int branch);
+int branch_set_mode(int branch, bool rw);
+void branches_enter(void);
+void branches_leave(void);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+* Description: collapse the whiteouts of branches that are not mounted
+*
+* License: BSD-style license
+*
+* Details:
+*	Removes the whiteouts below all directories hidden as a whole in the
+*	meta directory of each given branch, see whiteout_compact.c. Mounted
+*	branches are compacted with unionfsctl -w instead, a mount with
+*	-o whiteout_index would not notice the removed whiteouts otherwise.
+*
+*	Usage: unionfs-compact <branch>...
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include "unionfs.h"
+#include "whiteout_compact.h"
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <branch>...\n", basename(argv[0]));
+		exit(1);
+	}
+
+	int res = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		const char *branch = argv[i];
+
+		int fd = open(branch, O_RDONLY | O_DIRECTORY);
+		if (fd == -1) {
+			fprintf(stderr, "Failed to open %s: %s\n", branch, strerror(errno));
+			res = 1;
+			continue;
+		}
+
+		uint64_t removed = 0;
+		int r = whiteout_compact(fd, METANAME, NULL, NULL, &removed);
+		close(fd);
+		if (r) {
+			fprintf(stderr, "Failed to compact %s/%s: %s\n", branch, METANAME, strerror(-r));
+			res = 1;
+		}
+
+		printf("%s: %llu whiteouts removed\n", branch, (unsigned long long)removed);
+	}
+
+	return res;
+}
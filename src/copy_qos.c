@@ -0,0 +1,267 @@
+/*
+* Description: bandwidth limits and I/O priority of copy-ups
+*
+* License: BSD-style license
+*
+* Details:
+*	A copy-up of a large file reads the lower branch as fast as it can,
+*	everybody else reading from the same disk then waits behind it.
+*
+*	-o copyup_bwlimit=rate limits the bytes per second copied up from
+*	each branch, by a token bucket per branch shared by all copies from
+*	it. A copy takes the tokens of the bytes it copied, when the bucket
+*	runs dry it sleeps until the debt is paid. The bucket holds at most
+*	COPY_QOS_BURST_NS worth of tokens, so an idle branch does not allow
+*	a large burst later. The limits can be changed with unionfsctl -b
+*	while mounted.
+*
+*	-o copyup_ioprio=idle|0-7 sets the I/O priority of the threads while
+*	they copy, the idle class or a level of the best-effort class. The
+*	background copy-up workers keep it all the time.
+*
+*	Background copy-ups also give way to the reads of the union and to
+*	the copy-ups done while the caller waits: a chunk is only copied from
+*	a branch once nothing was read from it in the foreground for
+*	COPY_QOS_IDLE_NS, but it does not wait longer than
+*	COPY_QOS_MAX_YIELD_NS per chunk, so a busy branch does not starve
+*	the background copies.
+*/
+
+#if defined __linux__
+	// for syscall()
+	#define _GNU_SOURCE
+	#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "stats.h"
+#include "copy_qos.h"
+
+#define COPY_QOS_BURST_NS 100000000ULL		// 100ms
+#define COPY_QOS_IDLE_NS 5000000ULL		// 5ms
+#define COPY_QOS_MAX_YIELD_NS 100000000ULL	// 100ms
+#define COPY_QOS_YIELD_STEP_NS 1000000L		// 1ms
+
+#if defined __linux__ && defined SYS_ioprio_set
+	#define HAVE_IOPRIO
+	// from linux/ioprio.h, which is not exported by all distributions
+	#define IOPRIO_WHO_PROCESS 1
+	#define IOPRIO_CLASS_SHIFT 13
+	#define IOPRIO_CLASS_BE 2
+	#define IOPRIO_CLASS_IDLE 3
+	#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+struct bucket {
+	pthread_mutex_t lock;
+	uint64_t rate;		// bytes per second, 0 = no limit, atomic
+	double tokens;		// bytes, negative while in debt
+	uint64_t last;		// last refill, CLOCK_MONOTONIC
+	uint64_t foreground;	// last foreground read, CLOCK_MONOTONIC, atomic
+};
+
+// one per branch, NULL before copy_qos_init()
+static struct bucket *buckets;
+
+int copy_qos_init(void) {
+	buckets = calloc(uopt.max_branches, sizeof(struct bucket));
+	if (buckets == NULL) RETURN(-ENOMEM);
+
+	int i;
+	for (i = 0; i < uopt.max_branches; i++) {
+		pthread_mutex_init(&buckets[i].lock, NULL);
+		buckets[i].rate = uopt.copyup_bwlimit;
+	}
+
+	RETURN(0);
+}
+
+/**
+ * branch was added while mounted, it gets the limit of the mount options.
+ */
+void copy_qos_branch_init(int branch) {
+	if (buckets == NULL) return;
+
+	struct bucket *b = &buckets[branch];
+	pthread_mutex_lock(&b->lock);
+	b->tokens = 0;
+	b->last = 0;
+	__atomic_store_n(&b->rate, uopt.copyup_bwlimit, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static struct bucket *bucket_of(int branch) {
+	if (buckets == NULL || branch < 0 || branch >= uopt.nbranches) return NULL;
+	return &buckets[branch];
+}
+
+/**
+ * Convert "idle" or a best-effort level 0-7 to an I/O priority,
+ * -1 if it is neither.
+ */
+int copy_qos_parse_ioprio(const char *str) {
+#ifdef HAVE_IOPRIO
+	if (strcmp(str, "idle") == 0) return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+
+	char *end;
+	long level = strtol(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || level < 0 || level > 7) return -1;
+
+	return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+#else
+	(void)str;
+	return -1;
+#endif
+}
+
+/**
+ * Set the bandwidth limit of branch, of all branches if branch is -1.
+ */
+int copy_qos_set_bwlimit(int branch, uint64_t bwlimit) {
+	if (buckets == NULL) RETURN(-EAGAIN);
+	if (branch < -1 || branch >= uopt.nbranches) RETURN(-EINVAL);
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (branch != -1 && i != branch) continue;
+		__atomic_store_n(&buckets[i].rate, bwlimit, __ATOMIC_SEQ_CST);
+	}
+
+	DBG("branch %d: %llu bytes/s\n", branch, (unsigned long long)bwlimit);
+	RETURN(0);
+}
+
+/**
+ * The calling thread starts to copy, set its I/O priority. Returns the
+ * priority to give to copy_qos_end().
+ */
+int copy_qos_begin(void) {
+#ifdef HAVE_IOPRIO
+	if (uopt.copyup_ioprio == COPY_QOS_IOPRIO_NONE) return COPY_QOS_IOPRIO_NONE;
+
+	int old = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (old == -1) return COPY_QOS_IOPRIO_NONE;
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, uopt.copyup_ioprio) == -1) {
+		return COPY_QOS_IOPRIO_NONE;
+	}
+
+	return old;
+#else
+	return COPY_QOS_IOPRIO_NONE;
+#endif
+}
+
+/**
+ * The copy is done, restore the I/O priority of the thread.
+ */
+void copy_qos_end(int old) {
+#ifdef HAVE_IOPRIO
+	if (old != COPY_QOS_IOPRIO_NONE) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, old);
+#else
+	(void)old;
+#endif
+}
+
+/**
+ * The calling thread only copies in the background.
+ */
+void copy_qos_background(void) {
+#ifdef HAVE_IOPRIO
+	if (uopt.copyup_ioprio == COPY_QOS_IOPRIO_NONE) return;
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, uopt.copyup_ioprio) == -1) {
+		USYSLOG(LOG_WARNING, "Setting the I/O priority of a copy-up worker failed: %s\n",
+			strerror(errno));
+	}
+#endif
+}
+
+/**
+ * Something is read from branch by the union, background copies wait.
+ */
+void copy_qos_foreground(int branch) {
+	struct bucket *b = bucket_of(branch);
+	if (b) __atomic_store_n(&b->foreground, stats_now(), __ATOMIC_RELAXED);
+}
+
+static void sleep_ns(uint64_t ns) {
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/**
+ * Called by background copies before each chunk, wait until branch is not
+ * read by the union anymore.
+ */
+void copy_qos_yield(int branch) {
+	struct bucket *b = bucket_of(branch);
+	if (b == NULL) return;
+
+	uint64_t start = stats_now();
+	uint64_t now = start;
+	while (now - start < COPY_QOS_MAX_YIELD_NS) {
+		uint64_t fg = __atomic_load_n(&b->foreground, __ATOMIC_RELAXED);
+		if (fg + COPY_QOS_IDLE_NS <= now) break;
+
+		sleep_ns(COPY_QOS_YIELD_STEP_NS);
+		now = stats_now();
+	}
+}
+
+/**
+ * The number of bytes to copy from branch at once, at most chunk. With a
+ * limit only as many as it allows in COPY_QOS_BURST_NS, so the copy is
+ * throttled evenly.
+ */
+size_t copy_qos_chunk(int branch, size_t chunk) {
+	struct bucket *b = bucket_of(branch);
+	if (b == NULL) return chunk;
+
+	uint64_t rate = __atomic_load_n(&b->rate, __ATOMIC_RELAXED);
+	if (rate == 0) return chunk;
+
+	uint64_t burst = rate * COPY_QOS_BURST_NS / 1000000000ULL;
+	if (burst < 4096) burst = 4096;
+
+	return burst < chunk ? burst : chunk;
+}
+
+/**
+ * bytes were copied from branch, sleep as long as its limit requires.
+ */
+void copy_qos_throttle(int branch, size_t bytes, bool background) {
+	struct bucket *b = bucket_of(branch);
+	if (b == NULL) return;
+
+	if (!background) copy_qos_foreground(branch);
+
+	uint64_t rate = __atomic_load_n(&b->rate, __ATOMIC_RELAXED);
+	if (rate == 0) return;
+
+	pthread_mutex_lock(&b->lock);
+	uint64_t now = stats_now();
+	double burst = rate * (COPY_QOS_BURST_NS / 1e9);
+	if (b->last) b->tokens += (now - b->last) / 1e9 * rate;
+	if (b->last == 0 || b->tokens > burst) b->tokens = burst;
+	b->last = now;
+	b->tokens -= bytes;
+	double debt = b->tokens < 0 ? -b->tokens : 0;
+	pthread_mutex_unlock(&b->lock);
+
+	if (debt > 0) sleep_ns(debt / rate * 1e9);
+}
@@ -0,0 +1,28 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef COPY_QOS_H
+#define COPY_QOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COPY_QOS_IOPRIO_NONE -1	// keep the I/O priority of the threads
+
+int copy_qos_init(void);
+void copy_qos_branch_init(int branch);
+int copy_qos_parse_ioprio(const char *str);
+int copy_qos_set_bwlimit(int branch, uint64_t bwlimit);
+
+int copy_qos_begin(void);
+void copy_qos_end(int old);
+void copy_qos_background(void);
+
+void copy_qos_foreground(int branch);
+void copy_qos_yield(int branch);
+size_t copy_qos_chunk(int branch, size_t chunk);
+void copy_qos_throttle(int branch, size_t bytes, bool background);
+
+#endif
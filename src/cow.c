@@ -16,7 +16,11 @@
 #include <errno.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+#include "unionfs.h"
 #include "opts.h"
 #include "findbranch.h"
 #include "general.h"
@@ -26,6 +30,27 @@
 #include "debug.h"
 #include "usyslog.h"
 #include "cowolf.h"
+#include "lookup_cache.h"
+#include "stats.h"
+#include "cow_tree.h"
+#include "redirect.h"
+#include "bloom.h"
+#include "hashtable.h"
+
+/**
+ * A copy-up in progress, other threads copying up the same path wait for
+ * its result instead of copying it again.
+ */
+struct cow_flight {
+	pthread_cond_t cond;
+	bool done;
+	int res;
+	int err;		// errno of a failed copy-up
+	unsigned int waiters;
+};
+
+static struct hashtable *flights;	// path -> cow_flight
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /**
@@ -34,11 +59,10 @@
 static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 	DBG("%s\n", path);
 
-	char dirp[PATHLEN_MAX]; // dir path to create
-	sprintf(dirp, "%s%s", uopt.branches[nbranch_rw].path, path);
+	const char *relp = branch_relpath(path);
 
 	struct stat buf;
-	int res = stat(dirp, &buf);
+	int res = fstatat(uopt.branches[nbranch_rw].fd, relp, &buf, 0);
 	if (res != -1) RETURN(0); // already exists
 
 	if (nbranch_ro == nbranch_rw) {
@@ -47,18 +71,24 @@ static int do_create(const char *path, int nbranch_ro, int nbranch_rw) {
 		buf.st_mode = S_IRWXU | S_IRWXG;
 	} else {
 		// data from the ro-branch
-		char o_dirp[PATHLEN_MAX]; // the pathname we want to copy
-		sprintf(o_dirp, "%s%s", uopt.branches[nbranch_ro].path, path);
-		res = stat(o_dirp, &buf);
+		char rbuf[PATHLEN_MAX];
+		const char *rop = branch_relpath(redirect_path(path, nbranch_ro, rbuf));
+		res = fstatat(uopt.branches[nbranch_ro].fd, rop, &buf, 0);
 		if (res == -1) RETURN(1); // lower level branch removed in the mean time?
 	}
 
-	res = mkdir(dirp, buf.st_mode);
+	char dirp[PATHLEN_MAX]; // dir path to create, for messages and setfile()
+	sprintf(dirp, "%s%s", uopt.branches[nbranch_rw].path, path);
+
+	bloom_add(path, nbranch_rw);
+	res = mkdirat(uopt.branches[nbranch_rw].fd, relp, buf.st_mode);
 	if (res == -1) {
 		USYSLOG(LOG_DAEMON, "Creating %s failed: \n", dirp);
 		RETURN(1);
 	}
 
+	lookup_cache_invalidate(path);
+
 	if (nbranch_ro == nbranch_rw) RETURN(0); // the special case again
 
 	if (setfile(dirp, &buf)) RETURN(1); // directory already removed by another process?
@@ -77,15 +107,15 @@ int path_create(const char *path, int nbranch_ro, int nbranch_rw) {
 
 	if (!uopt.cow_enabled) RETURN(0);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[nbranch_rw].path, path)) RETURN(-ENAMETOOLONG);
+	if (uopt.branches[nbranch_rw].path_len + strlen(path) >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
 
 	struct stat st;
-	if (!stat(p, &st)) {
+	if (!fstatat(uopt.branches[nbranch_rw].fd, branch_relpath(path), &st, 0)) {
 		// path does already exists, no need to create it
 		RETURN(0);
 	}
 
+	char p[PATHLEN_MAX];
 	char *walk = (char *)path;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
@@ -129,11 +159,15 @@ int path_create_cutlast(const char *path, int nbranch_ro, int nbranch_rw) {
 int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 	DBG("%s\n", path);
 
+	uint64_t start = stats_now();
+
 	// create the path to the file
 	path_create_cutlast(path, branch_ro, branch_rw);
+	bloom_add(path, branch_rw);
 
+	char rbuf[PATHLEN_MAX];
 	char from[PATHLEN_MAX], to[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path))
+	if (BUILD_PATH(from, uopt.branches[branch_ro].path, redirect_path(path, branch_ro, rbuf)))
 		RETURN(-ENAMETOOLONG);
 	if (BUILD_PATH(to, uopt.branches[branch_rw].path, path))
 		RETURN(-ENAMETOOLONG);
@@ -150,6 +184,7 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 
 	cow.from_path = from;
 	cow.to_path = to;
+	cow.branch = branch_ro;
 
 	struct stat buf;
 	lstat(cow.from_path, &buf);
@@ -176,6 +211,7 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 			break;
 		case S_IFSOCK:
 			USYSLOG(LOG_WARNING, "COW of sockets not supported: %s\n", cow.from_path);
+			stats_copyup(start, 1);
 			RETURN(1);
 		default:
 			if (cowolf_create_datamap(path, branch_rw, cow.stat->st_size)
@@ -189,6 +225,9 @@ int cow_cp(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
 			}
 	}
 
+	if (res == 0) lookup_cache_invalidate(path);
+	stats_copyup(start, res);
+
 	RETURN(res);
 }
 
@@ -204,9 +243,14 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 		RETURN(res);
 	}
 
+	if (uopt.dir_copyup_threads > 1) {
+		RETURN(copy_tree(path, branch_ro, branch_rw, uopt.dir_copyup_threads));
+	}
+
 	/* determine path to source directory on read-only branch */
+	char buf[PATHLEN_MAX];
 	char from[PATHLEN_MAX];
-	if (BUILD_PATH(from, uopt.branches[branch_ro].path, path)) RETURN(1);
+	if (BUILD_PATH(from, uopt.branches[branch_ro].path, redirect_path(path, branch_ro, buf))) RETURN(1);
 
 	DIR *dp = opendir(from);
 	if (dp == NULL) RETURN(1);
@@ -228,3 +272,78 @@ int copy_directory(const char *path, int branch_ro, int branch_rw) {
 	RETURN(res);
 }
 
+/**
+ * Same as cow_cp(), but only one thread copies up path at a time. Threads
+ * coming in meanwhile wait for it and return its result. path might also
+ * have been copied up just before, between our lookup and here, then it is
+ * left alone.
+ */
+int cow_cp_once(const char *path, int branch_ro, int branch_rw, bool copy_dir) {
+	DBG("%s\n", path);
+
+	pthread_mutex_lock(&flights_lock);
+
+	if (flights == NULL) {
+		flights = create_hashtable(16, string_hash, string_equal);
+		if (flights == NULL) {
+			pthread_mutex_unlock(&flights_lock);
+			RETURN(cow_cp(path, branch_ro, branch_rw, copy_dir));
+		}
+	}
+
+	struct cow_flight *f = hashtable_search(flights, (void *)path);
+	if (f) {
+		f->waiters++;
+		while (!f->done) pthread_cond_wait(&f->cond, &flights_lock);
+		int res = f->res;
+		int err = f->err;
+		if (--f->waiters == 0) {
+			pthread_cond_destroy(&f->cond);
+			free(f);
+		}
+		pthread_mutex_unlock(&flights_lock);
+
+		errno = err;
+		RETURN(res);
+	}
+
+	f = calloc(1, sizeof(struct cow_flight));
+	char *key = strdup(path);
+	if (f == NULL || key == NULL || !hashtable_insert(flights, key, f)) {
+		pthread_mutex_unlock(&flights_lock);
+		free(f);
+		free(key);
+		RETURN(cow_cp(path, branch_ro, branch_rw, copy_dir));
+	}
+	pthread_cond_init(&f->cond, NULL);
+
+	pthread_mutex_unlock(&flights_lock);
+
+	// a copy-up done meanwhile must not be overwritten by ours, it might
+	// already have been written to
+	int res;
+	struct stat st;
+	if (!copy_dir && fstatat(uopt.branches[branch_rw].fd, branch_relpath(path), &st,
+			AT_SYMLINK_NOFOLLOW) == 0) {
+		res = 0;
+	} else {
+		res = cow_cp(path, branch_ro, branch_rw, copy_dir);
+	}
+	int err = errno;
+
+	pthread_mutex_lock(&flights_lock);
+	hashtable_remove(flights, (void *)path); // frees the key
+	f->done = true;
+	f->res = res;
+	f->err = err;
+	if (f->waiters) {
+		pthread_cond_broadcast(&f->cond);
+	} else {
+		pthread_cond_destroy(&f->cond);
+		free(f);
+	}
+	pthread_mutex_unlock(&flights_lock);
+
+	errno = err;
+	RETURN(res);
+}
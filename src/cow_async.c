@@ -0,0 +1,369 @@
+/*
+* Description: background copy-up of cowolf files
+*
+* License: BSD-style license
+*
+* Details:
+*	With cowolf the copy-up of a large file only creates a sparse file
+*	and a data-range map on the rw branch, reads of ranges which were
+*	never written are served from the lower branch. With
+*	-o async_copyup=<threads> a pool of worker threads copies these
+*	ranges to the rw branch in the background, so the file eventually
+*	becomes a normal file. Once the map covers the whole file,
+*	cowolf_open() removes it.
+*
+*	There is one job per map, found by the shared in-memory map. Open
+*	cowolf files keep a reference to the job. The worker copies a chunk
+*	with the job lock held, writes and truncates of the file take the
+*	same lock. So no write can come in between the worker looking up
+*	the unmapped ranges of a chunk and marking them mapped after copying
+*	them, which would overwrite the new data with the old data of the
+*	lower branch. Reads do not need the lock, an unmapped range has the
+*	same data on both branches while the worker copies it.
+*
+*	Progress is kept in the map file itself, the worker writes the map
+*	back every COW_ASYNC_SYNC bytes after flushing the copied data. If we
+*	are unmounted before a job is done, it is started again the next time
+*	the file is opened.
+*
+*	The workers copy with -o copyup_ioprio and -o copyup_bwlimit of the
+*	lower branch, and before each chunk they wait for the foreground
+*	reads of the lower branch to pause, see copy_qos.c.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "drm_file.h"
+#include "cow_async.h"
+#include "uring.h"
+#include "copy_qos.h"
+#include "branches.h"
+
+#define COW_ASYNC_CHUNK (1024 * 1024)
+#define COW_ASYNC_SYNC (64 * COW_ASYNC_CHUNK)
+
+struct cow_async_job {
+	struct drmf *map;	// identifies the job
+
+	int upper_fd;		// only used by the worker
+	int lower_fd;
+	int lower_branch;	// of lower_fd
+
+	off_t size;		// size of the lower file
+	off_t done;		// offset the worker got to, protected by jobs_lock
+
+	int refs;		// protected by jobs_lock
+	pthread_mutex_t lock;	// taken by the worker and by writes/truncates
+
+	struct cow_async_job *next;	// jobs list
+	struct cow_async_job *qnext;	// queue of jobs waiting for a worker
+};
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+// all protected by jobs_lock
+static struct cow_async_job *jobs;
+static struct cow_async_job *queue_head, *queue_tail;
+static unsigned long finished;
+
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Remove job from the jobs list, must be called with jobs_lock held.
+ */
+static void job_unlink(struct cow_async_job *job) {
+	struct cow_async_job **p;
+	for (p = &jobs; *p; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+}
+
+/**
+ * Copy len bytes at offset from the lower to the upper file and map them,
+ * the number of bytes copied is added to total.
+ * Return 1 if the lower file ended before, 0 if all were copied and -1 on
+ * error.
+ */
+static int copy_range(struct cow_async_job *job, char *buf, off_t offset, size_t len, size_t *total) {
+	size_t copied = 0;
+	int res = 0;
+
+	while (copied < len) {
+		ssize_t n = uring_pread(job->lower_fd, buf + copied, len - copied, offset + copied);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			RETURN(-1);
+		}
+		if (n == 0) {
+			res = 1;
+			break;
+		}
+		copied += n;
+	}
+
+	if (copied == 0) RETURN(res);
+
+	if (uring_pwrite(job->upper_fd, buf, copied, offset) != (ssize_t)copied) RETURN(-1);
+	if (drmf_add_entry(job->map, offset, copied)) RETURN(-1);
+
+	*total += copied;
+	RETURN(res);
+}
+
+/**
+ * Copy all ranges of the chunk which are not mapped yet, must be called
+ * with the job lock held. The bytes copied are added to copied.
+ */
+static int copy_chunk(struct cow_async_job *job, char *buf, off_t offset, size_t len, size_t *copied) {
+	struct drmf_entry *map = NULL;
+	unsigned int count = 0;
+
+	if (drmf_get_entries(job->map, offset, len, &map, &count)) RETURN(-1);
+
+	off_t pos = offset;
+	off_t end = offset + len;
+	int res = 0;
+	unsigned int i;
+	for (i = 0; i <= count && res == 0; i++) {
+		off_t gap_end = i < count ? map[i].offset : end;
+		if (gap_end > pos) res = copy_range(job, buf, pos, gap_end - pos, copied);
+		if (i < count) pos = map[i].offset + map[i].len;
+	}
+
+	free(map);
+	RETURN(res);
+}
+
+static void run_job(struct cow_async_job *job, char *buf) {
+	DBG("%lld bytes\n", (long long)job->size);
+
+	off_t offset = 0, synced = 0;
+	int res = 0;
+	while (offset < job->size) {
+		// the file was deleted
+		if (drmf_unlinked(job->map)) break;
+
+		size_t len = job->size - offset < COW_ASYNC_CHUNK ? job->size - offset : COW_ASYNC_CHUNK;
+		len = copy_qos_chunk(job->lower_branch, len);
+
+		// not with the lock held, writes to the file would wait, too
+		copy_qos_yield(job->lower_branch);
+
+		size_t copied = 0;
+		pthread_mutex_lock(&job->lock);
+		res = copy_chunk(job, buf, offset, len, &copied);
+		pthread_mutex_unlock(&job->lock);
+
+		copy_qos_throttle(job->lower_branch, copied, true);
+
+		if (res < 0) {
+			USYSLOG(LOG_ERR, "Background copy-up failed at %lld: %s\n",
+				(long long)offset, strerror(errno));
+			break;
+		}
+
+		offset += len;
+
+		// the chunks are smaller with a bandwidth limit
+		if (offset - synced >= COW_ASYNC_SYNC) {
+			synced = offset;
+			if (fsync(job->upper_fd) || drmf_sync(job->map)) {
+				USYSLOG(LOG_ERR, "Saving the background copy-up progress failed: %s\n",
+					strerror(errno));
+			}
+		}
+
+		pthread_mutex_lock(&jobs_lock);
+		job->done = offset;
+		pthread_mutex_unlock(&jobs_lock);
+
+		if (res > 0) break; // the lower file is shorter than it was
+	}
+
+	close(job->upper_fd);
+	close(job->lower_fd);
+	drmf_close(job->map);
+
+	pthread_mutex_lock(&jobs_lock);
+	job_unlink(job);
+	if (res == 0 || res == 1) finished++;
+	pthread_mutex_unlock(&jobs_lock);
+
+	cow_async_put(job);
+}
+
+static void *worker(void *arg) {
+	(void)arg;
+
+	char *buf = malloc(COW_ASYNC_CHUNK);
+	if (buf == NULL) {
+		USYSLOG(LOG_ERR, "Out of memory, background copy-up worker exits\n");
+		return NULL;
+	}
+
+	copy_qos_background();
+
+	while (1) {
+		pthread_mutex_lock(&jobs_lock);
+		while (queue_head == NULL) pthread_cond_wait(&jobs_cond, &jobs_lock);
+		struct cow_async_job *job = queue_head;
+		queue_head = job->qnext;
+		if (queue_head == NULL) queue_tail = NULL;
+		pthread_mutex_unlock(&jobs_lock);
+
+		branches_enter();
+		run_job(job, buf);
+		branches_leave();
+	}
+
+	return NULL;
+}
+
+/**
+ * Workers are started with the first job, fuse forks into the background
+ * after main() is done with the options.
+ */
+static void start_workers(void) {
+	unsigned int i;
+	for (i = 0; i < uopt.async_copyup_threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, NULL)) {
+			USYSLOG(LOG_ERR, "Starting a background copy-up worker failed\n");
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+/**
+ * Find the job by the map file, must be called with jobs_lock held.
+ */
+static struct cow_async_job *job_find(struct drmf *map) {
+	struct cow_async_job *job;
+	for (job = jobs; job; job = job->next) {
+		if (job->map == map) return job;
+	}
+	return NULL;
+}
+
+/**
+ * Return the running job of the file with this map and take a reference,
+ * NULL if there is none.
+ */
+struct cow_async_job *cow_async_get(struct drmf *map) {
+	pthread_mutex_lock(&jobs_lock);
+	struct cow_async_job *job = job_find(map);
+	if (job) job->refs++;
+	pthread_mutex_unlock(&jobs_lock);
+
+	return job;
+}
+
+/**
+ * Queue a job copying the unmapped ranges from lower_fd to upper_fd, the
+ * job takes over the file descriptors and the map reference. If another thread was faster to
+ * start a job for the same file, that one is returned. The caller gets a
+ * reference to the job, NULL is returned on error.
+ */
+struct cow_async_job *cow_async_start(int upper_fd, int lower_fd, int lower_branch, struct drmf *map) {
+	struct stat lower_st;
+	if (fstat(lower_fd, &lower_st)) goto err;
+
+	pthread_once(&workers_once, start_workers);
+
+	pthread_mutex_lock(&jobs_lock);
+
+	struct cow_async_job *job = job_find(map);
+	if (job) {
+		job->refs++;
+		pthread_mutex_unlock(&jobs_lock);
+		goto err_out;
+	}
+
+	job = calloc(1, sizeof(struct cow_async_job));
+	if (job == NULL) {
+		pthread_mutex_unlock(&jobs_lock);
+		goto err;
+	}
+
+	job->map = map;
+	job->upper_fd = upper_fd;
+	job->lower_fd = lower_fd;
+	job->lower_branch = lower_branch;
+	job->size = lower_st.st_size;
+	job->refs = 2; // the worker and the caller
+	pthread_mutex_init(&job->lock, NULL);
+
+	job->next = jobs;
+	jobs = job;
+
+	if (queue_tail) queue_tail->qnext = job;
+	else queue_head = job;
+	queue_tail = job;
+
+	pthread_cond_signal(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+
+	return job;
+
+err:
+	USYSLOG(LOG_ERR, "Starting the background copy-up failed: %s\n", strerror(errno));
+	job = NULL;
+err_out:
+	close(upper_fd);
+	close(lower_fd);
+	drmf_close(map);
+	return job;
+}
+
+void cow_async_put(struct cow_async_job *job) {
+	if (job == NULL) return;
+
+	pthread_mutex_lock(&jobs_lock);
+	bool last = --job->refs == 0;
+	pthread_mutex_unlock(&jobs_lock);
+
+	if (last) {
+		pthread_mutex_destroy(&job->lock);
+		free(job);
+	}
+}
+
+/**
+ * Keep the worker away from the file while its data or size is changed.
+ */
+void cow_async_lock(struct cow_async_job *job) {
+	if (job) pthread_mutex_lock(&job->lock);
+}
+
+void cow_async_unlock(struct cow_async_job *job) {
+	if (job) pthread_mutex_unlock(&job->lock);
+}
+
+void cow_async_progress(struct unionfs_copyup_progress *progress) {
+	memset(progress, 0, sizeof(*progress));
+
+	pthread_mutex_lock(&jobs_lock);
+	struct cow_async_job *job;
+	for (job = jobs; job; job = job->next) {
+		progress->files++;
+		progress->bytes_total += job->size;
+		progress->bytes_done += job->done;
+	}
+	progress->finished = finished;
+	pthread_mutex_unlock(&jobs_lock);
+}
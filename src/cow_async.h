@@ -0,0 +1,22 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef COW_ASYNC_H
+#define COW_ASYNC_H
+
+#include "uioctl.h"
+
+struct cow_async_job;
+struct drmf;
+
+struct cow_async_job *cow_async_get(struct drmf *map);
+struct cow_async_job *cow_async_start(int upper_fd, int lower_fd, int lower_branch, struct drmf *map);
+void cow_async_put(struct cow_async_job *job);
+
+void cow_async_lock(struct cow_async_job *job);
+void cow_async_unlock(struct cow_async_job *job);
+
+void cow_async_progress(struct unionfs_copyup_progress *progress);
+
+#endif
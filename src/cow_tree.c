@@ -0,0 +1,294 @@
+/*
+* Description: parallel copy-up of directory trees
+*
+* License: BSD-style license
+*
+* Details:
+*	Renaming a directory of a ro branch first copies the whole tree to
+*	the rw branch, see copy_directory(). With -o dir_copyup=<threads>
+*	the tree is copied by this number of threads of copy_threads().
+*
+*	Each thread has its own deque of tasks, a task is a directory to be
+*	created and listed, or any other entry to be copied by cow_cp(). The
+*	members of a listed directory are pushed to the deque of the thread.
+*	A thread takes its newest task, so it walks the tree depth first. An
+*	idle thread steals the oldest task of another one, which is usually
+*	a large subtree. A directory is created before its members are
+*	pushed, so their parent always exists.
+*
+*	The first error is returned, the tasks left are then thrown away.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "general.h"
+#include "string.h"
+#include "cow.h"
+#include "cow_tree.h"
+#include "cow_utils.h"
+#include "redirect.h"
+
+struct tree_task {
+	bool dir;
+	bool created;		// the top directory, created by the caller
+	char path[];
+};
+
+// ring buffer of tasks, the owner works at the tail, thieves at the head
+struct tree_deque {
+	pthread_mutex_t lock;
+	struct tree_task **tasks;
+	size_t head;
+	size_t tail;
+	size_t size;		// a power of 2
+};
+
+struct tree_copy {
+	int branch_ro;
+	int branch_rw;
+	unsigned int nthreads;
+	struct tree_deque *deques;
+
+	long pending;		// tasks pushed and not finished yet, atomic
+
+	pthread_mutex_t lock;	// protects the fields below
+	pthread_cond_t cond;
+	unsigned long pushes;	// idle threads wait for new tasks
+	unsigned int idle;
+	int res;		// first error
+};
+
+static struct tree_task *task_new(const char *path, bool dir) {
+	size_t len = strlen(path) + 1;
+	struct tree_task *t = malloc(sizeof(struct tree_task) + len);
+	if (t == NULL) return NULL;
+
+	t->dir = dir;
+	t->created = false;
+	memcpy(t->path, path, len);
+	return t;
+}
+
+static int deque_push(struct tree_deque *dq, struct tree_task *t) {
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail - dq->head == dq->size) {
+		size_t size = dq->size ? 2 * dq->size : 64;
+		struct tree_task **tasks = malloc(size * sizeof(*tasks));
+		if (tasks == NULL) {
+			pthread_mutex_unlock(&dq->lock);
+			RETURN(-ENOMEM);
+		}
+
+		size_t i, n = dq->tail - dq->head;
+		for (i = 0; i < n; i++) {
+			tasks[i] = dq->tasks[(dq->head + i) & (dq->size - 1)];
+		}
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->size = size;
+		dq->head = 0;
+		dq->tail = n;
+	}
+
+	dq->tasks[dq->tail++ & (dq->size - 1)] = t;
+
+	pthread_mutex_unlock(&dq->lock);
+	RETURN(0);
+}
+
+static struct tree_task *deque_take(struct tree_deque *dq, bool steal) {
+	struct tree_task *t = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head) {
+		if (steal) t = dq->tasks[dq->head++ & (dq->size - 1)];
+		else t = dq->tasks[--dq->tail & (dq->size - 1)];
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return t;
+}
+
+/**
+ * Push a task to the deque of thread self and wake up an idle thread.
+ */
+static int task_push(struct tree_copy *tc, unsigned int self, const char *path, bool dir) {
+	struct tree_task *t = task_new(path, dir);
+	if (t == NULL) RETURN(-ENOMEM);
+
+	// counted first, so nobody thinks we are done in between
+	__atomic_add_fetch(&tc->pending, 1, __ATOMIC_SEQ_CST);
+
+	int res = deque_push(&tc->deques[self], t);
+	if (res) {
+		free(t);
+		__atomic_sub_fetch(&tc->pending, 1, __ATOMIC_SEQ_CST);
+		RETURN(res);
+	}
+
+	pthread_mutex_lock(&tc->lock);
+	tc->pushes++;
+	if (tc->idle) pthread_cond_signal(&tc->cond);
+	pthread_mutex_unlock(&tc->lock);
+
+	RETURN(0);
+}
+
+/**
+ * Our newest task, or the oldest of another thread.
+ */
+static struct tree_task *task_get(struct tree_copy *tc, unsigned int self) {
+	struct tree_task *t = deque_take(&tc->deques[self], false);
+
+	unsigned int i;
+	for (i = 1; t == NULL && i < tc->nthreads; i++) {
+		t = deque_take(&tc->deques[(self + i) % tc->nthreads], true);
+	}
+
+	return t;
+}
+
+/**
+ * Create a directory and push its members.
+ */
+static int copy_dir_task(struct tree_copy *tc, unsigned int self, struct tree_task *t) {
+	if (!t->created) {
+		int res = cow_cp(t->path, tc->branch_ro, tc->branch_rw, false);
+		if (res) RETURN(res);
+	}
+
+	char buf[PATHLEN_MAX];
+	char from[PATHLEN_MAX];
+	if (BUILD_PATH(from, uopt.branches[tc->branch_ro].path, redirect_path(t->path, tc->branch_ro, buf))) RETURN(1);
+
+	DIR *dp = opendir(from);
+	if (dp == NULL) RETURN(1);
+
+	int res = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		char member[PATHLEN_MAX];
+		if (BUILD_PATH(member, t->path, "/", de->d_name)) {
+			res = 1;
+			break;
+		}
+
+		bool dir;
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (de->d_type != DT_UNKNOWN) {
+			dir = de->d_type == DT_DIR;
+		} else
+#endif
+		{
+			struct stat st;
+			if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				res = 1;
+				break;
+			}
+			dir = S_ISDIR(st.st_mode);
+		}
+
+		res = task_push(tc, self, member, dir);
+		if (res) break;
+	}
+
+	closedir(dp);
+	RETURN(res);
+}
+
+static void tree_work(void *arg, unsigned int self) {
+	struct tree_copy *tc = arg;
+
+	while (1) {
+		pthread_mutex_lock(&tc->lock);
+		unsigned long pushes = tc->pushes;
+		bool failed = tc->res != 0;
+		pthread_mutex_unlock(&tc->lock);
+
+		struct tree_task *t = task_get(tc, self);
+		if (t == NULL) {
+			pthread_mutex_lock(&tc->lock);
+			if (__atomic_load_n(&tc->pending, __ATOMIC_SEQ_CST) == 0) {
+				pthread_cond_broadcast(&tc->cond);
+				pthread_mutex_unlock(&tc->lock);
+				return;
+			}
+			if (pushes == tc->pushes) {
+				tc->idle++;
+				pthread_cond_wait(&tc->cond, &tc->lock);
+				tc->idle--;
+			}
+			pthread_mutex_unlock(&tc->lock);
+			continue;
+		}
+
+		int res = 0;
+		if (!failed) {
+			if (t->dir) res = copy_dir_task(tc, self, t);
+			else res = cow_cp(t->path, tc->branch_ro, tc->branch_rw, false);
+		}
+		free(t);
+
+		bool done = __atomic_sub_fetch(&tc->pending, 1, __ATOMIC_SEQ_CST) == 0;
+		if (res || done) {
+			pthread_mutex_lock(&tc->lock);
+			if (res && tc->res == 0) tc->res = res;
+			if (done) pthread_cond_broadcast(&tc->cond);
+			pthread_mutex_unlock(&tc->lock);
+		}
+	}
+}
+
+/**
+ * Copy the members of the directory path, which already exists on the rw
+ * branch, with the given number of threads.
+ */
+int copy_tree(const char *path, int branch_ro, int branch_rw, unsigned int nthreads) {
+	DBG("%s, %u threads\n", path, nthreads);
+
+	struct tree_copy tc;
+	memset(&tc, 0, sizeof(tc));
+	tc.branch_ro = branch_ro;
+	tc.branch_rw = branch_rw;
+	tc.nthreads = nthreads;
+	pthread_mutex_init(&tc.lock, NULL);
+	pthread_cond_init(&tc.cond, NULL);
+
+	tc.deques = calloc(nthreads, sizeof(struct tree_deque));
+	if (tc.deques == NULL) RETURN(-ENOMEM);
+
+	unsigned int i;
+	for (i = 0; i < nthreads; i++) pthread_mutex_init(&tc.deques[i].lock, NULL);
+
+	int res = task_push(&tc, 0, path, true);
+	if (res) goto out;
+	tc.deques[0].tasks[0]->created = true;
+
+	copy_threads(nthreads, tree_work, &tc);
+	res = tc.res;
+
+out:
+	for (i = 0; i < nthreads; i++) {
+		free(tc.deques[i].tasks);
+		pthread_mutex_destroy(&tc.deques[i].lock);
+	}
+	free(tc.deques);
+	pthread_cond_destroy(&tc.cond);
+	pthread_mutex_destroy(&tc.lock);
+
+	RETURN(res);
+}
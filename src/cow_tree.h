@@ -0,0 +1,10 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef COW_TREE_H
+#define COW_TREE_H
+
+int copy_tree(const char *path, int branch_ro, int branch_rw, unsigned int nthreads);
+
+#endif
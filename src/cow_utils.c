@@ -30,6 +30,10 @@
  *	This file was taken from OpenBSD and modified to fit the unionfs requirements.
  */
 
+#if defined __linux__
+	// For syscall()
+	#define _GNU_SOURCE
+#endif
 
 #include <err.h>
 #include <errno.h>
@@ -39,14 +43,34 @@
 #include <string.h>
 #include <unistd.h>
 #include <utime.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#if defined __linux__ && !defined DISABLE_COPY_OFFLOAD
+	#include <sys/sendfile.h>
+	#include <sys/syscall.h>
+	#include <linux/fs.h>
+
+	#define HAVE_SENDFILE
+	#if defined FICLONE
+		#define HAVE_FICLONE
+	#endif
+	// the glibc wrapper is rather new, the syscall exists since linux-4.5
+	#if defined SYS_copy_file_range
+		#define HAVE_COPY_FILE_RANGE
+	#endif
+#endif
 
 #include "unionfs.h"
+#include "opts.h"
 #include "cow_utils.h"
 #include "debug.h"
 #include "general.h"
 #include "usyslog.h"
+#include "uring.h"
+#include "copy_qos.h"
 
 // BSD seems to know S_ISTXT itself
 #ifndef S_ISTXT
@@ -127,6 +151,534 @@ static int setlink(const char *path, struct stat *fs)
 }
 
 
+static const char *copy_method_names[COPY_METHODS] = {
+	[COPY_CLONE]    = "clone",
+	[COPY_RANGE]    = "copy_file_range",
+	[COPY_SENDFILE] = "sendfile",
+	[COPY_SPARSE]   = "sparse",
+	[COPY_MMAP]     = "mmap",
+	[COPY_URING]    = "io_uring",
+	[COPY_STREAMS]  = "streams",
+	[COPY_BUFFER]   = "read/write",
+};
+
+static struct copy_stats copy_stats;
+static pthread_mutex_t copy_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *copy_method_name(enum copy_method method) {
+	return copy_method_names[method];
+}
+
+/**
+ * Return how many files and bytes were copied by which method.
+ */
+void copy_stats_get(struct copy_stats *stats) {
+	pthread_mutex_lock(&copy_stats_lock);
+	*stats = copy_stats;
+	pthread_mutex_unlock(&copy_stats_lock);
+}
+
+/**
+ * Account a copied file, bytes[] are the bytes each method copied and
+ * method the one that finished the copy.
+ */
+static void copy_stats_add(enum copy_method method, const off_t *bytes, off_t holes) {
+	pthread_mutex_lock(&copy_stats_lock);
+	copy_stats.files[method]++;
+	int i;
+	for (i = 0; i < COPY_METHODS; i++) copy_stats.bytes[i] += bytes[i];
+	copy_stats.holes += holes;
+	pthread_mutex_unlock(&copy_stats_lock);
+}
+
+/**
+ * fuse runs our operations in several threads, so the buffer of the
+ * read/write fallback is per thread. It is freed when the thread exits.
+ */
+static pthread_key_t copy_buf_key;
+static pthread_once_t copy_buf_once = PTHREAD_ONCE_INIT;
+
+static void copy_buf_init(void) {
+	pthread_key_create(&copy_buf_key, free);
+}
+
+static char *copy_buf_get(void) {
+	pthread_once(&copy_buf_once, copy_buf_init);
+
+	char *buf = pthread_getspecific(copy_buf_key);
+	if (buf == NULL) {
+		buf = malloc(COPY_BUFSIZE);
+		if (buf == NULL) return NULL;
+		pthread_setspecific(copy_buf_key, buf);
+	}
+
+	return buf;
+}
+
+#if defined HAVE_COPY_FILE_RANGE || defined HAVE_SENDFILE
+/**
+ * errno values telling us the kernel or the file systems cannot do the copy
+ * this way, so the next method has to be tried
+ */
+static bool copy_unsupported(int err) {
+	return err == ENOSYS || err == EOPNOTSUPP || err == ENOTTY
+		|| err == EXDEV || err == EINVAL || err == EBADF
+		|| err == ETXTBSY || err == EPERM;
+}
+#endif
+
+/**
+ * uring_copy() in chunks, as large as the bandwidth limit of the branch
+ * allows at once.
+ */
+static int copy_uring(struct cow *cow, int from_fd, int to_fd, off_t offset, off_t len, off_t *bytes)
+{
+	while (len > 0) {
+		off_t count = copy_qos_chunk(cow->branch, len < COPY_CHUNK ? len : COPY_CHUNK);
+		off_t n;
+		int res = uring_copy(from_fd, to_fd, offset, count, COPY_BUFSIZE, &n);
+		*bytes += n;
+		copy_qos_throttle(cow->branch, n, false);
+		if (res != 0) return res;
+		if (n < count) break; // end of file
+
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+#ifdef SEEK_DATA
+/**
+ * Copy len bytes at offset of from_fd to the same offset of to_fd, with
+ * copy_file_range() unless an earlier call told us it does not work.
+ */
+static int copy_extent(struct cow *cow, int from_fd, int to_fd, off_t offset, off_t len,
+                       bool *no_range, off_t *bytes)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t in = offset, out = offset;
+	while (!*no_range && len > 0) {
+		size_t count = copy_qos_chunk(cow->branch, len < COPY_CHUNK ? len : COPY_CHUNK);
+		ssize_t n = syscall(SYS_copy_file_range, from_fd, &in, to_fd, &out, count, 0);
+		if (n > 0) {
+			bytes[COPY_RANGE] += n;
+			copy_qos_throttle(cow->branch, n, false);
+			offset += n;
+			len -= n;
+		} else if (n == 0 && bytes[COPY_RANGE]) {
+			return 0; // end of file, it was truncated in the mean time
+		} else if (n == 0 || copy_unsupported(errno)) {
+			// some kernels return 0 right away if they cannot copy
+			// across file systems, the loop below notices a real EOF
+			*no_range = true;
+		} else {
+			USYSLOG(LOG_WARNING, "copy_file_range: %s", cow->to_path);
+			return -1;
+		}
+	}
+#else
+	(void)no_range;
+#endif
+
+	if (uring_available()) {
+		int res = copy_uring(cow, from_fd, to_fd, offset, len, &bytes[COPY_URING]);
+		if (res != 0) USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+		return res;
+	}
+
+	char *buf = copy_buf_get();
+	if (buf == NULL) {
+		USYSLOG(LOG_WARNING, "out of memory: %s", cow->from_path);
+		return -1;
+	}
+
+	while (len > 0) {
+		size_t count = len < COPY_BUFSIZE ? len : COPY_BUFSIZE;
+		ssize_t rcount = pread(from_fd, buf, count, offset);
+		if (rcount == -1) {
+			USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+			return -1;
+		}
+		if (rcount == 0) break;
+
+		if (pwrite(to_fd, buf, rcount, offset) != rcount) {
+			USYSLOG(LOG_WARNING, "%s", cow->to_path);
+			return -1;
+		}
+		bytes[COPY_BUFFER] += rcount;
+		copy_qos_throttle(cow->branch, rcount, false);
+		offset += rcount;
+		len -= rcount;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy only the data extents of a sparse file, so the holes stay holes
+ * on the rw branch. Return COPY_SPARSE or -1 on error.
+ */
+static int copy_sparse(struct cow *cow, int from_fd, int to_fd, off_t *bytes, off_t *holes)
+{
+	off_t size = cow->stat->st_size;
+	off_t data, hole = 0;
+	off_t copied = 0;
+	bool no_range = false;
+
+	while (hole < size && (data = lseek(from_fd, hole, SEEK_DATA)) != -1) {
+		hole = lseek(from_fd, data, SEEK_HOLE);
+		if (hole == -1) break;
+
+		if (copy_extent(cow, from_fd, to_fd, data, hole - data, &no_range, bytes)) return -1;
+		copied += hole - data;
+	}
+
+	// ENXIO: no data after the offset, the remaining file is a hole
+	if (hole < size && errno != ENXIO) {
+		USYSLOG(LOG_WARNING, "lseek: %s", cow->from_path);
+		return -1;
+	}
+
+	// the trailing hole
+	if (ftruncate(to_fd, size)) {
+		USYSLOG(LOG_WARNING, "ftruncate: %s", cow->to_path);
+		return -1;
+	}
+
+	*holes = size > copied ? size - copied : 0;
+	return COPY_SPARSE;
+}
+#endif
+
+struct copy_thread {
+	void (*fn)(void *arg, unsigned int self);
+	void *arg;
+	unsigned int self;
+	pthread_t thread;
+};
+
+static void *copy_thread(void *arg)
+{
+	struct copy_thread *ct = arg;
+	ct->fn(ct->arg, ct->self);
+	return NULL;
+}
+
+/**
+ * Run fn(arg, self) on n threads and return when all of them returned.
+ * The calling thread is self 0, the others only live for this call. If
+ * they cannot be started, fewer threads do the same work.
+ */
+void copy_threads(unsigned int n, void (*fn)(void *arg, unsigned int self), void *arg)
+{
+	struct copy_thread *cts = n > 1 ? calloc(n, sizeof(struct copy_thread)) : NULL;
+	if (cts == NULL) n = 1;
+
+	unsigned int started = 0;
+	unsigned int i;
+	for (i = 1; i < n; i++) {
+		cts[i].fn = fn;
+		cts[i].arg = arg;
+		cts[i].self = i;
+		if (pthread_create(&cts[i].thread, NULL, copy_thread, &cts[i])) {
+			USYSLOG(LOG_WARNING, "Starting a copy-up thread failed\n");
+			break;
+		}
+		started = i;
+	}
+
+	fn(arg, 0);
+
+	for (i = 1; i <= started; i++) pthread_join(cts[i].thread, NULL);
+	free(cts);
+}
+
+/**
+ * -o copyup_streams=n copies files of at least two chunks of
+ * -o copyup_chunk bytes with n threads of copy_threads(). Each thread
+ * takes the next chunk nobody copies yet, has the kernel read it ahead
+ * and copies it. A single stream from a network file system waits for
+ * every round trip, several of them keep the link busy.
+ */
+struct stream_copy {
+	struct cow *cow;
+	int from_fd;
+	int to_fd;
+	off_t size;
+	off_t chunk;
+
+	pthread_mutex_t lock;	// protects the members below
+	off_t next;		// offset of the next chunk
+	off_t bytes;		// copied by all threads
+	int err;		// the first error, the threads stop then
+};
+
+/**
+ * Copy len bytes at offset of one chunk, with copy_file_range() unless an
+ * earlier call of the thread told it does not work.
+ * Return 1 if the file ended before, 0 if all were copied and -1 on error.
+ */
+static int stream_chunk(struct stream_copy *sc, off_t offset, off_t len, bool *no_range,
+                        off_t *copied)
+{
+	struct cow *cow = sc->cow;
+
+	while (len > 0) {
+		size_t count = len < COPY_CHUNK ? len : COPY_CHUNK;
+		ssize_t n;
+#ifdef HAVE_COPY_FILE_RANGE
+		if (!*no_range) {
+			off_t in = offset, out = offset;
+			count = copy_qos_chunk(cow->branch, count);
+			n = syscall(SYS_copy_file_range, sc->from_fd, &in, sc->to_fd, &out, count, 0);
+			if (n == 0 && *copied) return 1;
+			if (n == 0 || (n == -1 && copy_unsupported(errno))) {
+				// as in copy_extent(), the loop notices a real EOF
+				*no_range = true;
+				continue;
+			}
+			if (n == -1) return -1;
+		} else
+#else
+		(void)no_range;
+#endif
+		{
+			char *buf = copy_buf_get();
+			if (buf == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+
+			count = copy_qos_chunk(cow->branch, count < COPY_BUFSIZE ? count : COPY_BUFSIZE);
+			n = pread(sc->from_fd, buf, count, offset);
+			if (n == -1) return -1;
+			if (n == 0) return 1;
+			if (pwrite(sc->to_fd, buf, n, offset) != n) return -1;
+		}
+
+		copy_qos_throttle(cow->branch, n, false);
+		*copied += n;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void stream_work(void *arg, unsigned int self)
+{
+	(void)self;
+	struct stream_copy *sc = arg;
+	bool no_range = false;
+
+	// the I/O priority is per thread
+	int ioprio = copy_qos_begin();
+
+	while (1) {
+		pthread_mutex_lock(&sc->lock);
+		if (sc->err || sc->next >= sc->size) {
+			pthread_mutex_unlock(&sc->lock);
+			break;
+		}
+		off_t offset = sc->next;
+		off_t len = sc->size - offset < sc->chunk ? sc->size - offset : sc->chunk;
+		sc->next += len;
+		pthread_mutex_unlock(&sc->lock);
+
+#ifdef POSIX_FADV_WILLNEED
+		// the whole chunk is requested at once, not page by page
+		posix_fadvise(sc->from_fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+
+		off_t copied = 0;
+		int res = stream_chunk(sc, offset, len, &no_range, &copied);
+
+		pthread_mutex_lock(&sc->lock);
+		sc->bytes += copied;
+		if (res == -1 && !sc->err) sc->err = errno;
+		if (res == 1) sc->next = sc->size; // the file is shorter than it was
+		pthread_mutex_unlock(&sc->lock);
+	}
+
+	copy_qos_end(ioprio);
+}
+
+/**
+ * Copy from_fd to to_fd by -o copyup_streams threads.
+ * Return COPY_STREAMS or -1 on error.
+ */
+static int copy_streams(struct cow *cow, int from_fd, int to_fd, off_t *bytes)
+{
+	struct stream_copy sc;
+	memset(&sc, 0, sizeof(sc));
+	sc.cow = cow;
+	sc.from_fd = from_fd;
+	sc.to_fd = to_fd;
+	sc.size = cow->stat->st_size;
+	sc.chunk = uopt.copyup_chunk;
+
+	// no more threads than chunks
+	unsigned int nthreads = uopt.copyup_streams;
+	if ((off_t)nthreads > (sc.size + sc.chunk - 1) / sc.chunk) {
+		nthreads = (sc.size + sc.chunk - 1) / sc.chunk;
+	}
+
+	pthread_mutex_init(&sc.lock, NULL);
+	copy_threads(nthreads, stream_work, &sc);
+	pthread_mutex_destroy(&sc.lock);
+
+	bytes[COPY_STREAMS] = sc.bytes;
+	if (sc.err) {
+		errno = sc.err;
+		USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+		return -1;
+	}
+
+	return COPY_STREAMS;
+}
+
+/**
+ * Copy the data of from_fd to to_fd. The in-kernel methods are tried first,
+ * the fastest one first. All methods continue at the current file offsets,
+ * so a method failing in the middle of the file is taken over by the next
+ * one. Return the method that finished the copy or -1 on error.
+ */
+static int copy_data(struct cow *cow, int from_fd, int to_fd, off_t *bytes, off_t *holes)
+{
+	off_t size = cow->stat->st_size;
+
+#ifdef HAVE_FICLONE
+	// shares the extents, if both are on the same btrfs/xfs/...
+	if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+		bytes[COPY_CLONE] = size;
+		return COPY_CLONE;
+	}
+#endif
+
+#ifdef SEEK_DATA
+	// fewer blocks allocated than the size needs, so there are holes. The
+	// methods below would fill them with zeros on the rw branch.
+	// EINVAL: the file system cannot tell us where the holes are
+	if ((off_t)cow->stat->st_blocks * 512 < size
+	    && (lseek(from_fd, 0, SEEK_DATA) != -1 || errno != EINVAL)) {
+		return copy_sparse(cow, from_fd, to_fd, bytes, holes);
+	}
+#else
+	(void)holes;
+#endif
+
+	// large files of network file systems are copied faster in parallel
+	if (uopt.copyup_streams > 1 && size >= 2 * (off_t)uopt.copyup_chunk) {
+		return copy_streams(cow, from_fd, to_fd, bytes);
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	// the file system might do a server side copy or reflink itself
+	ssize_t n;
+	while ((n = syscall(SYS_copy_file_range, from_fd, NULL, to_fd, NULL,
+	                    copy_qos_chunk(cow->branch, COPY_CHUNK), 0)) > 0) {
+		bytes[COPY_RANGE] += n;
+		copy_qos_throttle(cow->branch, n, false);
+	}
+	// some kernels return 0 right away if they cannot copy across file systems
+	if (n == 0 && (bytes[COPY_RANGE] || size == 0)) return COPY_RANGE;
+	if (n == -1 && !copy_unsupported(errno)) {
+		USYSLOG(LOG_WARNING, "copy_file_range: %s", cow->to_path);
+		return -1;
+	}
+#endif
+
+#ifdef HAVE_SENDFILE
+	// still a copy, but without taking the data through user space
+	ssize_t sent;
+	while ((sent = sendfile(to_fd, from_fd, NULL, copy_qos_chunk(cow->branch, COPY_CHUNK))) > 0) {
+		bytes[COPY_SENDFILE] += sent;
+		copy_qos_throttle(cow->branch, sent, false);
+	}
+	if (sent == 0) return COPY_SENDFILE;
+	if (!copy_unsupported(errno)) {
+		USYSLOG(LOG_WARNING, "sendfile: %s", cow->to_path);
+		return -1;
+	}
+#endif
+
+	off_t offset = lseek(from_fd, 0, SEEK_CUR);
+	if (offset == -1) {
+		USYSLOG(LOG_WARNING, "lseek: %s", cow->from_path);
+		return -1;
+	}
+
+	// several buffers in flight, instead of one read() after the other
+	if (uring_available() && offset <= size) {
+		if (copy_uring(cow, from_fd, to_fd, offset, size - offset, &bytes[COPY_URING]) != 0) {
+			USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+			return -1;
+		}
+		return COPY_URING;
+	}
+
+	/*
+	 * Mmap and write if less than 8M (the limit is so we don't totally
+	 * trash memory on big files.  This is really a minor hack, but it
+	 * wins some CPU back. Not if the bandwidth limit does not allow the
+	 * whole file at once.
+	 */
+#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
+	if (offset == 0 && size > 0 && size <= 8 * 1048576
+	    && copy_qos_chunk(cow->branch, size) == (size_t)size) {
+		char *p;
+		if ((p = mmap(NULL, (size_t)size, PROT_READ,
+		    MAP_FILE|MAP_SHARED, from_fd, (off_t)0)) == MAP_FAILED) {
+			USYSLOG(LOG_WARNING, "mmap: %s", cow->from_path);
+			return -1;
+		}
+
+		int rval = COPY_MMAP;
+		madvise(p, size, MADV_SEQUENTIAL);
+		if (write(to_fd, p, size) != size) {
+			USYSLOG(LOG_WARNING, "%s", cow->to_path);
+			rval = -1;
+		}
+		/* Some systems don't unmap on close(2). */
+		if (munmap(p, size) < 0) {
+			USYSLOG(LOG_WARNING, "%s", cow->from_path);
+			rval = -1;
+		}
+
+		if (rval == COPY_MMAP) {
+			bytes[COPY_MMAP] = size;
+			copy_qos_throttle(cow->branch, size, false);
+		}
+		return rval;
+	}
+#endif
+
+	char *buf = copy_buf_get();
+	if (buf == NULL) {
+		USYSLOG(LOG_WARNING, "out of memory: %s", cow->from_path);
+		return -1;
+	}
+
+	ssize_t rcount, wcount;
+	while ((rcount = read(from_fd, buf, copy_qos_chunk(cow->branch, COPY_BUFSIZE))) > 0) {
+		wcount = write(to_fd, buf, rcount);
+		if (rcount != wcount || wcount == -1) {
+			USYSLOG(LOG_WARNING, "%s", cow->to_path);
+			return -1;
+		}
+		bytes[COPY_BUFFER] += wcount;
+		copy_qos_throttle(cow->branch, wcount, false);
+	}
+	if (rcount < 0) {
+		USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
+		return -1;
+	}
+
+	return COPY_BUFFER;
+}
+
 /**
  * copy an ordinary file with all of its stat() data
  **/
@@ -134,13 +686,9 @@ int copy_file(struct cow *cow)
 {
 	DBG("from %s to %s\n", cow->from_path, cow->to_path);
 
-	static char buf[MAXBSIZE];
 	struct stat to_stat, *fs;
-	int from_fd, rcount, to_fd, wcount;
+	int from_fd, to_fd;
 	int rval = 0;
-#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	char *p;
-#endif
 
 	if ((from_fd = open(cow->from_path, O_RDONLY, 0)) == -1) {
 		USYSLOG(LOG_WARNING, "%s", cow->from_path);
@@ -158,44 +706,16 @@ int copy_file(struct cow *cow)
 		RETURN(1);
 	}
 
-	/*
-	 * Mmap and write if less than 8M (the limit is so we don't totally
-	 * trash memory on big files.  This is really a minor hack, but it
-	 * wins some CPU back.
-	 */
-#ifdef VM_AND_BUFFER_CACHE_SYNCHRONIZED
-	if (fs->st_size > 0 && fs->st_size <= 8 * 1048576) {
-		if ((p = mmap(NULL, (size_t)fs->st_size, PROT_READ,
-		    MAP_FILE|MAP_SHARED, from_fd, (off_t)0)) == MAP_FAILED) {
-			USYSLOG(LOG_WARNING, "mmap: %s", cow->from_path);
-			rval = 1;
-		} else {
-			madvise(p, fs->st_size, MADV_SEQUENTIAL);
-			if (write(to_fd, p, fs->st_size) != fs->st_size) {
-				USYSLOG(LOG_WARNING, "%s", cow->to_path);
-				rval = 1;
-			}
-			/* Some systems don't unmap on close(2). */
-			if (munmap(p, fs->st_size) < 0) {
-				USYSLOG(LOG_WARNING, "%s", cow->from_path);
-				rval = 1;
-			}
-		}
-	} else
-#endif
-	{
-		while ((rcount = read(from_fd, buf, MAXBSIZE)) > 0) {
-			wcount = write(to_fd, buf, rcount);
-			if (rcount != wcount || wcount == -1) {
-				USYSLOG(LOG_WARNING, "%s", cow->to_path);
-				rval = 1;
-				break;
-			}
-		}
-		if (rcount < 0) {
-			USYSLOG(LOG_WARNING, "copy failed: %s", cow->from_path);
-			rval = 1;
-		}
+	off_t bytes[COPY_METHODS] = { 0 };
+	off_t holes = 0;
+	int ioprio = copy_qos_begin();
+	int method = copy_data(cow, from_fd, to_fd, bytes, &holes);
+	copy_qos_end(ioprio);
+	if (method == -1) {
+		rval = 1;
+	} else {
+		DBG("%s: %s\n", cow->to_path, copy_method_name(method));
+		copy_stats_add(method, bytes, holes);
 	}
 
 	if (rval == 1) {
@@ -7,8 +7,12 @@
 #ifndef COW_UTILS_H
 #define COW_UTILS_H
 
+#include <sys/types.h>
+
 #define VM_AND_BUFFER_CACHE_SYNCHRONIZED
-#define MAXBSIZE 4096
+#define COPY_BUFSIZE (128 * 1024)	// buffer of the read/write fallback
+#define COPY_CHUNK (8 * 1024 * 1024)	// max bytes per in-kernel copy call
+#define DEFAULT_COPYUP_CHUNK (16 * 1024 * 1024) // of -o copyup_streams
 
 struct cow {
 	mode_t umask;
@@ -17,16 +21,40 @@ struct cow {
 	// source file
 	char  *from_path;
 	struct stat *stat;
+	int branch;		// its branch, copies from it are throttled, see copy_qos.c
 
 	// destination file
 	char *to_path;
 };
 
+// how copy_file() copied the data
+enum copy_method {
+	COPY_CLONE,	// FICLONE, the copy shares the extents
+	COPY_RANGE,	// copy_file_range()
+	COPY_SENDFILE,
+	COPY_SPARSE,	// only the data extents, see copy_sparse()
+	COPY_MMAP,
+	COPY_URING,	// io_uring reads and writes, see uring_copy()
+	COPY_STREAMS,	// chunks copied by several threads, see copy_streams()
+	COPY_BUFFER,	// read()/write()
+	COPY_METHODS
+};
+
+struct copy_stats {
+	unsigned long files[COPY_METHODS];
+	unsigned long long bytes[COPY_METHODS];
+	unsigned long long holes;	// bytes in holes, which were not copied
+};
+
+void copy_stats_get(struct copy_stats *stats);
+const char *copy_method_name(enum copy_method method);
+
 int setfile(const char *path, struct stat *fs);
 int copy_special(struct cow *cow);
 int copy_fifo(struct cow *cow);
 int copy_link(struct cow *cow);
 int copy_file(struct cow *cow);
 int create_sparse_file(struct cow *cow);
+void copy_threads(unsigned int n, void (*fn)(void *arg, unsigned int self), void *arg);
 
 #endif
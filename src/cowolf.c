@@ -13,6 +13,9 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "opts.h"
 #include "findbranch.h"
@@ -22,6 +25,17 @@
 #include "debug.h"
 #include "usyslog.h"
 #include "drm_file.h"
+#include "cow_async.h"
+#include "uring.h"
+#include "stats.h"
+#include "redirect.h"
+
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /**
  * Checks if cowolf could be made ON based on global settings and
@@ -29,7 +43,7 @@
  * @return true for ON, false of OFF.
  */
 static bool check_cowolfability(off_t file_size) {
-	if (uopt.cow_enabled && uopt.cowolf_enabled && (uopt.nbranches == 2)
+	if (uopt.cow_enabled && uopt.cowolf_enabled
 		&& (file_size >= uopt.cowolf_fsize_th)) {
 		RETURN(true);
 	}
@@ -79,7 +93,6 @@ static bool has_datamap(const char *path, int branch) {
 /**
  * Creates data-range map file, provided following conditions are met
  * - COW and COWOLF enabled.
- * - Number of branch is not more than 2.
  * - File is larger than the COWOLF threshold file size.
  * @param path filesystem filepath
  * @param branch branch number
@@ -113,10 +126,11 @@ int cowolf_create_datamap(const char *path, int branch, off_t file_size) {
 	 * We create a dummy symlink here to preserve the filepath in
 	 * lower RO branch. Given the file may be moved/renamed in top
 	 * RW branch, this symlink helps us to track the correct file
-	 * in lower branch.
+	 * in lower branch. Below renamed directories it has another name.
 	 */
+	char buf[PATHLEN_MAX];
 	unlink(linkpath); // remove previous link - just in case
-	if (symlink(path, linkpath) != 0) {
+	if (symlink(redirect_path(path, branch + 1, buf), linkpath) != 0) {
 		USYSLOG(LOG_ERR, "Creating symlink %s failed. %s\n",
 			linkpath, strerror(errno));
 		RETURN(-1);
@@ -155,38 +169,6 @@ int cowolf_destroy_datamap(const char *path, int branch) {
 	RETURN(res);
 }
 
-/**
- * Truncates the map range in data-range map file.
- * @param path filesystem filepath
- * @param branch branch number
- * @param new_size new size of the file
- * @return 0 when datamap is truncated (or does not exist). -1 when failed
- *         to truncate.
- */
-int cowolf_truncate_datamap(const char *path, int branch, off_t new_size) {
-        DBG("path = %s, branch = %d, size = %lu\n", path, branch, new_size);
-
-	if (!has_datamap(path, branch)) RETURN(0);
-
-	char mappath[PATHLEN_MAX];
-	if (!build_cowolf_paths(path, branch, mappath, NULL)) RETURN(-1);
-
-	int map_fd = -1;
-        if (drmf_open(mappath, &map_fd) != 0) {
-                RETURN(-1);
-        }
-
-	int res = drmf_trunc(map_fd, new_size);
-	if (res != 0) {
-		USYSLOG(LOG_ERR, "Truncating drmap %s failed. %s\n",
-			mappath, strerror(errno));
-	}
-
-        drmf_close(map_fd);
-
-	RETURN(res);
-}
-
 /**
  * Renames data-range map file.
  * @param oldpath old path for file
@@ -235,24 +217,90 @@ int cowolf_rename_datamap(const char *oldpath, const char *newpath, int branch)
 	RETURN(0);
 }
 
+/**
+ * Finds the branch that backs the unmapped ranges of a file with a
+ * data-range map in branch. That is the first branch below it having the
+ * file, like it was found when the file was copied up, unless a whiteout
+ * hides the file there.
+ * @param lower_path path of the file in lower branches
+ * @return the branch number, or -1 on failure.
+ */
+static int find_backing_branch(const char *lower_path, int branch) {
+	const char *rel = branch_relpath(lower_path);
+
+	int i;
+	for (i = branch + 1; i < uopt.nbranches; i++) {
+		struct stat st;
+		if (fstatat(uopt.branches[i].fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			if (has_datamap(lower_path, i)) {
+				/* the backing file is sparse itself */
+				USYSLOG(LOG_ERR,
+					"Datamap (%s, %d) exists in lower branch.\n",
+					lower_path, i);
+				errno = EIO;
+				RETURN(-1);
+			}
+			RETURN(i);
+		}
+
+		int res = path_hidden(lower_path, i);
+		if (res > 0) break;
+		if (res < 0) {
+			errno = -res;
+			RETURN(-1);
+		}
+	}
+
+	errno = ENOENT;
+	RETURN(-1);
+}
+
+/**
+ * Returns the background copy-up job of the file and starts it, if it is
+ * not running yet. The job has its own file descriptors, since the flags
+ * of the file being opened might not be suitable.
+ * @return the job, or NULL if it could not be started.
+ */
+static struct cow_async_job *async_attach(const char *path, int branch,
+	struct drmf *map, int lower, const char *backpath) {
+
+	struct cow_async_job *job = cow_async_get(map);
+	if (job != NULL) return job;
+
+	int upper_fd = openat(uopt.branches[branch].fd, branch_relpath(path),
+			O_WRONLY);
+	int lower_fd = open(backpath, O_RDONLY);
+
+	if (upper_fd < 0 || lower_fd < 0) {
+		USYSLOG(LOG_ERR, "Opening %s for background copy-up failed. %s\n",
+			path, strerror(errno));
+		if (upper_fd >= 0) close(upper_fd);
+		if (lower_fd >= 0) close(lower_fd);
+		return NULL;
+	}
+
+	return cow_async_start(upper_fd, lower_fd, lower, drmf_get(map));
+}
+
 /**
  * Opens files (file in lower branch and associated data-range map file)
  * required for cowolf feature.
  *
  * Here we do couple of checks to make sure that cowolf is ON for a file.
- * (1) Lower branches do not have data-range map file. If there is a
+ * (1) Read-only branches do not have data-range map file. If there is a
  *     data-range map file (due to past mounting/unmounting activities) in
- *     lower branches, this file cannot be read/written reliably (because
- *     the file here could be sparse). So this function returns error in
- *     such circumstances.
- * (2) If top branch does not have data-range map file, it means this is
+ *     a read-only branch, this file cannot be read/written reliably
+ *     (because the file here could be sparse). So this function returns
+ *     error in such circumstances.
+ * (2) If the rw branch does not have data-range map file, it means this is
  *     not a sparse file (i.e. it has complete data). In that case we can
  *     read data from this branch itself. This function returns SUCCESS
  *     without opening lower branch file and map file (because we do not
  *     need them).
- * (3) If top branch has data-range map file, this function opens lower
- *     branch file and data-range map file (because we cannot relibly
- *     read/write without these files).
+ * (3) If the rw branch has data-range map file, this function opens the
+ *     file in the branch backing it and data-range map file (because we
+ *     cannot relibly read/write without these files). The backing branch
+ *     is the first branch below having the file, see find_backing_branch().
  * NOTE: Here we do not check if cowolf feature is enabled or not, because
  * this flag only indicates that this feature is enabled/disabled in
  * current mount. A sparse file and associated data-range map file might
@@ -271,16 +319,18 @@ int cowolf_open(const char *path, int branch, int flags, struct cwf_info *cw)
 
 	cw->cwf_on = 0;
 	cw->lower_fd = -1;
-	cw->drmap_fd = -1;
+	cw->branch = branch;
+	cw->lower_branch = -1;
+	cw->drmap = NULL;
 
-	int map_fd = -1;
+	struct drmf *map = NULL;
 	int lfd = -1;
 
-	if (branch > 0) {
+	if (!uopt.branches[branch].rw) {
 		if (has_datamap(path, branch)) {
-			/* lower level must not have datamap */
+			/* read-only branches must not have datamap */
 			USYSLOG(LOG_ERR,
-				"Datamap (%s, %d) exists in lower branch.\n",
+				"Datamap (%s, %d) exists in read-only branch.\n",
 				path, branch);
 			errno = EIO;
 			RETURN(-1);
@@ -289,21 +339,21 @@ int cowolf_open(const char *path, int branch, int flags, struct cwf_info *cw)
 		RETURN(0);
 	}
 
-	/* remaining code in this function is only for branch == 0 */
+	/* remaining code in this function is only for rw branches */
 
 	char mappath[PATHLEN_MAX];
 	char linkpath[PATHLEN_MAX];
 	if (!build_cowolf_paths(path, branch, mappath, linkpath)) {
-		USYSLOG(LOG_ERR, "Datamap (%s) in top branch failed.\n",
+		USYSLOG(LOG_ERR, "Datamap (%s) in rw branch failed.\n",
 				path);
 		errno = ENAMETOOLONG;
 		USYSLOG(LOG_ERR, "Path (%s) is too long.\n", path);
 		RETURN(-1);
 	}
 
-	int err = drmf_open(mappath, &map_fd);
+	int err = drmf_open(mappath, &map);
 	if (err == ENOENT) {
-		/* if file is located in top branch and there is no datamap,
+		/* if file is located in rw branch and there is no datamap,
 		 * it is not a sparse file. simply return success.
 		 */
 		RETURN(0);
@@ -313,11 +363,20 @@ int cowolf_open(const char *path, int branch, int flags, struct cwf_info *cw)
 		goto error_out;
 	}
 
-	/* we came here because top branch is sparse (which means
+	if (drmf_is_full(map) == 1) {
+		/* all data was written or copied to the rw branch, it is
+		 * not a sparse file anymore.
+		 */
+		drmf_close(map);
+		cowolf_destroy_datamap(path, branch);
+		RETURN(0);
+	}
+
+	/* we came here because rw branch is sparse (which means
 	 * we need backend file in lower branch).
 	 * hence, open the file from lower branch too.
 	 * NOTE: we read the filename from symlink (created at the time
-	 * creating datamap), because file might have renamed in top RW
+	 * creating datamap), because file might have renamed in the RW
 	 * branch.
 	 */
 	char link_tgt[PATHLEN_MAX];
@@ -329,26 +388,40 @@ int cowolf_open(const char *path, int branch, int flags, struct cwf_info *cw)
 	}
 	link_tgt[tgt_name_len] = 0; // readlink does not put null byte at the end.
 
+	int lower = find_backing_branch(link_tgt, branch);
+	if (lower < 0) {
+		USYSLOG(LOG_ERR, "No lower branch has %s. %s\n",
+			link_tgt, strerror(errno));
+		goto error_out;
+	}
+
 	char backpath[PATHLEN_MAX];
-	if (BUILD_PATH(backpath, uopt.branches[branch+1].path, link_tgt)) {
+	if (BUILD_PATH(backpath, uopt.branches[lower].path, link_tgt)) {
 		errno = ENAMETOOLONG;
 		USYSLOG(LOG_ERR, "Path (%s) is too long.\n", link_tgt);
 		goto error_out;
 	}
 
-	lfd = open(backpath, flags);
+	/* only ever read, the ro branch might be mounted read-only */
+	lfd = open(backpath, O_RDONLY);
         if (lfd < 0) {
 		USYSLOG(LOG_ERR, "Open (%s) failed. %s\n",
 			backpath, strerror(errno));
 		goto error_out;
 	} 
 
-	cw->drmap_fd = map_fd;
+	cw->drmap = map;
 	cw->lower_fd = lfd;
+	cw->lower_branch = lower;
 	cw->cwf_on = 1;
+
+	if (uopt.async_copyup_threads) {
+		cw->job = async_attach(path, branch, map, lower, backpath);
+	}
+
 	RETURN(0);
 error_out:
-	if (map_fd >= 0) drmf_close(map_fd);
+	if (map) drmf_close(map);
 	if (lfd >= 0) close(lfd);
 
 	RETURN(-1);
@@ -361,15 +434,265 @@ error_out:
  * @return 0 on success, -1 on failure.
  */
 int cowolf_close(struct cwf_info *cw) {
-        DBG("lower fd = %d, map_fd = %d\n", cw->lower_fd, cw->drmap_fd);
+        DBG("lower fd = %d\n", cw->lower_fd);
 
 	if (!cw->cwf_on) RETURN(0);
 
 	if (cw->lower_fd >= 0) {
 		close(cw->lower_fd);
 	}
-	if (cw->drmap_fd >= 0) {
-		drmf_close(cw->drmap_fd);
+	cow_async_put(cw->job);
+	if (cw->drmap) {
+		drmf_close(cw->drmap);
+	}
+
+	RETURN(0);
+}
+
+/**
+ * Writes the data-range map back to its file. Must be called after the
+ * data of the top branch file was flushed, so that the map on disk never
+ * covers data which is not there yet.
+ * @param cw cowolf file info
+ * @return 0 on success, -1 on failure.
+ */
+int cowolf_sync(struct cwf_info *cw) {
+	if (!cw->cwf_on) RETURN(0);
+
+	if (drmf_sync(cw->drmap) != 0) {
+		errno = EIO;
+		RETURN(-1);
+	}
+
+	RETURN(0);
+}
+
+/* a preadv() of cowolf_read() */
+struct read_part {
+	const struct drmf_entry *ranges;	/* ranges[0..cnt) are read */
+	unsigned int cnt;
+	size_t want;				/* bytes including the holes */
+};
+
+/*
+ * Per thread scratch space of cowolf_read(), fuse might read the same
+ * handle from several threads at once.
+ */
+struct read_scratch {
+	struct drmf_entry *upper;	/* mapped ranges */
+	struct drmf_entry *lower;	/* the holes in between */
+	unsigned int max;
+	struct iovec *iov;
+	struct read_part *parts;	/* up to 2 * max + 2 reads */
+	struct uring_io *ios;
+	char *skip;			/* target of data not needed */
+	size_t skip_size;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *p) {
+	struct read_scratch *sc = p;
+
+	free(sc->upper);
+	free(sc->lower);
+	free(sc->iov);
+	free(sc->parts);
+	free(sc->ios);
+	free(sc->skip);
+	free(sc);
+}
+
+static void scratch_key_init(void) {
+	pthread_key_create(&scratch_key, scratch_free);
+}
+
+static struct read_scratch *scratch_get(void) {
+	pthread_once(&scratch_once, scratch_key_init);
+
+	struct read_scratch *sc = pthread_getspecific(scratch_key);
+	if (sc == NULL) {
+		sc = calloc(1, sizeof(struct read_scratch));
+		if (sc == NULL || pthread_setspecific(scratch_key, sc)) {
+			free(sc);
+			return NULL;
+		}
+	}
+
+	return sc;
+}
+
+/**
+ * Makes space for max mapped ranges and a skip buffer of skip_size.
+ */
+static int scratch_grow(struct read_scratch *sc, unsigned int max, size_t skip_size) {
+	if (max > sc->max) {
+		max = MAX(max, 2 * sc->max);
+
+		struct drmf_entry *upper = realloc(sc->upper, max * sizeof(*upper));
+		if (upper) sc->upper = upper;
+		struct drmf_entry *lower = realloc(sc->lower, (max + 1) * sizeof(*lower));
+		if (lower) sc->lower = lower;
+		struct iovec *iov = realloc(sc->iov, 4 * (max + 1) * sizeof(*iov));
+		if (iov) sc->iov = iov;
+		struct read_part *parts = realloc(sc->parts, 2 * (max + 1) * sizeof(*parts));
+		if (parts) sc->parts = parts;
+		struct uring_io *ios = realloc(sc->ios, 2 * (max + 1) * sizeof(*ios));
+		if (ios) sc->ios = ios;
+
+		if (!upper || !lower || !iov || !parts || !ios) RETURN(-1);
+		sc->max = max;
+	}
+
+	if (skip_size > sc->skip_size) {
+		char *skip = realloc(sc->skip, skip_size);
+		if (skip == NULL) RETURN(-1);
+		sc->skip = skip;
+		sc->skip_size = skip_size;
+	}
+
+	RETURN(0);
+}
+
+#if !defined __linux__ && !defined __FreeBSD__
+static ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		ssize_t n = pread(fd, iov[i].iov_base, iov[i].iov_len, offset + total);
+		if (n < 0) return total ? total : -1;
+		total += n;
+		if ((size_t)n < iov[i].iov_len) break;
+	}
+
+	return total;
+}
+#endif
+
+/**
+ * Prepares the reads of the ranges from fd into buf, one preadv() from
+ * the start of the first to the end of the last range, as far as IOV_MAX
+ * allows. The data of the holes between the ranges, which belongs to the
+ * other file, goes to sc->skip.
+ * @param buf buffer for the data, starting at file offset base
+ * @param np number of reads prepared so far, increased by the new ones
+ * @param niov number of iovecs used so far, increased by the new ones
+ */
+static void prepare_reads(int fd, const struct drmf_entry *ranges, unsigned int cnt,
+	char *buf, off_t base, struct read_scratch *sc, unsigned int *np,
+	unsigned int *niov) {
+
+	unsigned int i = 0;
+	while (i < cnt) {
+		struct iovec *iov = sc->iov + *niov;
+		struct read_part *part = &sc->parts[*np];
+		unsigned int n = 0;
+
+		part->ranges = ranges + i;
+		part->cnt = 0;
+		part->want = 0;
+
+		/* every range but the last is followed by the hole up to the
+		 * next one */
+		while (i < cnt) {
+			iov[n].iov_base = buf + (ranges[i].offset - base);
+			iov[n++].iov_len = ranges[i].len;
+			part->want += ranges[i].len;
+			part->cnt++;
+			i++;
+
+			if (i == cnt || n + 2 > IOV_MAX) break;
+
+			off_t hole = ranges[i - 1].offset + ranges[i - 1].len;
+			iov[n].iov_base = sc->skip;
+			iov[n++].iov_len = ranges[i].offset - hole;
+			part->want += ranges[i].offset - hole;
+		}
+
+		struct uring_io *io = &sc->ios[(*np)++];
+		io->fd = fd;
+		io->iov = iov;
+		io->iovcnt = n;
+		io->offset = part->ranges[0].offset;
+		*niov += n;
+	}
+}
+
+/**
+ * Does the prepared reads, with io_uring all of them at once.
+ * @param end lowered to the offset where the valid data ends, if a file
+ *        ended before
+ * @return 0 on success, -1 on failure.
+ */
+static int do_reads(struct read_scratch *sc, unsigned int np, off_t *end) {
+	unsigned int i;
+
+	if (np > 1 && uring_available()) {
+		if (uring_preadv_batch(sc->ios, np) != 0) RETURN(-1);
+	} else {
+		for (i = 0; i < np; i++) {
+			struct uring_io *io = &sc->ios[i];
+			io->res = preadv(io->fd, io->iov, io->iovcnt, io->offset);
+			if (io->res < 0) io->res = -errno;
+		}
+	}
+
+	for (i = 0; i < np; i++) {
+		const struct read_part *part = &sc->parts[i];
+		ssize_t res = sc->ios[i].res;
+
+		if (res < 0) {
+			errno = -res;
+			RETURN(-1);
+		}
+
+		if ((size_t)res < part->want) {
+			/* the data is valid up to there, if within a range */
+			off_t eof = part->ranges[0].offset + res;
+			unsigned int j;
+			for (j = 0; j < part->cnt; j++) {
+				const struct drmf_entry *r = &part->ranges[j];
+				if (eof < r->offset + (off_t)r->len) {
+					*end = MIN(*end, MAX(eof, r->offset));
+					break;
+				}
+			}
+		}
+	}
+
+	RETURN(0);
+}
+
+/**
+ * Fills sc->upper with the mapped ranges within <offset, size>, growing
+ * the scratch space until they fit. It also gets a skip buffer of skip_size.
+ * @param mcnt where the number of ranges is returned
+ * @return 0 on success, -1 on failure.
+ */
+static int scratch_map(struct read_scratch *sc, int upper_fd, struct cwf_info *cw,
+	off_t offset, size_t size, size_t skip_size, unsigned int *mcnt) {
+
+	if (scratch_grow(sc, 16, skip_size) != 0) {
+		errno = ENOMEM;
+		RETURN(-1);
+	}
+
+	while (1) {
+		if (drmf_fill_entries(cw->drmap, offset, size, sc->upper,
+				sc->max, mcnt) != 0) {
+			USYSLOG(LOG_ERR, "Failed to obtain datamap. fd = %d\n", upper_fd);
+			errno = EIO;
+			RETURN(-1);
+		}
+		if (*mcnt <= sc->max) break;
+
+		/* the map might change until it is read again */
+		if (scratch_grow(sc, *mcnt + 16, skip_size) != 0) {
+			errno = ENOMEM;
+			RETURN(-1);
+		}
 	}
 
 	RETURN(0);
@@ -380,7 +703,8 @@ int cowolf_close(struct cwf_info *cw) {
  * from top branch and non-mapped data (area with holes in top branch)
  * from lower branch.
  * Essentially this is scatter-gather read from two different
- * files - one from lower branch and another from top branch.
+ * files - one from lower branch and another from top branch. Each of
+ * them is read with a single preadv(), with -o io_uring both at once.
  * @param upper_fd file descriptor for top branch file sparse file)
  * @param cw cowolf file info
  * @param buf buffer pointer
@@ -391,82 +715,116 @@ int cowolf_close(struct cwf_info *cw) {
 int cowolf_read(int upper_fd, struct cwf_info *cw,
 	char *buf, size_t size, off_t offset) {
 
-	DBG("upper = %d, lower = %d, map = %d, size = %lu, off = %lu\n",
-		upper_fd, cw->lower_fd, cw->drmap_fd, size, offset);
+	DBG("upper = %d, lower = %d, size = %lu, off = %lu\n",
+		upper_fd, cw->lower_fd, size, offset);
 
-	struct drmf_entry *map = NULL;
-	unsigned int mcnt = 0;
-	if (drmf_get_entries(cw->drmap_fd, offset, size, &map, &mcnt) != 0) {
-		USYSLOG(LOG_ERR, "Failed to obtain datamap. fd = %d\n", cw->drmap_fd);
-		errno = EIO;
+	if (size == 0) RETURN(0);
+
+	struct read_scratch *sc = scratch_get();
+	if (sc == NULL) {
+		errno = ENOMEM;
 		RETURN(-1);
 	}
 
-	off_t start = offset;
-	size_t remain = size;
-	struct drmf_entry *mpe = map;
-	int rval;
-	int err_saved = 0;
-
-	while (remain > 0) {
-
-		size_t lower_sz;
-		size_t upper_sz;
-
-		if (mpe == NULL) {
-			lower_sz = remain;
-			upper_sz = 0;
-		} else {
-			lower_sz = mpe->offset - start;
-			upper_sz = mpe->len;
+	unsigned int mcnt = 0;
+	if (scratch_map(sc, upper_fd, cw, offset, size, size, &mcnt) != 0) RETURN(-1);
+
+	/* the holes between the mapped ranges */
+	unsigned int i, hcnt = 0;
+	off_t pos = offset;
+	for (i = 0; i <= mcnt; i++) {
+		off_t next = i < mcnt ? sc->upper[i].offset : offset + (off_t)size;
+		if (next > pos) {
+			sc->lower[hcnt].offset = pos;
+			sc->lower[hcnt++].len = next - pos;
 		}
+		if (i < mcnt) pos = sc->upper[i].offset + sc->upper[i].len;
+	}
 
-		if (lower_sz > 0) {
-			/* read the hole from lower branch */
-			rval = pread(cw->lower_fd, buf + (size - remain),
-				lower_sz, start);
-			if (rval < 0) {
-				err_saved = errno;
-				break;
-			}
+	unsigned int np = 0, niov = 0;
+	prepare_reads(cw->lower_fd, sc->lower, hcnt, buf, offset, sc, &np, &niov);
+	prepare_reads(upper_fd, sc->upper, mcnt, buf, offset, sc, &np, &niov);
 
-			start += rval;
-			remain -= rval;
+	off_t end = offset + size;
+	if (do_reads(sc, np, &end) != 0) RETURN(-1);
 
-			if (rval < lower_sz) {
-				break;
-			}
-		}
+	size_t lower = 0;
+	for (i = 0; i < hcnt && sc->lower[i].offset < end; i++) {
+		lower += MIN(sc->lower[i].len, (size_t)(end - sc->lower[i].offset));
+	}
+	stats_read(cw->lower_branch, lower);
+	stats_read(cw->branch, end - offset - lower);
 
-		if (upper_sz > 0) {
-			/* read data segment from top branch */
-			rval = pread(upper_fd, buf + (size - remain),
-				upper_sz, start);
-			if (rval < 0) {
-				err_saved = errno;
-				break;
-			}
+	RETURN((int)(end - offset));
+}
 
-			start += rval;
-			remain -= rval;
+#if FUSE_VERSION >= 29
+static void buf_add(struct fuse_bufvec *bufv, int fd, off_t pos, size_t len) {
+	struct fuse_buf *b = &bufv->buf[bufv->count++];
 
-			if (rval < upper_sz) {
-				break;
-			}
-		}
+	b->size = len;
+	b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	b->mem = NULL;
+	b->fd = fd;
+	b->pos = pos;
+}
 
-		mpe = (mpe < (map + mcnt -1)) ? mpe+1:NULL;
-	} // while
+/**
+ * Like cowolf_read(), but instead of reading the data it returns buffers
+ * referring to the ranges of both files, so that libfuse can splice
+ * them to /dev/fuse. As with cowolf_read(), the data ends where a read
+ * of a buffer comes back short.
+ * The map is read into the scratch space of cowolf_read(). The buffers
+ * cannot be kept there, libfuse frees them after the reply.
+ * @param bufp where the buffers are returned, they are freed with free()
+ * @return 0 on success, -1 on failure.
+ */
+int cowolf_read_buf(int upper_fd, struct cwf_info *cw,
+	struct fuse_bufvec **bufp, size_t size, off_t offset) {
 
-	if (map != NULL) free(map);
+	DBG("upper = %d, lower = %d, size = %lu, off = %lu\n",
+		upper_fd, cw->lower_fd, size, offset);
 
-	if (err_saved > 0) {
-		errno = err_saved;
+	struct read_scratch *sc = scratch_get();
+	if (sc == NULL) {
+		errno = ENOMEM;
+		RETURN(-1);
+	}
+
+	unsigned int mcnt = 0;
+	if (scratch_map(sc, upper_fd, cw, offset, size, 0, &mcnt) != 0) RETURN(-1);
+	const struct drmf_entry *map = sc->upper;
+
+	/* every mapped range might be preceded by a hole, and the end too */
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec)
+		+ 2 * mcnt * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		errno = ENOMEM;
 		RETURN(-1);
 	}
+	bufv->count = 0;
+	bufv->idx = 0;
+	bufv->off = 0;
+
+	off_t pos = offset;
+	unsigned int i;
+	for (i = 0; i <= mcnt; i++) {
+		off_t next = i < mcnt ? map[i].offset : offset + (off_t)size;
+		if (next > pos) {
+			buf_add(bufv, cw->lower_fd, pos, next - pos);
+			stats_read(cw->lower_branch, next - pos);
+		}
+		if (i < mcnt) {
+			buf_add(bufv, upper_fd, map[i].offset, map[i].len);
+			stats_read(cw->branch, map[i].len);
+			pos = map[i].offset + map[i].len;
+		}
+	}
 
-	RETURN((int)(size - remain));
+	*bufp = bufv;
+	RETURN(0);
 }
+#endif
 
 /**
  * Writes data-range maps in map file.
@@ -479,11 +837,11 @@ int cowolf_read(int upper_fd, struct cwf_info *cw,
  */
 int cowolf_write(struct cwf_info *cw, size_t size, off_t offset) {
 
-	DBG("map = %d, size = %lu, off = %lu\n", cw->drmap_fd, size, offset);
+	DBG("size = %lu, off = %lu\n", size, offset);
 
-	if (drmf_add_entry(cw->drmap_fd, offset, size) != 0) {
-		USYSLOG(LOG_ERR, "Failed to add datamap. fd = %d\n",
-			cw->drmap_fd);
+	if (drmf_add_entry(cw->drmap, offset, size) != 0) {
+		USYSLOG(LOG_ERR, "Failed to add datamap. off = %lu\n",
+			offset);
 		errno = EIO;
 		RETURN(-1);
 	}
@@ -491,3 +849,179 @@ int cowolf_write(struct cwf_info *cw, size_t size, off_t offset) {
 	RETURN(0);
 }
 
+/**
+ * Copies the ranges within <offset, len> which are not mapped yet from
+ * the lower branch to the top branch and maps them. With
+ * cowolf_block_size this is done for the parts of the blocks around a
+ * write, so that the map only ever gets whole blocks.
+ * @return 0 on success, -1 on failure.
+ */
+static int fill_blocks(int upper_fd, struct cwf_info *cw,
+	off_t offset, size_t len) {
+
+	if (len == 0) RETURN(0);
+
+	struct drmf_entry *map = NULL;
+	unsigned int mcnt = 0;
+	if (drmf_get_entries(cw->drmap, offset, len, &map, &mcnt) != 0) {
+		errno = EIO;
+		RETURN(-1);
+	}
+
+	char *buf = NULL;
+	off_t pos = offset;
+	off_t end = offset + len;
+	int res = 0;
+	unsigned int i;
+	for (i = 0; i <= mcnt && res == 0; i++) {
+		off_t gap_end = i < mcnt ? map[i].offset : end;
+		size_t gap = gap_end > pos ? gap_end - pos : 0;
+
+		if (gap > 0) {
+			if (buf == NULL) buf = malloc(len);
+			if (buf == NULL) {
+				errno = ENOMEM;
+				res = -1;
+				break;
+			}
+
+			/* unmapped ranges are within the size of the lower file */
+			ssize_t n = uring_pread(cw->lower_fd, buf, gap, pos);
+			if (n < 0
+				|| (n > 0 && uring_pwrite(upper_fd, buf, n, pos) != n)
+				|| (n > 0 && cowolf_write(cw, n, pos) != 0)) {
+				res = -1;
+			}
+		}
+
+		if (i < mcnt) pos = map[i].offset + map[i].len;
+	}
+
+	free(buf);
+	free(map);
+	RETURN(res);
+}
+
+/**
+ * Writes the data to the top branch file, from buf or, if it is NULL,
+ * from the fuse buffers.
+ */
+static ssize_t write_data(int upper_fd, const char *buf, struct fuse_bufvec *bufv,
+	size_t size, off_t offset) {
+
+#if FUSE_VERSION >= 29
+	if (buf == NULL) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = upper_fd;
+		dst.buf[0].pos = offset;
+
+		ssize_t res = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+		if (res < 0) {
+			errno = -res;
+			return -1;
+		}
+		return res;
+	}
+#else
+	(void)bufv;
+#endif
+
+	return uring_pwrite(upper_fd, buf, size, offset);
+}
+
+/**
+ * Writes data in top branch and the data-range map for it. A background
+ * copy-up must not copy the old data of this range in between.
+ */
+static int do_pwrite(int upper_fd, struct cwf_info *cw,
+	const char *buf, struct fuse_bufvec *bufv, size_t size, off_t offset) {
+
+	const off_t bs = uopt.cowolf_block_size;
+	int res = 0;
+
+	cow_async_lock(cw->job);
+	if (bs) drmf_lock_writes(cw->drmap);
+
+	if (bs && size > 0) {
+		/* the written range only covers the blocks partly */
+		off_t head = offset & ~(bs - 1);
+		off_t tail = (offset + size + bs - 1) & ~(bs - 1);
+
+		res = fill_blocks(upper_fd, cw, head, offset - head);
+		if (res == 0) {
+			res = fill_blocks(upper_fd, cw, offset + size,
+				tail - (offset + size));
+		}
+	}
+
+	if (res == 0) {
+		res = write_data(upper_fd, buf, bufv, size, offset);
+		if (res > 0 && cowolf_write(cw, res, offset) < 0) {
+			res = -1;
+		}
+	}
+
+	int err_saved = errno;
+	if (bs) drmf_unlock_writes(cw->drmap);
+	cow_async_unlock(cw->job);
+	errno = err_saved;
+
+	RETURN(res);
+}
+
+/**
+ * Writes data in top branch and the data-range map for it.
+ * @param upper_fd file descriptor for top branch file
+ * @param cw cowolf file info
+ * @param buf data to write
+ * @param size bytes to write
+ * @param offset file offset to write to
+ * @return number of bytes written, or -1 on failure.
+ */
+int cowolf_pwrite(int upper_fd, struct cwf_info *cw,
+	const char *buf, size_t size, off_t offset) {
+
+	return do_pwrite(upper_fd, cw, buf, NULL, size, offset);
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Like cowolf_pwrite(), but with the data in fuse buffers, which might
+ * be a pipe the data is spliced from.
+ */
+int cowolf_write_buf(int upper_fd, struct cwf_info *cw,
+	struct fuse_bufvec *bufv, off_t offset) {
+
+	return do_pwrite(upper_fd, cw, NULL, bufv, fuse_buf_size(bufv), offset);
+}
+#endif
+
+/**
+ * Truncates the top branch file and its data-range map.
+ * @param upper_fd file descriptor for top branch file
+ * @param cw cowolf file info
+ * @param size new size of the file
+ * @return 0 on success, or -1 on failure.
+ */
+int cowolf_ftruncate(int upper_fd, struct cwf_info *cw, off_t size) {
+	DBG("fd = %d, size = %lu\n", upper_fd, size);
+
+	cow_async_lock(cw->job);
+	if (uopt.cowolf_block_size) drmf_lock_writes(cw->drmap);
+
+	int res = ftruncate(upper_fd, size);
+	if (res == 0 && drmf_trunc(cw->drmap, size) != 0) {
+		USYSLOG(LOG_ERR, "Failed to truncate datamap. fd = %d\n",
+			upper_fd);
+		errno = EIO;
+		res = -1;
+	}
+
+	int err_saved = errno;
+	if (uopt.cowolf_block_size) drmf_unlock_writes(cw->drmap);
+	cow_async_unlock(cw->job);
+	errno = err_saved;
+
+	RETURN(res);
+}
@@ -8,26 +8,42 @@
 #define COWOLF_H
 
 #include <sys/stat.h>
+#include <fuse.h>
+
+struct cow_async_job;
+struct drmf;
 
 struct cwf_info {
 	int cwf_on;
 	int lower_fd;
-	int drmap_fd;
+	int branch;		// of the file, for the statistics
+	int lower_branch;	// of lower_fd
+	struct drmf *drmap;
+	struct cow_async_job *job;	// background copy-up, if running
 };
 
-#define CWF_INFO_INITIALIZER  { 0, -1, -1 }
+#define CWF_INFO_INITIALIZER  { 0, -1, -1, -1, NULL, NULL }
 #define CWF_ON(cw)    ((cw).cwf_on)
 
 int cowolf_create_datamap(const char *path, int branch, off_t file_size);
 int cowolf_destroy_datamap(const char *path, int branch);
 int cowolf_rename_datamap(const char *oldpath, const char *newpath, int branch);
-int cowolf_truncate_datamap(const char *path, int branch, off_t new_size);
 
 int cowolf_read(int upper_fd, struct cwf_info *cw,
 	char *buf, size_t size, off_t offset);
 int cowolf_write(struct cwf_info *cw, size_t size, off_t offset);
+int cowolf_pwrite(int upper_fd, struct cwf_info *cw,
+	const char *buf, size_t size, off_t offset);
+int cowolf_ftruncate(int upper_fd, struct cwf_info *cw, off_t size);
+#if FUSE_VERSION >= 29
+int cowolf_read_buf(int upper_fd, struct cwf_info *cw,
+	struct fuse_bufvec **bufp, size_t size, off_t offset);
+int cowolf_write_buf(int upper_fd, struct cwf_info *cw,
+	struct fuse_bufvec *bufv, off_t offset);
+#endif
 
 int cowolf_open(const char *path, int branch, int flags, struct cwf_info *cw);
 int cowolf_close(struct cwf_info *cw);
+int cowolf_sync(struct cwf_info *cw);
 
 #endif
@@ -0,0 +1,418 @@
+/*
+* Description: cache of merged directory listings
+*
+* License: BSD-style license
+*
+* Details:
+*	unionfs_readdir() has to read a directory on every branch, read the
+*	corresponding whiteouts from the meta directories and to merge all of
+*	them. With -o readdir_cache=<entries> the merged and filtered listing
+*	is kept in memory. Along with the listing we remember the inode, mtime
+*	and ctime of the directory and of its meta directory on every branch
+*	that contributed to it, and whether path_hidden() cut off lower
+*	branches. A cached listing is used only if all of these are unchanged,
+*	so a cache hit costs a stat() per branch instead of reading all
+*	directories again. Changes done directly on the branches are noticed
+*	by the same checks.
+*	The number of names in all cached listings is limited by the option
+*	value, least recently used listings are dropped first. Open
+*	directories keep a reference to the listing they are filled from, so
+*	a listing dropped from the cache lives on until they are released.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "general.h"
+#include "hashtable.h"
+#include "string.h"
+#include "dir_cache.h"
+#include "redirect.h"
+
+#if __APPLE__
+#define ST_MTIM(st) ((st)->st_mtimespec)
+#define ST_CTIM(st) ((st)->st_ctimespec)
+#else
+#define ST_MTIM(st) ((st)->st_mtim)
+#define ST_CTIM(st) ((st)->st_ctim)
+#endif
+
+typedef struct {
+	bool exists;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtim;
+	struct timespec ctim;
+} dir_stamp_t;
+
+typedef struct {
+	dir_stamp_t dir;	// the directory on the branch
+	dir_stamp_t meta;	// its meta directory, which has the whiteouts
+	int hidden;		// path_hidden() result
+} branch_stamp_t;
+
+typedef struct {
+	ino_t ino;
+	unsigned char type;
+	size_t name;		// offset into names
+} dir_entry_t;
+
+struct dir_listing {
+	char *path;
+	int nstamps;		// number of branches the listing was built from
+	branch_stamp_t *stamps;
+
+	unsigned int count, size;
+	dir_entry_t *ents;
+	char *names;
+	size_t names_len, names_size;
+
+	unsigned long gen;	// cache_gen when the listing was started
+	int refs;		// protected by cache_lock once cached
+	bool cached;		// still in the cache, protected by cache_lock
+	struct dir_listing *prev, *next; // LRU list, most recent first
+};
+
+static struct hashtable *cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// all protected by cache_lock
+static struct dir_listing *lru_head, *lru_tail;
+static unsigned long cached_entries;
+static unsigned long cache_gen;		// bumped by dir_cache_flush()
+
+void dir_cache_init(void) {
+	if (!uopt.readdir_cache_size) return;
+
+	cache = create_hashtable(16, string_hash, string_equal);
+	if (cache == NULL) {
+		fprintf(stderr, "Failed to create the readdir cache, disabling it.\n");
+		uopt.readdir_cache_size = 0;
+	}
+}
+
+/**
+ * Create an empty listing, returns NULL if the cache is disabled.
+ */
+struct dir_listing *dir_listing_new(void) {
+	if (!uopt.readdir_cache_size) return NULL;
+
+	struct dir_listing *dl = calloc(1, sizeof(struct dir_listing));
+	if (dl == NULL) return NULL;
+
+	dl->stamps = calloc(uopt.max_branches, sizeof(branch_stamp_t));
+	if (dl->stamps == NULL) {
+		free(dl);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	dl->gen = cache_gen;
+	pthread_mutex_unlock(&cache_lock);
+
+	return dl;
+}
+
+void dir_listing_free(struct dir_listing *dl) {
+	if (dl == NULL) return;
+
+	free(dl->path);
+	free(dl->stamps);
+	free(dl->ents);
+	free(dl->names);
+	free(dl);
+}
+
+static int get_stamp(int branch, const char *p, dir_stamp_t *stamp) {
+	struct stat st;
+
+	memset(stamp, 0, sizeof(*stamp));
+	if (fstatat(uopt.branches[branch].fd, branch_relpath(p), &st, 0) == -1) {
+		if (errno == ENOENT || errno == ENOTDIR) return 0;
+		return -errno;
+	}
+
+	stamp->exists = true;
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->mtim = ST_MTIM(&st);
+	stamp->ctim = ST_CTIM(&st);
+
+	return 0;
+}
+
+static bool stamp_equal(const dir_stamp_t *a, const dir_stamp_t *b) {
+	if (a->exists != b->exists) return false;
+	if (!a->exists) return true;
+
+	return a->dev == b->dev && a->ino == b->ino
+		&& a->mtim.tv_sec == b->mtim.tv_sec
+		&& a->mtim.tv_nsec == b->mtim.tv_nsec
+		&& a->ctim.tv_sec == b->ctim.tv_sec
+		&& a->ctim.tv_nsec == b->ctim.tv_nsec;
+}
+
+static int get_branch_stamp(const char *path, int branch, branch_stamp_t *bs) {
+	char buf[PATHLEN_MAX];
+	path = redirect_path(path, branch, buf);
+
+	int res = get_stamp(branch, path, &bs->dir);
+	if (res) return res;
+
+	memset(&bs->meta, 0, sizeof(bs->meta));
+	if (uopt.cow_enabled) {
+		char p[PATHLEN_MAX];
+		if (BUILD_PATH(p, METADIR, path)) return -ENAMETOOLONG;
+		res = get_stamp(branch, p, &bs->meta);
+	}
+
+	return res;
+}
+
+/**
+ * Remember the state of branch, must be called *before* the directory and
+ * its whiteouts are read. Once the listing is stored, it is only used
+ * again if this state did not change.
+ */
+int dir_listing_stamp(struct dir_listing *dl, const char *path, int branch, int hidden) {
+	if (dl == NULL) return 0;
+
+	int res = get_branch_stamp(path, branch, &dl->stamps[branch]);
+	if (res) return res;
+
+	dl->stamps[branch].hidden = hidden;
+	dl->nstamps = branch + 1;
+
+	return 0;
+}
+
+int dir_listing_add(struct dir_listing *dl, const char *name, ino_t ino, unsigned char type) {
+	if (dl == NULL) return 0;
+
+	if (dl->count == dl->size) {
+		unsigned int size = dl->size ? dl->size * 2 : 64;
+		dir_entry_t *ents = realloc(dl->ents, size * sizeof(dir_entry_t));
+		if (ents == NULL) return -ENOMEM;
+		dl->ents = ents;
+		dl->size = size;
+	}
+
+	size_t len = strlen(name) + 1;
+	if (dl->names_len + len > dl->names_size) {
+		size_t size = dl->names_size ? dl->names_size * 2 : 1024;
+		while (size < dl->names_len + len) size *= 2;
+		char *names = realloc(dl->names, size);
+		if (names == NULL) return -ENOMEM;
+		dl->names = names;
+		dl->names_size = size;
+	}
+
+	dir_entry_t *de = &dl->ents[dl->count++];
+	de->ino = ino;
+	de->type = type;
+	de->name = dl->names_len;
+	memcpy(dl->names + dl->names_len, name, len);
+	dl->names_len += len;
+
+	return 0;
+}
+
+static void lru_unlink(struct dir_listing *dl) {
+	if (dl->prev) dl->prev->next = dl->next;
+	else lru_head = dl->next;
+	if (dl->next) dl->next->prev = dl->prev;
+	else lru_tail = dl->prev;
+	dl->prev = dl->next = NULL;
+}
+
+static void lru_push(struct dir_listing *dl) {
+	dl->prev = NULL;
+	dl->next = lru_head;
+	if (lru_head) lru_head->prev = dl;
+	lru_head = dl;
+	if (!lru_tail) lru_tail = dl;
+}
+
+/**
+ * Remove dl from the cache, must be called with cache_lock held.
+ */
+static void cache_remove(struct dir_listing *dl) {
+	hashtable_remove(cache, dl->path);
+	lru_unlink(dl);
+	cached_entries -= dl->count;
+	dl->cached = false;
+	if (dl->refs == 0) dir_listing_free(dl);
+}
+
+/**
+ * Put a complete listing of path into the cache, the cache takes
+ * ownership of dl.
+ */
+void dir_cache_store(const char *path, struct dir_listing *dl) {
+	if (dl == NULL) return;
+
+	// would not fit even into an empty cache
+	if (dl->count > uopt.readdir_cache_size) goto fail;
+
+	dl->path = strdup(path);
+	char *key = strdup(path);
+	if (dl->path == NULL || key == NULL) {
+		free(key);
+		goto fail;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+
+	// the branches changed while it was read
+	if (dl->gen != cache_gen) {
+		pthread_mutex_unlock(&cache_lock);
+		free(key);
+		goto fail;
+	}
+
+	struct dir_listing *old = hashtable_search(cache, key);
+	if (old) cache_remove(old);
+
+	while (lru_tail && cached_entries + dl->count > uopt.readdir_cache_size)
+		cache_remove(lru_tail);
+
+	if (!hashtable_insert(cache, key, dl)) {
+		pthread_mutex_unlock(&cache_lock);
+		free(key);
+		goto fail;
+	}
+
+	dl->cached = true;
+	dl->refs = 0;
+	cached_entries += dl->count;
+	lru_push(dl);
+
+	pthread_mutex_unlock(&cache_lock);
+	return;
+
+fail:
+	dir_listing_free(dl);
+}
+
+/**
+ * Check if the branches still look like when the listing was made.
+ */
+static bool listing_valid(struct dir_listing *dl) {
+	int i;
+	for (i = 0; i < dl->nstamps; i++) {
+		branch_stamp_t bs;
+		if (get_branch_stamp(dl->path, i, &bs)) return false;
+		if (!stamp_equal(&bs.dir, &dl->stamps[i].dir)) return false;
+		if (!stamp_equal(&bs.meta, &dl->stamps[i].meta)) return false;
+
+		int hidden = path_hidden(dl->path, i);
+		if (hidden != dl->stamps[i].hidden) return false;
+	}
+
+	return true;
+}
+
+/**
+ * Return the cached listing of path, if it is still valid. The listing
+ * stays usable until released with dir_cache_put(), even if it gets
+ * dropped from the cache in the mean time.
+ */
+struct dir_listing *dir_cache_get(const char *path) {
+	if (!uopt.readdir_cache_size) return NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	struct dir_listing *dl = hashtable_search(cache, (void *)path);
+	if (dl) {
+		dl->refs++;
+		lru_unlink(dl);
+		lru_push(dl);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (dl == NULL) return NULL;
+
+	// the stat() calls must not be done with the cache locked
+	if (listing_valid(dl)) {
+		DBG("%s: hit\n", path);
+		return dl;
+	}
+
+	DBG("%s: stale\n", path);
+
+	pthread_mutex_lock(&cache_lock);
+	if (dl->cached) cache_remove(dl);
+	pthread_mutex_unlock(&cache_lock);
+
+	dir_cache_put(dl);
+	return NULL;
+}
+
+/**
+ * Release a listing returned by dir_cache_get().
+ */
+void dir_cache_put(struct dir_listing *dl) {
+	if (dl == NULL) return;
+
+	pthread_mutex_lock(&cache_lock);
+	dl->refs--;
+	if (!dl->cached && dl->refs == 0) dir_listing_free(dl);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Drop all cached listings, the branches changed. Listings still being
+ * read are not stored anymore.
+ */
+void dir_cache_flush(void) {
+	if (!uopt.readdir_cache_size) return;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_gen++;
+	while (lru_head) cache_remove(lru_head);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Drop the cached listings read from branch, which is removed. Listings
+ * still being read are not stored anymore.
+ */
+void dir_cache_invalidate_branch(int branch) {
+	if (!uopt.readdir_cache_size) return;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_gen++;
+	struct dir_listing *dl = lru_head;
+	while (dl) {
+		struct dir_listing *next = dl->next;
+		if (dl->nstamps > branch) cache_remove(dl);
+		dl = next;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Fill entries starting at offset from a cached listing, the offset of an
+ * entry is its index + 1. Return the offset of the first entry that did not
+ * fit anymore, or the number of entries if all were filled in.
+ */
+off_t dir_listing_fill(struct dir_listing *dl, void *buf, fuse_fill_dir_t filler, off_t offset) {
+	off_t i;
+	for (i = offset; i < dl->count; i++) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = dl->ents[i].ino;
+		st.st_mode = dl->ents[i].type << 12;
+
+		if (filler(buf, dl->names + dl->ents[i].name, &st, i + 1)) break;
+	}
+
+	return i;
+}
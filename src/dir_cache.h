@@ -0,0 +1,26 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <fuse.h>
+
+struct dir_listing;
+
+void dir_cache_init(void);
+struct dir_listing *dir_listing_new(void);
+void dir_listing_free(struct dir_listing *dl);
+int dir_listing_stamp(struct dir_listing *dl, const char *path, int branch, int hidden);
+int dir_listing_add(struct dir_listing *dl, const char *name, ino_t ino, unsigned char type);
+void dir_cache_store(const char *path, struct dir_listing *dl);
+struct dir_listing *dir_cache_get(const char *path);
+void dir_cache_put(struct dir_listing *dl);
+void dir_cache_flush(void);
+void dir_cache_invalidate_branch(int branch);
+off_t dir_listing_fill(struct dir_listing *dl, void *buf, fuse_fill_dir_t filler, off_t offset);
+
+#endif
@@ -49,6 +49,22 @@
  * ftruncate(fd, 3000);
  * lseek(fd, 600, SEEK_SET);
  * read(fd, buf, 100);
+ *
+ * On disk the map file starts with a header and a snapshot of the
+ * records, followed by a log of the changes done since:
+ *
+ * struct drmf_header
+ * struct drmm_rec [snap_cnt]
+ * struct drmf_log_rec ...
+ *
+ * Writing back the map appends the changes to the log. Once the log got
+ * longer than the snapshot, a new file with a new snapshot and an empty
+ * log is written and renamed over the old one. drmf_open() loads the
+ * snapshot and replays the log. Log records carry the generation of the
+ * header and a checksum, the log ends at the first record which does not
+ * match (e.g. due to a crash while appending). Files without the header
+ * are of the old format, a bare array of records. They are converted
+ * when written back the first time.
  */
 
 #include <stdio.h>
@@ -61,16 +77,76 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "usyslog.h"
 #include "debug.h"
 #include "drm_file.h"
 #include "drm_mem.h"
+#include "stats.h"
 
 #define RECSZ sizeof(struct drmm_rec)
 #define  MAX(x, y)  (((x) > (y))?(x):(y))
 #define  MIN(x, y)  (((x) < (y))?(x):(y))
 
+#define DRMF_MAGIC "DRMAPLG"
+#define DRMF_VERSION 2
+
+/* log op of a truncate, off_end is the new size */
+#define DRMF_LOG_TRUNC UINT64_MAX
+
+/* do not compact short logs, even if the snapshot is shorter */
+#define DRMF_LOG_MIN 1024
+
+struct drmf_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t gen;		/* incremented with every snapshot */
+	uint64_t snap_cnt;	/* number of records in the snapshot */
+};
+
+struct drmf_log_rec {
+	uint64_t off_start;	/* DRMF_LOG_TRUNC for a truncate */
+	uint64_t off_end;
+	uint64_t gen;		/* header generation */
+	uint64_t check;
+};
+
+#define HDRSZ sizeof(struct drmf_header)
+#define LOGSZ sizeof(struct drmf_log_rec)
+
+/**
+ * In-memory map, shared by all opens of the same map file.
+ */
+struct drmf {
+	dev_t dev;		/* protected by maps_lock */
+	ino_t ino;
+	char *path;
+	int refs;			/* protected by maps_lock */
+	struct drmf *next;		/* protected by maps_lock */
+
+	pthread_mutex_t write_lock;	/* see drmf_lock_writes() */
+
+	pthread_mutex_t lock;		/* protects everything below */
+	int fd;				/* replaced by compaction */
+	struct drmm_map *recs;
+	bool dirty;			/* not written back yet */
+
+	struct drmm_rec *log;		/* changes not written back yet */
+	unsigned int log_cnt, log_max;
+	bool compact;			/* write a new snapshot */
+
+	uint64_t gen;			/* of the file */
+	uint64_t disk_snap;		/* records in the snapshot in the file */
+	uint64_t disk_log;		/* records in the log in the file */
+	off_t log_end;			/* where the next log record goes */
+};
+
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct drmf *maps;
+
 /**
  * lock file
  */
@@ -93,93 +169,424 @@ static inline int file_unlock(int fd) {
 	RETURN(-1);
 }
 
+static uint64_t log_check(const struct drmf_log_rec *lr) {
+	/* FNV-1a over the three words */
+	uint64_t words[3] = { lr->off_start, lr->off_end, lr->gen };
+	const unsigned char *p = (const unsigned char *)words;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < sizeof(words); i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
 /**
- * Loads all data-range map records from file and return them in a
- * allocated buffer. It is caller's responsibility to free the buffer.
+ * Applies a truncate to the records. See drmf_trunc().
  */
-static int file_load(int fd, bool extra_rec_space, struct drmm_rec **recs,
-	unsigned int *cnt) {
+static int recs_trunc(struct drmm_map *recs, off_t new_size) {
+	/* last record is for the region beyond EOF, it is added
+	 * again below.
+	 */
+	off_t saved_last_start = drmm_map_last(recs)->off_start;
+	drmm_map_truncate(recs, new_size);
 
-	struct stat fst;
-	struct drmm_rec *buf = NULL;
+	/* add last record:
+	 * CASE 1:
+	 * If truncation position is in unmapped area, truncated
+	 * part simply gets added to the last record.
+	 *   rec[0] = [100, 199]
+	 *   rec[1] = [500, UINT64_MAX]
+	 *    --------------------------------
+	 *   |          |MMMMMMMM|            |
+	 *   |          |100     |199         |499 (EOF)
+	 *    --------------------------------
+	 *        truncate here -------->|399
+	 *
+	 * after truncation:
+	 *   rec[0] = [100, 199]
+	 *   rec[1] = [400, UINT64_MAX]
+	 *    ---------------------------
+	 *   |          |MMMMMMMM|       |
+	 *   |          |100     |199    |399 (EOF)
+	 *    ---------------------------
+	 *
+	 * CASE 2:
+	 * If truncation position is in mapped area, mapped area
+	 * gets merged into the last record (which is EOF to UINT64_MAX).
+	 *   rec[0] = [100, 299]
+	 *   rec[1] = [500, UINT64_MAX]
+	 *    ---------------------------------
+	 *   |          |MMMMMMMMMMMM|         |
+	 *   |          |100         |299      |499 (EOF)
+	 *    ---------------------------------
+	 *    truncate here -->|199
+	 *
+	 * after truncation:
+	 *   rec[0] = [100, UINT64_MAX]
+	 *    -----------------
+	 *   |          |MMMMMM|
+	 *   |          |100   |199 (EOF)
+	 *    -----------------
+	 */
+	if (saved_last_start < new_size) {
+		new_size = saved_last_start;
+	}
+	struct drmm_rec last_rec = { new_size, UINT64_MAX };
+	RETURN(drmm_map_insert(recs, &last_rec));
+}
 
-	if (fstat(fd, &fst) != 0) {
-		USYSLOG(LOG_ERR, "fstat(%d) failed. %s\n",
-			fd, strerror(errno));
-		goto error_out;
+/**
+ * Applies one log record to the records.
+ */
+static int recs_apply(struct drmm_map *recs, const struct drmm_rec *op) {
+	if (op->off_start == DRMF_LOG_TRUNC) {
+		RETURN(recs_trunc(recs, op->off_end));
 	}
+	RETURN(drmm_map_insert(recs, op));
+}
+
+/**
+ * Loads a file of the old format, a bare array of records.
+ */
+static int file_load_v1(int fd, off_t size, struct drmf *map) {
+	struct drmm_rec *buf = NULL;
+	int rval = -1;
 
-	if (fst.st_size%RECSZ) {
+	if (size%RECSZ || size == 0) {
 		/* file is corrupted */
 		USYSLOG(LOG_ERR, "bad file size %lu. fd %d\n",
-			fst.st_size, fd);
-		goto error_out;
+			size, fd);
+		goto out;
 	}
 
-	unsigned int num_rec = fst.st_size/RECSZ;
-
-	/* one extra space for new record */
-	buf = (struct drmm_rec *) malloc(
-			fst.st_size + (extra_rec_space? RECSZ : 0));
+	buf = (struct drmm_rec *) malloc(size);
 	if (buf == NULL) {
-		USYSLOG(LOG_ERR, "malloc(%lu) failed.\n",
-			fst.st_size + (extra_rec_space? RECSZ : 0));
-		goto error_out;
+		USYSLOG(LOG_ERR, "malloc(%lu) failed.\n", size);
+		goto out;
 	}
 
-	int sz = pread(fd, buf, fst.st_size, 0);
-	if (sz != fst.st_size) {
+	int sz = pread(fd, buf, size, 0);
+	if (sz != size) {
 		USYSLOG(LOG_ERR, "pread(%d, %lu) returned %d. %s\n",
-			fd, fst.st_size, sz, strerror(errno));
-		goto error_out;
+			fd, size, sz, strerror(errno));
+		goto out;
 	}
 
-	/* last record off_end is always UINT64_MAX */
-	if (buf[num_rec -1].off_end != UINT64_MAX) {
+	if (drmm_map_load(map->recs, buf, size/RECSZ) != 0) goto out;
 
-		USYSLOG(LOG_ERR, "fd %d is missing end sentinel rec.\n"
-			" got %lu %lu instead.\n",
-			fd, buf[num_rec -1].off_start,
-			buf[num_rec -1].off_end);
-		goto error_out;
+	/* there is nothing to append a log to */
+	map->compact = true;
+	rval = 0;
+out:
+	free(buf);
+	RETURN(rval);
+}
+
+/**
+ * Loads the snapshot and replays the log.
+ */
+static int file_load_v2(int fd, off_t size, const struct drmf_header *hdr,
+	struct drmf *map) {
+
+	struct drmm_rec *buf = NULL;
+	int rval = -1;
+
+	if (hdr->version != DRMF_VERSION) {
+		USYSLOG(LOG_ERR, "unknown map version %u. fd %d\n",
+			hdr->version, fd);
+		goto out;
+	}
+
+	off_t snap_end = HDRSZ + hdr->snap_cnt*RECSZ;
+	if (hdr->snap_cnt == 0 || snap_end > size) {
+		USYSLOG(LOG_ERR, "bad snapshot of %lu records. fd %d\n",
+			(unsigned long)hdr->snap_cnt, fd);
+		goto out;
 	}
 
-	*recs = (struct drmm_rec*) buf;
-	*cnt = num_rec;
+	size_t snap_sz = hdr->snap_cnt*RECSZ;
+	buf = (struct drmm_rec *) malloc(snap_sz);
+	if (buf == NULL) {
+		USYSLOG(LOG_ERR, "malloc(%lu) failed.\n", snap_sz);
+		goto out;
+	}
 
-	RETURN(0);
-error_out:
-	if (buf != NULL) free(buf);
-	RETURN(-1);
+	if (pread(fd, buf, snap_sz, HDRSZ) != (ssize_t)snap_sz) {
+		USYSLOG(LOG_ERR, "pread(%d, %lu) failed. %s\n",
+			fd, snap_sz, strerror(errno));
+		goto out;
+	}
+
+	if (drmm_map_load(map->recs, buf, hdr->snap_cnt) != 0) goto out;
+
+	struct drmf_log_rec lbuf[256];
+	off_t pos = snap_end;
+	uint64_t nlog = 0;
+	bool end = false;
+	while (!end && pos < size) {
+		ssize_t n = pread(fd, lbuf, sizeof(lbuf), pos);
+		if (n < 0) {
+			USYSLOG(LOG_ERR, "pread(%d) failed. %s\n",
+				fd, strerror(errno));
+			goto out;
+		}
+
+		unsigned int i, cnt = n/LOGSZ;
+		if (cnt == 0) break;
+		for (i = 0; i < cnt; i++) {
+			if (lbuf[i].gen != hdr->gen
+				|| lbuf[i].check != log_check(&lbuf[i])) {
+				/* torn or stale, the log ends here */
+				end = true;
+				break;
+			}
+
+			struct drmm_rec op = { lbuf[i].off_start, lbuf[i].off_end };
+			if (recs_apply(map->recs, &op) != 0) goto out;
+			pos += LOGSZ;
+			nlog++;
+		}
+	}
+
+	if (pos < size) {
+		/* nothing behind a torn record may be replayed later on */
+		USYSLOG(LOG_WARNING, "dropping %lu bytes at the end of the map log. fd %d\n",
+			(unsigned long)(size - pos), fd);
+		if (ftruncate(fd, pos) != 0) {
+			USYSLOG(LOG_ERR, "ftruncate(%d) failed. %s\n", fd, strerror(errno));
+			goto out;
+		}
+	}
+
+	map->gen = hdr->gen;
+	map->disk_snap = hdr->snap_cnt;
+	map->disk_log = nlog;
+	map->log_end = pos;
+	rval = 0;
+out:
+	free(buf);
+	RETURN(rval);
 }
 
 /**
- * Saves data-range map records in file.
+ * Loads the data-range map from file into map->recs.
  */
-static int file_save(int fd, const struct drmm_rec *recs,
-	unsigned int cnt) {
-	size_t sz = cnt*RECSZ;
+static int file_load(int fd, struct drmf *map) {
+	struct stat fst;
+	struct drmf_header hdr;
+
+	if (fstat(fd, &fst) != 0) {
+		USYSLOG(LOG_ERR, "fstat(%d) failed. %s\n",
+			fd, strerror(errno));
+		RETURN(-1);
+	}
+
+	int rval;
+	if (fst.st_size >= (off_t)HDRSZ
+		&& pread(fd, &hdr, HDRSZ, 0) == HDRSZ
+		&& memcmp(hdr.magic, DRMF_MAGIC, sizeof(hdr.magic)) == 0) {
+		rval = file_load_v2(fd, fst.st_size, &hdr, map);
+	} else {
+		rval = file_load_v1(fd, fst.st_size, map);
+	}
+	if (rval != 0) RETURN(-1);
 
 	/* last record off_end is always UINT64_MAX */
-	if (recs[cnt -1].off_end != UINT64_MAX) {
+	const struct drmm_rec *last = drmm_map_last(map->recs);
+	if (last == NULL || last->off_end != UINT64_MAX) {
 
-		USYSLOG(LOG_ERR, "missing end sentinel rec whle writing.\n"
+		USYSLOG(LOG_ERR, "fd %d is missing end sentinel rec.\n"
 			" got %lu %lu instead.\n",
-			recs[cnt -1].off_start,
-			recs[cnt -1].off_end);
+			fd, last ? last->off_start : 0,
+			last ? last->off_end : 0);
+		RETURN(-1);
 	}
 
-	if (pwrite(fd, recs, sz, 0) != sz) {
+	RETURN(0);
+}
+
+/**
+ * Writes a header and a snapshot of the records.
+ */
+static int file_write_snapshot(int fd, const struct drmm_map *recs, uint64_t gen) {
+	struct drmf_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DRMF_MAGIC, sizeof(hdr.magic));
+	hdr.version = DRMF_VERSION;
+	hdr.gen = gen;
+	hdr.snap_cnt = drmm_map_count(recs);
+
+	if (pwrite(fd, &hdr, HDRSZ, 0) != HDRSZ) {
 		USYSLOG(LOG_ERR, "write(%d) failed. %s\n", fd, strerror(errno));
 		RETURN(-1);
 	}
 
-	if (ftruncate(fd, sz) != 0) {
-		USYSLOG(LOG_ERR, "ftruncate(%d) failed. %s\n", fd, strerror(errno));
-		RETURN(-1);
+	struct drmm_rec buf[256];
+	struct drmm_iter iter;
+	const struct drmm_rec *rec = drmm_map_find(recs, 0, &iter);
+	off_t pos = HDRSZ;
+	while (rec) {
+		size_t n = 0;
+		for (; rec && n < 256; rec = drmm_map_next(&iter)) buf[n++] = *rec;
+
+		if (pwrite(fd, buf, n*RECSZ, pos) != (ssize_t)(n*RECSZ)) {
+			USYSLOG(LOG_ERR, "write(%d) failed. %s\n", fd, strerror(errno));
+			RETURN(-1);
+		}
+		pos += n*RECSZ;
+	}
+
+	RETURN(0);
+}
+
+/**
+ * Appends the changes not written back yet to the log.
+ * Must be called with map->lock held.
+ */
+static int file_append(struct drmf *map) {
+	struct drmf_log_rec lbuf[256];
+	unsigned int done = 0;
+
+	if (file_lock(map->fd) != 0) RETURN(-1);
+
+	while (done < map->log_cnt) {
+		unsigned int i, n = MIN(map->log_cnt - done, 256);
+		for (i = 0; i < n; i++) {
+			lbuf[i].off_start = map->log[done + i].off_start;
+			lbuf[i].off_end = map->log[done + i].off_end;
+			lbuf[i].gen = map->gen;
+			lbuf[i].check = log_check(&lbuf[i]);
+		}
+
+		if (pwrite(map->fd, lbuf, n*LOGSZ, map->log_end) != (ssize_t)(n*LOGSZ)) {
+			USYSLOG(LOG_ERR, "write(%d) failed. %s\n", map->fd, strerror(errno));
+			file_unlock(map->fd);
+			RETURN(-1);
+		}
+
+		map->log_end += n*LOGSZ;
+		map->disk_log += n;
+		done += n;
+	}
+
+	file_unlock(map->fd);
+	RETURN(0);
+}
+
+/**
+ * Replaces the map file by a new one with a snapshot of the records and
+ * an empty log. Must be called with map->lock held.
+ */
+static int file_compact(struct drmf *map) {
+	size_t len = strlen(map->path);
+	char tmppath[len + 5];
+	snprintf(tmppath, sizeof(tmppath), "%s.new", map->path);
+
+	/* keeps drmf_open(), drmf_rename() and drmf_destroy() away */
+	pthread_mutex_lock(&maps_lock);
+
+	struct stat st;
+	if (fstat(map->fd, &st) == 0 && st.st_nlink == 0) {
+		/* the map was removed, do not bring it back */
+		pthread_mutex_unlock(&maps_lock);
+		RETURN(0);
+	}
+
+	int fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		USYSLOG(LOG_ERR, "open(%s) failed. %s\n", tmppath, strerror(errno));
+		goto err;
+	}
+
+	if (file_write_snapshot(fd, map->recs, map->gen + 1) != 0) goto err_close;
+
+	/* the new file must be complete before it replaces the old one */
+	if (fsync(fd) != 0) {
+		USYSLOG(LOG_ERR, "fsync(%s) failed. %s\n", tmppath, strerror(errno));
+		goto err_close;
+	}
+
+	if (fstat(fd, &st) != 0 || rename(tmppath, map->path) != 0) {
+		USYSLOG(LOG_ERR, "rename(%s,%s) failed. %s\n",
+			tmppath, map->path, strerror(errno));
+		goto err_close;
+	}
+
+	/* the new name must be on disk as well, appends go to the new file */
+	char *slash = strrchr(tmppath, '/');
+	if (slash) {
+		*slash = '\0';
+		int dfd = open(slash == tmppath ? "/" : tmppath, O_RDONLY);
+		if (dfd >= 0) {
+			fsync(dfd);
+			close(dfd);
+		}
 	}
 
+	close(map->fd);
+	map->fd = fd;
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+
+	pthread_mutex_unlock(&maps_lock);
+
+	map->gen++;
+	map->disk_snap = drmm_map_count(map->recs);
+	map->disk_log = 0;
+	map->log_end = HDRSZ + map->disk_snap*RECSZ;
+
 	RETURN(0);
+
+err_close:
+	close(fd);
+	unlink(tmppath);
+err:
+	pthread_mutex_unlock(&maps_lock);
+	RETURN(-1);
+}
+
+/**
+ * Remembers a change to be written back to the log.
+ * Must be called with map->lock held.
+ */
+static void log_add(struct drmf *map, uint64_t off_start, uint64_t off_end) {
+	map->dirty = true;
+	if (map->compact) return;
+
+	if (off_start != DRMF_LOG_TRUNC && map->log_cnt > 0) {
+		/* the union of two overlapping or adjacent ranges is a range */
+		struct drmm_rec *prev = &map->log[map->log_cnt - 1];
+		if (prev->off_start != DRMF_LOG_TRUNC
+			&& off_start <= prev->off_end + 1 && prev->off_start <= off_end + 1) {
+			prev->off_start = MIN(prev->off_start, off_start);
+			prev->off_end = MAX(prev->off_end, off_end);
+			return;
+		}
+	}
+
+	/* a log longer than the map itself, better write a snapshot */
+	if (map->log_cnt >= drmm_map_count(map->recs) + DRMF_LOG_MIN) {
+		map->compact = true;
+		return;
+	}
+
+	if (map->log_cnt == map->log_max) {
+		unsigned int log_max = map->log_max ? map->log_max * 2 : 16;
+		struct drmm_rec *log = realloc(map->log, log_max * RECSZ);
+		if (log == NULL) {
+			map->compact = true;
+			return;
+		}
+		map->log = log;
+		map->log_max = log_max;
+	}
+
+	map->log[map->log_cnt].off_start = off_start;
+	map->log[map->log_cnt].off_end = off_end;
+	map->log_cnt++;
 }
 
 /**
@@ -209,12 +616,13 @@ int drmf_create(const char *path, off_t size_initial) {
 		RETURN(-1);
 	}
 
-	if (file_lock(fd) == 0) {
-		struct drmm_rec last_rec = { size_initial, UINT64_MAX };
-		int sz = pwrite(fd, &last_rec, RECSZ, 0);
-		if (sz != RECSZ) {
-			USYSLOG(LOG_ERR, "pwrite(%s, %d) failed. ret = %d. %s\n",
-				path, (int)RECSZ, sz, strerror(errno));
+	struct drmm_map *recs = drmm_map_new();
+	struct drmm_rec last_rec = { size_initial, UINT64_MAX };
+	if (recs == NULL || drmm_map_insert(recs, &last_rec) != 0) {
+		ret = -1;
+	} else if (file_lock(fd) == 0) {
+		if (file_write_snapshot(fd, recs, 1) != 0) {
+			USYSLOG(LOG_ERR, "Writing %s failed.\n", path);
 			ret = -1;
 		}
 
@@ -222,6 +630,7 @@ int drmf_create(const char *path, off_t size_initial) {
 	} else {
 		ret = -1;
 	}
+	drmm_map_free(recs);
 
 	if (close(fd) != 0) {
 		USYSLOG(LOG_ERR, "close(%s) failed. %s\n", path, strerror(errno));
@@ -238,8 +647,20 @@ int drmf_create(const char *path, off_t size_initial) {
  */
 int drmf_destroy(const char *path) {
 	DBG("%s\n", path);
-	if (unlink(path) != 0) {
-		USYSLOG(LOG_ERR, "unlink(%s) failed. %s\n", path, strerror(errno));
+	size_t len = strlen(path);
+	char tmppath[len + 5];
+	snprintf(tmppath, sizeof(tmppath), "%s.new", path);
+
+	pthread_mutex_lock(&maps_lock);
+	int res = unlink(path);
+	int errsaved = errno;
+	/* left behind if we crashed while compacting */
+	unlink(tmppath);
+	pthread_mutex_unlock(&maps_lock);
+
+	if (res != 0) {
+		USYSLOG(LOG_ERR, "unlink(%s) failed. %s\n", path, strerror(errsaved));
+		errno = errsaved;
 		RETURN(-1);
 	}
 	RETURN(0);
@@ -253,151 +674,365 @@ int drmf_destroy(const char *path) {
  */
 int drmf_rename(const char *oldpath, const char *newpath) {
 	DBG("from %s to %s\n", oldpath, newpath);
+
+	pthread_mutex_lock(&maps_lock);
 	if (rename(oldpath, newpath) != 0) {
+		int errsaved = errno;
+		pthread_mutex_unlock(&maps_lock);
 		USYSLOG(LOG_ERR, "rename(%s,%s) failed. %s\n",
-			oldpath, newpath, strerror(errno));
+			oldpath, newpath, strerror(errsaved));
+		errno = errsaved;
 		RETURN(-1);
 	}
+
+	/* compaction of an open map has to write the new path */
+	struct stat st;
+	if (stat(newpath, &st) == 0) {
+		struct drmf *map;
+		for (map = maps; map; map = map->next) {
+			if (map->dev != st.st_dev || map->ino != st.st_ino) continue;
+
+			char *path = strdup(newpath);
+			if (path) {
+				free(map->path);
+				map->path = path;
+			}
+		}
+	}
+	pthread_mutex_unlock(&maps_lock);
+
 	RETURN(0);
 }
 
 /**
- * Opens data-range map file.
+ * Writes the in-memory map back to the file, if it was modified.
+ * Must be called with map->lock held.
+ */
+static int map_save(struct drmf *map) {
+	if (!map->dirty) RETURN(0);
+
+	int rval;
+	if (map->compact || map->disk_log + map->log_cnt > MAX(map->disk_snap, DRMF_LOG_MIN)) {
+		rval = file_compact(map);
+		stats_map(STATS_MAP_COMPACT);
+	} else {
+		rval = file_append(map);
+		stats_map(STATS_MAP_APPEND);
+	}
+
+	if (rval == 0) {
+		map->dirty = false;
+		map->compact = false;
+		map->log_cnt = 0;
+	}
+	RETURN(rval);
+}
+
+/**
+ * Opens data-range map file. All opens of the same map file share the
+ * records, which are loaded once and kept in memory. Changes are written
+ * back by drmf_sync() and when the last reference is closed.
  * @param mpath path for data-range map file
- * @param map_fd pointer where fd to be returned
- * @return 0 if opened successfully. -1 on failure.
+ * @param mapp pointer where the map to be returned
+ * @return 0 if opened successfully. errno on failure.
  */
-int drmf_open(const char *mpath, int *map_fd) {
+int drmf_open(const char *mpath, struct drmf **mapp) {
 	DBG("%s\n", mpath);
-	*map_fd = -1;
+	*mapp = NULL;
+
+	/* compaction must not replace the file in between */
+	pthread_mutex_lock(&maps_lock);
+
 	int fd = open(mpath, O_RDWR);
 	if (fd < 0) {
 		int errsaved = errno;
-		USYSLOG(LOG_ERR, "open(%s) failed. %s\n", mpath, strerror(errno));
+		pthread_mutex_unlock(&maps_lock);
+		USYSLOG(LOG_ERR, "open(%s) failed. %s\n", mpath, strerror(errsaved));
+		RETURN(errsaved);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int errsaved = errno;
+		pthread_mutex_unlock(&maps_lock);
+		close(fd);
 		RETURN(errsaved);
 	}
 
-	/* TODO: check sanity of the file here? */
+	struct drmf *map;
+	for (map = maps; map; map = map->next) {
+		if (map->dev == st.st_dev && map->ino == st.st_ino) {
+			map->refs++;
+			pthread_mutex_unlock(&maps_lock);
+			close(fd);
+			*mapp = map;
+			RETURN(0);
+		}
+	}
+
+	map = calloc(1, sizeof(struct drmf));
+	if (map == NULL) {
+		pthread_mutex_unlock(&maps_lock);
+		close(fd);
+		RETURN(ENOMEM);
+	}
+
+	map->recs = drmm_map_new();
+	map->path = strdup(mpath);
+	int res = (map->recs && map->path) ? file_lock(fd) : -1;
+	if (res == 0) {
+		res = file_load(fd, map);
+		file_unlock(fd);
+	}
+	if (res != 0) {
+		pthread_mutex_unlock(&maps_lock);
+		drmm_map_free(map->recs);
+		free(map->path);
+		free(map);
+		close(fd);
+		RETURN(EIO);
+	}
+
+	map->fd = fd;
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->refs = 1;
+	pthread_mutex_init(&map->lock, NULL);
+	pthread_mutex_init(&map->write_lock, NULL);
+
+	map->next = maps;
+	maps = map;
+
+	pthread_mutex_unlock(&maps_lock);
 
-	*map_fd = fd;
+	*mapp = map;
 	RETURN(0);
 }
 
 /**
- * Closes data-range map file.
- * @param map_fd fd for data-range map file to be closed
+ * Takes another reference to an open map.
+ */
+struct drmf *drmf_get(struct drmf *map) {
+	pthread_mutex_lock(&maps_lock);
+	map->refs++;
+	pthread_mutex_unlock(&maps_lock);
+
+	return map;
+}
+
+/**
+ * Closes data-range map file. The map is written back and freed when
+ * the last reference is closed.
+ * @param map map to be closed
  * @return 0 if closed successfully. -1 on failure.
  */
-int drmf_close(int map_fd) {
-	DBG("%d\n", map_fd);
-	if (close(map_fd) != 0) {
-		USYSLOG(LOG_ERR, "close(%d) failed. %s\n", map_fd, strerror(errno));
+int drmf_close(struct drmf *map) {
+	DBG("%d\n", map->fd);
+
+	pthread_mutex_lock(&maps_lock);
+	if (--map->refs > 0) {
+		pthread_mutex_unlock(&maps_lock);
+		RETURN(0);
 	}
-	RETURN(0);
+
+	struct drmf **p;
+	for (p = &maps; *p; p = &(*p)->next) {
+		if (*p == map) {
+			*p = map->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&maps_lock);
+
+	int rval = map_save(map);
+
+	if (close(map->fd) != 0) {
+		USYSLOG(LOG_ERR, "close(%d) failed. %s\n", map->fd, strerror(errno));
+	}
+
+	pthread_mutex_destroy(&map->lock);
+	pthread_mutex_destroy(&map->write_lock);
+	drmm_map_free(map->recs);
+	free(map->log);
+	free(map->path);
+	free(map);
+
+	RETURN(rval);
 }
 
 /**
- * Adds a new map entry in the data-range map file.
- * @param map_fd map file fd
+ * Writes the map back to the file and flushes it to disk. Must be done
+ * after flushing the data the map describes.
+ * @param map map to be written
+ * @return 0 on success, -1 on failure.
+ */
+int drmf_sync(struct drmf *map) {
+	DBG("%d\n", map->fd);
+
+	pthread_mutex_lock(&map->lock);
+	int rval = map_save(map);
+	if (rval == 0 && fsync(map->fd) != 0) {
+		USYSLOG(LOG_ERR, "fsync(%d) failed. %s\n", map->fd, strerror(errno));
+		rval = -1;
+	}
+	pthread_mutex_unlock(&map->lock);
+
+	RETURN(rval);
+}
+
+/**
+ * Serializes writers which also copy data from the lower file, e.g. the
+ * unwritten parts of a block. Their copy must not overwrite data written
+ * in the mean time. Not taken by the drmf_* functions themselves.
+ */
+void drmf_lock_writes(struct drmf *map) {
+	pthread_mutex_lock(&map->write_lock);
+}
+
+void drmf_unlock_writes(struct drmf *map) {
+	pthread_mutex_unlock(&map->write_lock);
+}
+
+/**
+ * Checks if the map file was removed, e.g. because the file was deleted.
+ */
+bool drmf_unlinked(struct drmf *map) {
+	struct stat st;
+
+	pthread_mutex_lock(&map->lock);
+	bool unlinked = fstat(map->fd, &st) == 0 && st.st_nlink == 0;
+	pthread_mutex_unlock(&map->lock);
+
+	return unlinked;
+}
+
+/**
+ * Adds a new map entry in the data-range map.
+ * @param map the map
  * @param offset offset in the file
  * @param len length of map range
  * @return 0 on success, -1 on failure.
  */
-int drmf_add_entry(int map_fd, off_t offset, size_t len) {
-	DBG("fd = %d, off = %lu, len = %lu\n", map_fd, offset, len);
+int drmf_add_entry(struct drmf *map, off_t offset, size_t len) {
+	DBG("fd = %d, off = %lu, len = %lu\n", map->fd, offset, len);
 
-	struct drmm_rec *recs = NULL;
-	int rval = -1;
-	unsigned int num_rec = 0;
 	struct drmm_rec new_rec = { offset, offset + len -1 };
+	int rval = -1;
 
-	if (file_lock(map_fd) != 0) {
-		RETURN(-1);
-	}
-
-	if (file_load(map_fd, true, &recs, &num_rec) != 0) {
-		goto error_out;
+	if (len == 0) {
+		RETURN(0);
 	}
 
-	num_rec = drmm_rec_insert(&new_rec, recs, num_rec);
+	stats_map(STATS_MAP_ADD);
 
-	if (file_save(map_fd, recs, num_rec) != 0) {
-		goto error_out;
+	pthread_mutex_lock(&map->lock);
+	if (drmm_map_insert(map->recs, &new_rec) == 0) {
+		log_add(map, new_rec.off_start, new_rec.off_end);
+		rval = 0;
+	} else {
+		USYSLOG(LOG_ERR, "Out of memory adding a map entry. fd %d\n", map->fd);
 	}
-
-	rval = 0;
-error_out:
-	if (recs != NULL) free(recs);
-	file_unlock(map_fd);
+	pthread_mutex_unlock(&map->lock);
 
 	RETURN(rval);
 }
 
 /**
  * Get data-range map entries of specified <offset, len> range
- * from the map file.
- * @param map_fd map file fd
+ * from the map into a buffer of the caller.
+ * @param map the map
  * @param offset offset in the file
  * @param len lenght of range for which map is requested
- * @param entries address where allocated map entries to be returned.
- *        NULL if no map entry is available within the range.
- * @param count pointer where number of map entries to be returned.
+ * @param entries buffer for up to max entries
+ * @param max size of the buffer
+ * @param count pointer where the number of map entries within the range
+ *        is returned. If it is larger than max, only the first max
+ *        entries were filled in.
  * @return 0 on success, -1 on failure.
  */
-int drmf_get_entries(int map_fd, off_t offset, size_t len,
-	struct drmf_entry **entries, unsigned int *count) {
-	DBG("fd = %d, off = %lu, len = %lu\n", map_fd, offset, len);
+int drmf_fill_entries(struct drmf *map, off_t offset, size_t len,
+	struct drmf_entry *entries, unsigned int max, unsigned int *count) {
+	DBG("fd = %d, off = %lu, len = %lu\n", map->fd, offset, len);
 
-	struct drmm_rec *recs = NULL;
-	unsigned int num_rec = 0;
-	unsigned int olap_indx_first = 0;
-	struct drmf_entry *dm_tmp = NULL;
-	unsigned int i, olap_cnt;
-	struct drmm_rec *olap_rec;
+	unsigned int olap_cnt = 0;
+	const struct drmm_rec *olap_rec;
+	struct drmm_iter iter;
 	off_t range_st, range_en;
 
-	*entries = NULL;
 	*count = 0;
 
 	if (len == 0) {
 		RETURN(0);
 	}
 
-	if (file_lock(map_fd) != 0) {
-		RETURN(-1);
-	}
+	range_st = offset;
+	range_en = offset + len -1;
 
-	if (file_load(map_fd, false, &recs, &num_rec) != 0) {
-		file_unlock(map_fd);
-		RETURN(-1);
-	}
+	stats_map(STATS_MAP_LOOKUP);
 
-	file_unlock(map_fd);
+	pthread_mutex_lock(&map->lock);
 
-	olap_cnt = drmm_rec_find_overlaps(offset, len, recs, num_rec,
-			&olap_indx_first);
-	if (olap_cnt == 0) {
-		RETURN(0); /* not an error */
-	}
+	for (olap_rec = drmm_map_find(map->recs, offset, &iter);
+		olap_rec && olap_rec->off_start <= (uint64_t)range_en;
+		olap_rec = drmm_map_next(&iter)) {
 
-	dm_tmp = (struct drmf_entry *)malloc(
-			sizeof(struct drmf_entry)*olap_cnt);
-	if (dm_tmp == NULL) {
-		free(recs);
-		RETURN(-1);
+		if (olap_cnt < max) {
+			struct drmf_entry *e = &entries[olap_cnt];
+			e->offset = MAX(olap_rec->off_start, range_st);
+			e->len = MIN(olap_rec->off_end, range_en) - e->offset + 1;
+		}
+		olap_cnt++;
 	}
 
-	range_st = offset;
-	range_en = offset + len -1;
+	pthread_mutex_unlock(&map->lock);
 
-	for (i = 0; i < olap_cnt; i++) {
-		olap_rec = &recs[olap_indx_first + i];
-		dm_tmp[i].offset = MAX(olap_rec->off_start, range_st);
-		dm_tmp[i].len = MIN(olap_rec->off_end,
-					range_en) - dm_tmp[i].offset + 1;
-	}
+	*count = olap_cnt;
+
+	RETURN(0);
+}
+
+/**
+ * Get data-range map entries of specified <offset, len> range
+ * from the map.
+ * @param map the map
+ * @param offset offset in the file
+ * @param len lenght of range for which map is requested
+ * @param entries address where allocated map entries to be returned.
+ *        NULL if no map entry is available within the range.
+ * @param count pointer where number of map entries to be returned.
+ * @return 0 on success, -1 on failure.
+ */
+int drmf_get_entries(struct drmf *map, off_t offset, size_t len,
+	struct drmf_entry **entries, unsigned int *count) {
+
+	struct drmf_entry *dm_tmp = NULL;
+	unsigned int max = 0, olap_cnt = 0;
+
+	*entries = NULL;
+	*count = 0;
+
+	/* the map might change in between, until it fits */
+	do {
+		if (olap_cnt > max) {
+			free(dm_tmp);
+			max = olap_cnt;
+			dm_tmp = (struct drmf_entry *)malloc(
+					sizeof(struct drmf_entry)*max);
+			if (dm_tmp == NULL) {
+				RETURN(-1);
+			}
+		}
 
-	free(recs);
+		if (drmf_fill_entries(map, offset, len, dm_tmp, max, &olap_cnt) != 0) {
+			free(dm_tmp);
+			RETURN(-1);
+		}
+	} while (olap_cnt > max);
+
+	if (olap_cnt == 0) {
+		free(dm_tmp);
+		RETURN(0); /* not an error */
+	}
 
 	*entries = dm_tmp;
 	*count = olap_cnt;
@@ -405,92 +1040,42 @@ int drmf_get_entries(int map_fd, off_t offset, size_t len,
 	RETURN(0);
 }
 
+/**
+ * Checks if the whole file is mapped, i.e. there is only one record
+ * starting at offset 0. The lower branch file is not needed anymore then.
+ * @param map the map
+ * @return 1 if the file is completely mapped, 0 if not.
+ */
+int drmf_is_full(struct drmf *map) {
+	DBG("fd = %d\n", map->fd);
+
+	pthread_mutex_lock(&map->lock);
+	int rval = (drmm_map_count(map->recs) == 1
+		&& drmm_map_last(map->recs)->off_start == 0);
+	pthread_mutex_unlock(&map->lock);
+
+	RETURN(rval);
+}
+
 /**
  * Truncates the the data-range map to new size of of a file.
- * All the map records beyond the new_size are removed from the map file.
+ * All the map records beyond the new_size are removed from the map.
  * Given the last record also include the region EOF to UINT64_MAX,
  * the last record is adjusted accordingly.
- * @param map_fd file desc of map file
+ * @param map the map
  * @param new_size new size of file
  * @return 0 is truncated successfully (including no record removed).
  *         - on failure.
  */
-int drmf_trunc(int map_fd, off_t new_size) {
-	DBG("map_fd = %d, size = %lu\n", map_fd, new_size);
-
-	struct drmm_rec *recs = NULL;
-	unsigned int num_rec = 0;
-	int rval = -1;
-	int lck_ret = -1;
-	off_t saved_last_start;
-
-	if ((lck_ret = file_lock(map_fd)) != 0) {
-		goto err_out;
-	}
-
-	if (file_load(map_fd, true, &recs, &num_rec) != 0) {
-		goto err_out;
-	}
-
-	/* last record is for the region beyond EOF, truncate
-	 * without it.
-	 */
-	saved_last_start = recs[num_rec -1].off_start;
-	num_rec = drmm_rec_truncate(new_size, recs, num_rec -1);
+int drmf_trunc(struct drmf *map, off_t new_size) {
+	DBG("map_fd = %d, size = %lu\n", map->fd, new_size);
 
-	/* add last record:
-	 * CASE 1:
-	 * If truncation position is in unmapped area, truncated
-	 * part simply gets added to the last record.
-	 *   rec[0] = [100, 199]
-	 *   rec[1] = [500, UINT64_MAX]
-	 *    --------------------------------
-	 *   |          |MMMMMMMM|            |
-	 *   |          |100     |199         |499 (EOF)
-	 *    --------------------------------
-	 *        truncate here -------->|399
-	 *
-	 * after truncation:
-	 *   rec[0] = [100, 199]
-	 *   rec[1] = [400, UINT64_MAX]
-	 *    ---------------------------
-	 *   |          |MMMMMMMM|       |
-	 *   |          |100     |199    |399 (EOF)
-	 *    ---------------------------
-	 *
-	 * CASE 2:
-	 * If truncation position is in mapped area, mapped area
-	 * gets merged into the last record (which is EOF to UINT64_MAX).
-	 *   rec[0] = [100, 299]
-	 *   rec[1] = [500, UINT64_MAX]
-	 *    ---------------------------------
-	 *   |          |MMMMMMMMMMMM|         |
-	 *   |          |100         |299      |499 (EOF)
-	 *    ---------------------------------
-	 *    truncate here -->|199
-	 *
-	 * after truncation:
-	 *   rec[0] = [100, UINT64_MAX]
-	 *    -----------------
-	 *   |          |MMMMMM|
-	 *   |          |100   |199 (EOF)
-	 *    -----------------
-	 */
-	if (saved_last_start < new_size) {
-		new_size = saved_last_start;
-	}
-	struct drmm_rec last_rec = { new_size, UINT64_MAX };
-	num_rec = drmm_rec_insert(&last_rec, recs, num_rec);
+	stats_map(STATS_MAP_TRUNC);
 
-	if (file_save(map_fd, recs, num_rec) != 0) {
-		goto err_out;
-	}
-
-	rval = 0;
-err_out:
-	if (recs != NULL) free(recs);
-	if (lck_ret == 0) file_unlock(map_fd);
+	pthread_mutex_lock(&map->lock);
+	int rval = recs_trunc(map->recs, new_size);
+	log_add(map, DRMF_LOG_TRUNC, new_size);
+	pthread_mutex_unlock(&map->lock);
 
 	RETURN(rval);
 }
-
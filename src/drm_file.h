@@ -4,6 +4,7 @@
 #ifndef DRM_FILE_H
 #define DRM_FILE_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 struct drmf_entry {
@@ -15,13 +16,23 @@ int drmf_create(const char *mpath, off_t size_initial);
 int drmf_destroy(const char *mpath);
 int drmf_rename(const char *oldpath, const char *newpath);
 
-int drmf_open(const char *mpath, int *map_fd);
-int drmf_close(int map_fd);
+struct drmf;
 
-int drmf_add_entry(int map_fd, off_t offset, size_t len);
-int drmf_get_entries(int map_fd, off_t offset, size_t len,
+int drmf_open(const char *mpath, struct drmf **map);
+struct drmf *drmf_get(struct drmf *map);
+int drmf_close(struct drmf *map);
+int drmf_sync(struct drmf *map);
+bool drmf_unlinked(struct drmf *map);
+void drmf_lock_writes(struct drmf *map);
+void drmf_unlock_writes(struct drmf *map);
+
+int drmf_add_entry(struct drmf *map, off_t offset, size_t len);
+int drmf_get_entries(struct drmf *map, off_t offset, size_t len,
 	struct drmf_entry **entries, unsigned int *count);
+int drmf_fill_entries(struct drmf *map, off_t offset, size_t len,
+	struct drmf_entry *entries, unsigned int max, unsigned int *count);
 
-int drmf_trunc(int map_fd, off_t new_size);
+int drmf_trunc(struct drmf *map, off_t new_size);
+int drmf_is_full(struct drmf *map);
 
 #endif
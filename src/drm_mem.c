@@ -230,3 +230,272 @@ unsigned int drmm_rec_find_overlaps(off_t offset, size_t len,
 	RETURN(cnt);
 }
 
+
+/*
+ * 255 records and the count fill a 4k page.
+ */
+#define DRMM_LEAF_MAX 255
+
+struct drmm_leaf {
+	unsigned int cnt;
+	/* one spare record, drmm_rec_insert() needs it before a split */
+	struct drmm_rec recs[DRMM_LEAF_MAX + 1];
+};
+
+struct drmm_map {
+	struct drmm_leaf **leaves;	/* sorted by their first record */
+	unsigned int num_leaves;
+	unsigned int max_leaves;
+	unsigned long num_rec;
+};
+
+struct drmm_map *drmm_map_new(void) {
+	return calloc(1, sizeof(struct drmm_map));
+}
+
+void drmm_map_free(struct drmm_map *map) {
+	if (map == NULL) return;
+
+	unsigned int i;
+	for (i = 0; i < map->num_leaves; i++) free(map->leaves[i]);
+	free(map->leaves);
+	free(map);
+}
+
+/**
+ * make space for one more leaf in the index.
+ */
+static
+int map_reserve_leaf(struct drmm_map *map) {
+	if (map->num_leaves < map->max_leaves) RETURN(0);
+
+	unsigned int max_leaves = map->max_leaves ? map->max_leaves * 2 : 16;
+	struct drmm_leaf **leaves = realloc(map->leaves,
+			max_leaves * sizeof(struct drmm_leaf *));
+	if (leaves == NULL) RETURN(-1);
+
+	map->leaves = leaves;
+	map->max_leaves = max_leaves;
+	RETURN(0);
+}
+
+static
+void map_add_leaf(struct drmm_map *map, unsigned int indx,
+	struct drmm_leaf *leaf) {
+
+	memmove(&map->leaves[indx + 1], &map->leaves[indx],
+		(map->num_leaves - indx) * sizeof(struct drmm_leaf *));
+	map->leaves[indx] = leaf;
+	map->num_leaves++;
+}
+
+static
+void map_del_leaves(struct drmm_map *map, unsigned int indx, unsigned int cnt) {
+	unsigned int i;
+	for (i = indx; i < indx + cnt; i++) {
+		map->num_rec -= map->leaves[i]->cnt;
+		free(map->leaves[i]);
+	}
+
+	memmove(&map->leaves[indx], &map->leaves[indx + cnt],
+		(map->num_leaves - indx - cnt) * sizeof(struct drmm_leaf *));
+	map->num_leaves -= cnt;
+}
+
+/**
+ * find the last leaf which has its first record starting at or before
+ * offset, the first leaf if there is none.
+ */
+static
+unsigned int map_find_leaf(const struct drmm_map *map, uint64_t offset) {
+	unsigned int lo = 0, hi = map->num_leaves;
+
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (map->leaves[mid]->recs[0].off_start <= offset) lo = mid;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * replace the content of the map with a sorted array of records, as
+ * stored in the data-range map file.
+ * @return 0 on success, -1 on failure.
+ */
+int drmm_map_load(struct drmm_map *map, const struct drmm_rec *recs,
+	unsigned int num_rec) {
+
+	map_del_leaves(map, 0, map->num_leaves);
+
+	/* leave room in the leaves, for inserts not to split right away */
+	const unsigned int fill = DRMM_LEAF_MAX * 3 / 4;
+	unsigned int i;
+	for (i = 0; i < num_rec; i += fill) {
+		struct drmm_leaf *leaf = malloc(sizeof(struct drmm_leaf));
+		if (leaf == NULL || map_reserve_leaf(map)) {
+			free(leaf);
+			map_del_leaves(map, 0, map->num_leaves);
+			RETURN(-1);
+		}
+
+		leaf->cnt = MIN(fill, num_rec - i);
+		memcpy(leaf->recs, &recs[i], leaf->cnt * RECSZ);
+		map_add_leaf(map, map->num_leaves, leaf);
+		map->num_rec += leaf->cnt;
+	}
+
+	RETURN(0);
+}
+
+/**
+ * insert a new entry in the map, merging it with overlapped or adjacent
+ * records. unlike drmm_rec_insert() a merge can reach records in the
+ * following leaves.
+ * @return 0 on success, -1 if out of memory (map is unchanged then).
+ */
+int drmm_map_insert(struct drmm_map *map, const struct drmm_rec *new_entry) {
+	struct drmm_leaf *spare = NULL;
+
+	if (map->num_leaves == 0) {
+		spare = calloc(1, sizeof(struct drmm_leaf));
+		if (spare == NULL || map_reserve_leaf(map)) {
+			free(spare);
+			RETURN(-1);
+		}
+		map_add_leaf(map, 0, spare);
+		spare = NULL;
+	}
+
+	unsigned int li = map_find_leaf(map, new_entry->off_start);
+	struct drmm_leaf *leaf = map->leaves[li];
+
+	/* the leaf might have to be split, do not fail after altering it */
+	if (leaf->cnt == DRMM_LEAF_MAX) {
+		spare = malloc(sizeof(struct drmm_leaf));
+		if (spare == NULL || map_reserve_leaf(map)) {
+			free(spare);
+			RETURN(-1);
+		}
+	}
+
+	unsigned int old_cnt = leaf->cnt;
+	leaf->cnt = drmm_rec_insert(new_entry, leaf->recs, leaf->cnt);
+	map->num_rec += leaf->cnt;
+	map->num_rec -= old_cnt;
+
+	/* the last record might have grown into the following leaves */
+	struct drmm_rec *last = &leaf->recs[leaf->cnt - 1];
+	while (li + 1 < map->num_leaves) {
+		struct drmm_leaf *next = map->leaves[li + 1];
+
+		if (next->recs[next->cnt - 1].off_end <= last->off_end) {
+			map_del_leaves(map, li + 1, 1);
+			continue;
+		}
+
+		unsigned int merged = 0;
+		while (merged < next->cnt && rec_merge(last, &next->recs[merged])) {
+			merged++;
+		}
+		if (merged == next->cnt) {
+			map_del_leaves(map, li + 1, 1);
+		} else if (merged > 0) {
+			memmove(next->recs, &next->recs[merged],
+				(next->cnt - merged) * RECSZ);
+			next->cnt -= merged;
+			map->num_rec -= merged;
+		}
+		break;
+	}
+
+	if (leaf->cnt > DRMM_LEAF_MAX) {
+		unsigned int half = leaf->cnt / 2;
+		spare->cnt = leaf->cnt - half;
+		memcpy(spare->recs, &leaf->recs[half], spare->cnt * RECSZ);
+		leaf->cnt = half;
+		map_add_leaf(map, li + 1, spare);
+		spare = NULL;
+	}
+
+	free(spare);
+	RETURN(0);
+}
+
+/**
+ * truncates the map to new size, see drmm_rec_truncate().
+ */
+void drmm_map_truncate(struct drmm_map *map, off_t new_size) {
+	if (map->num_leaves == 0) return;
+
+	if (new_size == 0) {
+		map_del_leaves(map, 0, map->num_leaves);
+		return;
+	}
+
+	unsigned int li = map_find_leaf(map, new_size - 1);
+	struct drmm_leaf *leaf = map->leaves[li];
+
+	map_del_leaves(map, li + 1, map->num_leaves - li - 1);
+
+	unsigned int old_cnt = leaf->cnt;
+	leaf->cnt = drmm_rec_truncate(new_size, leaf->recs, leaf->cnt);
+	map->num_rec -= old_cnt - leaf->cnt;
+
+	if (leaf->cnt == 0) map_del_leaves(map, li, 1);
+}
+
+unsigned long drmm_map_count(const struct drmm_map *map) {
+	return map->num_rec;
+}
+
+const struct drmm_rec *drmm_map_last(const struct drmm_map *map) {
+	if (map->num_leaves == 0) return NULL;
+
+	const struct drmm_leaf *leaf = map->leaves[map->num_leaves - 1];
+	return &leaf->recs[leaf->cnt - 1];
+}
+
+/**
+ * find the first record which ends at or after offset, i.e. the first
+ * record which can overlap a range starting at offset. The following
+ * records are returned by drmm_map_next().
+ * @return the record, NULL if there is none.
+ */
+const struct drmm_rec *drmm_map_find(const struct drmm_map *map, off_t offset,
+	struct drmm_iter *iter) {
+
+	iter->map = map;
+	iter->leaf = 0;
+	iter->idx = 0;
+
+	if (map->num_leaves == 0) return NULL;
+
+	iter->leaf = map_find_leaf(map, offset);
+	const struct drmm_leaf *leaf = map->leaves[iter->leaf];
+
+	int indx = search_sml_or_eql(offset, leaf->recs, leaf->cnt);
+	if (indx < 0) indx = 0;
+	iter->idx = indx;
+
+	if (leaf->recs[indx].off_end < (uint64_t)offset) {
+		/* ends before offset, the next one starts after it */
+		return drmm_map_next(iter);
+	}
+
+	return &leaf->recs[indx];
+}
+
+const struct drmm_rec *drmm_map_next(struct drmm_iter *iter) {
+	const struct drmm_map *map = iter->map;
+
+	if (iter->leaf >= map->num_leaves) return NULL;
+
+	if (++iter->idx >= map->leaves[iter->leaf]->cnt) {
+		iter->idx = 0;
+		if (++iter->leaf >= map->num_leaves) return NULL;
+	}
+
+	return &map->leaves[iter->leaf]->recs[iter->idx];
+}
@@ -23,4 +23,32 @@ unsigned int drmm_rec_find_overlaps(off_t offset, size_t len,
         const struct drmm_rec *recs, unsigned int num_rec,
         unsigned int *first_index);
 
+/*
+ * Sorted set of records in a two level B-tree: leaves are arrays of up to
+ * DRMM_LEAF_MAX records, indexed by a sorted array of leaves. Inserting
+ * only moves records within one leaf instead of the whole map.
+ */
+struct drmm_map;
+
+struct drmm_iter {
+	const struct drmm_map *map;
+	unsigned int leaf;
+	unsigned int idx;
+};
+
+struct drmm_map *drmm_map_new(void);
+void drmm_map_free(struct drmm_map *map);
+
+int drmm_map_load(struct drmm_map *map, const struct drmm_rec *recs,
+	unsigned int num_rec);
+int drmm_map_insert(struct drmm_map *map, const struct drmm_rec *new_entry);
+void drmm_map_truncate(struct drmm_map *map, off_t new_size);
+
+unsigned long drmm_map_count(const struct drmm_map *map);
+const struct drmm_rec *drmm_map_last(const struct drmm_map *map);
+
+const struct drmm_rec *drmm_map_find(const struct drmm_map *map, off_t offset,
+	struct drmm_iter *iter);
+const struct drmm_rec *drmm_map_next(struct drmm_iter *iter);
+
 #endif
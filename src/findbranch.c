@@ -41,6 +41,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "unionfs.h"
 #include "opts.h"
@@ -50,30 +52,76 @@
 #include "string.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "lookup_cache.h"
+#include "redirect.h"
+#include "trace.h"
+#include "bloom.h"
+#include "manifest.h"
 
 /**
- *  Find a branch that has "path". Return the branch number.
+ * Find path on branch and lstat() it there.
  */
-static int find_branch(const char *path, searchflag_t flag) {
+static int stat_branch(const char *path, int branch, branch_lookup_t *bl) {
+	bl->branch = branch;
+	bl->path = branch_relpath(redirect_path(path, branch, bl->buf));
+
+	return manifest_lstatat(branch, bl->path, &bl->st);
+}
+
+/**
+ *  Find a branch that has "path". Return the branch number. If bl is not
+ *  NULL, it gets the stat and the path on the branch.
+ */
+static int find_branch(const char *path, searchflag_t flag, branch_lookup_t *bl) {
 	DBG("%s\n", path);
 
+	lookup_result_t cached;
+	if (lookup_cache_get(path, &cached)) {
+		if (cached.branch < 0) {
+			errno = ENOENT;
+			RETURN(-1);
+		}
+		// only the first branch having path is cached, for RWONLY we
+		// need to scan lower branches if that one is read-only, which
+		// might change while mounted
+		if (flag == RWRO || uopt.branches[cached.branch].rw) {
+			if (bl && stat_branch(path, cached.branch, bl) == -1) RETURN(-1);
+			RETURN(cached.branch);
+		}
+	}
+
+	branch_lookup_t local;
+	if (bl == NULL) bl = &local;
+
+	// only full RWRO scans give results we may cache
+	unsigned long seq = lookup_cache_begin();
+
+	// we do not build the full paths, but other functions do
+	size_t len = strlen(path);
+
 	int i = 0;
 	for (i = 0; i < uopt.nbranches; i++) {
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
+		if (uopt.branches[i].path_len + len >= PATHLEN_MAX) {
 			errno = ENAMETOOLONG;
 			RETURN(-1);
 		}
 
-		struct stat stbuf;
-		int res = lstat(p, &stbuf);
+		// below a renamed directory path might have another name
+		const char *p = redirect_path(path, i, bl->buf);
+		bl->path = branch_relpath(p);
+		bl->branch = i;
 
-		DBG("%s: res = %d\n", p, res);
+		// no need to stat, if the branch certainly does not have it
+		int res = -1;
+		if (bloom_may_have(p, i)) res = manifest_lstatat(i, bl->path, &bl->st);
+
+		DBG("%d: %s: res = %d\n", i, bl->path, res);
 
 		if (res == 0) { // path was found
 			switch (flag) {
 			case RWRO:
 				// any path we found is fine
+				lookup_cache_put(path, i, false, seq);
 				RETURN(i);
 			case RWONLY:
 				// we need a rw-branch
@@ -88,6 +136,7 @@ static int find_branch(const char *path, searchflag_t flag) {
 		res = path_hidden(path, i);
 		if (res > 0) {
 			// So no path, but whiteout found. No need to search in further branches
+			if (flag == RWRO) lookup_cache_put(path, -1, true, seq);
 			errno = ENOENT;
 			RETURN(-1);
 		} else if (res < 0) {
@@ -96,6 +145,7 @@ static int find_branch(const char *path, searchflag_t flag) {
 		}
 	}
 
+	if (flag == RWRO) lookup_cache_put(path, -1, false, seq);
 	errno = ENOENT;
 	RETURN(-1);
 }
@@ -105,7 +155,18 @@ static int find_branch(const char *path, searchflag_t flag) {
  */
 int find_rorw_branch(const char *path) {
 	DBG("%s\n", path);
-	int res = find_branch(path, RWRO);
+	int res = find_branch(path, RWRO, NULL);
+	if (res >= 0) trace_branch(res);
+	RETURN(res);
+}
+
+/**
+ * Find a ro or rw branch, together with the stat and the path of path on it.
+ */
+int find_rorw_branch_stat(const char *path, branch_lookup_t *bl) {
+	DBG("%s\n", path);
+	int res = find_branch(path, RWRO, bl);
+	if (res >= 0) trace_branch(res);
 	RETURN(res);
 }
 
@@ -168,6 +229,10 @@ int __find_rw_branch_cutlast(const char *path, int rw_hint) {
 	if (path_create(dname, branch, branch_rw) == 0) branch = branch_rw; // path successfully copied
 
 out:
+	if (branch >= 0) {
+		trace_branch(branch);
+		bloom_add(path, branch); // we are going to create it
+	}
 	free(dname);
 
 	RETURN(branch);
@@ -218,11 +283,13 @@ int find_rw_branch_cow_common(const char *path, bool copy_dir) {
 		RETURN(-1);
 	}
 
-	if (cow_cp(path, branch_rorw, branch_rw, copy_dir)) RETURN(-1);
+	// other threads might want to copy it at the same time
+	if (cow_cp_once(path, branch_rorw, branch_rw, copy_dir)) RETURN(-1);
 
 	// remove a file that might hide the copied file
 	remove_hidden(path, branch_rw);
 
+	trace_branch(branch_rw);
 	RETURN(branch_rw);
 }
 
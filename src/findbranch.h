@@ -7,12 +7,28 @@
 #ifndef FINDBRANCH_H
 #define FINDBRANCH_H
 
+#include <sys/stat.h>
+
+#include "unionfs.h"
+
 typedef enum searchflag {
 	RWRO,
 	RWONLY
 } searchflag_t;
 
+/**
+ * What find_rorw_branch_stat() found, so that callers need not build the
+ * path and stat it again.
+ */
+typedef struct {
+	int branch;
+	struct stat st;		// lstat() of path on branch
+	const char *path;	// relative to the root of branch, may point to buf
+	char buf[PATHLEN_MAX];	// path, if it is redirected on branch
+} branch_lookup_t;
+
 int find_rorw_branch(const char *path);
+int find_rorw_branch_stat(const char *path, branch_lookup_t *bl);
 int find_lowest_rw_branch(int branch_ro);
 int find_rw_branch_cutlast(const char *path);
 int __find_rw_branch_cutlast(const char *path, int rw_hint);
@@ -0,0 +1,1364 @@
+/*
+* Description: low-level fuse interface
+*
+* License: BSD-style license
+*
+* Details:
+*	With -o lowlevel we talk to the low-level fuse API instead of the
+*	path based one in fuse_ops.c. For every inode the kernel knows about
+*	we keep a node with its parent and name, the branch serving it, and
+*	for directories an O_PATH file descriptor per branch, for the
+*	directory itself and for its meta directory. Lookups and getattr are
+*	then fstatat() calls relative to the descriptors of the parent, which
+*	avoids building and walking full paths on every request.
+*
+*	Everything that changes the union (create, unlink, rename, copy-up,
+*	...) still goes through the path based implementations in
+*	fuse_ops.c, for which we build the path from the node table. After
+*	such an operation the nodes along the affected paths get re-resolved
+*	lazily, renaming a directory re-resolves all nodes. Changes done
+*	directly on the branches are only noticed once the kernel looks up the
+*	name again and the node is re-resolved for some other reason, so the
+*	entry and attribute timeouts should be kept short if branches are
+*	modified behind our back.
+*
+*	Unless -o watch_branches is given. Then every directory of a node is
+*	watched with inotify on all branches. A change of a name in it marks
+*	the nodes stale and invalidates the kernel's entry and the attributes
+*	and data of the node, so that long timeouts are safe. Watches are
+*	shared by the nodes of the same branch directory and are kept by
+*	their union path, so they survive the re-resolution of the nodes.
+*	Changes of whiteouts in the meta directories are not watched.
+*/
+
+#if defined __linux__
+	// For O_PATH, fstatat() and friends
+	#define _GNU_SOURCE
+#endif
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined __linux__
+	#include <sys/inotify.h>
+	#define HAVE_INOTIFY
+#endif
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "string.h"
+#include "usyslog.h"
+#include "conf.h"
+#include "readdir.h"
+#include "general.h"
+#include "fuse_ll_ops.h"
+#include "lookup_cache.h"
+#include "redirect.h"
+#include "session.h"
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+typedef struct {
+	int fd;		// the directory on the branch, -1 if none
+	int mfd;	// its meta directory on the branch, -1 if none
+	bool hidden;	// path_hidden() of the node on this branch
+	int wd;		// inotify watch of fd, -1 if none
+} ll_branch_t;
+
+typedef struct ll_node {
+	struct ll_node *parent;	// NULL for the root
+	char *name;
+	char *key;		// key in the node table, NULL if not linked
+	uint64_t nlookup;	// lookups the kernel did not forget yet
+	unsigned int children;	// nodes having us as parent
+	uint64_t ino;		// st_ino we report, not changed by copy-up
+	unsigned long gen;	// ll_gen the node was resolved for
+	int branch;		// branch serving the node, -1 if it does not exist
+	struct ll_node *prev, *next;	// in the list of all nodes
+	ll_branch_t b[];
+} ll_node_t;
+
+typedef struct {
+	double entry_timeout;
+	double attr_timeout;
+	double negative_timeout;
+} ll_conf_t;
+
+// same options and defaults as the high-level fuse library
+static ll_conf_t ll_conf = { 1.0, 1.0, 0.0 };
+
+static const struct fuse_opt ll_opts[] = {
+	{ "entry_timeout=%lf", offsetof(ll_conf_t, entry_timeout), 0 },
+	{ "attr_timeout=%lf", offsetof(ll_conf_t, attr_timeout), 0 },
+	{ "negative_timeout=%lf", offsetof(ll_conf_t, negative_timeout), 0 },
+	FUSE_OPT_END
+};
+
+// everything below is protected by ll_lock
+static pthread_mutex_t ll_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hashtable *nodes;	// "<parent ino>/<name>" -> node
+static ll_node_t *root;
+static ll_node_t *all_nodes;
+static uint64_t last_ino = FUSE_ROOT_ID;
+static unsigned long ll_gen = 1;	// bumped to re-resolve all nodes
+
+// the request the current thread works on, for set_owner()
+static __thread fuse_req_t current_req;
+
+static struct fuse_chan *ll_chan;	// for the invalidation notifications
+
+#ifdef HAVE_INOTIFY
+// changes of the names in a directory and of the directory itself
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+	IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | \
+	IN_ONLYDIR | IN_EXCL_UNLINK)
+
+typedef struct {
+	int refs;	// ll_branch_t having the watch
+	char *path;	// union path of the directory
+} ll_watch_t;
+
+static int watch_fd = -1;
+static struct hashtable *watches;	// "<wd>" -> ll_watch_t, under ll_lock
+#endif
+
+/**
+ * Return uid and gid of the process doing the current request.
+ */
+void ll_get_caller(uid_t *uid, gid_t *gid) {
+	const struct fuse_ctx *ctx = fuse_req_ctx(current_req);
+	*uid = ctx->uid;
+	*gid = ctx->gid;
+}
+
+static ll_node_t *get_node(fuse_ino_t ino) {
+	if (ino == FUSE_ROOT_ID) return root;
+	return (ll_node_t *)(uintptr_t)ino;
+}
+
+static fuse_ino_t node_id(ll_node_t *n) {
+	if (n == root) return FUSE_ROOT_ID;
+	return (uintptr_t)n;
+}
+
+static ll_node_t *node_alloc(ll_node_t *parent, const char *name) {
+	ll_node_t *n = calloc(1, sizeof(ll_node_t) + uopt.nbranches * sizeof(ll_branch_t));
+	if (n == NULL) return NULL;
+
+	if (name) {
+		n->name = strdup(name);
+		if (n->name == NULL) {
+			free(n);
+			return NULL;
+		}
+	}
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		n->b[i].fd = -1;
+		n->b[i].mfd = -1;
+		n->b[i].wd = -1;
+	}
+
+	n->parent = parent;
+	if (parent) parent->children++;
+	n->ino = ++last_ino;
+	n->branch = -1;
+
+	n->next = all_nodes;
+	if (all_nodes) all_nodes->prev = n;
+	all_nodes = n;
+
+	return n;
+}
+
+static void node_close(ll_node_t *n) {
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (n->b[i].fd >= 0) close(n->b[i].fd);
+		if (n->b[i].mfd >= 0) close(n->b[i].mfd);
+		n->b[i].fd = -1;
+		n->b[i].mfd = -1;
+	}
+}
+
+static char *node_key(ll_node_t *parent, const char *name) {
+	char *key;
+	if (asprintf(&key, "%llu/%s", (unsigned long long)parent->ino, name) == -1) return NULL;
+	return key;
+}
+
+static int node_path(ll_node_t *n, char *buf, size_t size);
+
+#ifdef HAVE_INOTIFY
+static char *watch_key(int wd) {
+	char *key;
+	if (asprintf(&key, "%d", wd) == -1) return NULL;
+	return key;
+}
+
+/**
+ * Drop the reference of a branch directory on watch wd.
+ */
+static void watch_drop(int wd) {
+	if (wd < 0) return;
+
+	char *key = watch_key(wd);
+	ll_watch_t *w = key ? hashtable_search(watches, key) : NULL;
+	if (w && --w->refs == 0) {
+		inotify_rm_watch(watch_fd, wd);
+		hashtable_remove(watches, key);
+		free(w->path);
+		free(w);
+	}
+	free(key);
+}
+
+/**
+ * Watch the directory of n on a branch, b->fd is opened already. Replaces
+ * the watch b had before, which is the same for the same directory.
+ */
+static void watch_add(ll_node_t *n, ll_branch_t *b) {
+	int old = b->wd;
+	b->wd = -1;
+
+	char path[PATHLEN_MAX];
+	if (watch_fd >= 0 && b->fd >= 0 && node_path(n, path, PATHLEN_MAX) == 0) {
+		// inotify wants a path, the O_PATH descriptor has none
+		char proc[64];
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", b->fd);
+
+		int wd = inotify_add_watch(watch_fd, proc, WATCH_EVENTS);
+		char *key = wd >= 0 ? watch_key(wd) : NULL;
+		ll_watch_t *w = key ? hashtable_search(watches, key) : NULL;
+		char *p = strdup(path);
+
+		if (wd < 0) {
+			static bool warned;
+			if (!warned) USYSLOG(LOG_WARNING, "Watching %s failed: %s\n", path, strerror(errno));
+			warned = true;
+		} else if (key && p && w) {
+			free(key);
+			free(w->path);
+			w->path = p;
+			w->refs++;
+			b->wd = wd;
+		} else if (key && p && (w = calloc(1, sizeof(ll_watch_t)))) {
+			w->path = p;
+			w->refs = 1;
+			if (hashtable_insert(watches, key, w)) {
+				b->wd = wd;
+			} else {
+				free(key);
+				free(p);
+				free(w);
+				inotify_rm_watch(watch_fd, wd);
+			}
+		} else {
+			free(key);
+			free(p);
+		}
+	}
+
+	watch_drop(old);
+}
+#else
+static void watch_drop(int wd) {
+	(void)wd;
+}
+
+static void watch_add(ll_node_t *n, ll_branch_t *b) {
+	(void)n;
+	(void)b;
+}
+#endif
+
+static void node_unwatch(ll_node_t *n) {
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		watch_drop(n->b[i].wd);
+		n->b[i].wd = -1;
+	}
+}
+
+/**
+ * Remove n from the node table, a later lookup of its name gets a new node.
+ */
+static void node_unlink(ll_node_t *n) {
+	if (n->key == NULL) return;
+
+	// frees the key
+	hashtable_remove(nodes, n->key);
+	n->key = NULL;
+}
+
+static int node_link(ll_node_t *n) {
+	char *key = node_key(n->parent, n->name);
+	if (key == NULL) return -ENOMEM;
+
+	if (!hashtable_insert(nodes, key, n)) {
+		free(key);
+		return -ENOMEM;
+	}
+
+	n->key = key;
+	return 0;
+}
+
+/**
+ * Free n and parents nobody refers to anymore.
+ */
+static void node_release(ll_node_t *n) {
+	while (n && n != root && n->nlookup == 0 && n->children == 0) {
+		ll_node_t *parent = n->parent;
+
+		node_unlink(n);
+		node_close(n);
+		node_unwatch(n);
+
+		if (n->prev) n->prev->next = n->next;
+		else all_nodes = n->next;
+		if (n->next) n->next->prev = n->prev;
+
+		free(n->name);
+		free(n);
+
+		parent->children--;
+		n = parent;
+	}
+}
+
+/**
+ * Mark n and all its parents for re-resolution.
+ */
+static void node_stale(ll_node_t *n) {
+	for (; n; n = n->parent) n->gen = 0;
+}
+
+static bool has_whiteout(int mfd, const char *name) {
+	if (mfd < 0) return false;
+
+	char p[PATHLEN_MAX];
+	if (snprintf(p, PATHLEN_MAX, "%s%s", name, HIDETAG) >= PATHLEN_MAX) return false;
+
+	struct stat st;
+	return fstatat(mfd, p, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/**
+ * Open n on branch i by its redirected path t, relative to the root of the
+ * branch instead of the parent's directory.
+ */
+static bool node_open_redirected(ll_node_t *n, int i, const char *path, const char *t) {
+	ll_branch_t *b = &n->b[i];
+	int fd = uopt.branches[i].fd;
+	const char *rel = branch_relpath(t);
+	struct stat st;
+
+	bool exists = fstatat(fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0;
+	if (exists && S_ISDIR(st.st_mode))
+		b->fd = openat(fd, rel, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+
+	b->hidden = path_hidden(path, i) > 0;
+
+	char p[PATHLEN_MAX];
+	if (uopt.cow_enabled && BUILD_PATH(p, METADIR, t) == 0)
+		b->mfd = openat(fd, p, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+
+	return exists;
+}
+
+/**
+ * Find the branch serving n and open the directories of n on all branches,
+ * the same as find_rorw_branch() does with paths, but relative to the
+ * parent's directories.
+ */
+static void node_resolve(ll_node_t *n) {
+	if (n->gen == ll_gen) return;
+
+	ll_node_t *parent = n->parent;
+	if (parent) node_resolve(parent);
+
+	node_close(n);
+	n->branch = -1;
+	bool stop = false; // a whiteout hides n in all lower branches
+
+	// below renamed directories n might have another path on lower branches
+	char path[PATHLEN_MAX];
+	bool redirected = parent && redirect_active() && node_path(n, path, PATHLEN_MAX) == 0;
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		ll_branch_t *b = &n->b[i];
+		bool exists;
+		char buf[PATHLEN_MAX];
+		const char *t = redirected ? redirect_path(path, i, buf) : NULL;
+
+		if (t && t != path) {
+			exists = node_open_redirected(n, i, path, t);
+		} else if (parent == NULL) {
+			b->fd = openat(uopt.branches[i].fd, ".", O_PATH | O_DIRECTORY);
+			exists = b->fd >= 0;
+			b->hidden = false;
+			if (uopt.cow_enabled)
+				b->mfd = openat(uopt.branches[i].fd, METANAME, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+		} else {
+			ll_branch_t *pb = &parent->b[i];
+			struct stat st;
+
+			exists = pb->fd >= 0 && fstatat(pb->fd, n->name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+			if (exists && S_ISDIR(st.st_mode))
+				b->fd = openat(pb->fd, n->name, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+
+			b->hidden = pb->hidden || has_whiteout(pb->mfd, n->name);
+			if (pb->mfd >= 0)
+				b->mfd = openat(pb->mfd, n->name, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+		}
+
+		if (n->branch < 0 && !stop) {
+			if (exists) n->branch = i;
+			else if (b->hidden) stop = true;
+		}
+
+		watch_add(n, b);
+	}
+
+	n->gen = ll_gen;
+}
+
+/**
+ * Build the path of n, as the path based functions expect it.
+ */
+static int node_path(ll_node_t *n, char *buf, size_t size) {
+	if (n->parent == NULL) {
+		if (size < 2) return -ENAMETOOLONG;
+		strcpy(buf, "/");
+		return 0;
+	}
+
+	int res = node_path(n->parent, buf, size);
+	if (res) return res;
+
+	size_t len = strlen(buf);
+	const char *sep = len > 1 ? "/" : "";
+	if (snprintf(buf + len, size - len, "%s%s", sep, n->name) >= (int)(size - len))
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static int get_path(fuse_ino_t ino, char *buf) {
+	pthread_mutex_lock(&ll_lock);
+	int res = node_path(get_node(ino), buf, PATHLEN_MAX);
+	pthread_mutex_unlock(&ll_lock);
+	return res;
+}
+
+static int get_child_path(fuse_ino_t parent, const char *name, char *buf) {
+	pthread_mutex_lock(&ll_lock);
+	int res = node_path(get_node(parent), buf, PATHLEN_MAX);
+	pthread_mutex_unlock(&ll_lock);
+	if (res) return res;
+
+	size_t len = strlen(buf);
+	const char *sep = len > 1 ? "/" : "";
+	if (snprintf(buf + len, PATHLEN_MAX - len, "%s%s", sep, name) >= (int)(PATHLEN_MAX - len))
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/**
+ * Stat the resolved node n.
+ */
+static int node_stat(ll_node_t *n, struct stat *st) {
+	node_resolve(n);
+	if (n->branch < 0) return -ENOENT;
+
+	int res;
+	if (n->parent == NULL) {
+		res = fstat(n->b[n->branch].fd, st);
+	} else {
+		res = fstatat(n->parent->b[n->branch].fd, n->name, st, AT_SYMLINK_NOFOLLOW);
+	}
+	if (res == -1) return -errno;
+
+	st->st_ino = n->ino;
+
+	// see unionfs_getattr()
+	if (S_ISDIR(st->st_mode)) st->st_nlink = 1;
+
+	return 0;
+}
+
+/**
+ * Files of immutable branches are only changed through us, so the kernel
+ * may keep their entries and attributes for long. Not directories, their
+ * attributes change when names are created in them on another branch.
+ */
+static double node_timeout(const ll_node_t *n, const struct stat *st, double timeout) {
+	if (n->branch < 0 || !uopt.branches[n->branch].imm || S_ISDIR(st->st_mode)) return timeout;
+
+	return timeout > IMM_TIMEOUT ? timeout : IMM_TIMEOUT;
+}
+
+/**
+ * Look up name in parent and fill e, takes a lookup reference on success.
+ */
+static int do_lookup(ll_node_t *parent, const char *name, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = ll_conf.attr_timeout;
+	e->entry_timeout = ll_conf.entry_timeout;
+
+	if (strlen(name) >= PATHLEN_MAX) return -ENAMETOOLONG;
+
+	node_resolve(parent);
+	if (parent->branch < 0) return -ENOENT;
+
+	char *key = node_key(parent, name);
+	if (key == NULL) return -ENOMEM;
+	ll_node_t *n = hashtable_search(nodes, key);
+	free(key);
+
+	if (n == NULL) {
+		n = node_alloc(parent, name);
+		if (n == NULL) return -ENOMEM;
+		if (node_link(n)) {
+			node_release(n);
+			return -ENOMEM;
+		}
+	}
+
+	int res = node_stat(n, &e->attr);
+	if (res) {
+		node_release(n);
+		return res;
+	}
+	e->attr_timeout = node_timeout(n, &e->attr, e->attr_timeout);
+	e->entry_timeout = node_timeout(n, &e->attr, e->entry_timeout);
+
+	n->nlookup++;
+	e->ino = node_id(n);
+	e->generation = n->ino;
+	return 0;
+}
+
+/**
+ * Reply to an operation that created name in parent.
+ */
+static void reply_new_entry(fuse_req_t req, fuse_ino_t parent, const char *name, struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
+
+	pthread_mutex_lock(&ll_lock);
+	ll_node_t *p = get_node(parent);
+	node_stale(p);
+
+	// a node we still have for name belongs to something that was
+	// deleted directly on the branches
+	char *key = node_key(p, name);
+	ll_node_t *old = key ? hashtable_search(nodes, key) : NULL;
+	free(key);
+	if (old) node_unlink(old);
+
+	int res = do_lookup(p, name, &e);
+	pthread_mutex_unlock(&ll_lock);
+
+	if (res) {
+		if (fi) unionfs_oper.release(NULL, fi);
+		fuse_reply_err(req, -res);
+	} else if (fi) {
+		fuse_reply_create(req, &e, fi);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void mark_stale(fuse_ino_t ino) {
+	pthread_mutex_lock(&ll_lock);
+	node_stale(get_node(ino));
+	pthread_mutex_unlock(&ll_lock);
+}
+
+/**
+ * name was removed from parent.
+ */
+static void removed_entry(fuse_ino_t parent, const char *name) {
+	pthread_mutex_lock(&ll_lock);
+	ll_node_t *p = get_node(parent);
+	node_stale(p);
+
+	char *key = node_key(p, name);
+	ll_node_t *n = key ? hashtable_search(nodes, key) : NULL;
+	free(key);
+	if (n) {
+		node_unlink(n);
+		n->gen = 0;
+	}
+	pthread_mutex_unlock(&ll_lock);
+}
+
+#ifdef HAVE_INOTIFY
+/**
+ * Find the node of a union path, if the kernel knows it.
+ */
+static ll_node_t *node_find(const char *path) {
+	char buf[PATHLEN_MAX];
+	snprintf(buf, PATHLEN_MAX, "%s", path);
+
+	ll_node_t *n = root;
+	char *save = NULL;
+	char *name = strtok_r(buf, "/", &save);
+	for (; n && name; name = strtok_r(NULL, "/", &save)) {
+		char *key = node_key(n, name);
+		n = key ? hashtable_search(nodes, key) : NULL;
+		free(key);
+	}
+
+	return n;
+}
+
+/* what the kernel has to forget */
+typedef struct {
+	fuse_ino_t parent;	// entry name in parent, if name is set
+	char *name;
+	fuse_ino_t ino;		// attributes and data of ino, if set
+} ll_inval_t;
+
+static void inval_send(ll_inval_t *inv, size_t count) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		// ENOENT: the kernel forgot the inode already
+		if (inv[i].name) {
+			fuse_lowlevel_notify_inval_entry(ll_chan, inv[i].parent,
+				inv[i].name, strlen(inv[i].name));
+			free(inv[i].name);
+		}
+		if (inv[i].ino) fuse_lowlevel_notify_inval_inode(ll_chan, inv[i].ino, 0, 0);
+	}
+}
+
+/**
+ * We missed events, so everything the kernel knows might have changed.
+ */
+static void watch_overflow(void) {
+	USYSLOG(LOG_WARNING, "Missed branch changes, invalidating all entries\n");
+
+	pthread_mutex_lock(&ll_lock);
+	ll_gen++;
+
+	size_t count = 0;
+	ll_node_t *n;
+	for (n = all_nodes; n; n = n->next) count++;
+
+	ll_inval_t *inv = calloc(count, sizeof(ll_inval_t));
+	count = 0;
+	for (n = all_nodes; inv && n; n = n->next) {
+		if (n->parent) {
+			inv[count].parent = node_id(n->parent);
+			inv[count].name = strdup(n->name);
+		}
+		inv[count++].ino = node_id(n);
+	}
+	pthread_mutex_unlock(&ll_lock);
+
+	if (inv) inval_send(inv, count);
+	free(inv);
+}
+
+/**
+ * A watched directory or a name in it changed on a branch.
+ */
+static void watch_event(const struct inotify_event *ev) {
+	ll_inval_t inv[2];
+	size_t count = 0;
+	char path[PATHLEN_MAX];
+
+	pthread_mutex_lock(&ll_lock);
+	char *key = watch_key(ev->wd);
+	ll_watch_t *w = key ? hashtable_search(watches, key) : NULL;
+	free(key);
+
+	ll_node_t *dir = w ? node_find(w->path) : NULL;
+	if (dir) {
+		node_stale(dir);
+		inv[count].parent = 0;
+		inv[count].name = NULL;
+		inv[count++].ino = node_id(dir);
+
+		if (ev->len > 0) {
+			key = node_key(dir, ev->name);
+			ll_node_t *n = key ? hashtable_search(nodes, key) : NULL;
+			free(key);
+			if (n) n->gen = 0;
+
+			inv[count].parent = node_id(dir);
+			inv[count].name = strdup(ev->name);
+			inv[count++].ino = n ? node_id(n) : 0;
+
+			const char *sep = strcmp(w->path, "/") ? "/" : "";
+			if (snprintf(path, PATHLEN_MAX, "%s%s%s", w->path, sep, ev->name) < PATHLEN_MAX)
+				lookup_cache_invalidate(path);
+		}
+	}
+	pthread_mutex_unlock(&ll_lock);
+
+	inval_send(inv, count);
+}
+
+static void *watch_thread(void *arg) {
+	(void)arg;
+
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t len = read(watch_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			USYSLOG(LOG_ERR, "Reading branch changes failed: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		char *p = buf;
+		while (p < buf + len) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) watch_overflow();
+			else if (!(ev->mask & IN_IGNORED)) watch_event(ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+static void watch_init(void) {
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	watches = create_hashtable(64, string_hash, string_equal);
+
+	pthread_t thread;
+	if (watch_fd < 0 || watches == NULL
+	    || pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+		USYSLOG(LOG_ERR, "Failed to watch the branches! Aborting!\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+#else
+static void watch_init(void) {
+	USYSLOG(LOG_WARNING, "Watching branches is not supported on this system\n");
+}
+#endif
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+	(void)userdata;
+
+	unionfs_oper.init(conn);
+
+	nodes = create_hashtable(64, string_hash, string_equal);
+	root = node_alloc(NULL, NULL);
+	if (nodes == NULL || root == NULL) {
+		USYSLOG(LOG_ERR, "Failed to allocate the node table! Aborting!\n");
+		exit(1);
+	}
+	root->ino = FUSE_ROOT_ID;
+
+	if (uopt.watch_branches) watch_init();
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	DBG("%lu %s\n", (unsigned long)parent, name);
+
+	struct fuse_entry_param e;
+
+	pthread_mutex_lock(&ll_lock);
+	int res = do_lookup(get_node(parent), name, &e);
+	pthread_mutex_unlock(&ll_lock);
+
+	if (res == -ENOENT && ll_conf.negative_timeout > 0) {
+		// ino 0 makes the kernel cache the negative result
+		e.ino = 0;
+		e.entry_timeout = ll_conf.negative_timeout;
+		fuse_reply_entry(req, &e);
+	} else if (res) {
+		fuse_reply_err(req, -res);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	pthread_mutex_lock(&ll_lock);
+	ll_node_t *n = get_node(ino);
+	n->nlookup -= nlookup;
+	node_release(n);
+	pthread_mutex_unlock(&ll_lock);
+
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)fi;
+	DBG("%lu\n", (unsigned long)ino);
+
+	struct stat st;
+	double timeout = ll_conf.attr_timeout;
+
+	pthread_mutex_lock(&ll_lock);
+	ll_node_t *n = get_node(ino);
+	int res = node_stat(n, &st);
+	if (res == 0) timeout = node_timeout(n, &st, timeout);
+	pthread_mutex_unlock(&ll_lock);
+
+	if (res) {
+		fuse_reply_err(req, -res);
+	} else {
+		fuse_reply_attr(req, &st, timeout);
+	}
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	(void)fi;
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+
+	if (!res && (to_set & FUSE_SET_ATTR_MODE))
+		res = unionfs_oper.chmod(path, attr->st_mode);
+
+	if (!res && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+		res = unionfs_oper.chown(path, uid, gid);
+	}
+
+	if (!res && (to_set & FUSE_SET_ATTR_SIZE))
+		res = unionfs_oper.truncate(path, attr->st_size);
+
+	if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec ts[2];
+		ts[0].tv_sec = 0;
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1] = ts[0];
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->st_mtim;
+
+		res = unionfs_oper.utimens(path, ts);
+	}
+
+	// all of these might have copied the file up
+	mark_stale(ino);
+
+	if (res) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	ll_getattr(req, ino, NULL);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+	char buf[PATHLEN_MAX];
+	int res;
+
+	pthread_mutex_lock(&ll_lock);
+	ll_node_t *n = get_node(ino);
+	node_resolve(n);
+	if (n->branch < 0 || n->parent == NULL) {
+		res = -ENOENT;
+	} else {
+		res = readlinkat(n->parent->b[n->branch].fd, n->name, buf, sizeof(buf) - 1);
+		if (res == -1) res = -errno;
+	}
+	pthread_mutex_unlock(&ll_lock);
+
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.mknod(path, mode, rdev);
+
+	if (res) fuse_reply_err(req, -res);
+	else reply_new_entry(req, parent, name, NULL);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.mkdir(path, mode);
+
+	if (res) fuse_reply_err(req, -res);
+	else reply_new_entry(req, parent, name, NULL);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.unlink(path);
+
+	if (res) mark_stale(parent);
+	else removed_entry(parent, name);
+	fuse_reply_err(req, -res);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.rmdir(path);
+
+	if (res) mark_stale(parent);
+	else removed_entry(parent, name);
+	fuse_reply_err(req, -res);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.symlink(link, path);
+
+	if (res) fuse_reply_err(req, -res);
+	else reply_new_entry(req, parent, name, NULL);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+	current_req = req;
+
+	char from[PATHLEN_MAX], to[PATHLEN_MAX];
+	int res = get_child_path(parent, name, from);
+	if (!res) res = get_child_path(newparent, newname, to);
+	if (!res) res = unionfs_oper.rename(from, to);
+
+	pthread_mutex_lock(&ll_lock);
+	ll_node_t *p = get_node(parent);
+	ll_node_t *np = get_node(newparent);
+	node_stale(p);
+	node_stale(np);
+
+	if (res == 0) {
+		char *key = node_key(np, newname);
+		ll_node_t *old = key ? hashtable_search(nodes, key) : NULL;
+		free(key);
+		if (old) node_unlink(old);
+
+		key = node_key(p, name);
+		ll_node_t *n = key ? hashtable_search(nodes, key) : NULL;
+		free(key);
+
+		char *name_dup = strdup(newname);
+		if (n && name_dup) {
+			bool is_dir = n->branch >= 0 && n->b[n->branch].fd >= 0;
+
+			node_unlink(n);
+			free(n->name);
+			n->name = name_dup;
+			np->children++;
+			n->parent = np;
+			p->children--;
+			node_release(p);
+			if (node_link(n)) USYSLOG(LOG_ERR, "%s: out of memory\n", __func__);
+			n->gen = 0;
+
+			// the whole tree below a renamed directory needs new
+			// descriptors
+			if (is_dir) ll_gen++;
+		} else {
+			free(name_dup);
+			if (n) node_unlink(n);
+			ll_gen++;
+		}
+	}
+	pthread_mutex_unlock(&ll_lock);
+
+	fuse_reply_err(req, -res);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+	current_req = req;
+
+	char from[PATHLEN_MAX], to[PATHLEN_MAX];
+	int res = get_path(ino, from);
+	if (!res) res = get_child_path(newparent, newname, to);
+	if (!res) res = unionfs_oper.link(from, to);
+
+	mark_stale(ino);
+
+	if (res) fuse_reply_err(req, -res);
+	else reply_new_entry(req, newparent, newname, NULL);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_child_path(parent, name, path);
+	if (!res) res = unionfs_oper.create(path, mode, fi);
+
+	if (res) fuse_reply_err(req, -res);
+	else reply_new_entry(req, parent, name, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	current_req = req;
+
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+	if (!res) res = unionfs_oper.open(path, fi);
+
+	// opening for writing copies the file up
+	if (fi->flags & (O_WRONLY | O_RDWR)) mark_stale(ino);
+
+	if (res) fuse_reply_err(req, -res);
+	else fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)ino;
+
+#if FUSE_VERSION >= 29
+	// the data is spliced from the branch files, like fuse_main() does
+	struct fuse_bufvec *bufv = NULL;
+	int res = unionfs_oper.read_buf(NULL, &bufv, size, off, fi);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+
+	if (bufv != NULL) {
+		size_t i;
+		for (i = 0; i < bufv->count; i++) free(bufv->buf[i].mem);
+		free(bufv);
+	}
+#else
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int res = unionfs_oper.read(NULL, buf, size, off, fi);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_buf(req, buf, res);
+
+	free(buf);
+#endif
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)ino;
+
+	int res = unionfs_oper.write(NULL, buf, size, off, fi);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+
+#if FUSE_VERSION >= 29
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	(void)ino;
+
+	int res = unionfs_oper.write_buf(NULL, bufv, off, fi);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+#endif
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	fuse_reply_err(req, -unionfs_oper.flush(NULL, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	fuse_reply_err(req, -unionfs_oper.release(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	(void)ino;
+	fuse_reply_err(req, -unionfs_oper.fsync(NULL, datasync, fi));
+}
+
+typedef struct {
+	char path[PATHLEN_MAX];
+	struct fuse_file_info fi;	// what unionfs_opendir() gives us
+} ll_dir_t;
+
+typedef struct {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+} ll_dirbuf_t;
+
+static int ll_filler(void *buf, const char *name, const struct stat *st, off_t off) {
+	ll_dirbuf_t *db = buf;
+
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, st, off);
+	if (len > db->size - db->used) return 1; // full
+
+	db->used += len;
+	return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	ll_dir_t *d = calloc(1, sizeof(ll_dir_t));
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int res = get_path(ino, d->path);
+	if (!res) res = unionfs_opendir(d->path, &d->fi);
+	if (res) {
+		free(d);
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	fi->fh = (unsigned long)d;
+	fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	(void)ino;
+	ll_dir_t *d = (ll_dir_t *)fi->fh;
+
+	ll_dirbuf_t db = { req, malloc(size), size, 0 };
+	if (db.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int res = unionfs_readdir(d->path, &db, ll_filler, off, &d->fi);
+	if (res) fuse_reply_err(req, -res);
+	else fuse_reply_buf(req, db.buf, db.used);
+
+	free(db.buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	(void)ino;
+	ll_dir_t *d = (ll_dir_t *)fi->fh;
+
+	unionfs_releasedir(d->path, &d->fi);
+	free(d);
+
+	fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	(void)ino;
+
+	struct statvfs st;
+	int res = unionfs_oper.statfs("/", &st);
+	if (res) fuse_reply_err(req, -res);
+	else fuse_reply_statfs(req, &st);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+	if (!res) res = unionfs_oper.access(path, mask);
+
+	fuse_reply_err(req, -res);
+}
+
+#if FUSE_VERSION >= 28
+static void ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+	(void)ino;
+
+	// our ioctls all have a fixed size, so the kernel already copied the
+	// data in and makes room for the data out, like fuse_lib_ioctl()
+	size_t size = in_bufsz > out_bufsz ? in_bufsz : out_bufsz;
+	char *data = NULL;
+	if (size) {
+		data = calloc(1, size);
+		if (data == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		if (in_bufsz) memcpy(data, in_buf, in_bufsz);
+	}
+
+	int res = unionfs_oper.ioctl(NULL, cmd, arg, fi, flags, data);
+	if (res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_ioctl(req, res, data, out_bufsz);
+
+	free(data);
+}
+#endif
+
+#ifdef HAVE_XATTR
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+	if (res) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	char *value = size ? malloc(size) : NULL;
+	if (size && value == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+#if __APPLE__
+	res = unionfs_oper.getxattr(path, name, value, size, 0);
+#else
+	res = unionfs_oper.getxattr(path, name, value, size);
+#endif
+	if (res < 0) fuse_reply_err(req, -res);
+	else if (size == 0) fuse_reply_xattr(req, res);
+	else fuse_reply_buf(req, value, res);
+
+	free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+	if (res) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	char *list = size ? malloc(size) : NULL;
+	if (size && list == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	res = unionfs_oper.listxattr(path, list, size);
+	if (res < 0) fuse_reply_err(req, -res);
+	else if (size == 0) fuse_reply_xattr(req, res);
+	else fuse_reply_buf(req, list, res);
+
+	free(list);
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags) {
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+#if __APPLE__
+	if (!res) res = unionfs_oper.setxattr(path, name, value, size, flags, 0);
+#else
+	if (!res) res = unionfs_oper.setxattr(path, name, value, size, flags);
+#endif
+
+	mark_stale(ino);
+	fuse_reply_err(req, -res);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+	char path[PATHLEN_MAX];
+	int res = get_path(ino, path);
+	if (!res) res = unionfs_oper.removexattr(path, name);
+
+	mark_stale(ino);
+	fuse_reply_err(req, -res);
+}
+#endif // HAVE_XATTR
+
+static struct fuse_lowlevel_ops unionfs_ll_oper = {
+	.init = ll_init,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.readlink = ll_readlink,
+	.mknod = ll_mknod,
+	.mkdir = ll_mkdir,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.symlink = ll_symlink,
+	.rename = ll_rename,
+	.link = ll_link,
+	.create = ll_create,
+	.open = ll_open,
+	.read = ll_read,
+	.write = ll_write,
+#if FUSE_VERSION >= 29
+	.write_buf = ll_write_buf,
+#endif
+	.flush = ll_flush,
+	.release = ll_release,
+	.fsync = ll_fsync,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.releasedir = ll_releasedir,
+	.statfs = ll_statfs,
+	.access = ll_access,
+#if FUSE_VERSION >= 28
+	.ioctl = ll_ioctl,
+#endif
+#ifdef HAVE_XATTR
+	.getxattr = ll_getxattr,
+	.listxattr = ll_listxattr,
+	.setxattr = ll_setxattr,
+	.removexattr = ll_removexattr,
+#endif
+};
+
+/**
+ * Replacement of fuse_main() for the low-level interface.
+ */
+int unionfs_ll_main(struct fuse_args *args) {
+	char *mountpoint;
+	int multithreaded, foreground;
+
+	if (fuse_opt_parse(args, &ll_conf, ll_opts, NULL) == -1) return 1;
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+
+	struct fuse_chan *ch = fuse_mount(mountpoint, args);
+	if (ch == NULL) {
+		free(mountpoint);
+		return 1;
+	}
+
+	int res = 1;
+	ll_chan = ch;
+	struct fuse_session *se = fuse_lowlevel_new(args, &unionfs_ll_oper, sizeof(unionfs_ll_oper), NULL);
+	if (se) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			fuse_session_add_chan(se, ch);
+			if (fuse_daemonize(foreground) == 0) {
+				res = multithreaded ? session_loop(se, ch) : fuse_session_loop(se);
+			}
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+
+	fuse_unmount(mountpoint, ch);
+	free(mountpoint);
+
+	return res ? 1 : 0;
+}
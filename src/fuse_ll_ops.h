@@ -0,0 +1,14 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef FUSE_LL_OPS_H
+#define FUSE_LL_OPS_H
+
+#include <fuse.h>
+#include <sys/types.h>
+
+int unionfs_ll_main(struct fuse_args *args);
+void ll_get_caller(uid_t *uid, gid_t *gid);
+
+#endif
@@ -17,6 +17,9 @@
 	// For chroot
 	#define _BSD_SOURCE // this is deprecated since glibc 2.20 but let's keep it for a while
 	#define _DEFAULT_SOURCE 1
+
+	// For O_DIRECT
+	#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
@@ -58,30 +61,105 @@
 #include "conf.h"
 #include "uioctl.h"
 #include "cowolf.h"
+#include "redirect.h"
+#include "cow_async.h"
+#include "lookup_cache.h"
+#include "whiteout_index.h"
+#include "uring.h"
+#include "stats.h"
+#include "statfs.h"
+#include "bloom.h"
+#include "manifest.h"
+#include "trace.h"
+#include "copy_qos.h"
+#include "xattr_cache.h"
+#include "branches.h"
+#include "record.h"
+
+#define DIRECT_IO_ALIGN 4096	// of the buffers of O_DIRECT reads and writes
 
 typedef struct {
 	int fd;
+	int branch;
 	struct cwf_info cw;
+	bool direct;		// fd is open with O_DIRECT
 } unionfs_fhandle_t;
 
-static unionfs_fhandle_t *fhandle_create(int fd, struct cwf_info *cw) {
+static unionfs_fhandle_t *fhandle_create(int fd, int branch, struct cwf_info *cw) {
 	unionfs_fhandle_t *fh = malloc(sizeof(unionfs_fhandle_t));
 	if (fh == NULL) { errno = ENOMEM; return NULL; }
 	fh->fd = fd;
+	fh->branch = branch;
 	fh->cw = *cw;
+	fh->direct = false;
 	return fh;
 }
 
+/**
+ * Bypass the page cache of the union for O_DIRECT opens and the files of
+ * -o direct_io_paths, not for all files since it makes exec() fail. The
+ * O_DIRECT opens also bypass the page cache of the branch.
+ */
+static void fhandle_direct_io(unionfs_fhandle_t *fh, const char *path, struct fuse_file_info *fi) {
+#ifdef O_DIRECT
+	if (fi->flags & O_DIRECT) {
+		fi->direct_io = 1;
+
+		// the read ranges of cowolf files are split at the mapped ranges
+		if (CWF_ON(fh->cw)) fcntl(fh->fd, F_SETFL, fcntl(fh->fd, F_GETFL) & ~O_DIRECT);
+		else fh->direct = true;
+	}
+#endif
+
+	if (direct_io_path(path)) fi->direct_io = 1;
+}
+
+/**
+ * O_DIRECT needs aligned buffers, the ones of fuse are not. The data goes
+ * through an aligned buffer then.
+ */
+static ssize_t direct_pread(int fd, char *buf, size_t size, off_t offset) {
+	if ((uintptr_t)buf % DIRECT_IO_ALIGN == 0) return uring_pread(fd, buf, size, offset);
+
+	void *abuf;
+	int err = posix_memalign(&abuf, DIRECT_IO_ALIGN, size ? size : 1);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	ssize_t res = uring_pread(fd, abuf, size, offset);
+	if (res > 0) memcpy(buf, abuf, res);
+
+	free(abuf);
+	return res;
+}
+
+static ssize_t direct_pwrite(int fd, const char *buf, size_t size, off_t offset) {
+	if ((uintptr_t)buf % DIRECT_IO_ALIGN == 0) return uring_pwrite(fd, buf, size, offset);
+
+	void *abuf;
+	int err = posix_memalign(&abuf, DIRECT_IO_ALIGN, size ? size : 1);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	memcpy(abuf, buf, size);
+	ssize_t res = uring_pwrite(fd, abuf, size, offset);
+
+	free(abuf);
+	return res;
+}
+
 static int unionfs_chmod(const char *path, mode_t mode) {
 	DBG("%s\n", path);
 
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = chmod(p, mode);
+	int res = fchmodat(uopt.branches[i].fd, branch_relpath(path), mode, 0);
+	xattr_cache_invalidate(path); // the ACLs follow the mode
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
@@ -93,10 +171,8 @@ static int unionfs_chown(const char *path, uid_t uid, gid_t gid) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lchown(p, uid, gid);
+	int res = fchownat(uopt.branches[i].fd, branch_relpath(path), uid, gid, AT_SYMLINK_NOFOLLOW);
+	xattr_cache_invalidate(path); // security.capability is removed
 	if (res == -1) RETURN(-errno);
 
 	RETURN(0);
@@ -112,28 +188,27 @@ static int unionfs_create(const char *path, mode_t mode, struct fuse_file_info *
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
 	// NOTE: We should do:
 	//       Create the file with mode=0 first, otherwise we might create
 	//       a file as root + x-bit + suid bit set, which might be used for
 	//       security racing!
-	int res = open(p, fi->flags, 0);
+	int res = openat(uopt.branches[i].fd, branch_relpath(path), fi->flags, 0);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lookup_cache_invalidate(path);
+	set_owner(i, path); // no error check, since creating the file succeeded
 
 	// NOW, that the file has the proper owner we may set the requested mode
 	fchmod(res, mode);
 
 	struct cwf_info dummy = CWF_INFO_INITIALIZER;
-	unionfs_fhandle_t *fh = fhandle_create(res, &dummy);
+	unionfs_fhandle_t *fh = fhandle_create(res, i, &dummy);
 	if (fh == NULL) {
 		close(res);
 		RETURN(-errno);
 	}
 
+	fhandle_direct_io(fh, path, fi);
 	fi->fh = (unsigned long)fh;
 	remove_hidden(path, i);
 
@@ -186,20 +261,19 @@ static int unionfs_fsync(const char *path, int isdatasync, struct fuse_file_info
 
 	if (res == -1) RETURN(-errno);
 
+	// the map must not be written before the data it points to
+	if (cowolf_sync(&fh->cw) == -1) RETURN(-errno);
+
 	RETURN(0);
 }
 
 static int unionfs_getattr(const char *path, struct stat *stbuf) {
 	DBG("%s\n", path);
 
-	int i = find_rorw_branch(path);
-	if (i == -1) RETURN(-errno);
-
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
-
-	int res = lstat(p, stbuf);
-	if (res == -1) RETURN(-errno);
+	// the lookup already stats path on the branch
+	branch_lookup_t bl;
+	if (find_rorw_branch_stat(path, &bl) == -1) RETURN(-errno);
+	*stbuf = bl.st;
 
 	/* This is a workaround for broken gnu find implementations. Actually,
 	 * n_links is not defined at all for directories by posix. However, it
@@ -239,6 +313,14 @@ static void * unionfs_init(struct fuse_conn_info *conn) {
 	// just to prevent the compiler complaining about unused variables
 	(void) conn->max_readahead;
 
+	// before the chroot, the stats and record files are outside of it
+	if (stats_file_start()) {
+		USYSLOG(LOG_WARNING, "Failed to write the stats file %s\n", uopt.stats_file);
+	}
+	if (record_start()) {
+		USYSLOG(LOG_WARNING, "Failed to record into %s\n", uopt.record_file);
+	}
+
 	// we only now (from unionfs_init) may go into the chroot, since otherwise
 	// fuse_main() will fail to open /dev/fuse and to call mount
 	if (uopt.chroot) {
@@ -250,11 +332,42 @@ static void * unionfs_init(struct fuse_conn_info *conn) {
 		}
 	}
 
+	// branch paths are relative to the chroot, so only scan them now
+	if (whiteout_index_init()) {
+		USYSLOG(LOG_ERR, "Building the whiteout index failed! Aborting!\n");
+		exit(1);
+	}
+
+	if (redirect_init()) {
+		USYSLOG(LOG_ERR, "Reading the directory redirects failed! Aborting!\n");
+		exit(1);
+	}
+
+	if (bloom_init()) {
+		USYSLOG(LOG_ERR, "Building the Bloom filters failed! Aborting!\n");
+		exit(1);
+	}
+
+	if (manifest_init()) {
+		USYSLOG(LOG_ERR, "Loading the manifests failed! Aborting!\n");
+		exit(1);
+	}
+
+	if (copy_qos_init()) {
+		USYSLOG(LOG_ERR, "Setting up the copy-up limits failed! Aborting!\n");
+		exit(1);
+	}
+
 #ifdef FUSE_CAP_IOCTL_DIR
 	if (conn->capable & FUSE_CAP_IOCTL_DIR)
 		conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif
 
+#if FUSE_VERSION >= 29
+	// read_buf/write_buf data can be spliced to and from /dev/fuse
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#endif
+
 	return NULL;
 }
 
@@ -270,13 +383,12 @@ static int unionfs_link(const char *from, const char *to) {
 
 	DBG("from branch: %d to branch: %d\n", i, j);
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[j].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = link(f, t);
+	int res = linkat(uopt.branches[i].fd, branch_relpath(from),
+			 uopt.branches[j].fd, branch_relpath(to), 0);
 	if (res == -1) RETURN(-errno);
 
+	lookup_cache_invalidate(to);
+
 	// no need for set_owner(), since owner and permissions are copied over by link()
 
 	remove_hidden(to, i); // remove hide file (if any)
@@ -284,6 +396,21 @@ static int unionfs_link(const char *from, const char *to) {
 }
 
 #if FUSE_VERSION >= 28
+/**
+ * Bytes read from or written to all branches, for the STATS_BYTES ioctls
+ */
+static int stats_bytes_total(bool read, uint64_t *total) {
+	struct unionfs_stats *stats = malloc(sizeof(struct unionfs_stats));
+	if (stats == NULL) return -ENOMEM;
+	stats_get(stats);
+
+	// also of the branches beyond UNIONFS_STATS_BRANCHES
+	*total = read ? stats->c.bytes_read : stats->c.bytes_written;
+
+	free(stats);
+	return 0;
+}
+
 static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
 	(void) path;
 	(void) arg; // avoid compiler warning
@@ -300,9 +427,10 @@ static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_
 	case UNIONFS_ONOFF_DEBUG: {
 		int on_off = *((int *) data);
 		// unionfs-ctl gives the opposite value, so !!
-		bool setRes = set_debug_onoff(!!on_off);
+		bool setRes = set_debug_onoff(!!(on_off & UNIONFS_DEBUG_LOG));
 		if (!setRes)
 			return -EINVAL;
+		trace_set(on_off & UNIONFS_DEBUG_TRACE);
 		return 0;
 	}
 	case UNIONFS_SET_DEBUG_FILE: {
@@ -313,6 +441,41 @@ static int unionfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_
 		debug_init();
 		return 0;
 	}
+	case UNIONFS_COPYUP_PROGRESS:
+		cow_async_progress((struct unionfs_copyup_progress *) data);
+		return 0;
+	case UNIONFS_STATS:
+		stats_get((struct unionfs_stats *) data);
+		return 0;
+	case UNIONFS_TRACE:
+		trace_get((struct unionfs_trace *) data);
+		return 0;
+	case UNIONFS_COMPACT_WHITEOUTS:
+		return compact_whiteouts((uint64_t *) data);
+	case UNIONFS_SET_COPYUP_QOS: {
+		struct unionfs_copyup_qos *qos = (struct unionfs_copyup_qos *) data;
+		return copy_qos_set_bwlimit(qos->branch, qos->bwlimit);
+	}
+	case UNIONFS_ADD_BRANCH: {
+		struct unionfs_branch *b = (struct unionfs_branch *) data;
+		b->path[PATHLEN_MAX - 1] = '\0';
+
+		int res = branch_add(b->path, b->rw);
+		if (res < 0) return res;
+
+		b->branch = res;
+		return 0;
+	}
+	case UNIONFS_REMOVE_BRANCH:
+		return branch_remove(((struct unionfs_branch *) data)->branch);
+	case UNIONFS_SET_BRANCH_MODE: {
+		struct unionfs_branch *b = (struct unionfs_branch *) data;
+		return branch_set_mode(b->branch, b->rw);
+	}
+	case UNIONFS_STATS_BYTES_READ:
+		return stats_bytes_total(true, (uint64_t *) data);
+	case UNIONFS_STATS_BYTES_WRITTEN:
+		return stats_bytes_total(false, (uint64_t *) data);
 	default:
 		USYSLOG(LOG_ERR, "Unknown ioctl: %d", cmd);
 		return -EINVAL;
@@ -335,15 +498,17 @@ static int unionfs_mkdir(const char *path, mode_t mode) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	int fd = uopt.branches[i].fd;
+	const char *p = branch_relpath(path);
 
-	int res = mkdir(p, 0);
+	int res = mkdirat(fd, p, 0);
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lookup_cache_invalidate(path);
+
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, mode);
+	fchmodat(fd, p, mode, 0);
 
 	RETURN(0);
 }
@@ -354,8 +519,8 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 	int i = find_rw_branch_cutlast(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	int fd = uopt.branches[i].fd;
+	const char *p = branch_relpath(path);
 
 	int file_type = mode & S_IFMT;
 	int file_perm = mode & (S_PROT_MASK);
@@ -369,17 +534,18 @@ static int unionfs_mknod(const char *path, mode_t mode, dev_t rdev) {
 
 		USYSLOG (LOG_INFO, "deprecated mknod workaround, tell the unionfs-fuse authors if you see this!\n");
 
-		res = creat(p, 0);
+		res = openat(fd, p, O_CREAT | O_WRONLY | O_TRUNC, 0);
 		if (res > 0 && close(res) == -1) USYSLOG(LOG_WARNING, "Warning, cannot close file\n");
 	} else {
-		res = mknod(p, file_type, rdev);
+		res = mknodat(fd, p, file_type, rdev);
 	}
 
 	if (res == -1) RETURN(-errno);
 
-	set_owner(p); // no error check, since creating the file succeeded
+	lookup_cache_invalidate(path);
+	set_owner(i, path); // no error check, since creating the file succeeded
 	// NOW, that the file has the proper owner we may set the requested mode
-	chmod(p, file_perm);
+	fchmodat(fd, p, file_perm, 0);
 
 	remove_hidden(path, i);
 
@@ -398,34 +564,55 @@ static int unionfs_open(const char *path, struct fuse_file_info *fi) {
 
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	// with a data-range map, the map has to be truncated along with the file
+	int flags = fi->flags;
+	if (uopt.cowolf_enabled && (flags & O_TRUNC) && (flags & (O_WRONLY | O_RDWR))) {
+		flags &= ~O_TRUNC;
+	}
 
-	int fd = open(p, fi->flags);
+	char buf[PATHLEN_MAX];
+	int fd = openat(uopt.branches[i].fd, branch_relpath(redirect_path(path, i, buf)), flags);
 	if (fd == -1) RETURN(-errno);
 
 	struct cwf_info cw = CWF_INFO_INITIALIZER;
-	if (cowolf_open(path, i, fi->flags, &cw) != 0) {
+	if (cowolf_open(path, i, flags, &cw) != 0) {
 		close(fd);
 		RETURN(-errno);
 	}
 
+	if (flags != fi->flags) {
+		int res = CWF_ON(cw) ? cowolf_ftruncate(fd, &cw, 0) : ftruncate(fd, 0);
+		if (res == -1) {
+			int err = errno;
+			cowolf_close(&cw);
+			close(fd);
+			RETURN(-err);
+		}
+	}
+
 	if (fi->flags & (O_WRONLY | O_RDWR)) {
 		// There might have been a hide file, but since we successfully
 		// wrote to the real file, a hide file must not exist anymore
 		remove_hidden(path, i);
 	}
 
-	unionfs_fhandle_t *fh = fhandle_create(fd, &cw);
+	unionfs_fhandle_t *fh = fhandle_create(fd, i, &cw);
 	if (fh == NULL) {
 		close(fd);
 		RETURN(-errno);
 	}
 
-	// This makes exec() fail
-	//fi->direct_io = 1;
+	fhandle_direct_io(fh, path, fi);
 	fi->fh = (unsigned long)fh;
 
+	// Files on ro branches are never written by us, writes go to the copy
+	// on the rw branch through the kernel's cache. So the kernel may keep
+	// serving reads from its cache, also after the following opens.
+	bool keep = uopt.keep_cache_ro || uopt.branches[i].imm;
+	if (keep && !uopt.branches[i].rw && !CWF_ON(cw) && !fi->direct_io) {
+		fi->keep_cache = 1;
+	}
+
 	DBG("fd = %x\n", fh->fd);
 	RETURN(0);
 }
@@ -436,10 +623,19 @@ static int unionfs_read(const char *path, char *buf, size_t size, off_t offset,
 
 	int res;
 
+	// background copy-ups from the branch give way
+	copy_qos_foreground(fh->branch);
+	if (CWF_ON(fh->cw)) copy_qos_foreground(fh->cw.lower_branch);
+
 	if (CWF_ON(fh->cw)) {
+		// counts the bytes of both branches itself
 		res = cowolf_read(fh->fd, &fh->cw, buf, size, offset);
+	} else if (fh->direct) {
+		res = direct_pread(fh->fd, buf, size, offset);
+		if (res > 0) stats_read(fh->branch, res);
 	} else {
-		res = pread(fh->fd, buf, size, offset);
+		res = uring_pread(fh->fd, buf, size, offset);
+		if (res > 0) stats_read(fh->branch, res);
 	}
 
 	if (res == -1) RETURN(-errno);
@@ -447,16 +643,78 @@ static int unionfs_read(const char *path, char *buf, size_t size, off_t offset,
 	RETURN(res);
 }
 
+#if FUSE_VERSION >= 29
+/**
+ * Instead of reading the data, tell libfuse which file ranges to send, so
+ * that it can splice them to /dev/fuse without copying them through our
+ * buffers.
+ */
+static int unionfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	unionfs_fhandle_t *fh = (unionfs_fhandle_t *)fi->fh;
+	DBG("fd = %x\n", fh->fd);
+
+	// the reads of the io_uring engine and of O_DIRECT files need a buffer
+	if (uopt.io_uring_depth || fh->direct) {
+		struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+		void *mem = NULL;
+		if (fh->direct) {
+			if (posix_memalign(&mem, DIRECT_IO_ALIGN, size ? size : 1)) mem = NULL;
+		} else {
+			mem = malloc(size);
+		}
+		if (bufv == NULL || mem == NULL) {
+			free(bufv);
+			free(mem);
+			RETURN(-ENOMEM);
+		}
+
+		int res = unionfs_read(path, mem, size, offset, fi);
+		if (res < 0) {
+			free(bufv);
+			free(mem);
+			RETURN(res);
+		}
+
+		*bufv = FUSE_BUFVEC_INIT(res);
+		bufv->buf[0].mem = mem;
+		*bufp = bufv;
+		RETURN(0);
+	}
+
+	copy_qos_foreground(fh->branch);
+	if (CWF_ON(fh->cw)) copy_qos_foreground(fh->cw.lower_branch);
+
+	if (CWF_ON(fh->cw)) {
+		if (cowolf_read_buf(fh->fd, &fh->cw, bufp, size, offset) == -1) RETURN(-errno);
+		RETURN(0);
+	}
+
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+	if (bufv == NULL) RETURN(-ENOMEM);
+
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	bufv->buf[0].fd = fh->fd;
+	bufv->buf[0].pos = offset;
+	*bufp = bufv;
+
+	// fuse does the read, short reads at the end of the file are not known
+	stats_read(fh->branch, size);
+
+	RETURN(0);
+}
+#endif
+
 static int unionfs_readlink(const char *path, char *buf, size_t size) {
 	DBG("%s\n", path);
 
-	int i = find_rorw_branch(path);
-	if (i == -1) RETURN(-errno);
+	branch_lookup_t bl;
+	if (find_rorw_branch_stat(path, &bl) == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	// do not wait for the branch to tell
+	if (!S_ISLNK(bl.st.st_mode)) RETURN(-EINVAL);
 
-	int res = readlink(p, buf, size - 1);
+	int res = readlinkat(uopt.branches[bl.branch].fd, bl.path, buf, size - 1);
 
 	if (res == -1) RETURN(-errno);
 
@@ -480,8 +738,8 @@ static int unionfs_release(const char *path, struct fuse_file_info *fi) {
 
 /**
  * unionfs rename function
- * TODO: If we rename a directory on a read-only branch, we need to copy over
- *       all files to the renamed directory on the read-write branch.
+ * Directories on a read-only branch are copied to the read-write branch
+ * first, unless redirect_rename() can rename them without copying.
  */
 static int unionfs_rename(const char *from, const char *to) {
 	DBG("from %s to %s\n", from, to);
@@ -494,6 +752,10 @@ static int unionfs_rename(const char *from, const char *to) {
 	int i = find_rorw_branch(from);
 	if (i == -1) RETURN(-errno);
 
+	// directories might not need to be copied at all
+	int res = redirect_rename(from, to, i, j);
+	if (res <= 0) RETURN(res);
+
 	if (!uopt.branches[i].rw) {
 		i = find_rw_branch_cow_common(from, true);
 		if (i == -1) RETURN(-errno);
@@ -505,17 +767,16 @@ static int unionfs_rename(const char *from, const char *to) {
 		RETURN(-EXDEV);
 	}
 
-	char f[PATHLEN_MAX], t[PATHLEN_MAX];
-	if (BUILD_PATH(f, uopt.branches[i].path, from)) RETURN(-ENAMETOOLONG);
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
+	int fd = uopt.branches[i].fd;
+	const char *f = branch_relpath(from);
+	const char *t = branch_relpath(to);
 
-	filetype_t ftype = path_is_dir(f);
+	filetype_t ftype = path_is_dir_at(fd, f);
 	if (ftype == NOT_EXISTING)
 		RETURN(-ENOENT);
 	else if (ftype == IS_DIR)
 		is_dir = true;
 
-	int res;
 	if (!uopt.branches[i].rw) {
 		// since original file is on a read-only branch, we copied the from file to a writable branch,
 		// but since we will rename from, we also need to hide the from file on the read-only branch
@@ -526,13 +787,25 @@ static int unionfs_rename(const char *from, const char *to) {
 		if (res) RETURN(-errno);
 	}
 
-	res = rename(f, t);
+	// the members get new paths
+	if (is_dir) bloom_add_tree(from, to, i);
+
+	res = renameat(fd, f, fd, t);
+
+	// the rename itself or the cleanup below changed both paths
+	if (is_dir) {
+		lookup_cache_invalidate_tree(from);
+		lookup_cache_invalidate_tree(to);
+	} else {
+		lookup_cache_invalidate(from);
+		lookup_cache_invalidate(to);
+	}
 
 	if (res == -1) {
 		int err = errno; // unlink() might overwrite errno
 		// if from was on a read-only branch we copied it, but now rename failed so we need to delete it
 		if (!uopt.branches[i].rw) {
-			if (unlink(f))
+			if (unlinkat(fd, f, 0))
 				USYSLOG(LOG_ERR, "%s: cow of %s succeeded, but rename() failed and now "
 				       "also unlink()  failed\n", __func__, from);
 
@@ -553,131 +826,23 @@ static int unionfs_rename(const char *from, const char *to) {
 			maybe_whiteout(from, i, WHITEOUT_FILE);
 	}
 
-	remove_hidden(to, i); // remove hide file (if any)
+	// like in unionfs_mkdir(), a directory whiteout of to keeps hiding the
+	// lower directory, whose members no longer have whiteouts of their own
+	if (!is_dir) remove_hidden(to, i); // remove hide file (if any)
 	cowolf_rename_datamap(from, to, i);
 	RETURN(0);
 }
 
-/**
- * Wrapper function to convert the result of statfs() to statvfs()
- * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
- * glibc's statvfs parses /proc/mounts, which then results in reading
- * the filesystem itself again - which would result in a deadlock.
- * TODO: BSD/MacOSX
- */
-static int statvfs_local(const char *path, struct statvfs *stbuf) {
-#ifdef linux
-	/* glibc's statvfs walks /proc/mounts and stats entries found there
-	 * in order to extract their mount flags, which may deadlock if they
-	 * are mounted under the unionfs. As a result, we have to do this
-	 * ourselves.
-	 */
-	struct statfs stfs;
-	int res = statfs(path, &stfs);
-	if (res == -1) RETURN(res);
-
-	memset(stbuf, 0, sizeof(*stbuf));
-	stbuf->f_bsize = stfs.f_bsize;
-	if (stfs.f_frsize) {
-		stbuf->f_frsize = stfs.f_frsize;
-	} else {
-		stbuf->f_frsize = stfs.f_bsize;
-	}
-	stbuf->f_blocks = stfs.f_blocks;
-	stbuf->f_bfree = stfs.f_bfree;
-	stbuf->f_bavail = stfs.f_bavail;
-	stbuf->f_files = stfs.f_files;
-	stbuf->f_ffree = stfs.f_ffree;
-	stbuf->f_favail = stfs.f_ffree; /* nobody knows */
-
-	/* We don't worry about flags, exactly because this would
-	 * require reading /proc/mounts, and avoiding that and the
-	 * resulting deadlocks is exactly what we're trying to avoid
-	 * by doing this rather than using statvfs.
-	 */
-	stbuf->f_flag = 0;
-	stbuf->f_namemax = stfs.f_namelen;
-
-	RETURN(0);
-#else
-	RETURN(statvfs(path, stbuf));
-#endif
-}
-
 /**
  * statvs implementation
- *
- * Note: We do not set the fsid, as fuse ignores it anyway.
  */
 static int unionfs_statfs(const char *path, struct statvfs *stbuf) {
 	(void)path;
 
 	DBG("%s\n", path);
 
-	int first = 1;
-
-	dev_t devno[uopt.nbranches];
-
-	int retVal = 0;
-
-	int i = 0;
-	for (i = 0; i < uopt.nbranches; i++) {
-		struct statvfs stb;
-		int res = statvfs_local(uopt.branches[i].path, &stb);
-		if (res == -1) {
-			retVal = -errno;
-			break;
-		}
-
-		struct stat st;
-		res = stat(uopt.branches[i].path, &st);
-		if (res == -1) {
-			retVal = -errno;
-			break;
-		}
-		devno[i] = st.st_dev;
-
-		if (first) {
-			memcpy(stbuf, &stb, sizeof(*stbuf));
-			first = 0;
-			stbuf->f_fsid = stb.f_fsid << 8;
-			continue;
-		}
-
-		// Eliminate same devices
-		int j = 0;
-		for (j = 0; j < i; j ++) {
-			if (st.st_dev == devno[j]) break;
-		}
-
-		if (j == i) {
-			// Filesystem can have different block sizes -> normalize to first's block size
-			double ratio = (double)stb.f_bsize / (double)stbuf->f_bsize;
-
-			if (uopt.branches[i].rw) {
-				stbuf->f_blocks += stb.f_blocks * ratio;
-				stbuf->f_bfree += stb.f_bfree * ratio;
-				stbuf->f_bavail += stb.f_bavail * ratio;
-
-				stbuf->f_files += stb.f_files;
-				stbuf->f_ffree += stb.f_ffree;
-				stbuf->f_favail += stb.f_favail;
-			} else if (!uopt.statfs_omit_ro) {
-				// omitting the RO branches is not correct regarding
-				// the block counts but it actually fixes the
-				// percentage of free space. so, let the user decide.
-				stbuf->f_blocks += stb.f_blocks * ratio;
-				stbuf->f_files  += stb.f_files;
-			}
-
-			if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
-			if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
-
-			if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
-		}
-	}
-
-	RETURN(retVal);
+	int res = statfs_get(stbuf);
+	RETURN(res);
 }
 
 static int unionfs_symlink(const char *from, const char *to) {
@@ -686,13 +851,12 @@ static int unionfs_symlink(const char *from, const char *to) {
 	int i = find_rw_branch_cutlast(to);
 	if (i == -1) RETURN(-errno);
 
-	char t[PATHLEN_MAX];
-	if (BUILD_PATH(t, uopt.branches[i].path, to)) RETURN(-ENAMETOOLONG);
-
-	int res = symlink(from, t);
+	int res = symlinkat(from, uopt.branches[i].fd, branch_relpath(to));
 	if (res == -1) RETURN(-errno);
 
-	set_owner(t); // no error check, since creating the file succeeded
+	lookup_cache_invalidate(to);
+
+	set_owner(i, to); // no error check, since creating the file succeeded
 
 	remove_hidden(to, i); // remove hide file (if any)
 	RETURN(0);
@@ -704,14 +868,29 @@ static int unionfs_truncate(const char *path, off_t size) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	// there is no truncateat()
+	int fd = openat(uopt.branches[i].fd, branch_relpath(path), O_WRONLY | O_NONBLOCK);
+	if (fd == -1) RETURN(-errno);
 
-	int res = truncate(p, size);
+	struct cwf_info cw = CWF_INFO_INITIALIZER;
+	if (cowolf_open(path, i, O_RDONLY, &cw) != 0) {
+		int err = errno;
+		close(fd);
+		RETURN(-err);
+	}
 
-	if (res == -1) RETURN(-errno);
+	int res;
+	if (CWF_ON(cw)) {
+		res = cowolf_ftruncate(fd, &cw, size);
+	} else {
+		res = ftruncate(fd, size);
+	}
+	int err = errno;
+
+	cowolf_close(&cw);
+	close(fd);
 
-	cowolf_truncate_datamap(path, i, size);
+	if (res == -1) RETURN(-err);
 
 	RETURN(0);
 }
@@ -722,12 +901,12 @@ static int unionfs_utimens(const char *path, const struct timespec ts[2]) {
 	int i = find_rw_branch_cow(path);
 	if (i == -1) RETURN(-errno);
 
+#ifdef UNIONFS_HAVE_AT
+	int res = utimensat(uopt.branches[i].fd, branch_relpath(path), ts, AT_SYMLINK_NOFOLLOW);
+#else
 	char p[PATHLEN_MAX];
 	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
 
-#ifdef UNIONFS_HAVE_AT
-	int res = utimensat(0, p, ts, AT_SYMLINK_NOFOLLOW);
-#else
 	struct timeval tv[2];
 	tv[0].tv_sec = ts[0].tv_sec;
 	tv[0].tv_usec = ts[0].tv_nsec / 1000;
@@ -747,17 +926,72 @@ static int unionfs_write(const char *path, const char *buf, size_t size, off_t o
 
 	DBG("fd = %x\n", fh->fd);
 
-	int res = pwrite(fh->fd, buf, size, offset);
+	int res;
+	if (CWF_ON(fh->cw)) {
+		res = cowolf_pwrite(fh->fd, &fh->cw, buf, size, offset);
+	} else if (fh->direct) {
+		res = direct_pwrite(fh->fd, buf, size, offset);
+	} else {
+		res = uring_pwrite(fh->fd, buf, size, offset);
+	}
+
 	if (res == -1) RETURN(-errno);
+	stats_written(fh->branch, res);
 
+	RETURN(res);
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Write the data libfuse passes us, with splice() straight from the
+ * /dev/fuse pipe to the branch file if the kernel supports it.
+ */
+static int unionfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	unionfs_fhandle_t *fh = (unionfs_fhandle_t *)fi->fh;
+	DBG("fd = %x\n", fh->fd);
+
+	// data in memory is written as usual, maybe with io_uring
+	if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		RETURN(unionfs_write(path, (char *)buf->buf[0].mem + buf->off,
+			fuse_buf_size(buf) - buf->off, offset, fi));
+	}
+
+	// splice() does not align the data for O_DIRECT
+	if (fh->direct) {
+		size_t size = fuse_buf_size(buf);
+		void *mem;
+		if (posix_memalign(&mem, DIRECT_IO_ALIGN, size ? size : 1)) RETURN(-ENOMEM);
+
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = mem;
+
+		ssize_t n = fuse_buf_copy(&dst, buf, 0);
+		int res = n < 0 ? (int)n : unionfs_write(path, mem, n, offset, fi);
+
+		free(mem);
+		RETURN(res);
+	}
+
+	int res;
 	if (CWF_ON(fh->cw)) {
-		if (cowolf_write(&fh->cw, size, offset) < 0) {
-			RETURN(-errno);
-		}
+		res = cowolf_write_buf(fh->fd, &fh->cw, buf, offset);
+	} else {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fh->fd;
+		dst.buf[0].pos = offset;
+
+		ssize_t n = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+		if (n < 0) RETURN((int)n);
+		res = n;
 	}
 
+	if (res == -1) RETURN(-errno);
+	stats_written(fh->branch, res);
+
 	RETURN(res);
 }
+#endif
 
 #ifdef HAVE_XATTR
 
@@ -768,19 +1002,34 @@ static int unionfs_getxattr(const char *path, const char *name, char *value, siz
 #endif
 	DBG("%s\n", path);
 
+	// asked for before every write
+	if (uopt.skip_capability && strcmp(name, "security.capability") == 0) RETURN(-ENOXATTR);
+
+	unsigned long seq = xattr_cache_begin();
+
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
+	int res;
+#if __APPLE__
+	bool cached = position == 0;
+#else
+	bool cached = true;
+#endif
+	if (cached && xattr_cache_get(path, name, i, value, size, &res)) RETURN(res);
+
+	char buf[PATHLEN_MAX];
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(p, uopt.branches[i].path, redirect_path(path, i, buf))) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
-	int res = getxattr(p, name, value, size, position, XATTR_NOFOLLOW);
+	res = getxattr(p, name, value, size, position, XATTR_NOFOLLOW);
 #else
-	int res = lgetxattr(p, name, value, size);
+	res = lgetxattr(p, name, value, size);
 #endif
+	if (res == -1) res = -errno;
 
-	if (res == -1) RETURN(-errno);
+	if (cached) xattr_cache_put(path, name, i, size ? value : NULL, res, seq);
 
 	RETURN(res);
 }
@@ -791,8 +1040,9 @@ static int unionfs_listxattr(const char *path, char *list, size_t size) {
 	int i = find_rorw_branch(path);
 	if (i == -1) RETURN(-errno);
 
+	char buf[PATHLEN_MAX];
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[i].path, path)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(p, uopt.branches[i].path, redirect_path(path, i, buf))) RETURN(-ENAMETOOLONG);
 
 #if __APPLE__
 	int res = listxattr(p, list, size, XATTR_NOFOLLOW);
@@ -819,6 +1069,7 @@ static int unionfs_removexattr(const char *path, const char *name) {
 #else
 	int res = lremovexattr(p, name);
 #endif
+	xattr_cache_invalidate(path);
 
 	if (res == -1) RETURN(-errno);
 
@@ -843,6 +1094,7 @@ static int unionfs_setxattr(const char *path, const char *name, const char *valu
 #else
 	int res = lsetxattr(p, name, value, size, flags);
 #endif
+	xattr_cache_invalidate(path);
 
 	if (res == -1) RETURN(-errno);
 
@@ -866,10 +1118,16 @@ struct fuse_operations unionfs_oper = {
 	.mkdir = unionfs_mkdir,
 	.mknod = unionfs_mknod,
 	.open = unionfs_open,
+	.opendir = unionfs_opendir,
 	.read = unionfs_read,
+#if FUSE_VERSION >= 29
+	.read_buf = unionfs_read_buf,
+	.write_buf = unionfs_write_buf,
+#endif
 	.readlink = unionfs_readlink,
 	.readdir = unionfs_readdir,
 	.release = unionfs_release,
+	.releasedir = unionfs_releasedir,
 	.rename = unionfs_rename,
 	.rmdir = unionfs_rmdir,
 	.statfs = unionfs_statfs,
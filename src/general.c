@@ -19,8 +19,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <pwd.h>
 #include <grp.h>
+#include <fnmatch.h>
 #include <pthread.h>
 
 #include "unionfs.h"
@@ -31,11 +34,18 @@
 #include "general.h"
 #include "debug.h"
 #include "usyslog.h"
+#include "lookup_cache.h"
+#include "whiteout_index.h"
+#include "fuse_ll_ops.h"
+#include "redirect.h"
+#include "manifest.h"
+#include "whiteout_compact.h"
 
 /**
  * Check if a file or directory with the hidden flag exists.
+ * @path - path relative to the root of branch
  */
-static int filedir_hidden(const char *path) {
+static int filedir_hidden(int branch, const char *path) {
 	// cow mode disabled, no need for hidden files
 	if (!uopt.cow_enabled) RETURN(false);
 
@@ -45,7 +55,7 @@ static int filedir_hidden(const char *path) {
 	DBG("%s\n", p);
 
 	struct stat stbuf;
-	int res = lstat(p, &stbuf);
+	int res = manifest_lstatat(branch, p, &stbuf);
 	if (res == 0) RETURN(1);
 
 	RETURN(0);
@@ -59,11 +69,18 @@ int path_hidden(const char *path, int branch) {
 
 	if (!uopt.cow_enabled) RETURN(false);
 
+	// whiteouts are named after the path on the branch
+	char buf[PATHLEN_MAX];
+	path = redirect_path(path, branch, buf);
+
+	if (uopt.whiteout_index) RETURN(whiteout_index_hidden(path, branch));
+
+	// relative to the branch, we stat it with the branch fd
 	char whiteoutpath[PATHLEN_MAX];
-	if (BUILD_PATH(whiteoutpath, uopt.branches[branch].path, METADIR, path)) RETURN(false);
+	if (BUILD_PATH(whiteoutpath, METADIR, path)) RETURN(false);
 
 	// -1 as we MUST not end on the next path element
-	char *walk = whiteoutpath + uopt.branches[branch].path_len + strlen(METADIR) - 1;
+	char *walk = whiteoutpath + strlen(METADIR) - 1;
 
 	// first slashes, e.g. we have path = /dir1/dir2/, will set walk = dir1/dir2/
 	while (*walk == '/') walk++;
@@ -76,7 +93,7 @@ int path_hidden(const char *path, int branch) {
 		char p[PATHLEN_MAX];
 		// walk - path = strlen(/dir1)
 		snprintf(p, (walk - whiteoutpath) + 1, "%s", whiteoutpath);
-		int res = filedir_hidden(p);
+		int res = filedir_hidden(branch, p);
 		if (res) RETURN(res); // path is hidden or error
 
 		// as above the do loop, walk over the next slashes, walk = dir2/
@@ -95,20 +112,36 @@ int remove_hidden(const char *path, int maxbranch) {
 
 	if (!uopt.cow_enabled) RETURN(0);
 
-	if (maxbranch == -1) maxbranch = uopt.nbranches;
+	if (maxbranch == -1) maxbranch = uopt.nbranches - 1;
 
 	int i;
 	for (i = 0; i <= maxbranch; i++) {
+		char buf[PATHLEN_MAX];
+		const char *bpath = redirect_path(path, i, buf);
+
+		// the index knows all whiteouts, no need to stat them
+		if (uopt.whiteout_index && !whiteout_index_has(bpath, i)) continue;
+
+		// relative to the branch
 		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, METADIR, path)) RETURN(-ENAMETOOLONG);
+		if (BUILD_PATH(p, METADIR, bpath)) RETURN(-ENAMETOOLONG);
 		if (strlen(p) + strlen(HIDETAG) > PATHLEN_MAX) RETURN(-ENAMETOOLONG);
 		strcat(p, HIDETAG); // TODO check length
 
-		switch (path_is_dir(p)) {
-			case IS_FILE: unlink(p); break;
-			case IS_DIR: rmdir(p); break;
-			case NOT_EXISTING: continue;
+		int fd = uopt.branches[i].fd;
+		switch (path_is_dir_at(fd, p)) {
+			case IS_FILE:
+				unlinkat(fd, p, 0);
+				lookup_cache_invalidate(path);
+				break;
+			case IS_DIR:
+				unlinkat(fd, p, AT_REMOVEDIR);
+				lookup_cache_invalidate_tree(path);
+				break;
+			case NOT_EXISTING:
+				break;
 		}
+		whiteout_index_remove(bpath, i);
 	}
 
 	RETURN(0);
@@ -120,11 +153,18 @@ int remove_hidden(const char *path, int maxbranch) {
  * return proper types given by filetype_t
  */
 filetype_t path_is_dir(const char *path) {
+	RETURN(path_is_dir_at(AT_FDCWD, path));
+}
+
+/**
+ * Same as path_is_dir(), but path is relative to the directory dirfd
+ */
+filetype_t path_is_dir_at(int dirfd, const char *path) {
 	DBG("%s\n", path);
 
 	struct stat buf;
 
-	if (lstat(path, &buf) == -1) RETURN(NOT_EXISTING);
+	if (fstatat(dirfd, path, &buf, AT_SYMLINK_NOFOLLOW) == -1) RETURN(NOT_EXISTING);
 
 	if (S_ISDIR(buf.st_mode)) RETURN(IS_DIR);
 
@@ -145,19 +185,27 @@ static int do_create_whiteout(const char *path, int branch_rw, enum whiteout mod
 	// this creates e.g. branch/.unionfs/some_directory
 	path_create_cutlast(metapath, branch_rw, branch_rw);
 
+	// relative to the branch
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, metapath)) RETURN(-1);
-	strcat(p, HIDETAG); // TODO check length
+	if (strlen(metapath) + strlen(HIDETAG) >= PATHLEN_MAX) RETURN(-1);
+	snprintf(p, PATHLEN_MAX, "%s%s", metapath, HIDETAG);
 
+	int fd = uopt.branches[branch_rw].fd;
 	int res;
 	if (mode == WHITEOUT_FILE) {
-		res = open(p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		res = openat(fd, p, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
 		if (res == -1) RETURN(-1);
 		res = close(res);
+		whiteout_index_add(path, branch_rw);
+		lookup_cache_invalidate(path);
 	} else {
-		res = mkdir(p, S_IRWXU);
-		if (res)
+		res = mkdirat(fd, p, S_IRWXU);
+		if (res) {
 			USYSLOG(LOG_ERR, "Creating %s failed: %s\n", p, strerror(errno));
+		} else {
+			whiteout_index_add(path, branch_rw);
+			lookup_cache_invalidate_tree(path);
+		}
 	}
 
 	RETURN(res);
@@ -181,6 +229,68 @@ int hide_dir(const char *path, int branch_rw) {
 	RETURN(res);
 }
 
+/**
+ * The directory path was removed and is hidden as a whole on branch_rw now,
+ * so the whiteouts of its members are not needed anymore. Collapse them
+ * into the one of path, see whiteout_compact.c.
+ */
+void collapse_whiteouts(const char *path, int branch_rw) {
+	DBG("%s\n", path);
+
+	if (!uopt.cow_enabled) return;
+
+	char metapath[PATHLEN_MAX];
+	char p[PATHLEN_MAX];
+	if (BUILD_PATH(metapath, METADIR, path)) return;
+	if (snprintf(p, PATHLEN_MAX, "%s%s", metapath, HIDETAG) >= PATHLEN_MAX) return;
+
+	// no lower branch had the directory
+	int fd = uopt.branches[branch_rw].fd;
+	if (path_is_dir_at(fd, p) == NOT_EXISTING) return;
+
+	whiteout_index_remove_tree(path, branch_rw);
+
+	uint64_t removed = 0;
+	int res = whiteout_collapse(fd, metapath, &removed);
+	if (res) {
+		USYSLOG(LOG_WARNING, "Removing the whiteouts below %s failed: %s\n",
+			metapath, strerror(-res));
+	}
+
+	DBG("%s: %llu whiteouts removed\n", path, (unsigned long long)removed);
+}
+
+static void compacted(const char *path, void *arg) {
+	whiteout_index_remove_tree(path, (int)(long)arg);
+}
+
+/**
+ * Collapse the whiteouts below all hidden directories of the rw branches,
+ * e.g. those left by older versions. removed is set to the number of
+ * whiteouts removed.
+ */
+int compact_whiteouts(uint64_t *removed) {
+	*removed = 0;
+
+	if (!uopt.cow_enabled) RETURN(0);
+
+	int res = 0;
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		if (!uopt.branches[i].rw) continue;
+
+		int r = whiteout_compact(uopt.branches[i].fd, METANAME, compacted, (void *)(long)i, removed);
+		if (r) {
+			USYSLOG(LOG_ERR, "Compacting the whiteouts of %s failed: %s\n",
+				uopt.branches[i].path, strerror(-r));
+			res = r;
+		}
+	}
+
+	DBG("%llu whiteouts removed\n", (unsigned long long)*removed);
+	RETURN(res);
+}
+
 /**
  * This is called *after* unlink() or rmdir(), create a whiteout file
  * if the same file/dir does exist in a lower branch
@@ -199,11 +309,21 @@ int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode) {
 
 /**
  * Set file owner of after an operation, which created a file.
+ * @path - the fuse path of the file, which was created on branch
  */
-int set_owner(const char *path) {
-	struct fuse_context *ctx = fuse_get_context();
-	if (ctx->uid != 0 && ctx->gid != 0) {
-		int res = lchown(path, ctx->uid, ctx->gid);
+int set_owner(int branch, const char *path) {
+	uid_t uid;
+	gid_t gid;
+	if (uopt.lowlevel) {
+		ll_get_caller(&uid, &gid);
+	} else {
+		struct fuse_context *ctx = fuse_get_context();
+		uid = ctx->uid;
+		gid = ctx->gid;
+	}
+
+	if (uid != 0 && gid != 0) {
+		int res = fchownat(uopt.branches[branch].fd, branch_relpath(path), uid, gid, AT_SYMLINK_NOFOLLOW);
 		if (res) {
 			USYSLOG(LOG_WARNING,
 			       ":%s: Setting the correct file owner failed: %s !\n",
@@ -228,3 +348,26 @@ int create_metapath(const char *path, int branch_rw) {
 	RETURN(0);
 }
 
+
+/**
+ * Match path against the patterns of -o direct_io_paths. A pattern with a
+ * '/' has to match the whole path, others only the name of the file, like
+ * "*.ibd".
+ */
+bool direct_io_path(const char *path) {
+	if (uopt.direct_io_paths == NULL) return false;
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	char **pattern;
+	for (pattern = uopt.direct_io_paths; *pattern; pattern++) {
+		if (strchr(*pattern, '/')) {
+			if (fnmatch(*pattern, path, FNM_PATHNAME) == 0) return true;
+		} else if (fnmatch(*pattern, name, 0) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -8,6 +8,7 @@
 #define GENERAL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 enum  whiteout {
 	WHITEOUT_FILE,
@@ -25,8 +26,12 @@ int remove_hidden(const char *path, int maxbranch);
 int hide_file(const char *path, int branch_rw);
 int hide_dir(const char *path, int branch_rw);
 filetype_t path_is_dir (const char *path);
+filetype_t path_is_dir_at(int dirfd, const char *path);
 int maybe_whiteout(const char *path, int branch_rw, enum whiteout mode);
-int set_owner(const char *path);
+void collapse_whiteouts(const char *path, int branch_rw);
+int compact_whiteouts(uint64_t *removed);
+int set_owner(int branch, const char *path);
 int create_metapath(const char *path, int branch_rw);
+bool direct_io_path(const char *path);
 
 #endif
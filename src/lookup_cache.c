@@ -0,0 +1,226 @@
+/*
+* Description: cache of find_branch() results
+*
+* License: BSD-style license
+*
+* Details:
+*	find_branch() needs an lstat() per branch and a path_hidden() walk
+*	(another lstat per path component) per branch until it finds path.
+*	With -o lookup_cache=<ttl> we remember the result, including negative
+*	results and results caused by whiteouts, for ttl seconds.
+*	All of our own operations that change which branch serves a path
+*	invalidate the cache entries they affect, so the ttl only limits
+*	how long changes done directly on the branches may stay invisible.
+*
+*	Invalidating a single path removes its entry. Invalidating a tree
+*	(directory renames, rmdir, directory whiteouts) must also drop all
+*	paths below it, which we do by bumping the cache generation. Entries
+*	of an older generation are treated as misses and get replaced lazily,
+*	or dropped with everything else once the cache is full.
+*	lookup_cache_begin() returns a sequence number, which must be passed
+*	to lookup_cache_put(). If any invalidation happened in between, the
+*	result might already be stale and is not inserted.
+*
+*	Branches added or removed while mounted only change the results found
+*	on the removed branch, or not found at all before a branch was added.
+*	These are dropped the same way, by a generation per branch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "string.h"
+#include "usyslog.h"
+#include "lookup_cache.h"
+#include "stats.h"
+#include "xattr_cache.h"
+
+typedef struct {
+	lookup_result_t res;
+	uint64_t expires;	// CLOCK_MONOTONIC, in ns
+	unsigned long gen;	// cache generation the entry was added in
+	unsigned long branch_gen; // generation of its branch, see branch_gen()
+} lc_entry_t;
+
+static struct hashtable *cache;
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// all protected by cache_lock
+static unsigned long cache_gen;	// bumped on tree invalidations
+static unsigned long cache_seq;	// bumped on any invalidation
+static unsigned long *branch_gens; // of the branches, [0] of paths not found
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * The generation of the branch of result res, the whiteouts hiding a path
+ * are not affected by the branches below.
+ */
+static unsigned long branch_gen(const lookup_result_t *res) {
+	return res->whiteout ? 0 : branch_gens[res->branch + 1];
+}
+
+static bool entry_valid(const lc_entry_t *e, uint64_t now) {
+	return e->gen == cache_gen && e->expires > now
+		&& e->branch_gen == branch_gen(&e->res);
+}
+
+/**
+ * The cache is full, drop everything. Must be called with cache_lock
+ * write-locked.
+ */
+static void cache_flush(void) {
+	DBG("lookup cache full, flushing it\n");
+
+	hashtable_destroy(cache, 1);
+	cache = create_hashtable(16, string_hash, string_equal);
+	if (cache == NULL) {
+		USYSLOG(LOG_ERR, "Failed to re-create the lookup cache, disabling it.\n");
+		uopt.lookup_cache_enabled = false;
+	}
+}
+
+/**
+ * Set up the cache, does nothing if the cache is not enabled.
+ */
+void lookup_cache_init(void) {
+	if (!uopt.lookup_cache_enabled) return;
+
+	cache = create_hashtable(16, string_hash, string_equal);
+	branch_gens = calloc(uopt.max_branches + 1, sizeof(unsigned long));
+	if (cache == NULL || branch_gens == NULL) {
+		fprintf(stderr, "Failed to create the lookup cache, disabling it.\n");
+		uopt.lookup_cache_enabled = false;
+	}
+}
+
+/**
+ * Return a sequence number to be given to lookup_cache_put(), must be taken
+ * before the branches are looked at.
+ */
+unsigned long lookup_cache_begin(void) {
+	if (!uopt.lookup_cache_enabled) return 0;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	unsigned long seq = cache_seq;
+	pthread_rwlock_unlock(&cache_lock);
+
+	return seq;
+}
+
+/**
+ * Look up path in the cache. Return true and fill in res on a hit.
+ */
+bool lookup_cache_get(const char *path, lookup_result_t *res) {
+	if (!uopt.lookup_cache_enabled) return false;
+
+	bool found = false;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	lc_entry_t *e = hashtable_search(cache, (void *)path);
+	if (e && entry_valid(e, now_ns())) {
+		*res = e->res;
+		found = true;
+	}
+	pthread_rwlock_unlock(&cache_lock);
+
+	stats_lookup(found);
+	DBG("%s: %s\n", path, found ? "hit" : "miss");
+	return found;
+}
+
+/**
+ * Remember the lookup result of path, branch is -1 if path was not found.
+ */
+void lookup_cache_put(const char *path, int branch, bool whiteout, unsigned long seq) {
+	if (!uopt.lookup_cache_enabled) return;
+
+	pthread_rwlock_wrlock(&cache_lock);
+
+	// something was invalidated while we were looking, this might be stale
+	if (seq != cache_seq) goto out;
+
+	lc_entry_t *e = hashtable_search(cache, (void *)path);
+	if (e == NULL) {
+		if (hashtable_count(cache) >= uopt.lookup_cache_size) {
+			cache_flush();
+			if (!uopt.lookup_cache_enabled) goto out;
+		}
+
+		e = malloc(sizeof(lc_entry_t));
+		char *key = strdup(path);
+		if (e == NULL || key == NULL || !hashtable_insert(cache, key, e)) {
+			free(e);
+			free(key);
+			goto out;
+		}
+	}
+
+	e->res.branch = branch;
+	e->res.whiteout = whiteout;
+	e->expires = now_ns() + (uint64_t)(uopt.lookup_cache_ttl * 1e9);
+	e->gen = cache_gen;
+	e->branch_gen = branch_gen(&e->res);
+
+out:
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * Drop the cached result of path.
+ */
+void lookup_cache_invalidate(const char *path) {
+	// another file might serve path now
+	xattr_cache_invalidate(path);
+
+	if (!uopt.lookup_cache_enabled) return;
+
+	DBG("%s\n", path);
+
+	pthread_rwlock_wrlock(&cache_lock);
+	cache_seq++;
+	free(hashtable_remove(cache, (void *)path));
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * Drop the cached results of path and everything below it.
+ */
+void lookup_cache_invalidate_tree(const char *path) {
+	xattr_cache_invalidate_tree(path);
+
+	if (!uopt.lookup_cache_enabled) return;
+
+	DBG("%s\n", path);
+
+	pthread_rwlock_wrlock(&cache_lock);
+	cache_seq++;
+	cache_gen++;
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * Drop the cached results of paths found on branch, or of paths not found
+ * if branch is -1, the branches were changed.
+ */
+void lookup_cache_invalidate_branch(int branch) {
+	if (!uopt.lookup_cache_enabled) return;
+
+	DBG("%d\n", branch);
+
+	pthread_rwlock_wrlock(&cache_lock);
+	cache_seq++;
+	branch_gens[branch + 1]++;
+	pthread_rwlock_unlock(&cache_lock);
+}
@@ -0,0 +1,26 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef LOOKUP_CACHE_H
+#define LOOKUP_CACHE_H
+
+#include <stdbool.h>
+
+#define DEFAULT_LOOKUP_CACHE_SIZE 65536
+
+/* cached result of a find_branch() RWRO lookup */
+typedef struct {
+	int branch;		// branch the path was found in, -1 if not found
+	bool whiteout;		// not found because a whiteout hides it
+} lookup_result_t;
+
+void lookup_cache_init(void);
+unsigned long lookup_cache_begin(void);
+bool lookup_cache_get(const char *path, lookup_result_t *res);
+void lookup_cache_put(const char *path, int branch, bool whiteout, unsigned long seq);
+void lookup_cache_invalidate(const char *path);
+void lookup_cache_invalidate_tree(const char *path);
+void lookup_cache_invalidate_branch(int branch);
+
+#endif
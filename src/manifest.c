@@ -0,0 +1,363 @@
+/*
+* Description: answer lookups of read-only branches from their manifests
+*
+* License: BSD-style license
+*
+* Details:
+*	Lower branches are often immutable images, which every mount has to
+*	lstat() and read with cold caches again. unionfs-mkmanifest writes
+*	the attributes of all paths of such a branch into MANIFEST_PATH on
+*	it, sorted so that a path is found by a binary search and the
+*	members of a directory follow each other. With -o manifest the
+*	manifests of the ro branches are mapped on mount and lookups,
+*	getattr and readdir of these branches do not touch them anymore.
+*	Mounts of the same image share the pages of the manifest. Branches
+*	added or made ro while mounted get theirs then.
+*
+*	The manifest is only used while the root of the branch has the
+*	inode number, mtime and ctime it had when the manifest was written,
+*	otherwise the branch is used as without it. It is not noticed if
+*	only paths further down change, so the manifest has to be written
+*	again whenever the image is changed. The manifest itself is not in
+*	the manifest, so it is not shown by the mount.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "manifest.h"
+
+struct manifest {
+	const struct manifest_header *h;
+	const struct manifest_entry *entries;
+	const char *names;
+};
+
+// NULL for branches without a manifest
+static struct manifest **manifests;
+
+static int load(int branch, struct manifest **mp) {
+	*mp = NULL;
+
+	int fd = openat(uopt.branches[branch].fd, MANIFEST_PATH, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) RETURN(0);
+		RETURN(-errno);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int res = -errno;
+		close(fd);
+		RETURN(res);
+	}
+
+	if ((size_t)st.st_size < sizeof(struct manifest_header)) {
+		close(fd);
+		RETURN(-EINVAL);
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) RETURN(-errno);
+
+	const struct manifest_header *h = map;
+	const uint64_t entries_end = sizeof(*h) + (uint64_t)h->count * sizeof(struct manifest_entry);
+	if (memcmp(h->magic, MANIFEST_MAGIC, sizeof(h->magic)) != 0
+	|| h->version != MANIFEST_VERSION
+	|| h->names < entries_end
+	|| h->names_size == 0
+	|| h->names > (uint64_t)st.st_size
+	|| h->names_size != (uint64_t)st.st_size - h->names
+	|| ((const char *)map)[st.st_size - 1] != '\0'
+	|| !S_ISDIR(h->root.mode)
+	|| (uint64_t)h->root.first + h->root.count > h->count) {
+		munmap(map, st.st_size);
+		RETURN(-EINVAL);
+	}
+
+	// the branch changed since the manifest was written
+	struct stat root;
+	if (fstat(uopt.branches[branch].fd, &root) == -1
+	|| root.st_ino != h->root.ino
+	|| root.st_mtim.tv_sec != h->root.mtime || root.st_mtim.tv_nsec != h->root.mtime_nsec
+	|| root.st_ctim.tv_sec != h->root.ctime || root.st_ctim.tv_nsec != h->root.ctime_nsec) {
+		munmap(map, st.st_size);
+		RETURN(-ESTALE);
+	}
+
+	struct manifest *m = malloc(sizeof(struct manifest));
+	if (m == NULL) {
+		munmap(map, st.st_size);
+		RETURN(-ENOMEM);
+	}
+	m->h = h;
+	m->entries = (const struct manifest_entry *)(h + 1);
+	m->names = (const char *)map + h->names;
+
+	DBG("branch %d: %u entries\n", branch, h->count);
+
+	*mp = m;
+	RETURN(0);
+}
+
+int manifest_init(void) {
+	if (!uopt.manifest) RETURN(0);
+
+	manifests = calloc(uopt.max_branches, sizeof(struct manifest *));
+	if (manifests == NULL) RETURN(-ENOMEM);
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		// paths of rw branches change
+		if (uopt.branches[i].rw) continue;
+
+		int res = load(i, &manifests[i]);
+		if (res) {
+			USYSLOG(LOG_WARNING, "Not using the manifest of %s: %s\n",
+				uopt.branches[i].path, strerror(-res));
+		}
+	}
+
+	RETURN(0);
+}
+
+/**
+ * branch was added while mounted or changes between ro and rw, use its
+ * manifest from now on if it is ro.
+ */
+void manifest_branch_init(int branch, bool rw) {
+	if (manifests == NULL) return;
+
+	// the old manifest might still be in use by other threads, so it
+	// stays mapped
+	struct manifest *m = NULL;
+	if (!rw) {
+		int res = load(branch, &m);
+		if (res) {
+			USYSLOG(LOG_WARNING, "Not using the manifest of %s: %s\n",
+				uopt.branches[branch].path, strerror(-res));
+		}
+	}
+
+	__atomic_store_n(&manifests[branch], m, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * The path of entry e, NULL if the manifest is broken.
+ */
+static const char *entry_path(const struct manifest *m, const struct manifest_entry *e) {
+	if (e->path >= m->h->names_size || e->dir_len >= m->h->names_size - e->path) return NULL;
+	return m->names + e->path;
+}
+
+/**
+ * Copy path without "." and needless slashes to p, like the paths of the
+ * manifest. Returns the length, -1 if it is too long.
+ */
+static int normalize(const char *path, char *p) {
+	size_t len = 0;
+	while (*path) {
+		while (*path == '/') path++;
+		if (path[0] == '.' && (path[1] == '/' || path[1] == '\0')) {
+			path++;
+			continue;
+		}
+		if (*path == '\0') break;
+
+		if (len) p[len++] = '/';
+		while (*path && *path != '/') {
+			if (len >= PATHLEN_MAX - 1) return -1;
+			p[len++] = *path++;
+		}
+	}
+	p[len] = '\0';
+
+	return len;
+}
+
+/**
+ * Find the entry of the normalized path p.
+ */
+static const struct manifest_entry *lookup_p(const struct manifest *m, char *p, size_t len) {
+	if (len == 0) return &m->h->root;
+
+	char *name = strrchr(p, '/');
+	size_t dir_len = name ? (size_t)(name - p) : 0;
+	name = name ? name + 1 : p;
+
+	uint32_t lo = 0, hi = m->h->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct manifest_entry *e = &m->entries[mid];
+
+		const char *ep = entry_path(m, e);
+		if (ep == NULL) return NULL;
+		const char *ename = ep + e->dir_len + (e->dir_len ? 1 : 0);
+
+		int res = manifest_cmp(p, dir_len, name, ep, e->dir_len, ename);
+		if (res == 0) return e;
+		if (res < 0) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+/**
+ * Find the entry of path, which is relative to the root of the branch.
+ */
+static const struct manifest_entry *lookup(const struct manifest *m, const char *path) {
+	char p[PATHLEN_MAX];
+	int len = normalize(path, p);
+	if (len < 0) return NULL;
+
+	return lookup_p(m, p, len);
+}
+
+static void entry_stat(int branch, const struct manifest_entry *e, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_dev = uopt.branches[branch].dev;
+	st->st_ino = e->ino;
+	st->st_mode = e->mode;
+	st->st_nlink = e->nlink;
+	st->st_uid = e->uid;
+	st->st_gid = e->gid;
+	st->st_rdev = e->rdev;
+	st->st_size = e->size;
+	st->st_blksize = e->blksize;
+	st->st_blocks = e->blocks;
+	st->st_atim.tv_sec = e->atime;
+	st->st_atim.tv_nsec = e->atime_nsec;
+	st->st_mtim.tv_sec = e->mtime;
+	st->st_mtim.tv_nsec = e->mtime_nsec;
+	st->st_ctim.tv_sec = e->ctime;
+	st->st_ctim.tv_nsec = e->ctime_nsec;
+}
+
+static struct manifest *manifest_of(int branch) {
+	if (manifests == NULL) return NULL;
+	return __atomic_load_n(&manifests[branch], __ATOMIC_SEQ_CST);
+}
+
+/**
+ * fstatat() with AT_SYMLINK_NOFOLLOW of path relative to the root of branch,
+ * from its manifest if it has one.
+ */
+int manifest_lstatat(int branch, const char *path, struct stat *st) {
+	struct manifest *m = manifest_of(branch);
+	if (m == NULL) return fstatat(uopt.branches[branch].fd, path, st, AT_SYMLINK_NOFOLLOW);
+
+	const struct manifest_entry *e = lookup(m, path);
+	if (e == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	entry_stat(branch, e, st);
+	return 0;
+}
+
+/**
+ * Open the directory path relative to the root of branch, from its manifest
+ * if it has one. NULL with errno set if it cannot be opened.
+ */
+struct manifest_dir *manifest_opendir(int branch, const char *path) {
+	struct manifest_dir *md = calloc(1, sizeof(struct manifest_dir));
+	if (md == NULL) return NULL;
+	md->branch = branch;
+
+	struct manifest *m = manifest_of(branch);
+	md->m = m;
+	if (m == NULL) {
+		int fd = openat(uopt.branches[branch].fd, path, O_RDONLY | O_DIRECTORY);
+		if (fd != -1) md->dp = fdopendir(fd);
+		if (md->dp == NULL) {
+			int err = errno;
+			if (fd != -1) close(fd);
+			free(md);
+			errno = err;
+			return NULL;
+		}
+		return md;
+	}
+
+	const struct manifest_entry *e = lookup(m, path);
+	int err = 0;
+	if (e == NULL) err = ENOENT;
+	else if (!S_ISDIR(e->mode)) err = ENOTDIR;
+	else if ((uint64_t)e->first + e->count > m->h->count) err = EIO;
+	if (err) {
+		free(md);
+		errno = err;
+		return NULL;
+	}
+
+	md->pos = e->first;
+	md->end = e->first + e->count;
+	md->dots_ino[0] = e->ino;
+
+	// ".." of the root is outside of the branch, its inode is not known
+	if (e != &m->h->root) {
+		char p[PATHLEN_MAX];
+		normalize(path, p);
+		char *slash = strrchr(p, '/');
+		if (slash) *slash = '\0';
+		else *p = '\0';
+
+		const struct manifest_entry *pe = lookup_p(m, p, strlen(p));
+		if (pe) md->dots_ino[1] = pe->ino;
+	}
+
+	return md;
+}
+
+struct dirent *manifest_readdir(struct manifest_dir *md) {
+	if (md->dp) return readdir(md->dp);
+
+	struct manifest *m = md->m;
+	struct dirent *de = &md->de;
+
+	if (md->dots < 2) {
+		memset(de, 0, sizeof(*de));
+		de->d_ino = md->dots_ino[md->dots];
+		de->d_type = DT_DIR;
+		strcpy(de->d_name, md->dots ? ".." : ".");
+		md->dots++;
+		return de;
+	}
+
+	while (md->pos < md->end) {
+		const struct manifest_entry *e = &m->entries[md->pos++];
+		const char *p = entry_path(m, e);
+		if (p == NULL) continue;
+
+		const char *name = p + e->dir_len + (e->dir_len ? 1 : 0);
+		if (strlen(name) >= sizeof(de->d_name)) continue;
+
+		memset(de, 0, sizeof(*de));
+		de->d_ino = e->ino;
+		de->d_type = (e->mode & S_IFMT) >> 12;
+		strcpy(de->d_name, name);
+		return de;
+	}
+
+	return NULL;
+}
+
+void manifest_closedir(struct manifest_dir *md) {
+	if (md->dp) closedir(md->dp);
+	free(md);
+}
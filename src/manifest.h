@@ -0,0 +1,89 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// of a branch, relative to its root, written by unionfs-mkmanifest
+#define MANIFEST_PATH ".unionfs/manifest"
+
+#define MANIFEST_MAGIC "UFSMANIF"	// 8 bytes, not terminated
+#define MANIFEST_VERSION 1
+
+/**
+ * The file has the header, the entries and then the names. Numbers are in
+ * the byte order of the host that wrote it, other hosts fail on the version.
+ */
+struct manifest_entry {
+	uint64_t path;		// offset in the names, the path relative to the root
+	uint64_t ino;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t rdev;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	uint32_t blksize;
+	uint32_t dir_len;	// length of the directory part of path, without '/'
+	uint32_t first;		// directories: index of their first member
+	uint32_t count;		// directories: number of their members
+};
+
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;		// number of entries
+	uint64_t names;		// offset of the names in the file
+	uint64_t names_size;	// the last name ends the file
+	struct manifest_entry root; // the root of the branch, its path is ""
+};
+
+/**
+ * Order of the entries: by the directory part of their path, then by their
+ * name, both compared bytewise. So the members of each directory follow each
+ * other. The directories are not terminated.
+ */
+static inline int manifest_cmp(const char *dir1, size_t len1, const char *name1,
+                               const char *dir2, size_t len2, const char *name2) {
+	int res = memcmp(dir1, dir2, len1 < len2 ? len1 : len2);
+	if (res == 0 && len1 != len2) res = len1 < len2 ? -1 : 1;
+	if (res == 0) res = strcmp(name1, name2);
+	return res;
+}
+
+/**
+ * A directory of a branch, read from the manifest if there is one.
+ */
+struct manifest_dir {
+	DIR *dp;		// NULL if read from the manifest
+	int branch;
+	struct manifest *m;	// the manifest at opendir, it might be replaced since
+	uint32_t pos;		// next entry of the manifest
+	uint32_t end;
+	int dots;		// number of "." and ".." already read
+	uint64_t dots_ino[2];
+	struct dirent de;
+};
+
+int manifest_init(void);
+void manifest_branch_init(int branch, bool rw);
+int manifest_lstatat(int branch, const char *path, struct stat *st);
+struct manifest_dir *manifest_opendir(int branch, const char *path);
+struct dirent *manifest_readdir(struct manifest_dir *md);
+void manifest_closedir(struct manifest_dir *md);
+
+#endif
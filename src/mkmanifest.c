@@ -0,0 +1,258 @@
+/*
+* Description: write the manifest of a read-only branch
+*
+* License: BSD-style license
+*
+* Details:
+*	Walks the branch and writes the attributes of all its paths into
+*	MANIFEST_PATH on it, see manifest.c. Run it again whenever the
+*	branch is changed, mounts with -o manifest do not use a manifest
+*	older than the root of the branch. The manifest is replaced
+*	atomically, so it can be written again while the branch is mounted.
+*
+*	Usage: unionfs-mkmanifest <branch>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "manifest.h"
+
+#define MANIFEST_TMP MANIFEST_PATH ".tmp"
+
+struct item {
+	char *path;		// relative to the root of the branch
+	uint32_t dir_len;
+	struct stat st;
+};
+
+static struct item *items;
+static size_t nitems;
+static size_t items_size;
+
+static void add_item(const char *path, const struct stat *st) {
+	if (nitems == items_size) {
+		items_size = items_size ? 2 * items_size : 4096;
+		items = realloc(items, items_size * sizeof(struct item));
+		if (items == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	struct item *it = &items[nitems++];
+	it->path = strdup(path);
+	if (it->path == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	const char *slash = strrchr(path, '/');
+	it->dir_len = slash ? slash - path : 0;
+	it->st = *st;
+}
+
+static const char *item_name(const struct item *it) {
+	return it->path + it->dir_len + (it->dir_len ? 1 : 0);
+}
+
+static int item_cmp(const void *a, const void *b) {
+	const struct item *x = a, *y = b;
+	return manifest_cmp(x->path, x->dir_len, item_name(x), y->path, y->dir_len, item_name(y));
+}
+
+/**
+ * Add everything below the directory path, which is open as fd. fd is closed.
+ */
+static void walk(int fd, char *path) {
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		fprintf(stderr, "Failed to read %s: %s\n", *path ? path : ".", strerror(errno));
+		exit(1);
+	}
+
+	size_t len = strlen(path);
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		if (snprintf(path + len, PATHLEN_MAX - len, "%s%s", len ? "/" : "", de->d_name) >= PATHLEN_MAX - (int)len) {
+			fprintf(stderr, "Path too long: %s/%s\n", path, de->d_name);
+			exit(1);
+		}
+
+		// the old manifest and the one we are writing
+		if (strcmp(path, MANIFEST_PATH) == 0 || strcmp(path, MANIFEST_TMP) == 0) {
+			path[len] = '\0';
+			continue;
+		}
+
+		struct stat st;
+		if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+		add_item(path, &st);
+
+		if (S_ISDIR(st.st_mode)) {
+			int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (sub == -1) {
+				fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+				exit(1);
+			}
+			walk(sub, path);
+		}
+
+		path[len] = '\0';
+	}
+
+	closedir(dp);
+}
+
+static void set_entry(struct manifest_entry *e, const struct stat *st) {
+	memset(e, 0, sizeof(*e));
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->blocks = st->st_blocks;
+	e->rdev = st->st_rdev;
+	e->atime = st->st_atim.tv_sec;
+	e->atime_nsec = st->st_atim.tv_nsec;
+	e->mtime = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->ctime = st->st_ctim.tv_sec;
+	e->ctime_nsec = st->st_ctim.tv_nsec;
+	e->mode = st->st_mode;
+	e->uid = st->st_uid;
+	e->gid = st->st_gid;
+	e->nlink = st->st_nlink;
+	e->blksize = st->st_blksize;
+}
+
+/**
+ * Set the range of the members of directory dir to e.
+ */
+static void set_members(struct manifest_entry *e, const char *dir) {
+	size_t len = strlen(dir);
+
+	// the first entry not before dir with the empty name
+	size_t lo = 0, hi = nitems;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct item *it = &items[mid];
+		if (manifest_cmp(it->path, it->dir_len, item_name(it), dir, len, "") < 0) lo = mid + 1;
+		else hi = mid;
+	}
+
+	size_t end = lo;
+	while (end < nitems && items[end].dir_len == len && memcmp(items[end].path, dir, len) == 0) end++;
+
+	e->first = lo;
+	e->count = end - lo;
+}
+
+static void write_all(FILE *f, const void *buf, size_t size) {
+	if (fwrite(buf, 1, size, f) != size) {
+		fprintf(stderr, "Failed to write %s: %s\n", MANIFEST_TMP, strerror(errno));
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <branch>\n", basename(argv[0]));
+		exit(1);
+	}
+	const char *branch = argv[1];
+
+	int bfd = open(branch, O_RDONLY | O_DIRECTORY);
+	if (bfd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+
+	// before the walk, it changes the root
+	if (mkdirat(bfd, METANAME, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create %s/%s: %s\n", branch, METANAME, strerror(errno));
+		exit(1);
+	}
+
+	struct stat root;
+	if (fstat(bfd, &root) == -1) {
+		fprintf(stderr, "Failed to stat %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+
+	char path[PATHLEN_MAX] = "";
+	int fd = openat(bfd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", branch, strerror(errno));
+		exit(1);
+	}
+	walk(fd, path);
+
+	if (nitems > UINT32_MAX) {
+		fprintf(stderr, "Too many paths on %s\n", branch);
+		exit(1);
+	}
+
+	qsort(items, nitems, sizeof(struct item), item_cmp);
+
+	struct manifest_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+	h.version = MANIFEST_VERSION;
+	h.count = nitems;
+	h.names = sizeof(h) + nitems * sizeof(struct manifest_entry);
+	h.names_size = 1; // "", the path of the root
+	set_entry(&h.root, &root);
+	set_members(&h.root, "");
+
+	size_t i;
+	for (i = 0; i < nitems; i++) h.names_size += strlen(items[i].path) + 1;
+
+	int tfd = openat(bfd, MANIFEST_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	FILE *f = tfd == -1 ? NULL : fdopen(tfd, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to create %s/%s: %s\n", branch, MANIFEST_TMP, strerror(errno));
+		exit(1);
+	}
+
+	write_all(f, &h, sizeof(h));
+
+	uint64_t name = 1;
+	for (i = 0; i < nitems; i++) {
+		struct manifest_entry e;
+		set_entry(&e, &items[i].st);
+		e.path = name;
+		e.dir_len = items[i].dir_len;
+		if (S_ISDIR(items[i].st.st_mode)) set_members(&e, items[i].path);
+		write_all(f, &e, sizeof(e));
+
+		name += strlen(items[i].path) + 1;
+	}
+
+	write_all(f, "", 1);
+	for (i = 0; i < nitems; i++) write_all(f, items[i].path, strlen(items[i].path) + 1);
+
+	if (fflush(f) || fsync(fileno(f)) || fclose(f)) {
+		fprintf(stderr, "Failed to write %s/%s: %s\n", branch, MANIFEST_TMP, strerror(errno));
+		exit(1);
+	}
+
+	if (renameat(bfd, MANIFEST_TMP, bfd, MANIFEST_PATH) == -1) {
+		fprintf(stderr, "Failed to rename %s/%s: %s\n", branch, MANIFEST_TMP, strerror(errno));
+		exit(1);
+	}
+
+	printf("%s: %zu paths\n", branch, nitems);
+
+	return 0;
+}
@@ -15,12 +15,18 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <pthread.h>
 
 #include "conf.h"
 #include "opts.h"
 #include "version.h"
 #include "string.h"
+#include "lookup_cache.h"
+#include "uring.h"
+#include "session.h"
+#include "copy_qos.h"
+#include "cow_utils.h"
 
 
 /**
@@ -97,17 +103,16 @@ int set_max_open_files(const char *arg)
 }
 
 /**
- * Set minimum file size for COWOLF
+ * Convert a size which can be suffixed by k, m, g or t.
+ * @return true on success, false if it is not a valid size.
  */
-int set_cowolf_file_size(const char *arg)
+static bool parse_size(const char *str, unsigned long *size)
 {
 	unsigned long sz;
 	char suf;
 
-	int cnt = sscanf(arg, "cowolf_file_size=%ld%c\n", &sz, &suf);
-	if ((cnt < 1) || (sz < 0)) {
-		goto error_out;
-	}
+	int cnt = sscanf(str, "%lu%c\n", &sz, &suf);
+	if (cnt < 1 || str[0] == '-') return false;
 
 	if (cnt == 2) {
 		switch(suf) {
@@ -130,26 +135,254 @@ int set_cowolf_file_size(const char *arg)
 			break;
 
 		default:
-			goto error_out;
+			return false;
 		}
 	}
 
-	uopt.cowolf_fsize_th = sz;
-	return 0;
+	*size = sz;
+	return true;
+}
 
-error_out:
-	fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
-		__func__, arg);
-	exit(1);
+/**
+ * Set minimum file size for COWOLF
+ */
+int set_cowolf_file_size(const char *arg)
+{
+	if (!parse_size(strchr(arg, '=') + 1, &uopt.cowolf_fsize_th)) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
 
 	return 0;
 }
 
+/**
+ * Set the block size of cowolf files, it has to be a power of two
+ */
+static void set_cowolf_block_size(const char *arg)
+{
+	unsigned long sz;
+	if (!parse_size(strchr(arg, '=') + 1, &sz) || sz == 0 || (sz & (sz - 1))) {
+		fprintf(stderr, "%s %s is not a power of two, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.cowolf_block_size = sz;
+	uopt.cowolf_enabled = true;
+}
+
+/**
+ * Set the time to live of the lookup cache
+ */
+static void set_lookup_cache(const char *arg)
+{
+	double ttl;
+	if (sscanf(arg, "lookup_cache=%lf\n", &ttl) != 1 || ttl < 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.lookup_cache_ttl = ttl;
+	uopt.lookup_cache_enabled = ttl > 0;
+}
+
+/**
+ * Set the time to live of the xattr cache
+ */
+static void set_xattr_cache(const char *arg)
+{
+	double ttl;
+	if (sscanf(arg, "xattr_cache=%lf\n", &ttl) != 1 || ttl < 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.xattr_cache_ttl = ttl;
+}
+
+/**
+ * Set the time the sum of the statfs() of the branches is cached
+ */
+static void set_statfs_cache(const char *arg)
+{
+	double ttl;
+	if (sscanf(arg, "statfs_cache=%lf\n", &ttl) != 1 || ttl < 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.statfs_cache_ttl = ttl;
+}
+
+/**
+ * Set the maximum number of entries of the lookup cache
+ */
+static void set_lookup_cache_size(const char *arg)
+{
+	unsigned int size;
+	if (sscanf(arg, "lookup_cache_size=%u\n", &size) != 1 || size == 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.lookup_cache_size = size;
+}
+
+/**
+ * Set the maximum number of names in the readdir cache
+ */
+static void set_readdir_cache(const char *arg)
+{
+	if (sscanf(arg, "readdir_cache=%lu\n", &uopt.readdir_cache_size) != 1) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+}
+
+/**
+ * Set the number of background copy-up threads, this needs cowolf
+ */
+static void set_async_copyup(const char *arg)
+{
+	unsigned int threads;
+	if (sscanf(arg, "async_copyup=%u\n", &threads) != 1 || threads == 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.async_copyup_threads = threads;
+	uopt.cowolf_enabled = true;
+}
+
+static void set_dir_copyup(const char *arg)
+{
+	unsigned int threads;
+	if (sscanf(arg, "dir_copyup=%u\n", &threads) != 1 || threads == 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.dir_copyup_threads = threads;
+}
+
+/**
+ * Set the depth of the io_uring rings, without a value the default one
+ */
+static void set_io_uring(const char *arg)
+{
+	unsigned int depth = DEFAULT_IO_URING_DEPTH;
+	if (strchr(arg, '=') != NULL &&
+	    (sscanf(arg, "io_uring=%u\n", &depth) != 1 || depth == 0 || depth > 4096)) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.io_uring_depth = depth;
+}
+
+/**
+ * Set the minimum or maximum number of idle worker threads
+ */
+static void set_idle_threads(const char *arg, unsigned int *threads)
+{
+	const char *value = strchr(arg, '=');
+	char *end;
+	unsigned long n = value ? strtoul(value + 1, &end, 10) : 0;
+	if (value == NULL || end == value + 1 || *end != '\0' || n == 0 || n > 100000) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	*threads = n;
+}
+
+/**
+ * Set the bandwidth limit of copy-ups, per branch
+ */
+static void set_copyup_bwlimit(const char *arg)
+{
+	if (!parse_size(strchr(arg, '=') + 1, &uopt.copyup_bwlimit)) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+}
+
+/**
+ * Set the I/O priority of copying threads, "idle" or a best-effort level
+ */
+static void set_copyup_ioprio(const char *arg)
+{
+	uopt.copyup_ioprio = copy_qos_parse_ioprio(strchr(arg, '=') + 1);
+	if (uopt.copyup_ioprio == -1) {
+		fprintf(stderr, "Invalid copyup_ioprio, it has to be idle or 0-7!\n");
+		exit(1);
+	}
+}
+
+/**
+ * Set the number of threads copying a large file in chunks
+ */
+static void set_copyup_streams(const char *arg)
+{
+	unsigned int streams;
+	if (sscanf(arg, "copyup_streams=%u\n", &streams) != 1 || streams == 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.copyup_streams = streams;
+}
+
+/**
+ * Set the number of branches the mount has room for
+ */
+static void set_max_branches(const char *arg)
+{
+	int n;
+	if (sscanf(arg, "max_branches=%d\n", &n) != 1 || n <= 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+
+	uopt.max_branches = n;
+}
+
+/**
+ * Set the size of the chunks of copyup_streams
+ */
+static void set_copyup_chunk(const char *arg)
+{
+	if (!parse_size(strchr(arg, '=') + 1, &uopt.copyup_chunk) || uopt.copyup_chunk == 0) {
+		fprintf(stderr, "%s Converting %s to number failed, aborting!\n",
+			__func__, arg);
+		exit(1);
+	}
+}
+
 uopt_t uopt;
 
 void uopt_init() {
 	memset(&uopt, 0, sizeof(uopt_t)); // initialize options with zeros first
 	uopt.cowolf_fsize_th = DEAFAUT_COWOLF_THSIZE;
+	uopt.lookup_cache_size = DEFAULT_LOOKUP_CACHE_SIZE;
+	uopt.min_idle_threads = DEFAULT_MIN_IDLE_THREADS;
+	uopt.max_idle_threads = DEFAULT_MAX_IDLE_THREADS;
+	uopt.copyup_ioprio = COPY_QOS_IOPRIO_NONE;
+	uopt.copyup_chunk = DEFAULT_COPYUP_CHUNK;
 
 	pthread_rwlock_init(&uopt.dbgpath_lock, NULL);
 }
@@ -216,7 +449,7 @@ char *add_trailing_slash(char *path) {
 
 /**
  * Add a given branch and its options to the array of available branches.
- * example branch string "branch1=RO" or "/path/path2=RW"
+ * example branch string "branch1=RO", "/path/path2=RW" or "image=IMM"
  */
 void add_branch(char *branch) {
 	uopt.branches = realloc(uopt.branches, (uopt.nbranches+1) * sizeof(branch_entry_t));
@@ -235,6 +468,7 @@ void add_branch(char *branch) {
 	// make_absolute() and add_trailing_slash() will corrupt our input (parse string)
 	uopt.branches[uopt.nbranches].path = strdup(res);
 	uopt.branches[uopt.nbranches].rw = 0;
+	uopt.branches[uopt.nbranches].imm = 0;
 
 	res = strsep(ptr, "=");
 	if (res) {
@@ -242,8 +476,11 @@ void add_branch(char *branch) {
 			uopt.branches[uopt.nbranches].rw = 1;
 		} else if (strcasecmp(res, "ro") == 0) {
 			// no action needed here
+		} else if (strcasecmp(res, "imm") == 0) {
+			// long timeouts only with -o lowlevel, see node_timeout()
+			uopt.branches[uopt.nbranches].imm = 1;
 		} else {
-			fprintf(stderr, "Failed to parse RO/RW flag, setting RO.\n");
+			fprintf(stderr, "Failed to parse RO/RW/IMM flag, setting RO.\n");
 			// no action needed here either
 		}
 	}
@@ -314,14 +551,43 @@ static char * get_opt_str(const char *arg, char *opt_name)
 	return str;
 }
 
+/**
+ * Add the patterns of -o direct_io_paths, separated by ROOT_SEP
+ */
+static void add_direct_io_paths(const char *arg)
+{
+	char *str = get_opt_str(arg, "direct_io_paths");
+	char *pattern;
+	int n = 0;
+
+	if (uopt.direct_io_paths) {
+		while (uopt.direct_io_paths[n]) n++;
+	}
+
+	while ((pattern = strsep(&str, ROOT_SEP)) != NULL) {
+		if (*pattern == '\0') continue;
+
+		char **paths = realloc(uopt.direct_io_paths, (n + 2) * sizeof(char *));
+		if (paths == NULL) {
+			fprintf(stderr, "realloc failed: %s Aborting!\n", strerror(errno));
+			exit(1);
+		}
+		paths[n++] = pattern;
+		paths[n] = NULL;
+		uopt.direct_io_paths = paths;
+	}
+}
+
 static void print_help(const char *progname) {
 	printf(
 	"unionfs-fuse version "VERSION"\n"
 	"by Radek Podgorny <radek@podgorny.cz>\n"
 	"\n"
-	"Usage: %s [options] branch[=RO/RW][:branch...] mountpoint\n"
+	"Usage: %s [options] branch[=RO/RW/IMM][:branch...] mountpoint\n"
 	"The first argument is a colon separated list of directories to merge\n"
 	"When neither RO nor RW is specified, selection defaults to RO.\n"
+	"IMM branches are read-only and never change, the kernel keeps\n"
+	"the cache of their files, with -o lowlevel also their attributes.\n"
 	"\n"
 	"general options:\n"
 	"    -d                     Enable debug output\n"
@@ -335,7 +601,7 @@ static void print_help(const char *progname) {
 	"    -o cow                 enable copy-on-write\n"
 	"                           mountpoint\n"
 	"    -o debug_file          file to write debug information into\n"
-	"    -o dirs=branch[=RO/RW][:branch...]\n"
+	"    -o dirs=branch[=RO/RW/IMM][:branch...]\n"
 	"                           alternate way to specify directories to merge\n"
 	"    -o hide_meta_files     \".unionfs\" is a secret directory not\n"
 	"                           visible by readdir(), and so are\n" 
@@ -344,8 +610,59 @@ static void print_help(const char *progname) {
 	"    -o relaxed_permissions Disable permissions checks, but only if\n"
 	"                           running neither as UID=0 or GID=0\n"
 	"    -o statfs_omit_ro      do not count blocks of ro-branches\n"
+	"    -o statfs_cache=seconds cache the statfs() sum of the branches\n"
+	"                           and refresh it in the background\n"
 	"    -o cowolf              enable COW-optimization for large files\n"
 	"    -o cowolf_file_size=size Minimum file size for COW-optimization\n"
+	"    -o cowolf_block_size=size copy and map cowolf files in blocks\n"
+	"                           of this size, implies cowolf\n"
+	"    -o lookup_cache=seconds cache branch lookups for this long\n"
+	"    -o lookup_cache_size=number\n"
+	"                           maximum number of cached lookups\n"
+	"    -o whiteout_index      keep an in-memory index of whiteouts\n"
+	"    -o readdir_cache=number cache merged directory listings, up to\n"
+	"                           this number of names in total\n"
+	"    -o lowlevel            use the low-level fuse interface\n"
+	"    -o async_copyup=threads copy cowolf files to the rw branch\n"
+	"                           in the background, implies cowolf\n"
+	"    -o io_uring[=depth]    do file I/O with io_uring rings of this\n"
+	"                           depth, 32 by default\n"
+	"    -o keep_cache_ro       keep the page cache of files on ro\n"
+	"                           branches between opens\n"
+	"    -o watch_branches      tell the kernel about changes done\n"
+	"                           directly on the branches, implies lowlevel\n"
+	"    -o stats_file=path     write the statistics to this file every\n"
+	"                           10 seconds, in the Prometheus text format\n"
+	"    -o dir_copyup=threads  copy directories of ro branches, which\n"
+	"                           are renamed, with this many threads\n"
+	"    -o redirect_dir        rename directories of ro branches without\n"
+	"                           copying them\n"
+	"    -o bloom_filter        keep Bloom filters of the paths on the\n"
+	"                           branches to skip lookups on them\n"
+	"    -o manifest            read the ro branches from the manifests\n"
+	"                           written by unionfs-mkmanifest\n"
+	"    -o clone_fd            read the requests with a /dev/fuse\n"
+	"                           descriptor per worker thread\n"
+	"    -o min_idle_threads=n  worker threads waiting for requests at\n"
+	"                           least (default 1)\n"
+	"    -o max_idle_threads=n  and at most (default 10)\n"
+	"    -o pin_threads         pin the worker threads to the CPUs\n"
+	"    -o copyup_bwlimit=rate copy up at most rate bytes per second\n"
+	"                           from each branch\n"
+	"    -o copyup_ioprio=idle|0-7 I/O priority of copy-ups\n"
+	"    -o copyup_streams=n    copy large files with n threads in\n"
+	"                           parallel, chunk by chunk\n"
+	"    -o copyup_chunk=size   size of these chunks (default 16M)\n"
+	"    -o direct_io_paths=pattern[:pattern...]\n"
+	"                           bypass the page cache of the union for\n"
+	"                           files matching one of the patterns\n"
+	"    -o xattr_cache=seconds cache getxattr() results for this long\n"
+	"    -o skip_capability     do not look for security.capability,\n"
+	"                           as if no file had one\n"
+	"    -o max_branches=n      room for this many branches, so that\n"
+	"                           unionfsctl -a can add branches later\n"
+	"    -o record_file=path    record all operations into this file,\n"
+	"                           for unionfs-replay\n"
 	"\n",
 	progname);
 }
@@ -354,6 +671,24 @@ static void print_help(const char *progname) {
   * This method is to post-process options once we know all of them
   */
 void unionfs_post_opts(void) {
+	if (uopt.max_idle_threads < uopt.min_idle_threads) {
+		fprintf(stderr, "max_idle_threads must not be less than min_idle_threads!\n");
+		exit(1);
+	}
+
+	// the low-level interface does not have them, see fuse_ll_ops.c
+	if (uopt.lowlevel && uopt.manifest) {
+		fprintf(stderr, "-o manifest cannot be used with -o lowlevel!\n");
+		exit(1);
+	}
+	if (uopt.lowlevel && uopt.max_branches > uopt.nbranches) {
+		fprintf(stderr, "-o max_branches cannot be used with -o lowlevel!\n");
+		exit(1);
+	}
+
+	// the per-branch arrays have room for the branches added later
+	if (uopt.max_branches < uopt.nbranches) uopt.max_branches = uopt.nbranches;
+
 	// chdir to the given chroot, we
 	if (uopt.chroot) {
 		int res = chdir(uopt.chroot);
@@ -393,7 +728,15 @@ void unionfs_post_opts(void) {
 			exit(1);
 		}
 		uopt.branches[i].fd = fd;
-		uopt.branches[i].path_len = strlen(path);
+		uopt.branches[i].path_len = strlen(uopt.branches[i].path);
+
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			fprintf(stderr, "\nFailed to stat %s: %s. Aborting!\n\n",
+				path, strerror(errno));
+			exit(1);
+		}
+		uopt.branches[i].dev = st.st_dev;
 	}
 }
 
@@ -449,6 +792,9 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 			printf("unionfs-fuse version: "VERSION"\n");
 #ifdef HAVE_XATTR
 			printf("(compiled with xattr support)\n");
+#endif
+#ifdef HAVE_IO_URING
+			printf("(compiled with io_uring support)\n");
 #endif
 			uopt.doexit = 1;
 			return 1;
@@ -458,6 +804,103 @@ int unionfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *out
 		case KEY_COWOLF_THSIZE:
 			set_cowolf_file_size(arg);
 			return 0;
+		case KEY_LOOKUP_CACHE:
+			set_lookup_cache(arg);
+			return 0;
+		case KEY_STATFS_CACHE:
+			set_statfs_cache(arg);
+			return 0;
+		case KEY_LOOKUP_CACHE_SIZE:
+			set_lookup_cache_size(arg);
+			return 0;
+		case KEY_WHITEOUT_INDEX:
+			uopt.whiteout_index = true;
+			return 0;
+		case KEY_READDIR_CACHE:
+			set_readdir_cache(arg);
+			return 0;
+		case KEY_LOWLEVEL:
+			uopt.lowlevel = true;
+			return 0;
+		case KEY_ASYNC_COPYUP:
+			set_async_copyup(arg);
+			return 0;
+		case KEY_COWOLF_BLOCK_SIZE:
+			set_cowolf_block_size(arg);
+			return 0;
+		case KEY_IO_URING:
+			set_io_uring(arg);
+			return 0;
+		case KEY_KEEP_CACHE_RO:
+			uopt.keep_cache_ro = true;
+			return 0;
+		case KEY_WATCH_BRANCHES:
+			uopt.watch_branches = true;
+			uopt.lowlevel = true;
+			return 0;
+		case KEY_DIR_COPYUP:
+			set_dir_copyup(arg);
+			return 0;
+		case KEY_REDIRECT_DIR:
+			uopt.redirect_dir = true;
+			return 0;
+		case KEY_BLOOM_FILTER:
+			uopt.bloom_filter = true;
+			return 0;
+		case KEY_MANIFEST:
+			uopt.manifest = true;
+			return 0;
+		case KEY_CLONE_FD:
+			uopt.clone_fd = true;
+			return 0;
+		case KEY_MIN_IDLE_THREADS:
+			set_idle_threads(arg, &uopt.min_idle_threads);
+			return 0;
+		case KEY_MAX_IDLE_THREADS:
+			set_idle_threads(arg, &uopt.max_idle_threads);
+			return 0;
+		case KEY_PIN_THREADS:
+			uopt.pin_threads = true;
+			return 0;
+		case KEY_COPYUP_BWLIMIT:
+			set_copyup_bwlimit(arg);
+			return 0;
+		case KEY_COPYUP_IOPRIO:
+			set_copyup_ioprio(arg);
+			return 0;
+		case KEY_COPYUP_STREAMS:
+			set_copyup_streams(arg);
+			return 0;
+		case KEY_COPYUP_CHUNK:
+			set_copyup_chunk(arg);
+			return 0;
+		case KEY_DIRECT_IO_PATHS:
+			add_direct_io_paths(arg);
+			return 0;
+		case KEY_XATTR_CACHE:
+			set_xattr_cache(arg);
+			return 0;
+		case KEY_SKIP_CAPABILITY:
+			uopt.skip_capability = true;
+			return 0;
+		case KEY_MAX_BRANCHES:
+			set_max_branches(arg);
+			return 0;
+		case KEY_STATS_FILE:
+			// fuse changes into / before we start writing it
+			uopt.stats_file = make_absolute(get_opt_str(arg, "stats_file"));
+			if (uopt.stats_file == NULL) {
+				fprintf(stderr, "Invalid stats_file path!\n");
+				exit(1);
+			}
+			return 0;
+		case KEY_RECORD_FILE:
+			uopt.record_file = make_absolute(get_opt_str(arg, "record_file"));
+			if (uopt.record_file == NULL) {
+				fprintf(stderr, "Invalid record_file path!\n");
+				exit(1);
+			}
+			return 0;
 		default:
  			uopt.retval = 1;
 			return 1;
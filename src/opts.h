@@ -34,6 +34,36 @@ typedef struct {
 	bool relaxed_permissions;
 	bool cowolf_enabled;
 	unsigned long cowolf_fsize_th;
+	unsigned long cowolf_block_size; // map cowolf files in blocks, 0 = off
+	bool lookup_cache_enabled;	// cache find_branch() results
+	double lookup_cache_ttl;	// seconds a cached lookup stays valid
+	unsigned int lookup_cache_size;	// max number of cached lookups
+	bool whiteout_index;		// keep whiteouts in memory
+	unsigned long readdir_cache_size; // max cached readdir names, 0 = off
+	bool lowlevel;			// use the low-level fuse interface
+	unsigned int async_copyup_threads; // background copy-up workers, 0 = off
+	unsigned int io_uring_depth;	// entries of the io_uring rings, 0 = off
+	bool keep_cache_ro;		// kernel keeps the cache of ro branch files
+	bool watch_branches;		// invalidate the kernel's caches on changes
+	char *stats_file;		// Prometheus text file of the statistics
+	unsigned int dir_copyup_threads; // threads copying directory trees
+	bool redirect_dir;		// rename directories by redirect records
+	double statfs_cache_ttl;	// seconds the statfs() sum is cached, 0 = off
+	bool bloom_filter;		// skip branches which do not have a path
+	bool manifest;			// answer lookups of ro branches from manifests
+	bool clone_fd;			// a /dev/fuse descriptor per worker thread
+	unsigned int min_idle_threads;	// workers waiting for requests at least
+	unsigned int max_idle_threads;	// and at most
+	bool pin_threads;		// pin the workers to the CPUs
+	unsigned long copyup_bwlimit;	// bytes/s copied up from a branch, 0 = no limit
+	int copyup_ioprio;		// I/O priority of copying threads
+	unsigned int copyup_streams;	// threads copying a large file, 0 = off
+	unsigned long copyup_chunk;	// bytes each of them copies at once
+	char **direct_io_paths;		// patterns of files opened with direct_io, NULL-terminated
+	double xattr_cache_ttl;		// seconds a cached getxattr() stays valid, 0 = off
+	bool skip_capability;		// there are no security.capability xattrs
+	int max_branches;		// room for branches added while mounted
+	char *record_file;		// operations recorded for unionfs-replay
 
 } uopt_t;
 
@@ -51,7 +81,36 @@ enum {
 	KEY_STATFS_OMIT_RO,
 	KEY_VERSION,
 	KEY_COWOLF,
-	KEY_COWOLF_THSIZE
+	KEY_COWOLF_THSIZE,
+	KEY_LOOKUP_CACHE,
+	KEY_LOOKUP_CACHE_SIZE,
+	KEY_WHITEOUT_INDEX,
+	KEY_READDIR_CACHE,
+	KEY_LOWLEVEL,
+	KEY_ASYNC_COPYUP,
+	KEY_COWOLF_BLOCK_SIZE,
+	KEY_IO_URING,
+	KEY_KEEP_CACHE_RO,
+	KEY_WATCH_BRANCHES,
+	KEY_STATS_FILE,
+	KEY_DIR_COPYUP,
+	KEY_REDIRECT_DIR,
+	KEY_STATFS_CACHE,
+	KEY_BLOOM_FILTER,
+	KEY_MANIFEST,
+	KEY_CLONE_FD,
+	KEY_MIN_IDLE_THREADS,
+	KEY_MAX_IDLE_THREADS,
+	KEY_PIN_THREADS,
+	KEY_COPYUP_BWLIMIT,
+	KEY_COPYUP_IOPRIO,
+	KEY_COPYUP_STREAMS,
+	KEY_COPYUP_CHUNK,
+	KEY_DIRECT_IO_PATHS,
+	KEY_XATTR_CACHE,
+	KEY_SKIP_CAPABILITY,
+	KEY_MAX_BRANCHES,
+	KEY_RECORD_FILE
 };
 
 
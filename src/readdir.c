@@ -20,33 +20,33 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/statvfs.h>
 #include <stdbool.h>
 
 #include "unionfs.h"
 #include "opts.h"
 #include "debug.h"
-#include "hashtable.h"
 #include "general.h"
 #include "string.h"
+#include "dir_cache.h"
+#include "redirect.h"
+#include "strset.h"
+#include "bloom.h"
+#include "manifest.h"
 
 
 /**
   * Hide metadata. As is causes a slight slowndown this is optional
   *
   */
-static bool hide_meta_files(int branch, const char *path, struct dirent *de)
+static bool hide_meta_files(const char *path, struct dirent *de)
 {
 
 	if (uopt.hide_meta_files == false) RETURN(false);
 
-	fprintf(stderr, "uopt.branches[branch].path = %s path = %s\n", uopt.branches[branch].path, path);
-	fprintf(stderr, "METANAME = %s, de->d_name = %s\n", METANAME, de->d_name);
-
-	// TODO Would it be faster to add hash comparison?
-
 	// HIDE out .unionfs directory
-	if (strcmp(uopt.branches[branch].path, path) == 0
+	if (strcmp(branch_relpath(path), ".") == 0
 	&& strcmp(METANAME, de->d_name) == 0) {
 		RETURN(true);
 	}
@@ -59,12 +59,25 @@ static bool hide_meta_files(int branch, const char *path, struct dirent *de)
 	RETURN(false);
 }
 
+/**
+ * Open the fuse path on branch as directory stream.
+ */
+static struct manifest_dir *opendir_branch(int branch, const char *path) {
+	char buf[PATHLEN_MAX];
+	const char *p = redirect_path(path, branch, buf);
+
+	// the branch certainly does not have the directory
+	if (!bloom_may_have(p, branch)) return NULL;
+
+	return manifest_opendir(branch, branch_relpath(p));
+}
+
 /**
  * Check if fname has a hiding tag and return its status.
  * Also, add this file and to the hiding hash table.
  * Warning: If fname has the tag, fname gets modified.
  */
-static bool is_hiding(struct hashtable *hides, char *fname) {
+static bool is_hiding(struct strset *hides, char *fname) {
 	DBG("%s\n", fname);
 
 	char *tag;
@@ -76,10 +89,7 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 		*tag = '\0'; // this modifies fname!
 
 		// add to hides (only if not there already)
-		if (!hashtable_search(hides, fname)) {
-			char *key = strdup(fname);
-			hashtable_insert(hides, key, key);
-		}
+		strset_add(hides, fname, NULL);
 
 		RETURN(true);
 	}
@@ -90,102 +100,246 @@ static bool is_hiding(struct hashtable *hides, char *fname) {
 /**
  * Read whiteout files
  */
-static void read_whiteouts(const char *path, struct hashtable *whiteouts, int branch) {
+static void read_whiteouts(const char *path, struct strset *whiteouts, int branch) {
 	DBG("%s\n", path);
 
+	char buf[PATHLEN_MAX];
 	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch].path, METADIR, path)) return;
+	if (BUILD_PATH(p, METADIR, redirect_path(path, branch, buf))) return;
 
-	DIR *dp = opendir(p);
+	struct manifest_dir *dp = manifest_opendir(branch, p);
 	if (dp == NULL) return;
 
 	struct dirent *de;
-	while ((de = readdir(dp)) != NULL) {
+	while ((de = manifest_readdir(dp)) != NULL) {
 		is_hiding(whiteouts, de->d_name);
 	}
 
-	closedir(dp);
+	manifest_closedir(dp);
 }
 
 /**
- * unionfs-fuse readdir function
+ * State of an open directory. Listings are streamed, every call of
+ * unionfs_readdir() only reads as many entries from the branches as fit into
+ * the buffer and continues where the previous call stopped. Offsets given to
+ * the filler are the index of the entry + 1.
  */
-int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	DBG("%s\n", path);
+typedef struct {
+	off_t offset;		// offset of the next entry to fill
+	int branch;		// branch we are reading, -1 before the first one
+	struct manifest_dir *dp; // directory of branch, NULL if not open
+	bool subdir_hidden;
 
-	(void)offset;
-	(void)fi;
-	int i = 0;
-	int rc = 0;
+	// entry that did not fit into the buffer anymore, filled first next time
+	const char *pending;
+	struct stat pending_st;
 
 	// we will store already added files here to handle same file names across different branches
-	struct hashtable *files = create_hashtable(16, string_hash, string_equal);
+	struct strset *files;
+	struct strset *whiteouts;
+
+	struct dir_listing *dl;		// listing built for the readdir cache
+	struct dir_listing *cached;	// listing from the readdir cache we fill from
+} dir_handle_t;
+
+static void dir_handle_clear(dir_handle_t *dh) {
+	if (dh->dp) manifest_closedir(dh->dp);
+	strset_free(dh->files);
+	strset_free(dh->whiteouts);
+	dir_listing_free(dh->dl);
+	dir_cache_put(dh->cached);
+
+	memset(dh, 0, sizeof(*dh));
+	dh->branch = -1;
+}
 
-	struct hashtable *whiteouts = NULL;
+/**
+ * Start reading the directory from the beginning.
+ */
+static int dir_handle_reset(dir_handle_t *dh) {
+	dir_handle_clear(dh);
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	dh->files = strset_new();
+	if (dh->files == NULL) RETURN(-ENOMEM);
 
-	bool subdir_hidden = false;
+	if (uopt.cow_enabled) {
+		dh->whiteouts = strset_new();
+		if (dh->whiteouts == NULL) RETURN(-ENOMEM);
+	}
 
-	for (i = 0; i < uopt.nbranches; i++) {
-		if (subdir_hidden) break;
+	// NULL if the readdir cache is disabled
+	dh->dl = dir_listing_new();
 
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
-			rc = -ENAMETOOLONG;
-			goto out;
-		}
+	RETURN(0);
+}
+
+/**
+ * Open the directory on the next branch that has it. dh->branch is
+ * uopt.nbranches once there are no more branches to read.
+ */
+static int open_next_branch(const char *path, dir_handle_t *dh) {
+	while (++dh->branch < uopt.nbranches) {
+		if (dh->subdir_hidden) break;
+
+		if (uopt.branches[dh->branch].path_len + strlen(path) >= PATHLEN_MAX) RETURN(-ENAMETOOLONG);
 
 		// check if branches below this branch are hidden
-		int res = path_hidden(path, i);
-		if (res < 0) {
-			rc = res; // error
-			goto out;
+		int res = path_hidden(path, dh->branch);
+		if (res < 0) RETURN(res);
+
+		if (res > 0) dh->subdir_hidden = true;
+
+		// must be done before reading, so that changes while we read
+		// invalidate the listing
+		if (dir_listing_stamp(dh->dl, path, dh->branch, res)) {
+			dir_listing_free(dh->dl);
+			dh->dl = NULL;
 		}
 
-		if (res > 0) subdir_hidden = true;
+		dh->dp = opendir_branch(dh->branch, path);
+		if (dh->dp) RETURN(0);
 
-		DIR *dp = opendir(p);
-		if (dp == NULL) {
-			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		if (uopt.cow_enabled) read_whiteouts(path, dh->whiteouts, dh->branch);
+	}
+
+	dh->branch = uopt.nbranches;
+	RETURN(0);
+}
+
+/**
+ * Fill entries until the buffer is full or all branches are read. Entries
+ * before skip are read, but not given to the filler.
+ */
+static int fill_entries(const char *path, dir_handle_t *dh, void *buf, fuse_fill_dir_t filler, off_t skip) {
+	if (dh->pending) {
+		if (filler(buf, dh->pending, &dh->pending_st, dh->offset + 1)) RETURN(0);
+		dh->pending = NULL;
+		dh->offset++;
+	}
+
+	while (dh->branch < uopt.nbranches) {
+		if (dh->dp == NULL) {
+			int res = open_next_branch(path, dh);
+			if (res) RETURN(res);
 			continue;
 		}
 
-		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
-			// already added in some other branch
-			if (hashtable_search(files, de->d_name) != NULL) continue;
+		struct dirent *de = manifest_readdir(dh->dp);
+		if (de == NULL) {
+			manifest_closedir(dh->dp);
+			dh->dp = NULL;
+			if (uopt.cow_enabled) read_whiteouts(path, dh->whiteouts, dh->branch);
+			continue;
+		}
 
-			// check if we need file hiding
-			if (uopt.cow_enabled) {
-				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
-			}
+		// check if we need file hiding
+		if (uopt.cow_enabled) {
+			// file should be hidden from the user
+			if (strset_find(dh->whiteouts, de->d_name) != NULL) continue;
+		}
 
-			if (hide_meta_files(i, p, de) == true) continue;
+		if (hide_meta_files(path, de) == true) continue;
 
-			// fill with something dummy, we're interested in key existence only
-			char *key = strdup(de->d_name);
-			hashtable_insert(files, key, key);
+		// hashed only once, if it was already added in some other branch
+		bool added;
+		const char *key = strset_add(dh->files, de->d_name, &added);
+		if (key == NULL) RETURN(-ENOMEM);
+		if (!added) continue;
 
-			struct stat st;
-			memset(&st, 0, sizeof(st));
-			st.st_ino = de->d_ino;
-			st.st_mode = de->d_type << 12;
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = de->d_ino;
+		st.st_mode = de->d_type << 12;
 
-			if (filler(buf, de->d_name, &st, 0)) break;
+		if (dir_listing_add(dh->dl, de->d_name, de->d_ino, de->d_type)) {
+			dir_listing_free(dh->dl);
+			dh->dl = NULL;
 		}
 
-		closedir(dp);
-		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
+		if (dh->offset < skip) {
+			dh->offset++;
+			continue;
+		}
+
+		if (filler(buf, de->d_name, &st, dh->offset + 1)) {
+			// the key stays valid as long as dh->files
+			dh->pending = key;
+			dh->pending_st = st;
+			RETURN(0);
+		}
+
+		dh->offset++;
 	}
 
-out:
-	hashtable_destroy(files, 0);
+	// everything was read, the listing is complete
+	dir_cache_store(path, dh->dl);
+	dh->dl = NULL;
 
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 0);
+	RETURN(0);
+}
 
-	RETURN(rc);
+/**
+ * unionfs-fuse opendir function
+ */
+int unionfs_opendir(const char *path, struct fuse_file_info *fi) {
+	DBG("%s\n", path);
+
+	dir_handle_t *dh = calloc(1, sizeof(dir_handle_t));
+	if (dh == NULL) RETURN(-ENOMEM);
+	dh->branch = -1;
+
+	fi->fh = (unsigned long)dh;
+	RETURN(0);
+}
+
+/**
+ * unionfs-fuse releasedir function
+ */
+int unionfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	DBG("%s\n", path);
+
+	dir_handle_t *dh = (dir_handle_t *)fi->fh;
+	dir_handle_clear(dh);
+	free(dh);
+
+	RETURN(0);
+}
+
+/**
+ * unionfs-fuse readdir function
+ */
+int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	DBG("%s %lld\n", path, (long long)offset);
+
+	dir_handle_t *dh = (dir_handle_t *)fi->fh;
+
+	// a cached listing can be filled from any offset, 0 means rewinddir()
+	if (dh->cached && offset != 0) {
+		dh->offset = dir_listing_fill(dh->cached, buf, filler, offset);
+		RETURN(0);
+	}
+
+	// start over on rewinddir() and seekdir(), entries before offset are
+	// read again but skipped
+	if (offset == 0 || offset != dh->offset) {
+		int res = dir_handle_reset(dh);
+		if (res) RETURN(res);
+
+		dh->cached = dir_cache_get(path);
+		if (dh->cached) {
+			dh->offset = dir_listing_fill(dh->cached, buf, filler, offset);
+			RETURN(0);
+		}
+	}
+
+	int res = fill_entries(path, dh, buf, filler, offset);
+	if (res) {
+		// do not cache a listing we could not complete
+		dir_listing_free(dh->dl);
+		dh->dl = NULL;
+	}
+
+	RETURN(res);
 }
 
 /**
@@ -203,17 +357,19 @@ int dir_not_empty(const char *path) {
 	int rc = 0;
 	int not_empty = 0;
 
-	struct hashtable *whiteouts = NULL;
+	struct strset *whiteouts = NULL;
 
-	if (uopt.cow_enabled) whiteouts = create_hashtable(16, string_hash, string_equal);
+	if (uopt.cow_enabled) {
+		whiteouts = strset_new();
+		if (whiteouts == NULL) RETURN(-ENOMEM);
+	}
 
 	bool subdir_hidden = false;
 
 	for (i = 0; i < uopt.nbranches; i++) {
 		if (subdir_hidden) break;
 
-		char p[PATHLEN_MAX];
-		if (BUILD_PATH(p, uopt.branches[i].path, path)) {
+		if (uopt.branches[i].path_len + strlen(path) >= PATHLEN_MAX) {
 			rc = -ENAMETOOLONG;
 			goto out;
 		}
@@ -227,14 +383,14 @@ int dir_not_empty(const char *path) {
 
 		if (res > 0) subdir_hidden = true;
 
-		DIR *dp = opendir(p);
+		struct manifest_dir *dp = opendir_branch(i, path);
 		if (dp == NULL) {
 			if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
 			continue;
 		}
 
 		struct dirent *de;
-		while ((de = readdir(dp)) != NULL) {
+		while ((de = manifest_readdir(dp)) != NULL) {
 			// Ignore . and ..
 			if ((strcmp(de->d_name, ".") == 0) ||  (strcmp(de->d_name, "..") == 0)) {
 				continue;
@@ -243,23 +399,23 @@ int dir_not_empty(const char *path) {
 			// check if we need file hiding
 			if (uopt.cow_enabled) {
 				// file should be hidden from the user
-				if (hashtable_search(whiteouts, de->d_name) != NULL) continue;
+				if (strset_find(whiteouts, de->d_name) != NULL) continue;
 			}
 
-			if (hide_meta_files(i, p, de) == true) continue;
+			if (hide_meta_files(path, de) == true) continue;
 
 			// When we arrive here, a valid entry was found
 			not_empty = 1;
-			closedir(dp);
+			manifest_closedir(dp);
 			goto out;
 		}
 
-		closedir(dp);
+		manifest_closedir(dp);
 		if (uopt.cow_enabled) read_whiteouts(path, whiteouts, i);
 	}
 
 out:
-	if (uopt.cow_enabled) hashtable_destroy(whiteouts, 0);
+	strset_free(whiteouts);
 
 	if (rc) RETURN(rc);
 
@@ -3,6 +3,8 @@
 
 #include <fuse.h>
 
+int unionfs_opendir(const char *path, struct fuse_file_info *fi);
+int unionfs_releasedir(const char *path, struct fuse_file_info *fi);
 int unionfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 int dir_not_empty(const char *path);
 
@@ -0,0 +1,214 @@
+/*
+* Description: record the file system operations for unionfs-replay
+*
+* License: BSD-style license
+*
+* Details:
+*	The statistics and the trace of trace.c tell how slow the operations
+*	were, but not what they were, so a slow workload cannot be run again
+*	against a changed unionfs. -o record_file=path writes every call of
+*	the fuse operations into this file: the operation, its paths and
+*	arguments, the file handle, the result, start time and latency.
+*	unionfs-replay then issues the same calls against another mount.
+*
+*	The entries are 56 bytes and the paths, they are collected in
+*	a buffer of RECORD_BUF_SIZE. A full buffer is written out by the
+*	thread whose entry does not fit anymore, while all others wait, and
+*	by a thread every RECORD_FLUSH_INTERVAL, so that a reader does not
+*	wait long for the last entries. Recording stops when a write fails.
+*	The file must not be in the union, the writes would record themselves.
+*
+*	What the arguments of an entry are:
+*	access: mask; chmod, create, mkdir: mode; create, open: flags too;
+*	chown: uid and gid; fsync: datasync; ioctl: cmd; mknod: mode and
+*	rdev; read, read_buf, write, write_buf: size and offset; readdir:
+*	offset; readlink, getxattr, listxattr: size; setxattr: size and
+*	flags; truncate: size; utimens: both times by record_time().
+*
+*	The entries are recorded by the timing wrappers of stats.c.
+*/
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "stats.h"
+#include "record.h"
+
+#define RECORD_BUF_SIZE (1024 * 1024)
+#define RECORD_FLUSH_INTERVAL 1	// seconds
+
+bool record_on;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int record_fd = -1;
+static char *buf;
+static size_t buf_used;
+static uint64_t record_start_ns;
+
+static int write_all(const void *data, size_t size) {
+	const char *p = data;
+	while (size > 0) {
+		ssize_t n = write(record_fd, p, size);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * Stop recording, with record_lock held.
+ */
+static void stop_locked(void) {
+	__atomic_store_n(&record_on, false, __ATOMIC_RELAXED);
+	close(record_fd);
+	record_fd = -1;
+}
+
+static void flush_locked(void) {
+	if (record_fd == -1 || buf_used == 0) return;
+
+	if (write_all(buf, buf_used) == -1) {
+		USYSLOG(LOG_ERR, "Failed to write %s: %s, recording stopped\n",
+			uopt.record_file, strerror(errno));
+		stop_locked();
+	}
+	buf_used = 0;
+}
+
+static void *flush_thread(void *arg) {
+	(void)arg;
+
+	while (1) {
+		sleep(RECORD_FLUSH_INTERVAL);
+
+		pthread_mutex_lock(&record_lock);
+		flush_locked();
+		bool done = record_fd == -1;
+		pthread_mutex_unlock(&record_lock);
+
+		if (done) break;
+	}
+
+	return NULL;
+}
+
+/**
+ * Start recording into the file of -o record_file. It is opened now, so
+ * that it is still written after unionfs_init() went into the chroot.
+ */
+int record_start(void) {
+	if (!uopt.record_file) RETURN(0);
+
+	buf = malloc(RECORD_BUF_SIZE);
+	if (buf == NULL) RETURN(-1);
+
+	record_fd = open(uopt.record_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (record_fd == -1) {
+		USYSLOG(LOG_ERR, "Failed to create %s: %s\n", uopt.record_file, strerror(errno));
+		RETURN(-1);
+	}
+
+	struct record_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+	h.version = RECORD_VERSION;
+	h.nops = UNIONFS_STATS_OPS;
+	h.time = time(NULL);
+
+	char names[UNIONFS_STATS_OPS][UNIONFS_STATS_NAME_LEN];
+	memset(names, 0, sizeof(names));
+	unsigned int i;
+	for (i = 0; i < UNIONFS_STATS_OPS; i++) {
+		strncpy(names[i], stats_op_name(i), UNIONFS_STATS_NAME_LEN - 1);
+	}
+
+	if (write_all(&h, sizeof(h)) == -1 || write_all(names, sizeof(names)) == -1) {
+		USYSLOG(LOG_ERR, "Failed to write %s: %s\n", uopt.record_file, strerror(errno));
+		goto err;
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, flush_thread, NULL) != 0) {
+		USYSLOG(LOG_ERR, "Failed to start the record flush thread\n");
+		goto err;
+	}
+	pthread_detach(thread);
+
+	record_start_ns = stats_now();
+	__atomic_store_n(&record_on, true, __ATOMIC_RELAXED);
+	RETURN(0);
+
+err:
+	close(record_fd);
+	record_fd = -1;
+	RETURN(-1);
+}
+
+/**
+ * Write out what is left, called when the file system is unmounted.
+ */
+void record_stop(void) {
+	pthread_mutex_lock(&record_lock);
+	if (record_fd != -1) {
+		flush_locked();
+		if (record_fd != -1) stop_locked();
+	}
+	pthread_mutex_unlock(&record_lock);
+}
+
+/**
+ * Record a call of op, which started at start and returned res. The
+ * arguments are described above, fi is the file handle if there is one.
+ */
+void record_op(enum unionfs_stats_op op, uint64_t start, int res, const char *path,
+		const char *path2, uint64_t arg0, uint64_t arg1, const struct fuse_file_info *fi) {
+	struct record_entry e;
+	memset(&e, 0, sizeof(e));
+	e.latency_ns = stats_now() - start;
+	e.start_ns = start > record_start_ns ? start - record_start_ns : 0;
+	e.fh = fi ? fi->fh : 0;
+	e.arg[0] = arg0;
+	e.arg[1] = arg1;
+	e.res = res;
+	e.op = op;
+	e.path_len = path ? strnlen(path, PATHLEN_MAX) : 0;
+	e.path2_len = path2 ? strnlen(path2, PATHLEN_MAX) : 0;
+
+	size_t size = sizeof(e) + e.path_len + e.path2_len;
+
+	pthread_mutex_lock(&record_lock);
+	if (record_fd == -1) goto out;
+
+	if (buf_used + size > RECORD_BUF_SIZE) flush_locked();
+	if (record_fd == -1) goto out;
+
+	memcpy(buf + buf_used, &e, sizeof(e));
+	if (e.path_len) memcpy(buf + buf_used + sizeof(e), path, e.path_len);
+	if (e.path2_len) memcpy(buf + buf_used + sizeof(e) + e.path_len, path2, e.path2_len);
+	buf_used += size;
+
+out:
+	pthread_mutex_unlock(&record_lock);
+}
+
+/**
+ * A time given to utimens as recorded.
+ */
+uint64_t record_time(const struct timespec *ts) {
+	if (ts->tv_nsec == UTIME_NOW) return RECORD_UTIME_NOW;
+	if (ts->tv_nsec == UTIME_OMIT) return RECORD_UTIME_OMIT;
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
@@ -0,0 +1,57 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "uioctl.h"
+
+#define RECORD_MAGIC "UFSRECRD"	// 8 bytes, not terminated
+#define RECORD_VERSION 1
+
+// arg of utimens for UTIME_NOW and UTIME_OMIT, others are in ns
+#define RECORD_UTIME_NOW UINT64_MAX
+#define RECORD_UTIME_OMIT (UINT64_MAX - 1)
+
+/**
+ * The file of -o record_file has the header, the names of its nops
+ * operations and then the entries, in the order the calls returned. Each
+ * entry is followed by path_len bytes of the path and path2_len bytes of
+ * the second path, neither terminated. Numbers are in the byte order of the
+ * host that wrote it, other hosts fail on the version.
+ */
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nops;		// followed by nops names of UNIONFS_STATS_NAME_LEN
+	int64_t time;		// when the recording started, seconds since the epoch
+};
+
+struct record_entry {
+	uint64_t start_ns;	// since the recording started
+	uint64_t latency_ns;
+	uint64_t fh;		// the file handle used or opened, 0 if none
+	uint64_t arg[2];	// depend on the operation, see record.c
+	int32_t res;
+	uint16_t op;		// enum unionfs_stats_op, by the names of the header
+	uint16_t path_len;
+	uint16_t path2_len;	// link, rename: to, symlink: the target, xattrs: the name
+	uint16_t pad[3];
+};
+
+struct fuse_file_info;
+
+extern bool record_on;
+
+int record_start(void);
+void record_stop(void);
+void record_op(enum unionfs_stats_op op, uint64_t start, int res, const char *path,
+	const char *path2, uint64_t arg0, uint64_t arg1, const struct fuse_file_info *fi);
+uint64_t record_time(const struct timespec *ts);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+* Description: rename directories of lower branches by redirect records
+*
+* License: BSD-style license
+*
+* Details:
+*	Without -o redirect_dir a directory of a read-only branch can only be
+*	renamed by copying the whole tree to the rw branch first, see
+*	copy_directory(). With it unionfs_rename() only creates the new,
+*	empty directory on the rw branch, hides the old one and leaves a
+*	record, the symlink "branch/.unionfs/newdir_REDIRECT~" to the path of
+*	the directory in the branches below, e.g. "/olddir". Lookups and
+*	listings of "/newdir/..." are then done at "/olddir/..." on these
+*	branches, see redirect_path().
+*	Directories of the rw branch merged with lower ones get a record when
+*	renamed as well. Their meta directory, with the whiteouts, cowolf maps
+*	and records of the members, is moved along.
+*
+*	A record applies to all branches below the one it is on. The records
+*	of all branches are read into memory on mount, records created or
+*	removed directly on the branches while mounted are not noticed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "string.h"
+#include "usyslog.h"
+#include "general.h"
+#include "findbranch.h"
+#include "cow_utils.h"
+#include "lookup_cache.h"
+#include "whiteout_index.h"
+#include "redirect.h"
+#include "bloom.h"
+
+// per branch, the fuse path of a renamed directory to its lower path
+static struct hashtable **records;
+static pthread_rwlock_t records_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int nrecords; // of all branches, read without the lock
+
+/**
+ * Set the record of path, must be called with the lock held.
+ */
+static int do_add(struct hashtable *h, const char *path, const char *lower) {
+	free(hashtable_remove(h, (void *)path));
+
+	char *key = strdup(path);
+	char *value = strdup(lower);
+	if (key == NULL || value == NULL || !hashtable_insert(h, key, value)) {
+		free(key);
+		free(value);
+		USYSLOG(LOG_ERR, "%s: out of memory, %s not redirected\n", __func__, path);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void update_count(void) {
+	unsigned int n = 0;
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) n += hashtable_count(records[i]);
+
+	__atomic_store_n(&nrecords, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Recursively walk the meta directory of a branch and add all records.
+ * @dir  - directory in the meta directory to scan
+ * @path - fuse path corresponding to dir
+ * @old  - path dir was renamed from, its records are removed, or NULL
+ */
+static int scan_records(struct hashtable *h, const char *dir, const char *path, const char *old) {
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		if (errno == ENOENT) return 0; // branch without meta directory
+		return -errno;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		char p[PATHLEN_MAX];
+		char member[PATHLEN_MAX];
+		char old_member[PATHLEN_MAX];
+		if (BUILD_PATH(p, dir, de->d_name)) continue;
+		if (BUILD_PATH(member, path, de->d_name)) continue;
+		if (old && BUILD_PATH(old_member, old, de->d_name)) continue;
+
+		char *tag = redirect_tag(member);
+		if (tag) {
+			char lower[PATHLEN_MAX];
+			ssize_t len = readlink(p, lower, PATHLEN_MAX - 1);
+			if (len <= 0) {
+				USYSLOG(LOG_WARNING, "Reading the redirect %s failed\n", p);
+				continue;
+			}
+			lower[len] = '\0';
+
+			*tag = '\0';
+			res = do_add(h, member, lower);
+			if (res) break;
+			if (old) {
+				*redirect_tag(old_member) = '\0';
+				free(hashtable_remove(h, old_member));
+			}
+			continue;
+		}
+
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = lstat(p, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir) {
+			res = scan_records(h, p, member, old ? old_member : NULL);
+			if (res) break;
+		}
+	}
+
+	closedir(dp);
+	return res;
+}
+
+/**
+ * Read the records of branch, replacing the ones it had before if it was
+ * added again while mounted. Must be called once we are in the chroot (if
+ * any), since branch paths are relative to it.
+ */
+int redirect_branch_init(int branch) {
+	if (!uopt.redirect_dir) RETURN(0);
+
+	struct hashtable *h = create_hashtable(16, string_hash, string_equal);
+	if (h == NULL) RETURN(-ENOMEM);
+
+	char metadir[PATHLEN_MAX];
+	if (BUILD_PATH(metadir, uopt.branches[branch].path, METADIR)) {
+		hashtable_destroy(h, 1);
+		RETURN(-ENAMETOOLONG);
+	}
+
+	int res = scan_records(h, metadir, "/", NULL);
+	if (res) {
+		USYSLOG(LOG_ERR, "Scanning redirects of %s failed: %s\n",
+			metadir, strerror(-res));
+		hashtable_destroy(h, 1);
+		RETURN(res);
+	}
+
+	DBG("branch %d: %u redirects\n", branch, hashtable_count(h));
+
+	pthread_rwlock_wrlock(&records_lock);
+	struct hashtable *old = records[branch];
+	records[branch] = h;
+	pthread_rwlock_unlock(&records_lock);
+
+	if (old) hashtable_destroy(old, 1);
+	RETURN(0);
+}
+
+/**
+ * Read the records of all branches. Must be called once we are in the
+ * chroot (if any), since branch paths are relative to it.
+ */
+int redirect_init(void) {
+	if (!uopt.redirect_dir) RETURN(0);
+
+	records = calloc(uopt.max_branches, sizeof(struct hashtable *));
+	if (records == NULL) RETURN(-ENOMEM);
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		int res = redirect_branch_init(i);
+		if (res) RETURN(res);
+	}
+
+	update_count();
+
+	RETURN(0);
+}
+
+/**
+ * The branches changed while mounted, count the records again.
+ */
+void redirect_branches_changed(void) {
+	if (!uopt.redirect_dir) return;
+
+	pthread_rwlock_rdlock(&records_lock);
+	update_count();
+	pthread_rwlock_unlock(&records_lock);
+}
+
+/**
+ * Check if there is any record at all.
+ */
+bool redirect_active(void) {
+	return uopt.redirect_dir && __atomic_load_n(&nrecords, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * Path of the fuse path on branch. That is path itself, unless path is in
+ * a directory renamed on an upper branch, then it is built in buf.
+ */
+const char *redirect_path(const char *path, int branch, char *buf) {
+	// the common case, nothing was ever renamed
+	if (!redirect_active()) return path;
+
+	const char *cur = path;
+
+	pthread_rwlock_rdlock(&records_lock);
+
+	int i;
+	for (i = 0; i < branch && i < uopt.nbranches; i++) {
+		struct hashtable *h = records[i];
+		if (hashtable_count(h) == 0) continue;
+
+		char p[PATHLEN_MAX];
+		size_t len = strlen(cur);
+		if (len >= PATHLEN_MAX) break;
+		memcpy(p, cur, len + 1);
+
+		// the longest prefix with a record wins, "/dir1/dir2", "/dir1"
+		while (len > 1) {
+			p[len] = '\0';
+
+			const char *lower = hashtable_search(h, p);
+			if (lower) {
+				char tmp[PATHLEN_MAX];
+				if (snprintf(tmp, PATHLEN_MAX, "%s%s", lower, cur + len) >= PATHLEN_MAX) break;
+				strcpy(buf, tmp);
+				cur = buf;
+				break;
+			}
+
+			while (len > 0 && p[len - 1] != '/') len--;
+			if (len > 0) len--;
+		}
+	}
+
+	pthread_rwlock_unlock(&records_lock);
+
+	return cur;
+}
+
+/**
+ * Check if a branch below branch_rw has the directory path, not hidden
+ * by a whiteout.
+ */
+static bool lower_dir(const char *path, int branch_rw) {
+	int i;
+	for (i = branch_rw; i < uopt.nbranches; i++) {
+		if (i > branch_rw) {
+			char buf[PATHLEN_MAX];
+			struct stat st;
+			const char *p = branch_relpath(redirect_path(path, i, buf));
+			if (fstatat(uopt.branches[i].fd, p, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+				return S_ISDIR(st.st_mode);
+			}
+		}
+
+		if (path_hidden(path, i) != 0) return false;
+	}
+
+	return false;
+}
+
+/**
+ * Build the path of the record of path, relative to the branch.
+ */
+static int record_path(char *p, const char *path) {
+	if (BUILD_PATH(p, METADIR, path)) return -ENAMETOOLONG;
+	if (strlen(p) + strlen(REDIRECTTAG) >= PATHLEN_MAX) return -ENAMETOOLONG;
+	strcat(p, REDIRECTTAG);
+	return 0;
+}
+
+/**
+ * Replace the record of from by one of to, must be called with the lock
+ * held.
+ * @lower - the lower path of to, NULL if there is none
+ */
+static int move_record(const char *from, const char *to, const char *lower, int branch_rw) {
+	int fd = uopt.branches[branch_rw].fd;
+	struct hashtable *h = records[branch_rw];
+	char p[PATHLEN_MAX];
+
+	if (hashtable_search(h, (void *)from)) {
+		if (record_path(p, from)) RETURN(-ENAMETOOLONG);
+		if (unlinkat(fd, p, 0) && errno != ENOENT) {
+			USYSLOG(LOG_WARNING, "Removing the redirect %s failed: %s\n", p, strerror(errno));
+		}
+		free(hashtable_remove(h, (void *)from));
+	}
+
+	if (lower == NULL) RETURN(0);
+
+	// the caller created the meta directory of to
+	if (record_path(p, to)) RETURN(-ENAMETOOLONG);
+
+	unlinkat(fd, p, 0); // just in case
+	if (symlinkat(lower, fd, p)) {
+		int err = errno;
+		USYSLOG(LOG_ERR, "Creating the redirect %s failed: %s\n", p, strerror(err));
+		RETURN(-err);
+	}
+
+	RETURN(do_add(h, to, lower));
+}
+
+/**
+ * Rename the directory from, found on branch, to to on branch_rw without
+ * copying it. to must not exist yet, its parent must exist on branch_rw.
+ * Returns 1 if from is no such directory or cannot be renamed like this,
+ * the caller then renames or copies it as usual.
+ */
+int redirect_rename(const char *from, const char *to, int branch, int branch_rw) {
+	DBG("%s -> %s\n", from, to);
+
+	if (!uopt.redirect_dir || !uopt.cow_enabled) RETURN(1);
+
+	// from must be on branch_rw or on a ro branch below it
+	if (branch < branch_rw) RETURN(1);
+	if (branch != branch_rw && uopt.branches[branch].rw) RETURN(1);
+
+	char buf[PATHLEN_MAX];
+	struct stat st;
+	const char *p = branch_relpath(redirect_path(from, branch, buf));
+	if (fstatat(uopt.branches[branch].fd, p, &st, AT_SYMLINK_NOFOLLOW)) RETURN(1);
+	if (!S_ISDIR(st.st_mode)) RETURN(1);
+
+	// replacing an existing directory is left to the usual rename
+	if (find_rorw_branch(to) != -1) RETURN(1);
+
+	int fd = uopt.branches[branch_rw].fd;
+
+	char meta_from[PATHLEN_MAX], meta_to[PATHLEN_MAX];
+	if (BUILD_PATH(meta_from, METADIR, from)) RETURN(-ENAMETOOLONG);
+	if (BUILD_PATH(meta_to, METADIR, to)) RETURN(-ENAMETOOLONG);
+	bool has_meta = path_is_dir_at(fd, meta_from) == IS_DIR;
+
+	bool merged = lower_dir(from, branch_rw);
+
+	// a directory of the rw branch alone has nothing to redirect
+	if (!merged && !has_meta) RETURN(1);
+
+	char lower[PATHLEN_MAX];
+	if (merged && snprintf(lower, PATHLEN_MAX, "%s",
+			redirect_path(from, branch_rw + 1, buf)) >= PATHLEN_MAX) {
+		RETURN(-ENAMETOOLONG);
+	}
+
+	if (create_metapath(to, branch_rw)) RETURN(-EIO);
+
+	// whiteouts and records of the members move along
+	if (has_meta) {
+		if (renameat(fd, meta_from, fd, meta_to)) {
+			// e.g. whiteouts of an earlier to
+			USYSLOG(LOG_WARNING, "Moving %s to %s failed: %s\n",
+				meta_from, meta_to, strerror(errno));
+			RETURN(1);
+		}
+	}
+
+	int res;
+	if (branch == branch_rw) {
+		bloom_add_tree(from, to, branch_rw);
+		res = renameat(fd, branch_relpath(from), fd, branch_relpath(to));
+	} else {
+		res = mkdirat(fd, branch_relpath(to), S_IRWXU);
+	}
+	if (res == -1) {
+		int err = errno;
+		if (has_meta && renameat(fd, meta_to, fd, meta_from)) {
+			USYSLOG(LOG_ERR, "%s: Moving %s back failed: %s\n",
+				__func__, meta_to, strerror(errno));
+		}
+		RETURN(-err);
+	}
+
+	if (branch != branch_rw) {
+		char dirp[PATHLEN_MAX]; // for setfile()
+		if (BUILD_PATH(dirp, uopt.branches[branch_rw].path, to) == 0) setfile(dirp, &st);
+	}
+
+	if (has_meta) whiteout_index_rename(from, to, branch_rw);
+
+	pthread_rwlock_wrlock(&records_lock);
+	if (has_meta) {
+		char metadir[PATHLEN_MAX];
+		if (BUILD_PATH(metadir, uopt.branches[branch_rw].path, meta_to) == 0) {
+			res = scan_records(records[branch_rw], metadir, to, from);
+			if (res) {
+				USYSLOG(LOG_ERR, "Scanning redirects of %s failed: %s\n",
+					metadir, strerror(-res));
+			}
+		}
+	}
+	res = move_record(from, to, merged ? lower : NULL, branch_rw);
+	update_count();
+	pthread_rwlock_unlock(&records_lock);
+
+	lookup_cache_invalidate_tree(from);
+	lookup_cache_invalidate_tree(to);
+
+	if (res) RETURN(res);
+
+	// the lower branches still have from
+	if (merged && hide_dir(from, branch_rw)) RETURN(-errno);
+
+	remove_hidden(to, branch_rw);
+
+	RETURN(0);
+}
+
+/**
+ * The directory path was removed from branch_rw, remove its record.
+ */
+void redirect_remove(const char *path, int branch_rw) {
+	if (!uopt.redirect_dir) return;
+
+	DBG("%s\n", path);
+
+	pthread_rwlock_wrlock(&records_lock);
+	move_record(path, NULL, NULL, branch_rw);
+	update_count();
+	pthread_rwlock_unlock(&records_lock);
+
+	lookup_cache_invalidate_tree(path);
+}
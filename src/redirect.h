@@ -0,0 +1,18 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef REDIRECT_H
+#define REDIRECT_H
+
+#include <stdbool.h>
+
+int redirect_init(void);
+int redirect_branch_init(int branch);
+void redirect_branches_changed(void);
+bool redirect_active(void);
+const char *redirect_path(const char *path, int branch, char *buf);
+int redirect_rename(const char *from, const char *to, int branch, int branch_rw);
+void redirect_remove(const char *path, int branch_rw);
+
+#endif
@@ -0,0 +1,698 @@
+/*
+* Description: replay the operations recorded by -o record_file
+*
+* License: BSD-style license
+*
+* Details:
+*	Issues the operations of a file written by -o record_file, see
+*	record.c, against a mounted union again, with system calls on the
+*	same paths below the mountpoint, and prints the latency percentiles
+*	of each operation next to the recorded ones. So a workload captured
+*	on a production mount can be run against a test mount of a changed
+*	unionfs, which should have the same branches as the recorded one
+*	had when recording started.
+*
+*	The operations are started in the order they were recorded to start,
+*	by <threads> threads at once, as fast as possible or at <speed>
+*	times the recorded pace. A file handle is opened again by the
+*	recorded open, create or opendir; the operations on it wait until
+*	it is, its release waits until they are done. Operations on handles
+*	opened before the recording started, flush, which the close of the
+*	release does, and ioctl are skipped. Written data is zeros. An
+*	operation which failed with another error than recorded, or failed
+*	but did not then or vice versa, is counted as differing. With more
+*	than one thread, operations on different paths overlap like they did
+*	on the recorded mount, but one might also overtake another it
+*	depended on, a lookup the create of its path for example.
+*
+*	Usage: unionfs-replay [-j threads] [-s speed] <record file> <mountpoint>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "conf.h"
+#include "unionfs.h"
+#include "record.h"
+
+#define REPLAY_SKIP INT_MIN		// result of an operation which was not replayed
+#define HANDLE_BUCKETS 4096		// a power of 2
+
+struct handle {
+	uint64_t fh;		// the recorded one
+	int fd;
+	DIR *dir;
+	bool ready;		// the open was replayed
+	int users;		// dispatched operations on it, which are not done
+	struct handle *next;
+};
+
+struct op;
+
+struct entry {
+	struct record_entry r;
+	size_t index;		// in the file
+	char *path;
+	char *path2;
+	const struct op *op;	// NULL if this version does not know it
+	struct handle *h;
+	bool opens;		// h is opened by this entry
+	bool closes;		// and closed by this one
+	uint64_t latency_ns;
+	int res;
+};
+
+struct worker {
+	pthread_t thread;
+	char path[2 * PATHLEN_MAX];
+	char path2[2 * PATHLEN_MAX];
+	void *buf;
+	size_t buf_size;
+};
+
+enum handle_use {
+	USE_NONE,
+	USE_OPENS,
+	USE_USES,
+	USE_CLOSES
+};
+
+struct op {
+	const char *name;
+	enum handle_use use;
+	int (*replay)(struct worker *w, struct entry *x);
+};
+
+static const char *mountpoint;
+static double speed;		// 0 = as fast as possible
+
+static struct entry *entries;
+static size_t nentries;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static size_t next_entry;
+static struct handle *handles[HANDLE_BUCKETS];
+static uint64_t start_ns;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int result(long res) {
+	return res == -1 ? -errno : (int)res;
+}
+
+/**
+ * The path of the entry below the mountpoint.
+ */
+static const char *mount_path(char *buf, const char *path) {
+	snprintf(buf, 2 * PATHLEN_MAX, "%s%s", mountpoint, path);
+	return buf;
+}
+
+/**
+ * A buffer of the calling worker for size bytes, aligned for O_DIRECT.
+ */
+static void *worker_buf(struct worker *w, size_t size) {
+	if (size <= w->buf_size) return w->buf;
+
+	void *buf;
+	if (posix_memalign(&buf, 4096, size)) return NULL;
+	memset(buf, 0, size);
+	free(w->buf);
+	w->buf = buf;
+	w->buf_size = size;
+	return buf;
+}
+
+#define P(x) mount_path(w->path, (x)->path)
+#define P2(x) mount_path(w->path2, (x)->path2)
+#define ARG(x, i) ((x)->r.arg[i])
+#define FD(x) ((x)->h->fd)
+
+static int do_access(struct worker *w, struct entry *x) {
+	return result(access(P(x), ARG(x, 0)));
+}
+
+static int do_chmod(struct worker *w, struct entry *x) {
+	return result(chmod(P(x), ARG(x, 0)));
+}
+
+static int do_chown(struct worker *w, struct entry *x) {
+	return result(lchown(P(x), ARG(x, 0), ARG(x, 1)));
+}
+
+static int do_create(struct worker *w, struct entry *x) {
+	FD(x) = open(P(x), ARG(x, 1) | O_CREAT, ARG(x, 0));
+	return result(FD(x) == -1 ? -1 : 0);
+}
+
+static int do_fsync(struct worker *w, struct entry *x) {
+	(void)w;
+	return result(ARG(x, 0) ? fdatasync(FD(x)) : fsync(FD(x)));
+}
+
+static int do_getattr(struct worker *w, struct entry *x) {
+	struct stat st;
+	return result(lstat(P(x), &st));
+}
+
+static int do_link(struct worker *w, struct entry *x) {
+	return result(link(P(x), P2(x)));
+}
+
+static int do_mkdir(struct worker *w, struct entry *x) {
+	return result(mkdir(P(x), ARG(x, 0)));
+}
+
+static int do_mknod(struct worker *w, struct entry *x) {
+	return result(mknod(P(x), ARG(x, 0), ARG(x, 1)));
+}
+
+static int do_open(struct worker *w, struct entry *x) {
+	FD(x) = open(P(x), ARG(x, 1));
+	return result(FD(x) == -1 ? -1 : 0);
+}
+
+static int do_opendir(struct worker *w, struct entry *x) {
+	x->h->dir = opendir(P(x));
+	return result(x->h->dir ? 0 : -1);
+}
+
+static int do_read(struct worker *w, struct entry *x) {
+	void *buf = worker_buf(w, ARG(x, 0));
+	if (ARG(x, 0) && buf == NULL) return -ENOMEM;
+	return result(pread(FD(x), buf, ARG(x, 0), ARG(x, 1)));
+}
+
+static int do_readdir(struct worker *w, struct entry *x) {
+	(void)w;
+	DIR *dir = x->h->dir;
+	if (dir == NULL) return -EBADF;
+
+	// the kernel reads the whole directory from offset 0 on
+	if (ARG(x, 0) == 0) rewinddir(dir);
+
+	errno = 0;
+	while (readdir(dir));
+	return -errno;
+}
+
+static int do_readlink(struct worker *w, struct entry *x) {
+	size_t size = ARG(x, 0);
+	void *buf = worker_buf(w, size);
+	if (size && buf == NULL) return -ENOMEM;
+
+	ssize_t res = readlink(P(x), buf, size);
+	return result(res == -1 ? -1 : 0);
+}
+
+static int do_release(struct worker *w, struct entry *x) {
+	(void)w;
+	return result(close(FD(x)));
+}
+
+static int do_releasedir(struct worker *w, struct entry *x) {
+	(void)w;
+	if (x->h->dir == NULL) return -EBADF;
+	return result(closedir(x->h->dir));
+}
+
+static int do_rename(struct worker *w, struct entry *x) {
+	return result(rename(P(x), P2(x)));
+}
+
+static int do_rmdir(struct worker *w, struct entry *x) {
+	return result(rmdir(P(x)));
+}
+
+static int do_statfs(struct worker *w, struct entry *x) {
+	struct statvfs st;
+	return result(statvfs(P(x), &st));
+}
+
+static int do_symlink(struct worker *w, struct entry *x) {
+	// the target is not a path of the union
+	return result(symlink(x->path2, P(x)));
+}
+
+static int do_truncate(struct worker *w, struct entry *x) {
+	return result(truncate(P(x), ARG(x, 0)));
+}
+
+static void set_time(struct timespec *ts, uint64_t t) {
+	ts->tv_sec = 0;
+	if (t == RECORD_UTIME_NOW) {
+		ts->tv_nsec = UTIME_NOW;
+	} else if (t == RECORD_UTIME_OMIT) {
+		ts->tv_nsec = UTIME_OMIT;
+	} else {
+		ts->tv_sec = t / 1000000000ULL;
+		ts->tv_nsec = t % 1000000000ULL;
+	}
+}
+
+static int do_unlink(struct worker *w, struct entry *x) {
+	return result(unlink(P(x)));
+}
+
+static int do_utimens(struct worker *w, struct entry *x) {
+	struct timespec ts[2];
+	set_time(&ts[0], ARG(x, 0));
+	set_time(&ts[1], ARG(x, 1));
+	return result(utimensat(AT_FDCWD, P(x), ts, AT_SYMLINK_NOFOLLOW));
+}
+
+static int do_write(struct worker *w, struct entry *x) {
+	void *buf = worker_buf(w, ARG(x, 0));
+	if (ARG(x, 0) && buf == NULL) return -ENOMEM;
+	return result(pwrite(FD(x), buf, ARG(x, 0), ARG(x, 1)));
+}
+
+#if defined HAVE_XATTR && !defined __APPLE__
+static int do_getxattr(struct worker *w, struct entry *x) {
+	size_t size = ARG(x, 0);
+	void *buf = worker_buf(w, size);
+	if (size && buf == NULL) return -ENOMEM;
+	return result(lgetxattr(P(x), x->path2, buf, size));
+}
+
+static int do_listxattr(struct worker *w, struct entry *x) {
+	size_t size = ARG(x, 0);
+	void *buf = worker_buf(w, size);
+	if (size && buf == NULL) return -ENOMEM;
+	return result(llistxattr(P(x), buf, size));
+}
+
+static int do_removexattr(struct worker *w, struct entry *x) {
+	return result(lremovexattr(P(x), x->path2));
+}
+
+static int do_setxattr(struct worker *w, struct entry *x) {
+	size_t size = ARG(x, 0);
+	void *buf = worker_buf(w, size);
+	if (size && buf == NULL) return -ENOMEM;
+	return result(lsetxattr(P(x), x->path2, buf, size, ARG(x, 1)));
+}
+#else
+#define do_getxattr NULL
+#define do_listxattr NULL
+#define do_removexattr NULL
+#define do_setxattr NULL
+#endif
+
+// by the names of stats.c, a NULL replay means the operation is skipped
+static const struct op ops[] = {
+	{ "access", USE_NONE, do_access },
+	{ "chmod", USE_NONE, do_chmod },
+	{ "chown", USE_NONE, do_chown },
+	{ "create", USE_OPENS, do_create },
+	{ "flush", USE_USES, NULL },
+	{ "fsync", USE_USES, do_fsync },
+	{ "getattr", USE_NONE, do_getattr },
+	{ "getxattr", USE_NONE, do_getxattr },
+	{ "ioctl", USE_NONE, NULL },
+	{ "link", USE_NONE, do_link },
+	{ "listxattr", USE_NONE, do_listxattr },
+	{ "mkdir", USE_NONE, do_mkdir },
+	{ "mknod", USE_NONE, do_mknod },
+	{ "open", USE_OPENS, do_open },
+	{ "opendir", USE_OPENS, do_opendir },
+	{ "read", USE_USES, do_read },
+	{ "read_buf", USE_USES, do_read },
+	{ "readdir", USE_USES, do_readdir },
+	{ "readlink", USE_NONE, do_readlink },
+	{ "release", USE_CLOSES, do_release },
+	{ "releasedir", USE_CLOSES, do_releasedir },
+	{ "removexattr", USE_NONE, do_removexattr },
+	{ "rename", USE_NONE, do_rename },
+	{ "rmdir", USE_NONE, do_rmdir },
+	{ "setxattr", USE_NONE, do_setxattr },
+	{ "statfs", USE_NONE, do_statfs },
+	{ "symlink", USE_NONE, do_symlink },
+	{ "truncate", USE_NONE, do_truncate },
+	{ "unlink", USE_NONE, do_unlink },
+	{ "utimens", USE_NONE, do_utimens },
+	{ "write", USE_USES, do_write },
+	{ "write_buf", USE_USES, do_write },
+};
+
+#define NOPS (sizeof(ops) / sizeof(ops[0]))
+
+static const struct op *find_op(const char *name) {
+	size_t i;
+	for (i = 0; i < NOPS; i++) {
+		if (strcmp(ops[i].name, name) == 0) return &ops[i];
+	}
+	return NULL;
+}
+
+static void read_all(FILE *f, void *buf, size_t size, const char *fn) {
+	if (fread(buf, 1, size, f) != size) {
+		fprintf(stderr, "%s: %s\n", fn, ferror(f) ? strerror(errno) : "truncated");
+		exit(1);
+	}
+}
+
+static char *read_path(FILE *f, size_t len, const char *fn) {
+	char *p = malloc(len + 1);
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	read_all(f, p, len, fn);
+	p[len] = '\0';
+	return p;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+	const struct entry *x = a, *y = b;
+	if (x->r.start_ns != y->r.start_ns) return x->r.start_ns < y->r.start_ns ? -1 : 1;
+	// in the order of the file, the results are recorded in that order
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Read the record file and put its entries into the order of their start.
+ */
+static void load(const char *fn) {
+	FILE *f = fopen(fn, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", fn, strerror(errno));
+		exit(1);
+	}
+
+	struct record_header h;
+	read_all(f, &h, sizeof(h), fn);
+	if (memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)) != 0 || h.version != RECORD_VERSION) {
+		fprintf(stderr, "%s is not a record file of this version\n", fn);
+		exit(1);
+	}
+
+	const struct op **file_ops = calloc(h.nops, sizeof(struct op *));
+	if (file_ops == NULL && h.nops) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	uint32_t i;
+	for (i = 0; i < h.nops; i++) {
+		char name[UNIONFS_STATS_NAME_LEN];
+		read_all(f, name, sizeof(name), fn);
+		name[UNIONFS_STATS_NAME_LEN - 1] = '\0';
+		file_ops[i] = find_op(name);
+	}
+
+	size_t size = 0;
+	struct record_entry r;
+	while (fread(&r, 1, sizeof(r), f) == sizeof(r)) {
+		if (nentries == size) {
+			size = size ? 2 * size : 4096;
+			entries = realloc(entries, size * sizeof(struct entry));
+			if (entries == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+
+		struct entry *x = &entries[nentries++];
+		memset(x, 0, sizeof(*x));
+		x->r = r;
+		x->index = nentries - 1;
+		x->path = read_path(f, r.path_len, fn);
+		x->path2 = read_path(f, r.path2_len, fn);
+		x->op = r.op < h.nops ? file_ops[r.op] : NULL;
+		x->res = REPLAY_SKIP;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "Failed to read %s: %s\n", fn, strerror(errno));
+		exit(1);
+	}
+
+	free(file_ops);
+	fclose(f);
+
+	qsort(entries, nentries, sizeof(struct entry), entry_cmp);
+}
+
+static struct handle **bucket(uint64_t fh) {
+	return &handles[(fh ^ (fh >> 12)) & (HANDLE_BUCKETS - 1)];
+}
+
+static struct handle *handle_find(uint64_t fh) {
+	struct handle *h;
+	for (h = *bucket(fh); h; h = h->next) {
+		if (h->fh == fh) return h;
+	}
+	return NULL;
+}
+
+static void handle_remove(struct handle *h) {
+	struct handle **p;
+	for (p = bucket(h->fh); *p; p = &(*p)->next) {
+		if (*p == h) {
+			*p = h->next;
+			return;
+		}
+	}
+}
+
+/**
+ * Connect the entry to its file handle, with lock held. Returns false if it
+ * is skipped.
+ */
+static bool dispatch(struct entry *x) {
+	if (x->op == NULL || x->op->replay == NULL) return false;
+
+	switch (x->op->use) {
+	case USE_NONE:
+		return true;
+	case USE_OPENS:
+		x->h = calloc(1, sizeof(struct handle));
+		if (x->h == NULL) return false;
+		x->h->fh = x->r.fh;
+		x->h->fd = -1;
+		x->h->users = 1;
+		x->opens = true;
+
+		// nothing was opened, so nothing uses it
+		if (x->r.res < 0) {
+			x->closes = true;
+			return true;
+		}
+
+		// an unreleased handle of the same number is gone
+		struct handle *old = handle_find(x->r.fh);
+		if (old) handle_remove(old);
+
+		x->h->next = *bucket(x->r.fh);
+		*bucket(x->r.fh) = x->h;
+		return true;
+	case USE_USES:
+	case USE_CLOSES:
+		x->h = handle_find(x->r.fh);
+		if (x->h == NULL) return false; // opened before the recording
+		x->h->users++;
+
+		if (x->op->use == USE_CLOSES) {
+			handle_remove(x->h);
+			x->closes = true;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+static void *worker_thread(void *arg) {
+	struct worker *w = arg;
+
+	while (1) {
+		pthread_mutex_lock(&lock);
+		if (next_entry == nentries) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		struct entry *x = &entries[next_entry++];
+		bool replay = dispatch(x);
+		pthread_mutex_unlock(&lock);
+
+		if (!replay) continue;
+
+		if (speed > 0) {
+			uint64_t at = start_ns + x->r.start_ns / speed;
+			struct timespec ts = {
+				.tv_sec = at / 1000000000ULL,
+				.tv_nsec = at % 1000000000ULL,
+			};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+
+		struct handle *h = x->h;
+		if (h && !x->opens) {
+			pthread_mutex_lock(&lock);
+			while (!h->ready || (x->closes && h->users > 1)) pthread_cond_wait(&cond, &lock);
+			pthread_mutex_unlock(&lock);
+		}
+
+		uint64_t start = now_ns();
+		x->res = x->op->replay(w, x);
+		x->latency_ns = now_ns() - start;
+
+		if (h) {
+			pthread_mutex_lock(&lock);
+			h->ready = true;
+			h->users--;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&lock);
+
+			if (x->opens && x->closes) {
+				if (h->fd != -1) close(h->fd);
+				if (h->dir) closedir(h->dir);
+			}
+			if (x->closes) free(h);
+		}
+	}
+
+	free(w->buf);
+	return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * The latency of quantile q of the n sorted ones, in us.
+ */
+static double quantile(const uint64_t *lat, size_t n, double q) {
+	size_t i = q * n;
+	if (i >= n) i = n - 1;
+	return lat[i] / 1000.0;
+}
+
+static void print_results(double seconds, unsigned int nthreads) {
+	uint64_t *lat = malloc(nentries * sizeof(uint64_t));
+	uint64_t *rec = malloc(nentries * sizeof(uint64_t));
+	if (nentries && (lat == NULL || rec == NULL)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	size_t replayed = 0;
+	printf("%-12s %10s %8s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+		"operation", "calls", "errors", "differ", "p50 us", "p90 us", "p99 us",
+		"p99.9 us", "max us", "rec p50", "rec p99");
+
+	size_t i, j;
+	for (i = 0; i < NOPS; i++) {
+		size_t n = 0, errors = 0, differ = 0;
+		for (j = 0; j < nentries; j++) {
+			const struct entry *x = &entries[j];
+			if (x->op != &ops[i] || x->res == REPLAY_SKIP) continue;
+
+			lat[n] = x->latency_ns;
+			rec[n] = x->r.latency_ns;
+			n++;
+			if (x->res < 0) errors++;
+			if ((x->res < 0 ? x->res : 0) != (x->r.res < 0 ? x->r.res : 0)) differ++;
+		}
+		if (n == 0) continue;
+		replayed += n;
+
+		qsort(lat, n, sizeof(uint64_t), u64_cmp);
+		qsort(rec, n, sizeof(uint64_t), u64_cmp);
+		printf("%-12s %10zu %8zu %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			ops[i].name, n, errors, differ,
+			quantile(lat, n, 0.5), quantile(lat, n, 0.9), quantile(lat, n, 0.99),
+			quantile(lat, n, 0.999), lat[n - 1] / 1000.0,
+			quantile(rec, n, 0.5), quantile(rec, n, 0.99));
+	}
+
+	printf("\n%zu of %zu operations replayed in %.3f s by %u threads, %.0f ops/s\n",
+		replayed, nentries, seconds, nthreads, seconds > 0 ? replayed / seconds : 0.0);
+
+	free(lat);
+	free(rec);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-j threads] [-s speed] <record file> <mountpoint>\n", prog);
+	fprintf(stderr, "       -j threads  replay with this many threads, 1 by default\n");
+	fprintf(stderr, "       -s speed    start the operations at this many times the\n");
+	fprintf(stderr, "                   recorded pace, as fast as possible by default\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *prog = basename(argv[0]);
+	unsigned int nthreads = 1;
+
+	int opt;
+	char *end;
+	while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+		switch (opt) {
+		case 'j': {
+			long n = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || n <= 0 || n > 4096) usage(prog);
+			nthreads = n;
+			break;
+		}
+		case 's':
+			speed = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || speed <= 0) usage(prog);
+			break;
+		default:
+			usage(prog);
+		}
+	}
+	if (argc - optind != 2) usage(prog);
+
+	mountpoint = argv[optind + 1];
+	struct stat st;
+	if (stat(mountpoint, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s is not a directory\n", mountpoint);
+		exit(1);
+	}
+
+	load(argv[optind]);
+
+	struct worker *workers = calloc(nthreads, sizeof(struct worker));
+	if (workers == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	start_ns = now_ns();
+
+	unsigned int i;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+			fprintf(stderr, "Failed to start a thread\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++) pthread_join(workers[i].thread, NULL);
+
+	print_results((now_ns() - start_ns) / 1e9, nthreads);
+
+	free(workers);
+	return 0;
+}
@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -33,6 +34,8 @@
 #include "string.h"
 #include "readdir.h"
 #include "usyslog.h"
+#include "lookup_cache.h"
+#include "redirect.h"
 
 /**
   * If the branch that has the directory to be removed is in read-write mode,
@@ -41,12 +44,11 @@
 static int rmdir_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) return ENAMETOOLONG;
-
-	int res = rmdir(p);
+	int res = unlinkat(uopt.branches[branch_rw].fd, branch_relpath(path), AT_REMOVEDIR);
 	if (res == -1) return errno;
 
+	lookup_cache_invalidate_tree(path);
+
 	return 0;
 }
 
@@ -99,13 +101,18 @@ int unionfs_rmdir(const char *path) {
 			res = EROFS;
 		} else {
 			res = rmdir_ro(path, i);
+			if (res == 0) collapse_whiteouts(path, find_lowest_rw_branch(i));
 		}
 	} else {
 		// read-write branch
 		res = rmdir_rw(path, i);
 		if (res == 0) {
+			// the lower directory must not show up again with path
+			redirect_remove(path, i);
+
 			// No need to be root, whiteouts are created as root!
 			maybe_whiteout(path, i, WHITEOUT_DIR);
+			collapse_whiteouts(path, i);
 		}
 	}
 
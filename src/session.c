@@ -0,0 +1,395 @@
+/*
+* Description: our own multithreaded fuse session loop
+*
+* License: BSD-style license
+*
+* Details:
+*	fuse_main() and fuse_session_loop_mt() of libfuse 2 read all requests
+*	from the one /dev/fuse descriptor of the mount, start a thread when
+*	none is idle and end threads while more than 10 are idle. On hosts
+*	with many cores the dispatch of the requests through that descriptor
+*	becomes the bottleneck. So we run the session loop ourselves:
+*
+*	-o clone_fd gives every worker its own descriptor, cloned from the
+*	one of the mount with FUSE_DEV_IOC_CLONE. The kernel then keeps the
+*	requests being processed per descriptor. If the kernel cannot clone
+*	the descriptor, the workers share the one of the mount.
+*
+*	-o min_idle_threads and -o max_idle_threads tell how many workers wait
+*	for requests at least and at most, the defaults are those of libfuse.
+*
+*	-o pin_threads pins the workers to the CPUs we may run on, one after
+*	the other in the order they are started.
+*
+*	Like in libfuse, the workers are cancelled once the session exits, as
+*	they might block in reading the device.
+*/
+
+#if defined __linux__
+	// for pthread_setaffinity_np()
+	#define _GNU_SOURCE
+	#include <sched.h>
+#endif
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "session.h"
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+// sizeof(struct fuse_in_header) of the kernel protocol
+#define FUSE_IN_HEADER_SIZE 40
+
+typedef struct worker {
+	pthread_t thread;
+	struct fuse_chan *ch;	// cloned channel, NULL if the mount's one is used
+	char *buf;
+	int cpu;		// to pin to, -1 if not pinned
+	struct worker *prev, *next;
+} worker_t;
+
+static struct {
+	pthread_mutex_t lock;
+	struct fuse_session *se;
+	struct fuse_chan *ch;	// of the mount
+	size_t bufsize;
+	worker_t *workers;	// NULL terminated list
+	int idle;		// workers waiting for a request
+	int started;		// workers started so far, for pinning
+	bool exit;		// the loop ends, workers are joined by it
+	int error;
+	sem_t finish;
+#ifdef __linux__
+	cpu_set_t cpus;		// we may run on
+#endif
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int chan_receive(struct fuse_chan **chp, char *buf, size_t size) {
+	struct fuse_chan *ch = *chp;
+	struct fuse_session *se = fuse_chan_data(ch);
+
+	ssize_t res;
+	do {
+		// ENOENT means the request was interrupted, it is gone
+		res = read(fuse_chan_fd(ch), buf, size);
+	} while (res == -1 && errno == ENOENT && !fuse_session_exited(se));
+
+	int err = errno;
+	if (fuse_session_exited(se)) return 0;
+	if (res == -1) {
+		// the file system was unmounted
+		if (err == ENODEV) {
+			fuse_session_exit(se);
+			return 0;
+		}
+		if (err != EINTR && err != EAGAIN) {
+			USYSLOG(LOG_ERR, "Reading the fuse device failed: %s\n", strerror(err));
+		}
+		return -err;
+	}
+
+	if (res < FUSE_IN_HEADER_SIZE) {
+		USYSLOG(LOG_ERR, "Short read on the fuse device\n");
+		return -EIO;
+	}
+
+	return res;
+}
+
+static int chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count) {
+	if (iov == NULL) return 0;
+
+	ssize_t res = writev(fuse_chan_fd(ch), iov, count);
+	if (res == -1) {
+		int err = errno;
+		// ENOENT means the request was interrupted
+		if (err != ENOENT && !fuse_session_exited(fuse_chan_data(ch))) {
+			USYSLOG(LOG_ERR, "Writing the fuse device failed: %s\n", strerror(err));
+		}
+		return -err;
+	}
+
+	return 0;
+}
+
+static void chan_destroy(struct fuse_chan *ch) {
+	close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops chan_ops = {
+	.receive = chan_receive,
+	.send = chan_send,
+	.destroy = chan_destroy,
+};
+
+/**
+ * Clone the channel of the mount, NULL if the kernel cannot.
+ */
+static struct fuse_chan *clone_chan(void) {
+	int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd == -1) return NULL;
+
+	uint32_t master = fuse_chan_fd(pool.ch);
+	if (ioctl(fd, FUSE_DEV_IOC_CLONE, &master) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	struct fuse_chan *ch = fuse_chan_new(&chan_ops, fd, pool.bufsize, pool.se);
+	if (ch == NULL) close(fd);
+
+	return ch;
+}
+
+static void worker_free(worker_t *w) {
+	if (w->ch) fuse_chan_destroy(w->ch);
+	free(w->buf);
+	free(w);
+}
+
+/**
+ * Remove w from the list, pool.lock must be held.
+ */
+static void worker_unlink(worker_t *w) {
+	if (w->prev) w->prev->next = w->next;
+	else pool.workers = w->next;
+	if (w->next) w->next->prev = w->prev;
+}
+
+static int start_worker(void);
+
+static void *worker_main(void *arg) {
+	worker_t *w = arg;
+
+#ifdef __linux__
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+
+	struct fuse_chan *ch = w->ch ? w->ch : pool.ch;
+	while (!fuse_session_exited(pool.se)) {
+		struct fuse_buf fbuf = {
+			.mem = w->buf,
+			.size = pool.bufsize,
+		};
+		struct fuse_chan *rch = ch;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int res = fuse_session_receive_buf(pool.se, &fbuf, &rch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res == -EINTR) continue;
+		if (res <= 0) {
+			if (res < 0) {
+				fuse_session_exit(pool.se);
+				pool.error = -1;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		if (pool.exit) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+
+		// keep enough workers waiting for the next requests
+		pool.idle--;
+		while (pool.idle < (int)uopt.min_idle_threads) {
+			if (start_worker()) break;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		fuse_session_process_buf(pool.se, &fbuf, rch);
+
+		pthread_mutex_lock(&pool.lock);
+		if (pool.exit) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+
+		// too many are waiting, end this one
+		if (pool.idle >= (int)uopt.max_idle_threads) {
+			worker_unlink(w);
+			pthread_mutex_unlock(&pool.lock);
+
+			pthread_detach(w->thread);
+			worker_free(w);
+			return NULL;
+		}
+		pool.idle++;
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	sem_post(&pool.finish);
+	return NULL;
+}
+
+/**
+ * Start another idle worker, pool.lock must be held.
+ */
+static int start_worker(void) {
+	worker_t *w = calloc(1, sizeof(worker_t));
+	if (w == NULL) RETURN(-ENOMEM);
+
+	w->cpu = -1;
+#ifdef __linux__
+	if (uopt.pin_threads && CPU_COUNT(&pool.cpus) > 0) {
+		// the n-th CPU of the set, for the n-th worker
+		int n = pool.started % CPU_COUNT(&pool.cpus);
+		int cpu;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &pool.cpus)) continue;
+			if (n-- == 0) break;
+		}
+		w->cpu = cpu;
+	}
+#endif
+
+	if (uopt.clone_fd) w->ch = clone_chan();
+
+	w->buf = malloc(pool.bufsize);
+	if (w->buf == NULL) {
+		worker_free(w);
+		RETURN(-ENOMEM);
+	}
+
+	// the signals ending the session are handled by the thread of the loop
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	int res = pthread_create(&w->thread, NULL, worker_main, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (res) {
+		USYSLOG(LOG_ERR, "Starting a worker thread failed: %s\n", strerror(res));
+		worker_free(w);
+		RETURN(-res);
+	}
+
+	w->next = pool.workers;
+	if (w->next) w->next->prev = w;
+	pool.workers = w;
+	pool.idle++;
+	pool.started++;
+
+	RETURN(0);
+}
+
+/**
+ * Replacement of fuse_session_loop_mt().
+ */
+int session_loop(struct fuse_session *se, struct fuse_chan *ch) {
+	pool.se = se;
+	pool.ch = ch;
+	pool.bufsize = fuse_chan_bufsize(ch);
+	pool.error = 0;
+	pool.exit = false;
+	sem_init(&pool.finish, 0, 0);
+
+#ifdef __linux__
+	if (uopt.pin_threads && sched_getaffinity(0, sizeof(pool.cpus), &pool.cpus) == -1) {
+		USYSLOG(LOG_WARNING, "Not pinning the worker threads, getting the CPUs failed: %s\n",
+			strerror(errno));
+		CPU_ZERO(&pool.cpus);
+	}
+#endif
+
+	pthread_mutex_lock(&pool.lock);
+	int res = 0;
+	while (pool.idle < (int)uopt.min_idle_threads) {
+		res = start_worker();
+		if (res) break;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (res == 0) {
+		// the signal handlers are called on this thread
+		while (sem_wait(&pool.finish) == -1 && errno == EINTR) {
+			if (fuse_session_exited(se)) break;
+		}
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.exit = true;
+	worker_t *w;
+	for (w = pool.workers; w; w = w->next) pthread_cancel(w->thread);
+	pthread_mutex_unlock(&pool.lock);
+
+	while (pool.workers) {
+		w = pool.workers;
+		pthread_join(w->thread, NULL);
+		pool.workers = w->next;
+		worker_free(w);
+	}
+	pool.idle = 0;
+	sem_destroy(&pool.finish);
+
+	fuse_session_reset(se);
+	return res ? -1 : pool.error;
+}
+
+/**
+ * Replacement of fuse_main() for the high-level interface.
+ */
+int session_main(struct fuse_args *args, const struct fuse_operations *op) {
+	char *mountpoint;
+	int multithreaded, foreground;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+
+	struct fuse_chan *ch = fuse_mount(mountpoint, args);
+	if (ch == NULL) {
+		free(mountpoint);
+		return 1;
+	}
+
+	int res = 1;
+	struct fuse *f = fuse_new(ch, args, op, sizeof(*op), NULL);
+	if (f) {
+		struct fuse_session *se = fuse_get_session(f);
+		if (fuse_daemonize(foreground) == 0 && fuse_set_signal_handlers(se) == 0) {
+			if (!multithreaded) {
+				res = fuse_loop(f);
+			} else if (fuse_start_cleanup_thread(f) == 0) {
+				res = session_loop(se, ch);
+				fuse_stop_cleanup_thread(f);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+	}
+
+	fuse_unmount(mountpoint, ch);
+	if (f) fuse_destroy(f);
+	free(mountpoint);
+
+	return res ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+// those of fuse_session_loop_mt()
+#define DEFAULT_MIN_IDLE_THREADS 1
+#define DEFAULT_MAX_IDLE_THREADS 10
+
+int session_loop(struct fuse_session *se, struct fuse_chan *ch);
+int session_main(struct fuse_args *args, const struct fuse_operations *op);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+* Description: statfs() of the union, summed up over the branches
+*
+* License: BSD-style license
+*
+* Details:
+*	The block and file counts of all branches are added up, each file
+*	system only once. The device of each branch is taken when it is
+*	opened, see parse_branches().
+*
+*	A statfs() of every branch is still needed for each call, which
+*	monitoring agents and df in a loop do a lot, and a slow network
+*	file system makes them all wait. With -o statfs_cache=<seconds> the
+*	sum is cached for this long. Once it is older, the callers still
+*	get it while a thread refreshes it in the background. If refreshing
+*	fails, the last sum is kept. Only the calls before the first sum was
+*	cached sum up the branches themselves.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#ifdef linux
+	#include <sys/vfs.h>
+#endif
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "stats.h"
+#include "statfs.h"
+#include "branches.h"
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+// protected by cache_lock
+static bool cache_valid;
+static struct statvfs cache;
+static uint64_t cache_time;	// when cache was summed up, CLOCK_MONOTONIC
+static bool refresh;		// the refresh thread shall sum up again
+static bool refresh_started;
+
+/**
+ * Wrapper function to convert the result of statfs() to statvfs()
+ * libfuse uses statvfs, since it conforms to POSIX. Unfortunately,
+ * glibc's statvfs parses /proc/mounts, which then results in reading
+ * the filesystem itself again - which would result in a deadlock.
+ * TODO: BSD/MacOSX
+ */
+static int statvfs_local(int fd, struct statvfs *stbuf) {
+#ifdef linux
+	/* glibc's statvfs walks /proc/mounts and stats entries found there
+	 * in order to extract their mount flags, which may deadlock if they
+	 * are mounted under the unionfs. As a result, we have to do this
+	 * ourselves.
+	 */
+	struct statfs stfs;
+	int res = fstatfs(fd, &stfs);
+	if (res == -1) RETURN(res);
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = stfs.f_bsize;
+	if (stfs.f_frsize) {
+		stbuf->f_frsize = stfs.f_frsize;
+	} else {
+		stbuf->f_frsize = stfs.f_bsize;
+	}
+	stbuf->f_blocks = stfs.f_blocks;
+	stbuf->f_bfree = stfs.f_bfree;
+	stbuf->f_bavail = stfs.f_bavail;
+	stbuf->f_files = stfs.f_files;
+	stbuf->f_ffree = stfs.f_ffree;
+	stbuf->f_favail = stfs.f_ffree; /* nobody knows */
+
+	/* We don't worry about flags, exactly because this would
+	 * require reading /proc/mounts, and avoiding that and the
+	 * resulting deadlocks is exactly what we're trying to avoid
+	 * by doing this rather than using statvfs.
+	 */
+	stbuf->f_flag = 0;
+	stbuf->f_namemax = stfs.f_namelen;
+
+	RETURN(0);
+#else
+	RETURN(fstatvfs(fd, stbuf));
+#endif
+}
+
+/**
+ * Sum up the statfs() of all branches.
+ *
+ * Note: We do not set the fsid, as fuse ignores it anyway.
+ */
+static int statfs_sum(struct statvfs *stbuf) {
+	int i = 0;
+	for (i = 0; i < uopt.nbranches; i++) {
+		struct statvfs stb;
+		int res = statvfs_local(uopt.branches[i].fd, &stb);
+		if (res == -1) RETURN(-errno);
+
+		if (i == 0) {
+			memcpy(stbuf, &stb, sizeof(*stbuf));
+			stbuf->f_fsid = stb.f_fsid << 8;
+			continue;
+		}
+
+		// Eliminate same devices
+		int j = 0;
+		for (j = 0; j < i; j ++) {
+			if (uopt.branches[i].dev == uopt.branches[j].dev) break;
+		}
+
+		if (j == i) {
+			// Filesystem can have different block sizes -> normalize to first's block size
+			double ratio = (double)stb.f_bsize / (double)stbuf->f_bsize;
+
+			if (uopt.branches[i].rw) {
+				stbuf->f_blocks += stb.f_blocks * ratio;
+				stbuf->f_bfree += stb.f_bfree * ratio;
+				stbuf->f_bavail += stb.f_bavail * ratio;
+
+				stbuf->f_files += stb.f_files;
+				stbuf->f_ffree += stb.f_ffree;
+				stbuf->f_favail += stb.f_favail;
+			} else if (!uopt.statfs_omit_ro) {
+				// omitting the RO branches is not correct regarding
+				// the block counts but it actually fixes the
+				// percentage of free space. so, let the user decide.
+				stbuf->f_blocks += stb.f_blocks * ratio;
+				stbuf->f_files  += stb.f_files;
+			}
+
+			if (!(stb.f_flag & ST_RDONLY)) stbuf->f_flag &= ~ST_RDONLY;
+			if (!(stb.f_flag & ST_NOSUID)) stbuf->f_flag &= ~ST_NOSUID;
+
+			if (stb.f_namemax < stbuf->f_namemax) stbuf->f_namemax = stb.f_namemax;
+		}
+	}
+
+	RETURN(0);
+}
+
+static void cache_store(const struct statvfs *stbuf) {
+	cache = *stbuf;
+	cache_time = stats_now();
+	cache_valid = true;
+}
+
+static void *refresh_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&cache_lock);
+	while (1) {
+		while (!refresh) pthread_cond_wait(&cache_cond, &cache_lock);
+		pthread_mutex_unlock(&cache_lock);
+
+		struct statvfs stbuf;
+		branches_enter();
+		int res = statfs_sum(&stbuf);
+		branches_leave();
+
+		pthread_mutex_lock(&cache_lock);
+		if (res == 0) cache_store(&stbuf);
+		else USYSLOG(LOG_WARNING, "Refreshing the statfs cache failed: %s\n", strerror(-res));
+		refresh = false;
+	}
+
+	return NULL;
+}
+
+/**
+ * Ask the refresh thread to sum up again, cache_lock must be held.
+ */
+static void request_refresh(void) {
+	if (refresh) return;
+
+	if (!refresh_started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, refresh_thread, NULL)) {
+			USYSLOG(LOG_WARNING, "Failed to start the statfs refresh thread\n");
+			return;
+		}
+		pthread_detach(thread);
+		refresh_started = true;
+	}
+
+	refresh = true;
+	pthread_cond_signal(&cache_cond);
+}
+
+int statfs_get(struct statvfs *stbuf) {
+	if (uopt.statfs_cache_ttl == 0) return statfs_sum(stbuf);
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache_valid) {
+		*stbuf = cache;
+		if (stats_now() - cache_time > uopt.statfs_cache_ttl * 1e9) request_refresh();
+		pthread_mutex_unlock(&cache_lock);
+		RETURN(0);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// nothing to give out yet
+	int res = statfs_sum(stbuf);
+	if (res) RETURN(res);
+
+	pthread_mutex_lock(&cache_lock);
+	cache_store(stbuf);
+	pthread_mutex_unlock(&cache_lock);
+
+	RETURN(0);
+}
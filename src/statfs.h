@@ -0,0 +1,12 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef STATFS_H
+#define STATFS_H
+
+struct statvfs;
+
+int statfs_get(struct statvfs *stbuf);
+
+#endif
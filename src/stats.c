@@ -0,0 +1,573 @@
+/*
+* Description: statistics of the file system operations
+*
+* License: BSD-style license
+*
+* Details:
+*	Each thread counts into its own block of counters, so the hot paths
+*	neither lock nor share cache lines. The blocks are on a list, which
+*	is only locked when a thread starts or exits and when the counters
+*	are summed up for the UNIONFS_STATS ioctl (unionfsctl -s) or for
+*	the Prometheus text file of -o stats_file. A thread only updates its
+*	own counters, with relaxed atomic stores so the readers never see
+*	torn values. When a thread exits its counts are added to those of
+*	the exited threads.
+*
+*	The operations are timed by wrappers around the fuse operations,
+*	which the low-level interface calls as well. They also record the
+*	operations for the binary trace of trace.c, when it is turned on,
+*	and for -o record_file, see record.c.
+*/
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+#include "cow_utils.h"
+#include "stats.h"
+#include "trace.h"
+#include "record.h"
+#include "branches.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define STATS_FILE_INTERVAL 10	// seconds between updates of the stats file
+
+#define NCOUNTERS (sizeof(struct unionfs_stats_counters) / sizeof(uint64_t))
+
+struct stats_thread {
+	struct unionfs_stats_counters c;
+	struct stats_thread *prev;
+	struct stats_thread *next;
+};
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *threads;
+static struct unionfs_stats_counters exited;	// counts of exited threads
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static const char *op_names[UNIONFS_STATS_OPS] = {
+	[UNIONFS_OP_ACCESS] = "access",
+	[UNIONFS_OP_CHMOD] = "chmod",
+	[UNIONFS_OP_CHOWN] = "chown",
+	[UNIONFS_OP_CREATE] = "create",
+	[UNIONFS_OP_FLUSH] = "flush",
+	[UNIONFS_OP_FSYNC] = "fsync",
+	[UNIONFS_OP_GETATTR] = "getattr",
+	[UNIONFS_OP_GETXATTR] = "getxattr",
+	[UNIONFS_OP_IOCTL] = "ioctl",
+	[UNIONFS_OP_LINK] = "link",
+	[UNIONFS_OP_LISTXATTR] = "listxattr",
+	[UNIONFS_OP_MKDIR] = "mkdir",
+	[UNIONFS_OP_MKNOD] = "mknod",
+	[UNIONFS_OP_OPEN] = "open",
+	[UNIONFS_OP_OPENDIR] = "opendir",
+	[UNIONFS_OP_READ] = "read",
+	[UNIONFS_OP_READ_BUF] = "read_buf",
+	[UNIONFS_OP_READDIR] = "readdir",
+	[UNIONFS_OP_READLINK] = "readlink",
+	[UNIONFS_OP_RELEASE] = "release",
+	[UNIONFS_OP_RELEASEDIR] = "releasedir",
+	[UNIONFS_OP_REMOVEXATTR] = "removexattr",
+	[UNIONFS_OP_RENAME] = "rename",
+	[UNIONFS_OP_RMDIR] = "rmdir",
+	[UNIONFS_OP_SETXATTR] = "setxattr",
+	[UNIONFS_OP_STATFS] = "statfs",
+	[UNIONFS_OP_SYMLINK] = "symlink",
+	[UNIONFS_OP_TRUNCATE] = "truncate",
+	[UNIONFS_OP_UNLINK] = "unlink",
+	[UNIONFS_OP_UTIMENS] = "utimens",
+	[UNIONFS_OP_WRITE] = "write",
+	[UNIONFS_OP_WRITE_BUF] = "write_buf",
+};
+
+const char *stats_op_name(enum unionfs_stats_op op) {
+	return op_names[op];
+}
+
+uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void counters_add(struct unionfs_stats_counters *to,
+	struct unionfs_stats_counters *from) {
+	uint64_t *t = (uint64_t *)to, *f = (uint64_t *)from;
+	unsigned int i;
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+	}
+}
+
+static void thread_exit(void *p) {
+	struct stats_thread *t = p;
+
+	pthread_mutex_lock(&threads_lock);
+	counters_add(&exited, &t->c);
+	if (t->prev) t->prev->next = t->next;
+	else threads = t->next;
+	if (t->next) t->next->prev = t->prev;
+	pthread_mutex_unlock(&threads_lock);
+
+	free(t);
+}
+
+static void thread_key_init(void) {
+	pthread_key_create(&thread_key, thread_exit);
+}
+
+/**
+ * The counters of the calling thread, NULL if they cannot be allocated.
+ */
+static struct unionfs_stats_counters *counters(void) {
+	pthread_once(&thread_once, thread_key_init);
+
+	struct stats_thread *t = pthread_getspecific(thread_key);
+	if (t) return &t->c;
+
+	t = calloc(1, sizeof(struct stats_thread));
+	if (t == NULL) return NULL;
+	if (pthread_setspecific(thread_key, t)) {
+		free(t);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	t->next = threads;
+	if (threads) threads->prev = t;
+	threads = t;
+	pthread_mutex_unlock(&threads_lock);
+
+	return &t->c;
+}
+
+/**
+ * Only the owning thread writes its counters.
+ */
+static inline void count(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static unsigned int latency_bucket(uint64_t ns) {
+	uint64_t us = ns / 1000;
+	if (us == 0) return 0;
+
+	unsigned int bucket = 64 - __builtin_clzll(us);
+	if (bucket >= UNIONFS_STATS_LAT_BUCKETS) bucket = UNIONFS_STATS_LAT_BUCKETS - 1;
+	return bucket;
+}
+
+/**
+ * Count a call of op, which started at start and returned res.
+ */
+void stats_op(enum unionfs_stats_op op, uint64_t start, int res) {
+	struct unionfs_stats_counters *c = counters();
+	if (c == NULL) return;
+
+	uint64_t ns = stats_now() - start;
+	struct unionfs_op_stats *s = &c->ops[op];
+
+	count(&s->calls, 1);
+	if (res < 0) count(&s->errors, 1);
+	count(&s->time_ns, ns);
+	count(&s->latency[latency_bucket(ns)], 1);
+}
+
+void stats_read(int branch, size_t bytes) {
+	struct unionfs_stats_counters *c = counters();
+	if (c == NULL) return;
+
+	count(&c->bytes_read, bytes);
+	if (branch >= 0 && branch < UNIONFS_STATS_BRANCHES) {
+		count(&c->branches[branch].bytes_read, bytes);
+	}
+}
+
+void stats_written(int branch, size_t bytes) {
+	struct unionfs_stats_counters *c = counters();
+	if (c == NULL) return;
+
+	count(&c->bytes_written, bytes);
+	if (branch >= 0 && branch < UNIONFS_STATS_BRANCHES) {
+		count(&c->branches[branch].bytes_written, bytes);
+	}
+}
+
+/**
+ * Count a copy-up, which started at start and returned res.
+ */
+void stats_copyup(uint64_t start, int res) {
+	struct unionfs_stats_counters *c = counters();
+	if (c == NULL) return;
+
+	count(&c->copyups, 1);
+	if (res != 0) count(&c->copyup_errors, 1);
+	count(&c->copyup_ns, stats_now() - start);
+}
+
+void stats_map(enum stats_map_op op) {
+	struct unionfs_stats_counters *c = counters();
+	if (c == NULL) return;
+
+	switch (op) {
+	case STATS_MAP_ADD: count(&c->map_adds, 1); break;
+	case STATS_MAP_LOOKUP: count(&c->map_lookups, 1); break;
+	case STATS_MAP_TRUNC: count(&c->map_truncs, 1); break;
+	case STATS_MAP_APPEND: count(&c->map_appends, 1); break;
+	case STATS_MAP_COMPACT: count(&c->map_compactions, 1); break;
+	}
+}
+
+void stats_lookup(bool hit) {
+	struct unionfs_stats_counters *c = counters();
+	if (c == NULL) return;
+
+	count(hit ? &c->lookup_hits : &c->lookup_misses, 1);
+}
+
+/**
+ * Sum up the counters of all threads.
+ */
+void stats_get(struct unionfs_stats *stats) {
+	memset(stats, 0, sizeof(struct unionfs_stats));
+
+	stats->nops = UNIONFS_STATS_OPS;
+	stats->nbranches = MIN(uopt.nbranches, UNIONFS_STATS_BRANCHES);
+	stats->ncopy_methods = MIN(COPY_METHODS, UNIONFS_STATS_COPY_METHODS);
+
+	unsigned int i;
+	for (i = 0; i < UNIONFS_STATS_OPS; i++) {
+		strncpy(stats->op_names[i], op_names[i], UNIONFS_STATS_NAME_LEN - 1);
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	counters_add(&stats->c, &exited);
+	struct stats_thread *t;
+	for (t = threads; t; t = t->next) counters_add(&stats->c, &t->c);
+	pthread_mutex_unlock(&threads_lock);
+
+	// copy_file() keeps its own counts
+	struct copy_stats cs;
+	copy_stats_get(&cs);
+	for (i = 0; i < stats->ncopy_methods; i++) {
+		strncpy(stats->copy_method_names[i], copy_method_name(i),
+			UNIONFS_STATS_NAME_LEN - 1);
+		stats->c.copy_files[i] = cs.files[i];
+		stats->c.copy_bytes[i] = cs.bytes[i];
+	}
+	stats->c.copy_holes = cs.holes;
+}
+
+/* the timing wrappers of the fuse operations */
+
+static struct fuse_operations next;
+
+// rec are the path, second path, two arguments and file handle recorded
+// by record_op()
+#define RECORD_ARGS(path, path2, arg0, arg1, fi) path, path2, arg0, arg1, fi
+
+#define TIMED(name, op, path, params, args, rec) \
+static int timed_##name params { \
+	uint64_t start = stats_now(); \
+	bool traced = __atomic_load_n(&trace_on, __ATOMIC_RELAXED); \
+	if (traced) trace_begin(); \
+	branches_enter(); \
+	int res = next.name args; \
+	branches_leave(); \
+	stats_op(op, start, res); \
+	if (traced) trace_op(op, start, path, res); \
+	if (__atomic_load_n(&record_on, __ATOMIC_RELAXED)) { \
+		record_op(op, start, res, RECORD_ARGS rec); \
+	} \
+	return res; \
+}
+
+TIMED(access, UNIONFS_OP_ACCESS, path, (const char *path, int mask), (path, mask), (path, NULL, mask, 0, NULL))
+TIMED(chmod, UNIONFS_OP_CHMOD, path, (const char *path, mode_t mode), (path, mode), (path, NULL, mode, 0, NULL))
+TIMED(chown, UNIONFS_OP_CHOWN, path, (const char *path, uid_t uid, gid_t gid), (path, uid, gid), (path, NULL, uid, gid, NULL))
+TIMED(create, UNIONFS_OP_CREATE, path, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), (path, NULL, mode, fi->flags, fi))
+TIMED(flush, UNIONFS_OP_FLUSH, path, (const char *path, struct fuse_file_info *fi), (path, fi), (path, NULL, 0, 0, fi))
+TIMED(fsync, UNIONFS_OP_FSYNC, path, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi), (path, NULL, isdatasync, 0, fi))
+TIMED(getattr, UNIONFS_OP_GETATTR, path, (const char *path, struct stat *st), (path, st), (path, NULL, 0, 0, NULL))
+TIMED(link, UNIONFS_OP_LINK, from, (const char *from, const char *to), (from, to), (from, to, 0, 0, NULL))
+TIMED(mkdir, UNIONFS_OP_MKDIR, path, (const char *path, mode_t mode), (path, mode), (path, NULL, mode, 0, NULL))
+TIMED(mknod, UNIONFS_OP_MKNOD, path, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev), (path, NULL, mode, rdev, NULL))
+TIMED(open, UNIONFS_OP_OPEN, path, (const char *path, struct fuse_file_info *fi), (path, fi), (path, NULL, 0, fi->flags, fi))
+TIMED(opendir, UNIONFS_OP_OPENDIR, path, (const char *path, struct fuse_file_info *fi), (path, fi), (path, NULL, 0, 0, fi))
+TIMED(read, UNIONFS_OP_READ, path, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi), (path, NULL, size, offset, fi))
+TIMED(readdir, UNIONFS_OP_READDIR, path, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi), (path, NULL, offset, 0, fi))
+TIMED(readlink, UNIONFS_OP_READLINK, path, (const char *path, char *buf, size_t size), (path, buf, size), (path, NULL, size, 0, NULL))
+TIMED(release, UNIONFS_OP_RELEASE, path, (const char *path, struct fuse_file_info *fi), (path, fi), (path, NULL, 0, 0, fi))
+TIMED(releasedir, UNIONFS_OP_RELEASEDIR, path, (const char *path, struct fuse_file_info *fi), (path, fi), (path, NULL, 0, 0, fi))
+TIMED(rename, UNIONFS_OP_RENAME, from, (const char *from, const char *to), (from, to), (from, to, 0, 0, NULL))
+TIMED(rmdir, UNIONFS_OP_RMDIR, path, (const char *path), (path), (path, NULL, 0, 0, NULL))
+TIMED(statfs, UNIONFS_OP_STATFS, path, (const char *path, struct statvfs *st), (path, st), (path, NULL, 0, 0, NULL))
+TIMED(symlink, UNIONFS_OP_SYMLINK, to, (const char *from, const char *to), (from, to), (to, from, 0, 0, NULL))
+TIMED(truncate, UNIONFS_OP_TRUNCATE, path, (const char *path, off_t size), (path, size), (path, NULL, size, 0, NULL))
+TIMED(unlink, UNIONFS_OP_UNLINK, path, (const char *path), (path), (path, NULL, 0, 0, NULL))
+TIMED(utimens, UNIONFS_OP_UTIMENS, path, (const char *path, const struct timespec ts[2]), (path, ts), (path, NULL, record_time(&ts[0]), record_time(&ts[1]), NULL))
+TIMED(write, UNIONFS_OP_WRITE, path, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi), (path, NULL, size, offset, fi))
+#if FUSE_VERSION >= 28
+TIMED(ioctl, UNIONFS_OP_IOCTL, path, (const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data), (path, cmd, arg, fi, flags, data), (path, NULL, (unsigned int)cmd, 0, fi))
+#endif
+#if FUSE_VERSION >= 29
+TIMED(read_buf, UNIONFS_OP_READ_BUF, path, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi), (path, NULL, size, offset, fi))
+TIMED(write_buf, UNIONFS_OP_WRITE_BUF, path, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi), (path, NULL, fuse_buf_size(buf), offset, fi))
+#endif
+#ifdef HAVE_XATTR
+#if __APPLE__
+TIMED(getxattr, UNIONFS_OP_GETXATTR, path, (const char *path, const char *name, char *value, size_t size, uint32_t position), (path, name, value, size, position), (path, name, size, 0, NULL))
+TIMED(setxattr, UNIONFS_OP_SETXATTR, path, (const char *path, const char *name, const char *value, size_t size, int flags, uint32_t position), (path, name, value, size, flags, position), (path, name, size, flags, NULL))
+#else
+TIMED(getxattr, UNIONFS_OP_GETXATTR, path, (const char *path, const char *name, char *value, size_t size), (path, name, value, size), (path, name, size, 0, NULL))
+TIMED(setxattr, UNIONFS_OP_SETXATTR, path, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags), (path, name, size, flags, NULL))
+#endif
+TIMED(listxattr, UNIONFS_OP_LISTXATTR, path, (const char *path, char *list, size_t size), (path, list, size), (path, NULL, size, 0, NULL))
+TIMED(removexattr, UNIONFS_OP_REMOVEXATTR, path, (const char *path, const char *name), (path, name), (path, name, 0, 0, NULL))
+#endif
+
+#define WRAP(name) if (ops->name) ops->name = timed_##name
+
+/**
+ * Replace the operations by ones, which time the calls of the original.
+ */
+void stats_wrap_ops(struct fuse_operations *ops) {
+	next = *ops;
+
+	WRAP(access);
+	WRAP(chmod);
+	WRAP(chown);
+	WRAP(create);
+	WRAP(flush);
+	WRAP(fsync);
+	WRAP(getattr);
+	WRAP(link);
+	WRAP(mkdir);
+	WRAP(mknod);
+	WRAP(open);
+	WRAP(opendir);
+	WRAP(read);
+	WRAP(readdir);
+	WRAP(readlink);
+	WRAP(release);
+	WRAP(releasedir);
+	WRAP(rename);
+	WRAP(rmdir);
+	WRAP(statfs);
+	WRAP(symlink);
+	WRAP(truncate);
+	WRAP(unlink);
+	WRAP(utimens);
+	WRAP(write);
+#if FUSE_VERSION >= 28
+	WRAP(ioctl);
+#endif
+#if FUSE_VERSION >= 29
+	WRAP(read_buf);
+	WRAP(write_buf);
+#endif
+#ifdef HAVE_XATTR
+	WRAP(getxattr);
+	WRAP(setxattr);
+	WRAP(listxattr);
+	WRAP(removexattr);
+#endif
+}
+
+/* the Prometheus text file of -o stats_file */
+
+static int file_dirfd = -1;
+static const char *file_name;
+
+static void put_label(FILE *f, const char *value) {
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"') fputc('\\', f);
+		if (*value == '\n') fputs("\\n", f);
+		else fputc(*value, f);
+	}
+}
+
+static void put_header(FILE *f, const char *name, const char *type, const char *help) {
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_prometheus(FILE *f, const struct unionfs_stats *s) {
+	const struct unionfs_stats_counters *c = &s->c;
+	unsigned int i, j;
+
+	put_header(f, "unionfs_op_errors_total", "counter", "Operations which failed.");
+	for (i = 0; i < s->nops; i++) {
+		fprintf(f, "unionfs_op_errors_total{op=\"%s\"} %llu\n", s->op_names[i],
+			(unsigned long long)c->ops[i].errors);
+	}
+
+	put_header(f, "unionfs_op_duration_seconds", "histogram", "Time spent in the operations.");
+	for (i = 0; i < s->nops; i++) {
+		const struct unionfs_op_stats *op = &c->ops[i];
+		uint64_t sum = 0;
+		for (j = 0; j + 1 < UNIONFS_STATS_LAT_BUCKETS; j++) {
+			sum += op->latency[j];
+			fprintf(f, "unionfs_op_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+				s->op_names[i], (double)(1ULL << j) / 1e6, (unsigned long long)sum);
+		}
+		fprintf(f, "unionfs_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+			s->op_names[i], (unsigned long long)op->calls);
+		fprintf(f, "unionfs_op_duration_seconds_sum{op=\"%s\"} %.9f\n",
+			s->op_names[i], op->time_ns / 1e9);
+		fprintf(f, "unionfs_op_duration_seconds_count{op=\"%s\"} %llu\n",
+			s->op_names[i], (unsigned long long)op->calls);
+	}
+
+	put_header(f, "unionfs_branch_read_bytes_total", "counter", "Bytes read from the branches.");
+	for (i = 0; i < s->nbranches; i++) {
+		fprintf(f, "unionfs_branch_read_bytes_total{branch=\"%u\",path=\"", i);
+		put_label(f, uopt.branches[i].path);
+		fprintf(f, "\"} %llu\n", (unsigned long long)c->branches[i].bytes_read);
+	}
+
+	put_header(f, "unionfs_branch_written_bytes_total", "counter", "Bytes written to the branches.");
+	for (i = 0; i < s->nbranches; i++) {
+		fprintf(f, "unionfs_branch_written_bytes_total{branch=\"%u\",path=\"", i);
+		put_label(f, uopt.branches[i].path);
+		fprintf(f, "\"} %llu\n", (unsigned long long)c->branches[i].bytes_written);
+	}
+
+	put_header(f, "unionfs_read_bytes_total", "counter", "Bytes read from all branches.");
+	fprintf(f, "unionfs_read_bytes_total %llu\n", (unsigned long long)c->bytes_read);
+	put_header(f, "unionfs_written_bytes_total", "counter", "Bytes written to all branches.");
+	fprintf(f, "unionfs_written_bytes_total %llu\n", (unsigned long long)c->bytes_written);
+
+	put_header(f, "unionfs_copyups_total", "counter", "Copy-ups to the rw branch.");
+	fprintf(f, "unionfs_copyups_total %llu\n", (unsigned long long)c->copyups);
+	put_header(f, "unionfs_copyup_errors_total", "counter", "Copy-ups which failed.");
+	fprintf(f, "unionfs_copyup_errors_total %llu\n", (unsigned long long)c->copyup_errors);
+	put_header(f, "unionfs_copyup_seconds_total", "counter", "Time spent in copy-ups.");
+	fprintf(f, "unionfs_copyup_seconds_total %.9f\n", c->copyup_ns / 1e9);
+
+	put_header(f, "unionfs_copy_files_total", "counter", "Files copied, by copy method.");
+	for (i = 0; i < s->ncopy_methods; i++) {
+		fprintf(f, "unionfs_copy_files_total{method=\"%s\"} %llu\n",
+			s->copy_method_names[i], (unsigned long long)c->copy_files[i]);
+	}
+	put_header(f, "unionfs_copy_bytes_total", "counter", "Bytes copied, by copy method.");
+	for (i = 0; i < s->ncopy_methods; i++) {
+		fprintf(f, "unionfs_copy_bytes_total{method=\"%s\"} %llu\n",
+			s->copy_method_names[i], (unsigned long long)c->copy_bytes[i]);
+	}
+	put_header(f, "unionfs_copy_hole_bytes_total", "counter", "Bytes in holes, which were not copied.");
+	fprintf(f, "unionfs_copy_hole_bytes_total %llu\n", (unsigned long long)c->copy_holes);
+
+	put_header(f, "unionfs_datamap_ops_total", "counter", "Operations on the cowolf data-range maps.");
+	fprintf(f, "unionfs_datamap_ops_total{op=\"add\"} %llu\n", (unsigned long long)c->map_adds);
+	fprintf(f, "unionfs_datamap_ops_total{op=\"lookup\"} %llu\n", (unsigned long long)c->map_lookups);
+	fprintf(f, "unionfs_datamap_ops_total{op=\"trunc\"} %llu\n", (unsigned long long)c->map_truncs);
+	fprintf(f, "unionfs_datamap_ops_total{op=\"append\"} %llu\n", (unsigned long long)c->map_appends);
+	fprintf(f, "unionfs_datamap_ops_total{op=\"compact\"} %llu\n", (unsigned long long)c->map_compactions);
+
+	put_header(f, "unionfs_lookup_cache_hits_total", "counter", "Lookups served by the lookup cache.");
+	fprintf(f, "unionfs_lookup_cache_hits_total %llu\n", (unsigned long long)c->lookup_hits);
+	put_header(f, "unionfs_lookup_cache_misses_total", "counter", "Lookups not in the lookup cache.");
+	fprintf(f, "unionfs_lookup_cache_misses_total %llu\n", (unsigned long long)c->lookup_misses);
+}
+
+/**
+ * Write the statistics to a temporary file, which then replaces the
+ * stats file, so readers never see a partial file.
+ */
+static int file_write(void) {
+	struct unionfs_stats *s = malloc(sizeof(struct unionfs_stats));
+	if (s == NULL) RETURN(-1);
+	stats_get(s);
+
+	char tmpname[PATHLEN_MAX];
+	snprintf(tmpname, sizeof(tmpname), ".%s.tmp", file_name);
+
+	int res = -1;
+	int fd = openat(file_dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (f == NULL) {
+		USYSLOG(LOG_ERR, "Failed to create %s: %s\n", tmpname, strerror(errno));
+		if (fd >= 0) close(fd);
+		goto out;
+	}
+
+	write_prometheus(f, s);
+
+	if (fclose(f) != 0 || renameat(file_dirfd, tmpname, file_dirfd, file_name) != 0) {
+		USYSLOG(LOG_ERR, "Failed to write %s: %s\n", uopt.stats_file, strerror(errno));
+		unlinkat(file_dirfd, tmpname, 0);
+		goto out;
+	}
+	res = 0;
+
+out:
+	free(s);
+	RETURN(res);
+}
+
+static void *file_thread(void *arg) {
+	(void)arg;
+
+	while (1) {
+		branches_enter();
+		file_write();
+		branches_leave();
+		sleep(STATS_FILE_INTERVAL);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start updating the stats file of -o stats_file. The directory is opened
+ * now, so the file is still written after unionfs_init() went into the
+ * chroot.
+ */
+int stats_file_start(void) {
+	if (!uopt.stats_file) RETURN(0);
+
+	// the path was made absolute by the option parsing
+	char dir[PATHLEN_MAX];
+	const char *slash = strrchr(uopt.stats_file, '/');
+	size_t len = slash - uopt.stats_file;
+	if (len >= sizeof(dir)) {
+		errno = ENAMETOOLONG;
+		RETURN(-1);
+	}
+	if (len == 0) len = 1; // in /
+	memcpy(dir, uopt.stats_file, len);
+	dir[len] = '\0';
+	file_name = slash + 1;
+
+	file_dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (file_dirfd == -1) {
+		USYSLOG(LOG_ERR, "Failed to open %s: %s\n", dir, strerror(errno));
+		RETURN(-1);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, file_thread, NULL) != 0) {
+		USYSLOG(LOG_ERR, "Failed to start the stats file thread\n");
+		close(file_dirfd);
+		file_dirfd = -1;
+		RETURN(-1);
+	}
+	pthread_detach(thread);
+
+	RETURN(0);
+}
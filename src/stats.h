@@ -0,0 +1,40 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uioctl.h"
+
+struct fuse_operations;
+
+uint64_t stats_now(void);
+const char *stats_op_name(enum unionfs_stats_op op);
+
+void stats_wrap_ops(struct fuse_operations *ops);
+void stats_op(enum unionfs_stats_op op, uint64_t start, int res);
+void stats_read(int branch, size_t bytes);
+void stats_written(int branch, size_t bytes);
+void stats_copyup(uint64_t start, int res);
+void stats_lookup(bool hit);
+
+// cowolf data-range map operations, see drm_file.c
+enum stats_map_op {
+	STATS_MAP_ADD,
+	STATS_MAP_LOOKUP,
+	STATS_MAP_TRUNC,
+	STATS_MAP_APPEND,
+	STATS_MAP_COMPACT
+};
+
+void stats_map(enum stats_map_op op);
+
+void stats_get(struct unionfs_stats *stats);
+int stats_file_start(void);
+
+#endif
@@ -26,22 +26,38 @@
 #include "usyslog.h"
 
 /**
- * Check if the given fname suffixes the hide tag
+ * Check if fname ends with tag, but is not only the tag
  */
-char *whiteout_tag(const char *fname) {
-	DBG("%s\n", fname);
-
-	char *tag = strstr(fname, HIDETAG);
+static char *name_tag(const char *fname, const char *tagname) {
+	char *tag = strstr(fname, tagname);
 
 	// check if fname has tag, fname is not only the tag, file name ends with the tag
-	// TODO: static strlen(HIDETAG)
-	if (tag && tag != fname && strlen(tag) == strlen(HIDETAG)) {
+	// TODO: static strlen(tagname)
+	if (tag && tag != fname && strlen(tag) == strlen(tagname)) {
 		return tag;
 	}
 
 	return NULL;
 }
 
+/**
+ * Check if the given fname suffixes the hide tag
+ */
+char *whiteout_tag(const char *fname) {
+	DBG("%s\n", fname);
+
+	return name_tag(fname, HIDETAG);
+}
+
+/**
+ * Check if the given fname suffixes the redirect tag
+ */
+char *redirect_tag(const char *fname) {
+	DBG("%s\n", fname);
+
+	return name_tag(fname, REDIRECTTAG);
+}
+
 /**
  * copy one or more char arrays into dest and check for maximum size
  *
@@ -10,6 +10,7 @@
 #include <string.h>
 
 char *whiteout_tag(const char *fname);
+char *redirect_tag(const char *fname);
 int build_path(char *dest, int max_len, const char *callfunc, int line, ...);
 char *u_dirname(const char *path);
 unsigned int string_hash(void *s);
@@ -31,4 +32,14 @@ static inline int string_equal(void *s1, void *s2) {
 	return 0;
 }
 
+/**
+ * Return path relative to the root of a branch, to be used with the *at()
+ * functions and uopt.branches[i].fd, e.g. "dir/file" for "/dir/file".
+ */
+static inline const char *branch_relpath(const char *path) {
+	while (*path == '/') path++;
+	if (*path == '\0') return ".";
+	return path;
+}
+
 #endif // UNIONFS_STRING_H
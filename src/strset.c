@@ -0,0 +1,191 @@
+/*
+* Description: set of strings, for the names of directory listings
+*
+* License: BSD-style license
+*
+* Details:
+*	Listing a directory needs a set of the names seen so far and one
+*	of the whiteouts, which are only searched and added to and then
+*	thrown away as a whole. The strings are therefore copied into an
+*	arena of large chunks, which is freed at once. The table is open
+*	addressing with linear probing and keeps the hash of every string,
+*	so most probes do not touch the string and growing the table does
+*	not hash again.
+*
+*	The hash reads 8 bytes at a time and mixes them with a multiply,
+*	which is much faster than the byte-wise elfhash() of string.c and
+*	spreads file names like file-0001, file-0002 much better.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "strset.h"
+
+#define STRSET_MIN_SLOTS 64	// a power of 2
+#define STRSET_CHUNK (64 * 1024)
+
+struct strset_slot {
+	const char *str;	// NULL if free
+	uint64_t hash;
+};
+
+struct strset_chunk {
+	struct strset_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct strset {
+	struct strset_slot *slots;
+	size_t mask;		// number of slots - 1
+	size_t count;
+	struct strset_chunk *chunks; // the newest one first
+};
+
+static inline uint64_t mix(uint64_t x) {
+	x ^= x >> 32;
+	x *= 0xd6e8feb86659fd93ULL;
+	x ^= x >> 32;
+	return x;
+}
+
+uint64_t strset_hash(const char *str, size_t len) {
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, str, 8);
+		h = mix(h ^ v) + 0x9e3779b97f4a7c15ULL;
+		str += 8;
+		len -= 8;
+	}
+
+	v = 0;
+	memcpy(&v, str, len);
+	return mix(mix(h ^ v) ^ 0x9e3779b97f4a7c15ULL);
+}
+
+struct strset *strset_new(void) {
+	struct strset *set = calloc(1, sizeof(struct strset));
+	if (set == NULL) return NULL;
+
+	set->slots = calloc(STRSET_MIN_SLOTS, sizeof(struct strset_slot));
+	if (set->slots == NULL) {
+		free(set);
+		return NULL;
+	}
+	set->mask = STRSET_MIN_SLOTS - 1;
+
+	return set;
+}
+
+void strset_free(struct strset *set) {
+	if (set == NULL) return;
+
+	while (set->chunks) {
+		struct strset_chunk *c = set->chunks;
+		set->chunks = c->next;
+		free(c);
+	}
+	free(set->slots);
+	free(set);
+}
+
+size_t strset_count(const struct strset *set) {
+	return set->count;
+}
+
+/**
+ * The slot of str, or the free slot it would go to.
+ */
+static struct strset_slot *lookup(const struct strset *set, const char *str, uint64_t hash) {
+	size_t i = hash & set->mask;
+
+	while (1) {
+		struct strset_slot *slot = &set->slots[i];
+		if (slot->str == NULL) return slot;
+		if (slot->hash == hash && strcmp(slot->str, str) == 0) return slot;
+		i = (i + 1) & set->mask;
+	}
+}
+
+const char *strset_find(const struct strset *set, const char *str) {
+	return lookup(set, str, strset_hash(str, strlen(str)))->str;
+}
+
+static int grow(struct strset *set) {
+	size_t nslots = 2 * (set->mask + 1);
+	struct strset_slot *slots = calloc(nslots, sizeof(struct strset_slot));
+	if (slots == NULL) return -1;
+
+	size_t i;
+	for (i = 0; i <= set->mask; i++) {
+		struct strset_slot *old = &set->slots[i];
+		if (old->str == NULL) continue;
+
+		size_t j = old->hash & (nslots - 1);
+		while (slots[j].str) j = (j + 1) & (nslots - 1);
+		slots[j] = *old;
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->mask = nslots - 1;
+	return 0;
+}
+
+static char *arena_copy(struct strset *set, const char *str, size_t size) {
+	struct strset_chunk *c = set->chunks;
+
+	if (c == NULL || c->size - c->used < size) {
+		size_t csize = size > STRSET_CHUNK ? size : STRSET_CHUNK;
+		c = malloc(sizeof(struct strset_chunk) + csize);
+		if (c == NULL) return NULL;
+
+		c->used = 0;
+		c->size = csize;
+		c->next = set->chunks;
+		set->chunks = c;
+	}
+
+	char *copy = c->data + c->used;
+	memcpy(copy, str, size);
+	c->used += size;
+	return copy;
+}
+
+/**
+ * Add a copy of str, unless it is already in the set. Returns the copy in
+ * the set, which stays valid until the set is freed, NULL with errno set
+ * if we are out of memory. added tells if str was new, it may be NULL.
+ */
+const char *strset_add(struct strset *set, const char *str, bool *added) {
+	size_t len = strlen(str);
+	uint64_t hash = strset_hash(str, len);
+
+	struct strset_slot *slot = lookup(set, str, hash);
+	if (added) *added = slot->str == NULL;
+	if (slot->str) return slot->str;
+
+	// at most 3/4 of the slots are used, so lookups end soon
+	if (4 * (set->count + 1) > 3 * (set->mask + 1)) {
+		if (grow(set)) goto nomem;
+		slot = lookup(set, str, hash);
+	}
+
+	char *copy = arena_copy(set, str, len + 1);
+	if (copy == NULL) goto nomem;
+
+	slot->str = copy;
+	slot->hash = hash;
+	set->count++;
+	return copy;
+
+nomem:
+	if (added) *added = false;
+	errno = ENOMEM;
+	return NULL;
+}
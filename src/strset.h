@@ -0,0 +1,22 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef STRSET_H
+#define STRSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct strset;
+
+uint64_t strset_hash(const char *str, size_t len);
+
+struct strset *strset_new(void);
+void strset_free(struct strset *set);
+size_t strset_count(const struct strset *set);
+const char *strset_find(const struct strset *set, const char *str);
+const char *strset_add(struct strset *set, const char *str, bool *added);
+
+#endif
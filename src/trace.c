@@ -0,0 +1,245 @@
+/*
+* Description: binary trace of the file system operations
+*
+* License: BSD-style license
+*
+* Details:
+*	DBG() formats and flushes every message under a lock, which is far
+*	too slow to be turned on in production. The trace instead records
+*	one fixed-size entry per operation: start time, operation, hash of
+*	the path, the branch found for it, result and latency. It is turned
+*	on with UNIONFS_DEBUG_TRACE of the UNIONFS_ONOFF_DEBUG ioctl
+*	(unionfsctl -d trace) and read with the UNIONFS_TRACE ioctl, which
+*	unionfsctl -t decodes.
+*
+*	Each thread writes into its own ring of entries without any lock,
+*	the oldest entries are overwritten. The ring of an exited thread is
+*	kept with its entries and taken over by the next new thread, so
+*	rings are never freed and their number is bounded by the number of
+*	threads running at the same time. Each slot is a seqlock: the writer
+*	invalidates its seq before rewriting it and stores the new seq last,
+*	the readers copy an entry and then check that its seq is still the
+*	one they want, so they neither lock nor slow down the writers.
+*
+*	The entries are recorded by the timing wrappers of stats.c.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "string.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE 4096	// entries per ring, a power of 2
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define TRACE_SEQ_INVALID UINT64_MAX	// seq of a slot being written
+
+struct trace_ring {
+	struct unionfs_trace_entry entries[TRACE_RING_SIZE];
+	uint64_t head;		// entries written, atomic
+	uint32_t id;
+	bool used;		// a running thread writes into it
+	struct trace_ring *next;
+};
+
+// reading the rings of all threads
+struct ring_cursor {
+	struct trace_ring *r;
+	uint64_t pos;
+	uint64_t end;
+	struct unionfs_trace_entry e; // the next entry, if valid
+	bool valid;
+};
+
+bool trace_on;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static uint32_t nrings;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static __thread int cur_branch = -1;
+
+void trace_set(bool on) {
+	__atomic_store_n(&trace_on, on, __ATOMIC_RELAXED);
+}
+
+static void ring_release(void *p) {
+	struct trace_ring *r = p;
+
+	pthread_mutex_lock(&rings_lock);
+	r->used = false;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_init(void) {
+	pthread_key_create(&ring_key, ring_release);
+}
+
+/**
+ * The ring of the calling thread, NULL if it cannot be allocated.
+ */
+static struct trace_ring *ring(void) {
+	pthread_once(&ring_once, ring_key_init);
+
+	struct trace_ring *r = pthread_getspecific(ring_key);
+	if (r) return r;
+
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r; r = r->next) {
+		if (!r->used) break;
+	}
+	if (r == NULL) {
+		r = calloc(1, sizeof(struct trace_ring));
+		if (r == NULL) goto out;
+		r->id = nrings++;
+		r->next = rings;
+		rings = r;
+	}
+	if (pthread_setspecific(ring_key, r)) {
+		r = NULL;
+		goto out;
+	}
+	r->used = true;
+out:
+	pthread_mutex_unlock(&rings_lock);
+	return r;
+}
+
+/**
+ * An operation starts, no branch was found for it yet.
+ */
+void trace_begin(void) {
+	cur_branch = -1;
+}
+
+/**
+ * The operation of the calling thread works on this branch.
+ */
+void trace_branch(int branch) {
+	cur_branch = branch;
+}
+
+/**
+ * Record a call of op on path, which started at start and returned res.
+ */
+void trace_op(enum unionfs_stats_op op, uint64_t start, const char *path, int res) {
+	struct trace_ring *r = ring();
+	if (r == NULL) return;
+
+	uint64_t seq = r->head; // only we write it
+	struct unionfs_trace_entry *e = &r->entries[seq & TRACE_RING_MASK];
+
+	// readers of the old entry see it is gone before any field changes
+	__atomic_store_n(&e->seq, TRACE_SEQ_INVALID, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->time_ns = start;
+	e->latency_ns = stats_now() - start;
+	e->ring = r->id;
+	e->path_hash = path ? string_hash((void *)path) : 0;
+	e->res = res;
+	e->op = op;
+	e->branch = cur_branch;
+
+	// and the new one only once all of them are written
+	__atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int entry_cmp(const struct unionfs_trace_entry *a, const struct unionfs_trace_entry *b) {
+	if (a->time_ns != b->time_ns) return a->time_ns < b->time_ns ? -1 : 1;
+	if (a->ring != b->ring) return a->ring < b->ring ? -1 : 1;
+	if (a->seq != b->seq) return a->seq < b->seq ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Copy entry seq of ring r, false if the writer overwrote it meanwhile.
+ */
+static bool ring_read(struct trace_ring *r, uint64_t seq, struct unionfs_trace_entry *e) {
+	struct unionfs_trace_entry *slot = &r->entries[seq & TRACE_RING_MASK];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) return false;
+	*e = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	// the writer invalidates seq before it changes the slot for the next entry
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * Move the cursor to the next entry after the given one.
+ */
+static void cursor_next(struct ring_cursor *c, const struct unionfs_trace_entry *after) {
+	c->valid = false;
+
+	while (c->pos < c->end) {
+		if (ring_read(c->r, c->pos, &c->e)) {
+			c->pos++;
+			if (entry_cmp(&c->e, after) > 0) {
+				c->valid = true;
+				return;
+			}
+		} else {
+			// skip what the writer already overwrote
+			uint64_t head = __atomic_load_n(&c->r->head, __ATOMIC_ACQUIRE);
+			uint64_t oldest = head - TRACE_RING_SIZE + 1;
+			c->pos = oldest > c->pos ? oldest : c->pos + 1;
+		}
+	}
+}
+
+/**
+ * Return the oldest entries of all rings after trace->after, in the order
+ * of their start time. The entries of a ring are already in this order,
+ * so they are merged.
+ */
+void trace_get(struct unionfs_trace *trace) {
+	struct unionfs_trace_entry after = trace->after;
+	memset(trace, 0, sizeof(struct unionfs_trace));
+
+	trace->nops = UNIONFS_STATS_OPS;
+	unsigned int i;
+	for (i = 0; i < UNIONFS_STATS_OPS; i++) {
+		strncpy(trace->op_names[i], stats_op_name(i), UNIONFS_STATS_NAME_LEN - 1);
+	}
+
+	pthread_mutex_lock(&rings_lock);
+
+	struct ring_cursor *cursors = calloc(nrings, sizeof(struct ring_cursor));
+	if (cursors == NULL) goto out;
+
+	unsigned int n = 0;
+	struct trace_ring *r;
+	for (r = rings; r; r = r->next, n++) {
+		struct ring_cursor *c = &cursors[n];
+		c->r = r;
+		c->end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		c->pos = c->end > TRACE_RING_SIZE ? c->end - TRACE_RING_SIZE : 0;
+		cursor_next(c, &after);
+	}
+
+	while (trace->nentries < UNIONFS_TRACE_CHUNK) {
+		struct ring_cursor *min = NULL;
+		for (i = 0; i < n; i++) {
+			if (!cursors[i].valid) continue;
+			if (min == NULL || entry_cmp(&cursors[i].e, &min->e) < 0) min = &cursors[i];
+		}
+		if (min == NULL) break;
+
+		trace->entries[trace->nentries++] = min->e;
+		cursor_next(min, &after);
+	}
+
+	free(cursors);
+out:
+	pthread_mutex_unlock(&rings_lock);
+}
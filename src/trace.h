@@ -0,0 +1,21 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uioctl.h"
+
+extern bool trace_on;
+
+void trace_set(bool on);
+void trace_op(enum unionfs_stats_op op, uint64_t start, const char *path, int res);
+void trace_begin(void);
+void trace_branch(int branch);
+void trace_get(struct unionfs_trace *trace);
+
+#endif
@@ -7,16 +7,157 @@
 #ifndef UIOCTL_H_
 #define UIOCTL_H_
 
+#include <stdint.h>
 #include <sys/ioctl.h>
 
 #include "unionfs.h"
 
+// files being copied in the background, see cow_async.c
+struct unionfs_copyup_progress {
+	uint64_t files;
+	uint64_t bytes_total;
+	uint64_t bytes_done;
+	uint64_t finished;	// files copied since mount
+};
 
-enum unionfs_ioctls {
+// the operations timed by the statistics, see stats.c
+enum unionfs_stats_op {
+	UNIONFS_OP_ACCESS,
+	UNIONFS_OP_CHMOD,
+	UNIONFS_OP_CHOWN,
+	UNIONFS_OP_CREATE,
+	UNIONFS_OP_FLUSH,
+	UNIONFS_OP_FSYNC,
+	UNIONFS_OP_GETATTR,
+	UNIONFS_OP_GETXATTR,
+	UNIONFS_OP_IOCTL,
+	UNIONFS_OP_LINK,
+	UNIONFS_OP_LISTXATTR,
+	UNIONFS_OP_MKDIR,
+	UNIONFS_OP_MKNOD,
+	UNIONFS_OP_OPEN,
+	UNIONFS_OP_OPENDIR,
+	UNIONFS_OP_READ,
+	UNIONFS_OP_READ_BUF,
+	UNIONFS_OP_READDIR,
+	UNIONFS_OP_READLINK,
+	UNIONFS_OP_RELEASE,
+	UNIONFS_OP_RELEASEDIR,
+	UNIONFS_OP_REMOVEXATTR,
+	UNIONFS_OP_RENAME,
+	UNIONFS_OP_RMDIR,
+	UNIONFS_OP_SETXATTR,
+	UNIONFS_OP_STATFS,
+	UNIONFS_OP_SYMLINK,
+	UNIONFS_OP_TRUNCATE,
+	UNIONFS_OP_UNLINK,
+	UNIONFS_OP_UTIMENS,
+	UNIONFS_OP_WRITE,
+	UNIONFS_OP_WRITE_BUF,
+	UNIONFS_STATS_OPS
+};
+
+// latency bucket 0 counts calls below 1us, bucket i calls below 2^i us
+// and the last one all slower calls
+#define UNIONFS_STATS_LAT_BUCKETS 20
+#define UNIONFS_STATS_BRANCHES 32	// later branches only count in bytes_read/written
+#define UNIONFS_STATS_COPY_METHODS 8
+#define UNIONFS_STATS_NAME_LEN 16
+
+struct unionfs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t time_ns;
+	uint64_t latency[UNIONFS_STATS_LAT_BUCKETS];
+};
+
+// all counters are 64 bit, stats.c sums them up as an array
+struct unionfs_stats_counters {
+	struct unionfs_op_stats ops[UNIONFS_STATS_OPS];
+	struct {
+		uint64_t bytes_read;
+		uint64_t bytes_written;
+	} branches[UNIONFS_STATS_BRANCHES];
+	uint64_t copyups;		// cow_cp() calls
+	uint64_t copyup_errors;
+	uint64_t copyup_ns;
+	uint64_t copy_files[UNIONFS_STATS_COPY_METHODS]; // files copied per method
+	uint64_t copy_bytes[UNIONFS_STATS_COPY_METHODS];
+	uint64_t copy_holes;		// bytes in holes, which were not copied
+	uint64_t map_adds;		// cowolf data-range map operations
+	uint64_t map_lookups;
+	uint64_t map_truncs;
+	uint64_t map_appends;		// log appends to the map files
+	uint64_t map_compactions;
+	uint64_t lookup_hits;		// lookup cache
+	uint64_t lookup_misses;
+	uint64_t bytes_read;		// all branches, also those not in branches
+	uint64_t bytes_written;
+};
+
+struct unionfs_stats {
+	uint32_t nops;			// UNIONFS_STATS_OPS of the daemon
+	uint32_t nbranches;		// counted branches
+	uint32_t ncopy_methods;
+	char op_names[UNIONFS_STATS_OPS][UNIONFS_STATS_NAME_LEN];
+	char copy_method_names[UNIONFS_STATS_COPY_METHODS][UNIONFS_STATS_NAME_LEN];
+	struct unionfs_stats_counters c;
+};
+
+// values of UNIONFS_ONOFF_DEBUG, they may be combined
+#define UNIONFS_DEBUG_LOG 1	// DBG() messages to stderr and the debug file
+#define UNIONFS_DEBUG_TRACE 2	// binary trace of the operations, see trace.c
+
+#define UNIONFS_TRACE_CHUNK 256	// entries per UNIONFS_TRACE call
+
+struct unionfs_trace_entry {
+	uint64_t time_ns;	// CLOCK_MONOTONIC when the operation started
+	uint64_t latency_ns;
+	uint64_t seq;		// position in the ring
+	uint32_t ring;		// each thread writes into its own ring
+	uint32_t path_hash;	// string_hash() of the path in the union
+	int32_t res;
+	uint16_t op;		// enum unionfs_stats_op
+	int16_t branch;		// the branch last found for the operation, -1 if none
+};
+
+struct unionfs_trace {
+	// in: only entries ordered after this one by time, ring and seq are
+	// returned, all zero for the oldest ones
+	struct unionfs_trace_entry after;
+	uint32_t nentries;	// out: a full chunk means there might be more
+	uint32_t nops;
+	char op_names[UNIONFS_STATS_OPS][UNIONFS_STATS_NAME_LEN];
+	struct unionfs_trace_entry entries[UNIONFS_TRACE_CHUNK];
+};
+
+// bandwidth limit of copy-ups, see copy_qos.c
+struct unionfs_copyup_qos {
+	int32_t branch;		// -1 for all branches
+	uint32_t pad;
+	uint64_t bwlimit;	// bytes per second, 0 = no limit
+};
+
+// a branch changed while mounted, see branches.c
+struct unionfs_branch {
+	int32_t branch;		// UNIONFS_ADD_BRANCH: out, the index of the new branch
+	uint32_t rw;		// 1 for rw, 0 for ro, not used to remove a branch
+	char path[PATHLEN_MAX];	// UNIONFS_ADD_BRANCH: the absolute path of the branch
+};
+
+typedef enum unionfs_ioctls {
 	UNIONFS_ONOFF_DEBUG         = _IOW('E', 0, int),
 	UNIONFS_SET_DEBUG_FILE      = _IOW('E', 1, char[PATHLEN_MAX]),
-	UNIONFS_STATS_BYTES_READ    = _IOW('E', 2, void),
-	UNIONFS_STATS_BYTES_WRITTEN = _IOW('E', 3, void),
+	UNIONFS_STATS_BYTES_READ    = _IOR('E', 2, uint64_t),
+	UNIONFS_STATS_BYTES_WRITTEN = _IOR('E', 3, uint64_t),
+	UNIONFS_COPYUP_PROGRESS     = _IOR('E', 4, struct unionfs_copyup_progress),
+	UNIONFS_STATS               = _IOR('E', 5, struct unionfs_stats),
+	UNIONFS_TRACE               = _IOWR('E', 6, struct unionfs_trace),
+	UNIONFS_COMPACT_WHITEOUTS   = _IOR('E', 7, uint64_t),	// number of whiteouts removed
+	UNIONFS_SET_COPYUP_QOS      = _IOW('E', 8, struct unionfs_copyup_qos),
+	UNIONFS_ADD_BRANCH          = _IOWR('E', 9, struct unionfs_branch),
+	UNIONFS_REMOVE_BRANCH       = _IOW('E', 10, struct unionfs_branch),
+	UNIONFS_SET_BRANCH_MODE     = _IOW('E', 11, struct unionfs_branch),
 } unionfs_ioctls_t;
 
 #endif // UIOCTL_H_
@@ -20,6 +20,13 @@
 #include "debug.h"
 #include "opts.h"
 #include "usyslog.h"
+#include "lookup_cache.h"
+#include "xattr_cache.h"
+#include "dir_cache.h"
+#include "fuse_ll_ops.h"
+#include "stats.h"
+#include "record.h"
+#include "session.h"
 
 static struct fuse_opt unionfs_opts[] = {
 	FUSE_OPT_KEY("chroot=%s,", KEY_CHROOT),
@@ -34,10 +41,40 @@ static struct fuse_opt unionfs_opts[] = {
 	FUSE_OPT_KEY("noinitgroups", KEY_NOINITGROUPS),
 	FUSE_OPT_KEY("relaxed_permissions", KEY_RELAXED_PERMISSIONS),
 	FUSE_OPT_KEY("statfs_omit_ro", KEY_STATFS_OMIT_RO),
+	FUSE_OPT_KEY("statfs_cache=%s", KEY_STATFS_CACHE),
+	FUSE_OPT_KEY("bloom_filter", KEY_BLOOM_FILTER),
+	FUSE_OPT_KEY("manifest", KEY_MANIFEST),
+	FUSE_OPT_KEY("clone_fd", KEY_CLONE_FD),
+	FUSE_OPT_KEY("min_idle_threads=%s", KEY_MIN_IDLE_THREADS),
+	FUSE_OPT_KEY("max_idle_threads=%s", KEY_MAX_IDLE_THREADS),
+	FUSE_OPT_KEY("pin_threads", KEY_PIN_THREADS),
+	FUSE_OPT_KEY("copyup_bwlimit=%s", KEY_COPYUP_BWLIMIT),
+	FUSE_OPT_KEY("copyup_ioprio=%s", KEY_COPYUP_IOPRIO),
+	FUSE_OPT_KEY("copyup_streams=%s", KEY_COPYUP_STREAMS),
+	FUSE_OPT_KEY("copyup_chunk=%s", KEY_COPYUP_CHUNK),
+	FUSE_OPT_KEY("direct_io_paths=%s", KEY_DIRECT_IO_PATHS),
+	FUSE_OPT_KEY("xattr_cache=%s", KEY_XATTR_CACHE),
+	FUSE_OPT_KEY("skip_capability", KEY_SKIP_CAPABILITY),
+	FUSE_OPT_KEY("max_branches=%s", KEY_MAX_BRANCHES),
+	FUSE_OPT_KEY("record_file=%s", KEY_RECORD_FILE),
 	FUSE_OPT_KEY("--version", KEY_VERSION),
 	FUSE_OPT_KEY("-V", KEY_VERSION),
 	FUSE_OPT_KEY("cowolf", KEY_COWOLF),
 	FUSE_OPT_KEY("cowolf_file_size=%s", KEY_COWOLF_THSIZE),
+	FUSE_OPT_KEY("cowolf_block_size=%s", KEY_COWOLF_BLOCK_SIZE),
+	FUSE_OPT_KEY("lookup_cache=%s", KEY_LOOKUP_CACHE),
+	FUSE_OPT_KEY("lookup_cache_size=%s", KEY_LOOKUP_CACHE_SIZE),
+	FUSE_OPT_KEY("whiteout_index", KEY_WHITEOUT_INDEX),
+	FUSE_OPT_KEY("readdir_cache=%s", KEY_READDIR_CACHE),
+	FUSE_OPT_KEY("lowlevel", KEY_LOWLEVEL),
+	FUSE_OPT_KEY("async_copyup=%s", KEY_ASYNC_COPYUP),
+	FUSE_OPT_KEY("io_uring", KEY_IO_URING),
+	FUSE_OPT_KEY("io_uring=%s", KEY_IO_URING),
+	FUSE_OPT_KEY("keep_cache_ro", KEY_KEEP_CACHE_RO),
+	FUSE_OPT_KEY("watch_branches", KEY_WATCH_BRANCHES),
+	FUSE_OPT_KEY("stats_file=%s", KEY_STATS_FILE),
+	FUSE_OPT_KEY("dir_copyup=%s", KEY_DIR_COPYUP),
+	FUSE_OPT_KEY("redirect_dir", KEY_REDIRECT_DIR),
 	FUSE_OPT_END
 };
 
@@ -79,6 +116,9 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	unionfs_post_opts();
+	lookup_cache_init();
+	xattr_cache_init();
+	dir_cache_init();
 
 #ifdef FUSE_CAP_BIG_WRITES
 	/* libfuse > 0.8 supports large IO, also for reads, to increase performance
@@ -89,7 +129,15 @@ int main(int argc, char *argv[]) {
 	}
 #endif
 
+	stats_wrap_ops(&unionfs_oper);
+
 	umask(0);
-	int res = fuse_main(args.argc, args.argv, &unionfs_oper, NULL);
+	int res;
+	if (uopt.lowlevel && !uopt.doexit) {
+		res = unionfs_ll_main(&args);
+	} else {
+		res = session_main(&args, &unionfs_oper);
+	}
+	record_stop();
 	RETURN(uopt.doexit ? uopt.retval : res);
 }
@@ -7,10 +7,16 @@
 #ifndef UNIONFS_H
 #define UNIONFS_H
 
+#include <sys/types.h>
+
 #define PATHLEN_MAX 1024
 #define HIDETAG "_HIDDEN~"
 #define COWOLF_DRMAPTAG "_DRMAP~"
 #define COWOLF_LINKTAG "_LBLINK~"
+#define REDIRECTTAG "_REDIRECT~"
+
+// entry and attribute timeout of files on immutable branches, in seconds
+#define IMM_TIMEOUT 86400.0
 
 #define METANAME ".unionfs"
 #define METADIR (METANAME  "/") // string concetanation!
@@ -42,6 +48,8 @@ typedef struct {
 	int path_len;		// strlen(path)
 	int fd;			 // used to prevent accidental umounts of path
 	unsigned char rw;	 // the writable flag
+	unsigned char imm;	 // never changes, implies read-only
+	dev_t dev;		 // st_dev of path, for statfs
 } branch_entry_t;
 
 extern struct fuse_operations unionfs_oper;
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -9,14 +10,225 @@
 #include "uioctl.h"
 
 
+/**
+ * Upper bound of the latency of the given quantile of the calls, in us
+ */
+static unsigned long long latency_quantile(const struct unionfs_op_stats *op, double q) {
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < UNIONFS_STATS_LAT_BUCKETS - 1; i++) {
+		sum += op->latency[i];
+		if (sum >= q * op->calls) break;
+	}
+
+	return 1ULL << i;
+}
+
+static void print_stats(const struct unionfs_stats *s) {
+	const struct unionfs_stats_counters *c = &s->c;
+	unsigned int i;
+
+	printf("%-12s %12s %8s %10s %10s %10s\n",
+		"operation", "calls", "errors", "avg us", "p50 us", "p99 us");
+	for (i = 0; i < s->nops; i++) {
+		const struct unionfs_op_stats *op = &c->ops[i];
+		if (op->calls == 0) continue;
+
+		printf("%-12s %12llu %8llu %10.1f %9s%llu %9s%llu\n", s->op_names[i],
+			(unsigned long long)op->calls,
+			(unsigned long long)op->errors,
+			op->time_ns / 1000.0 / op->calls,
+			"<", latency_quantile(op, 0.5),
+			"<", latency_quantile(op, 0.99));
+	}
+	printf("\n");
+
+	for (i = 0; i < s->nbranches; i++) {
+		printf("branch %u: %llu bytes read, %llu bytes written\n", i,
+			(unsigned long long)c->branches[i].bytes_read,
+			(unsigned long long)c->branches[i].bytes_written);
+	}
+	printf("all branches: %llu bytes read, %llu bytes written\n",
+		(unsigned long long)c->bytes_read, (unsigned long long)c->bytes_written);
+
+	printf("copy-ups: %llu, %llu failed, %.3f s\n",
+		(unsigned long long)c->copyups,
+		(unsigned long long)c->copyup_errors,
+		c->copyup_ns / 1e9);
+	for (i = 0; i < s->ncopy_methods; i++) {
+		if (c->copy_files[i] == 0) continue;
+		printf("  %-10s %llu files, %llu bytes\n", s->copy_method_names[i],
+			(unsigned long long)c->copy_files[i],
+			(unsigned long long)c->copy_bytes[i]);
+	}
+	printf("  holes      %llu bytes not copied\n",
+		(unsigned long long)c->copy_holes);
+
+	printf("datamaps: %llu adds, %llu lookups, %llu truncates, "
+		"%llu appends, %llu compactions\n",
+		(unsigned long long)c->map_adds,
+		(unsigned long long)c->map_lookups,
+		(unsigned long long)c->map_truncs,
+		(unsigned long long)c->map_appends,
+		(unsigned long long)c->map_compactions);
+
+	uint64_t lookups = c->lookup_hits + c->lookup_misses;
+	printf("lookup cache: %llu hits, %llu misses (%.1f%% hits)\n",
+		(unsigned long long)c->lookup_hits,
+		(unsigned long long)c->lookup_misses,
+		lookups ? 100.0 * c->lookup_hits / lookups : 0.0);
+}
+
+/**
+ * Read the trace of the mount in chunks and print it, oldest entries first.
+ */
+static int print_trace(int fd) {
+	struct unionfs_trace *t = calloc(1, sizeof(struct unionfs_trace));
+	if (t == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	printf("%-18s %5s %-12s %-8s %6s %10s %s\n",
+		"time s", "ring", "operation", "path", "branch", "latency us", "result");
+	do {
+		if (ioctl(fd, UNIONFS_TRACE, t) == -1) {
+			fprintf(stderr, "trace ioctl failed: %s\n", strerror(errno));
+			free(t);
+			return -1;
+		}
+
+		uint32_t i;
+		for (i = 0; i < t->nentries; i++) {
+			const struct unionfs_trace_entry *e = &t->entries[i];
+			const char *op = e->op < t->nops ? t->op_names[e->op] : "?";
+
+			printf("%18.9f %5u %-12s %08x %6d %10.1f ", e->time_ns / 1e9,
+				e->ring, op, e->path_hash, e->branch, e->latency_ns / 1000.0);
+			if (e->res < 0) printf("%s\n", strerror(-e->res));
+			else printf("%d\n", e->res);
+		}
+
+		if (t->nentries) t->after = t->entries[t->nentries - 1];
+	} while (t->nentries == UNIONFS_TRACE_CHUNK);
+
+	free(t);
+	return 0;
+}
+
+/**
+ * Parse "[branch:]rate" of -b, the rate might have a k, m or g suffix
+ */
+static int parse_copyup_qos(const char *arg, struct unionfs_copyup_qos *qos) {
+	char *end;
+
+	memset(qos, 0, sizeof(*qos));
+	qos->branch = -1;
+
+	const char *colon = strchr(arg, ':');
+	if (colon) {
+		long branch = strtol(arg, &end, 10);
+		if (end == arg || end != colon || branch < 0) return -1;
+		qos->branch = branch;
+		arg = colon + 1;
+	}
+
+	unsigned long long rate = strtoull(arg, &end, 10);
+	if (end == arg) return -1;
+	switch (*end) {
+		case 'g': case 'G': rate *= 1024;
+		// fall through
+		case 'm': case 'M': rate *= 1024;
+		// fall through
+		case 'k': case 'K': rate *= 1024;
+			end++;
+			break;
+	}
+	if (*end != '\0') return -1;
+
+	qos->bwlimit = rate;
+	return 0;
+}
+
+/**
+ * Parse the RW or RO of a branch
+ */
+static int parse_branch_mode(const char *mode, uint32_t *rw) {
+	if (strcasecmp(mode, "rw") == 0) *rw = 1;
+	else if (strcasecmp(mode, "ro") == 0) *rw = 0;
+	else return -1;
+	return 0;
+}
+
+/**
+ * Parse "path[=RW|RO]" of -a, the path is made absolute
+ */
+static int parse_add_branch(const char *arg, struct unionfs_branch *b) {
+	char path[PATHLEN_MAX];
+
+	memset(b, 0, sizeof(*b));
+
+	const char *eq = strchr(arg, '=');
+	size_t len = eq ? (size_t)(eq - arg) : strlen(arg);
+	if (len == 0 || len >= PATHLEN_MAX) return -1;
+	memcpy(path, arg, len);
+	path[len] = '\0';
+
+	if (eq && parse_branch_mode(eq + 1, &b->rw)) return -1;
+
+	if (realpath(path, b->path) == NULL) {
+		fprintf(stderr, "Failed to resolve %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	return 0;
+}
+
+/**
+ * Parse "branch=RW|RO" of -m
+ */
+static int parse_set_branch_mode(const char *arg, struct unionfs_branch *b) {
+	char *end;
+
+	memset(b, 0, sizeof(*b));
+
+	long branch = strtol(arg, &end, 10);
+	if (end == arg || *end != '=' || branch < 0) return -1;
+	b->branch = branch;
+
+	return parse_branch_mode(end + 1, &b->rw);
+}
+
 static void print_help(char* progname) {
 	fprintf(stderr, "Usage:\n");
 	fprintf(stderr, "     %s <parameter1> [<parameter2>] [file-path] \n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "     List of parameters\n");
 	fprintf(stderr, "       -p </path/to/debug/file>\n");
-	fprintf(stderr, "       -d <on/off>\n");
-	fprintf(stderr, "          Enable or disable debugging.\n");
+	fprintf(stderr, "       -d <on/off/trace>\n");
+	fprintf(stderr, "          Enable or disable debugging, or only record\n");
+	fprintf(stderr, "          the binary trace of the operations.\n");
+	fprintf(stderr, "       -c\n");
+	fprintf(stderr, "          Show the progress of background copy-ups.\n");
+	fprintf(stderr, "       -s\n");
+	fprintf(stderr, "          Show the statistics of the mount.\n");
+	fprintf(stderr, "       -t\n");
+	fprintf(stderr, "          Print the recorded trace of the operations.\n");
+	fprintf(stderr, "       -w\n");
+	fprintf(stderr, "          Remove the whiteouts below directories that\n");
+	fprintf(stderr, "          are hidden as a whole.\n");
+	fprintf(stderr, "       -b [branch:]rate\n");
+	fprintf(stderr, "          Copy up at most rate bytes per second from the\n");
+	fprintf(stderr, "          branch, from each branch without one. 0 removes\n");
+	fprintf(stderr, "          the limit.\n");
+	fprintf(stderr, "       -a path[=RW|RO]\n");
+	fprintf(stderr, "          Add a branch below the lowest one, read-only by\n");
+	fprintf(stderr, "          default. Needs room by -o max_branches.\n");
+	fprintf(stderr, "       -r branch\n");
+	fprintf(stderr, "          Remove the lowest branch.\n");
+	fprintf(stderr, "       -m branch=RW|RO\n");
+	fprintf(stderr, "          Make a branch writable or read-only.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Example: ");
 	fprintf(stderr, " %s -p /tmp/unionfs-fuse.log -d on /mnt/unionfs/union\n", progname);
@@ -46,7 +258,13 @@ int main(int argc, char **argv) {
 	const char* argument_param;
 	int debug_on_off;
 	int ioctl_res;
-	while ((opt = getopt(argc, argv, "d:p:")) != -1) {
+	struct unionfs_copyup_progress progress;
+	struct unionfs_stats stats;
+	uint64_t removed;
+	struct unionfs_copyup_qos qos;
+	struct unionfs_branch branch;
+	char *end;
+	while ((opt = getopt(argc, argv, "a:b:d:m:p:r:cstw")) != -1) {
 		switch (opt) {
 		case 'p':
 			argument_param = optarg;
@@ -79,13 +297,15 @@ int main(int argc, char **argv) {
 			}
 
 			if (strncmp(argument_param, "on", 2) == 0)
-				debug_on_off = 1;
+				debug_on_off = UNIONFS_DEBUG_LOG;
 			else if ((strncmp(argument_param, "off", 3) == 0) )
 				debug_on_off = 0;
+			else if (strcmp(argument_param, "trace") == 0)
+				debug_on_off = UNIONFS_DEBUG_TRACE;
 			else {
 				fprintf(stderr,
 					"invalid \"-d %s\" option given, valid is "
-					"\"-d on/off\"!\n", argument_param);
+					"\"-d on/off/trace\"!\n", argument_param);
 				exit(1);
 			}
 
@@ -96,6 +316,108 @@ int main(int argc, char **argv) {
 				exit(1);
 			}
 			break;
+		case 'c':
+			ioctl_res = ioctl(fd, UNIONFS_COPYUP_PROGRESS, &progress);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "copy-up progress ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			printf("copying: %llu files, %llu of %llu bytes\n",
+				(unsigned long long)progress.files,
+				(unsigned long long)progress.bytes_done,
+				(unsigned long long)progress.bytes_total);
+			printf("finished: %llu files\n",
+				(unsigned long long)progress.finished);
+			break;
+		case 's':
+			ioctl_res = ioctl(fd, UNIONFS_STATS, &stats);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "stats ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			print_stats(&stats);
+			break;
+		case 't':
+			if (print_trace(fd)) exit(1);
+			break;
+		case 'w':
+			ioctl_res = ioctl(fd, UNIONFS_COMPACT_WHITEOUTS, &removed);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "whiteout compaction ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			printf("%llu whiteouts removed\n", (unsigned long long)removed);
+			break;
+		case 'b':
+			if (parse_copyup_qos(optarg, &qos)) {
+				fprintf(stderr,
+					"invalid \"-b %s\" option given, valid is "
+					"\"-b [branch:]rate\"!\n", optarg);
+				exit(1);
+			}
+
+			ioctl_res = ioctl(fd, UNIONFS_SET_COPYUP_QOS, &qos);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "copy-up limit ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 'a':
+			if (parse_add_branch(optarg, &branch)) {
+				fprintf(stderr,
+					"invalid \"-a %s\" option given, valid is "
+					"\"-a path[=RW|RO]\"!\n", optarg);
+				exit(1);
+			}
+
+			ioctl_res = ioctl(fd, UNIONFS_ADD_BRANCH, &branch);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "add branch ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+
+			printf("added branch %d\n", branch.branch);
+			break;
+		case 'r':
+			memset(&branch, 0, sizeof(branch));
+			branch.branch = strtol(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || branch.branch < 0) {
+				fprintf(stderr,
+					"invalid \"-r %s\" option given, valid is "
+					"\"-r branch\"!\n", optarg);
+				exit(1);
+			}
+
+			ioctl_res = ioctl(fd, UNIONFS_REMOVE_BRANCH, &branch);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "remove branch ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
+		case 'm':
+			if (parse_set_branch_mode(optarg, &branch)) {
+				fprintf(stderr,
+					"invalid \"-m %s\" option given, valid is "
+					"\"-m branch=RW|RO\"!\n", optarg);
+				exit(1);
+			}
+
+			ioctl_res = ioctl(fd, UNIONFS_SET_BRANCH_MODE, &branch);
+			if (ioctl_res == -1) {
+				fprintf(stderr, "branch mode ioctl failed: %s\n",
+					strerror(errno) );
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "Unhandled option %c given.\n", opt);
 			break;
@@ -20,6 +20,7 @@
 #include <strings.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 
 #include "unionfs.h"
@@ -30,6 +31,7 @@
 #include "findbranch.h"
 #include "string.h"
 #include "cowolf.h"
+#include "lookup_cache.h"
 
 /**
   * If the branch that has the file to be unlinked is in read-only mode,
@@ -61,12 +63,11 @@ static int unlink_ro(const char *path, int branch_ro) {
 static int unlink_rw(const char *path, int branch_rw) {
 	DBG("%s\n", path);
 
-	char p[PATHLEN_MAX];
-	if (BUILD_PATH(p, uopt.branches[branch_rw].path, path)) RETURN(ENAMETOOLONG);
-
-	int res = unlink(p);
+	int res = unlinkat(uopt.branches[branch_rw].fd, branch_relpath(path), 0);
 	if (res == -1) RETURN(errno);
 
+	lookup_cache_invalidate(path);
+
 	RETURN(0);
 }
 
@@ -0,0 +1,439 @@
+/*
+* Description: io_uring engine for file data I/O
+*
+* License: BSD-style license
+*
+* Details:
+*	With -o io_uring=<depth> the reads and writes of file data, the
+*	segment reads of cowolf files and the buffered copy-up go through
+*	io_uring instead of pread()/pwrite(). Every thread gets its own ring
+*	of <depth> entries on first use, so there is no locking. The calls
+*	still wait for their I/O, but the ones doing several requests keep
+*	them all in flight: a cowolf read submits the reads of both branches
+*	at once, a copy-up keeps up to URING_COPY_SLOTS buffers in flight.
+*
+*	Without a ring, because the option is not given, the kernel does
+*	not support io_uring or a ring could not be set up, the functions
+*	fall back to the plain system calls, except for uring_preadv_batch()
+*	and uring_copy(). Callers check uring_available() before using them.
+*
+*	The rings are set up with the raw system calls, so neither liburing
+*	nor a particular version of it is required.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "uring.h"
+#include "opts.h"
+#include "debug.h"
+#include "usyslog.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_COPY_SLOTS 16	// max buffers of uring_copy() in flight
+
+struct uring {
+	int fd;
+	unsigned int entries;
+	unsigned int inflight;		// submitted, but not reaped
+	unsigned int to_submit;		// queued, but not submitted
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	char *copy_buf;			// URING_COPY_SLOTS buffers
+	size_t copy_bufsize;
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static bool ring_failed;		// do not try to set up rings anymore
+
+static void ring_free(void *p) {
+	struct uring *r = p;
+
+	if (r->sqes) munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_size);
+	if (r->fd >= 0) close(r->fd);
+	free(r->copy_buf);
+	free(r);
+}
+
+static void ring_key_init(void) {
+	pthread_key_create(&ring_key, ring_free);
+}
+
+static struct uring *ring_setup(unsigned int entries) {
+	struct uring *r = calloc(1, sizeof(struct uring));
+	if (r == NULL) return NULL;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) goto err;
+	r->entries = p.sq_entries;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err;
+	}
+
+	char *sq = r->sq_ring, *cq = r->cq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return r;
+err:
+	USYSLOG(LOG_WARNING, "Setting up io_uring failed, using synchronous I/O. %s\n",
+		strerror(errno));
+	ring_free(r);
+	return NULL;
+}
+
+/**
+ * Returns the ring of the calling thread, sets it up on first use.
+ */
+static struct uring *ring_get(void) {
+	if (uopt.io_uring_depth == 0 || ring_failed) return NULL;
+
+	pthread_once(&ring_once, ring_key_init);
+
+	struct uring *r = pthread_getspecific(ring_key);
+	if (r != NULL) return r;
+
+	r = ring_setup(uopt.io_uring_depth);
+	if (r == NULL) {
+		// no point in trying again for every thread
+		ring_failed = true;
+		return NULL;
+	}
+
+	if (pthread_setspecific(ring_key, r)) {
+		ring_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/**
+ * Queues a readv or writev, the caller has to make sure that there is
+ * space, r->inflight < r->entries.
+ */
+static void ring_queue(struct uring *r, int op, int fd, const struct iovec *iov,
+	int iovcnt, off_t offset, uint64_t data) {
+
+	unsigned int tail = *r->sq_tail;
+	unsigned int idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = data;
+	r->sq_array[idx] = idx;
+
+	// the kernel must not see the new tail before the entry
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	r->inflight++;
+}
+
+/**
+ * Submits the queued requests and returns the next completion, waits for
+ * one if there is none yet.
+ * @return 0 on success, -1 on failure.
+ */
+static int ring_wait(struct uring *r, uint64_t *data, ssize_t *res) {
+	while (1) {
+		unsigned int head = *r->cq_head;
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			*data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+			r->inflight--;
+			return 0;
+		}
+
+		int n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+			USYSLOG(LOG_ERR, "io_uring_enter failed. %s\n", strerror(errno));
+			return -1;
+		}
+		r->to_submit -= n;
+	}
+}
+
+/**
+ * Does a single readv or writev and waits for it.
+ */
+static ssize_t ring_rw(struct uring *r, int op, int fd, void *buf, size_t count,
+	off_t offset) {
+
+	struct iovec iov = { buf, count };
+	uint64_t data;
+	ssize_t res;
+
+	ring_queue(r, op, fd, &iov, 1, offset, 0);
+	if (ring_wait(r, &data, &res) != 0) return -1;
+
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+
+	return res;
+}
+
+bool uring_available(void) {
+	return ring_get() != NULL;
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t count, off_t offset) {
+	struct uring *r = ring_get();
+	if (r == NULL) return pread(fd, buf, count, offset);
+
+	return ring_rw(r, IORING_OP_READV, fd, buf, count, offset);
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+	struct uring *r = ring_get();
+	if (r == NULL) return pwrite(fd, buf, count, offset);
+
+	return ring_rw(r, IORING_OP_WRITEV, fd, (void *)buf, count, offset);
+}
+
+/**
+ * Does all the reads at once, up to the depth of the ring is in flight.
+ * The result of each read is stored in its res.
+ * @return 0 on success, -1 if the ring failed.
+ */
+int uring_preadv_batch(struct uring_io *ios, unsigned int n) {
+	struct uring *r = ring_get();
+	if (r == NULL) {
+		errno = ENOSYS;
+		RETURN(-1);
+	}
+
+	unsigned int next = 0, done = 0;
+	while (done < n) {
+		while (next < n && r->inflight < r->entries) {
+			ring_queue(r, IORING_OP_READV, ios[next].fd, ios[next].iov,
+				ios[next].iovcnt, ios[next].offset, next);
+			next++;
+		}
+
+		uint64_t data;
+		ssize_t res;
+		if (ring_wait(r, &data, &res) != 0) RETURN(-1);
+		ios[data].res = res;
+		done++;
+	}
+
+	RETURN(0);
+}
+
+/* a buffer of uring_copy() */
+struct copy_slot {
+	struct iovec iov;
+	off_t offset;		// offset of the buffer in the file
+	size_t len;		// bytes to copy into the buffer
+	size_t got;		// bytes read so far
+	bool writing;
+};
+
+/**
+ * Starts the read of the rest of the slot.
+ */
+static void copy_read(struct uring *r, int fd, struct copy_slot *s, unsigned int i) {
+	s->writing = false;
+	s->iov.iov_base = r->copy_buf + i * r->copy_bufsize + s->got;
+	s->iov.iov_len = s->len - s->got;
+	ring_queue(r, IORING_OP_READV, fd, &s->iov, 1, s->offset + s->got, i);
+}
+
+static void copy_write(struct uring *r, int fd, struct copy_slot *s, unsigned int i) {
+	s->writing = true;
+	s->iov.iov_base = r->copy_buf + i * r->copy_bufsize;
+	s->iov.iov_len = s->got;
+	ring_queue(r, IORING_OP_WRITEV, fd, &s->iov, 1, s->offset, i);
+}
+
+/**
+ * Copies len bytes at offset of from_fd to the same offset of to_fd, or
+ * up to the end of from_fd. Several buffers of bufsize are in flight.
+ * @param copied the number of bytes copied
+ * @return 0 on success, -1 on failure.
+ */
+int uring_copy(int from_fd, int to_fd, off_t offset, off_t len, size_t bufsize,
+	off_t *copied) {
+
+	*copied = 0;
+
+	struct uring *r = ring_get();
+	if (r == NULL) {
+		errno = ENOSYS;
+		RETURN(-1);
+	}
+
+	unsigned int nslots = r->entries < URING_COPY_SLOTS ? r->entries : URING_COPY_SLOTS;
+	if (r->copy_bufsize != bufsize) {
+		char *buf = realloc(r->copy_buf, nslots * bufsize);
+		if (buf == NULL) RETURN(-1);
+		r->copy_buf = buf;
+		r->copy_bufsize = bufsize;
+	}
+
+	struct copy_slot slots[URING_COPY_SLOTS];
+	off_t next = offset, end = offset + len;
+	int err = 0;
+
+	unsigned int i;
+	for (i = 0; i < nslots && next < end; i++) {
+		slots[i].offset = next;
+		slots[i].len = end - next < (off_t)bufsize ? (size_t)(end - next) : bufsize;
+		slots[i].got = 0;
+		next += slots[i].len;
+		copy_read(r, from_fd, &slots[i], i);
+	}
+
+	// on errors, we wait for the requests in flight, they use the buffers
+	while (r->inflight > 0) {
+		uint64_t data;
+		ssize_t res;
+		if (ring_wait(r, &data, &res) != 0) RETURN(-1);
+
+		struct copy_slot *s = &slots[data];
+		if (res < 0) {
+			err = -res;
+			continue;
+		}
+
+		if (!s->writing) {
+			s->got += res;
+			if (res == 0) {
+				// end of file, no need to read any further
+				if (s->offset + (off_t)s->got < end) end = s->offset + s->got;
+				if (next > end) next = end;
+			}
+			if (err) continue;
+			if (res > 0 && s->got < s->len) {
+				copy_read(r, from_fd, s, data);
+			} else if (s->got > 0) {
+				copy_write(r, to_fd, s, data);
+			}
+			continue;
+		}
+
+		if ((size_t)res != s->got) {
+			err = EIO;
+			continue;
+		}
+		*copied += res;
+
+		if (!err && next < end) {
+			s->offset = next;
+			s->len = end - next < (off_t)bufsize ? (size_t)(end - next) : bufsize;
+			s->got = 0;
+			next += s->len;
+			copy_read(r, from_fd, s, data);
+		}
+	}
+
+	if (err) {
+		errno = err;
+		RETURN(-1);
+	}
+
+	RETURN(0);
+}
+
+#else
+
+bool uring_available(void) {
+	return false;
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t count, off_t offset) {
+	return pread(fd, buf, count, offset);
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+	return pwrite(fd, buf, count, offset);
+}
+
+int uring_preadv_batch(struct uring_io *ios, unsigned int n) {
+	(void)ios;
+	(void)n;
+	errno = ENOSYS;
+	RETURN(-1);
+}
+
+int uring_copy(int from_fd, int to_fd, off_t offset, off_t len, size_t bufsize,
+	off_t *copied) {
+	(void)from_fd;
+	(void)to_fd;
+	(void)offset;
+	(void)len;
+	(void)bufsize;
+	*copied = 0;
+	errno = ENOSYS;
+	RETURN(-1);
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined __linux__ && !defined DISABLE_IO_URING
+	#define HAVE_IO_URING
+#endif
+
+#define DEFAULT_IO_URING_DEPTH 32
+
+/* a read of a uring_preadv_batch() */
+struct uring_io {
+	int fd;
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	ssize_t res;		// bytes read, or -errno
+};
+
+bool uring_available(void);
+ssize_t uring_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t uring_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int uring_preadv_batch(struct uring_io *ios, unsigned int n);
+int uring_copy(int from_fd, int to_fd, off_t offset, off_t len, size_t bufsize,
+	off_t *copied);
+
+#endif
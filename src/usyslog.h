@@ -6,16 +6,14 @@
 #include <syslog.h>
 #include <stdbool.h>
 
-#define MAX_SYSLOG_MESSAGES 32	// max number of buffered syslog messages
+#define MAX_SYSLOG_MESSAGES 256	// max number of buffered syslog messages, a power of 2
 #define MAX_MSG_SIZE 256	// max string length for syslog messages
 
-/* chained buffer list of syslog entries  */
+/* an entry of the syslog ring buffer */
 typedef struct ulogs {
+	unsigned long seq;	// round of positions the entry is used for, see usyslog.c
 	int priority; // first argument for syslog()
 	char message[MAX_MSG_SIZE]; // 2nd argument for syslog() 
-	bool used;		// is this entry used?
-	pthread_mutex_t lock;	// lock a single entry
-	struct ulogs *next;	// pointer to the next entry
 } ulogs_t;
 
 
@@ -0,0 +1,175 @@
+/*
+* Description: collapse the whiteouts below hidden directories
+*
+* License: BSD-style license
+*
+* Details:
+*	rm -rf of a tree of a read-only branch creates one whiteout per member,
+*	e.g. "branch/.unionfs/dir/file_HIDDEN~", and at last the whiteout of
+*	the directory itself, "branch/.unionfs/dir_HIDDEN~". That one already
+*	hides everything below dir on the branches below, so the whiteouts of
+*	the members are of no use anymore. They only cost inodes on the rw
+*	branch and slow down every later scan of the meta directory.
+*	unionfs_rmdir() removes them right away, see collapse_whiteouts().
+*	whiteout_compact() does the same for a whole meta directory, for the
+*	whiteouts left by older versions, online with unionfsctl -w and
+*	offline with unionfs-compact.
+*
+*	Only whiteouts are removed and then the directories left empty, so
+*	cowolf maps and redirect records stay. Nothing of the rest of unionfs
+*	is used here, unionfs-compact links this file alone.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "unionfs.h"
+#include "whiteout_compact.h"
+
+static bool is_whiteout(const char *name) {
+	size_t len = strlen(name);
+	size_t tag = strlen(HIDETAG);
+
+	// not only the tag, like whiteout_tag()
+	return len > tag && strcmp(name + len - tag, HIDETAG) == 0;
+}
+
+static bool is_dir(DIR *dp, const struct dirent *de) {
+#ifdef _DIRENT_HAVE_D_TYPE
+	if (de->d_type != DT_UNKNOWN) return de->d_type == DT_DIR;
+#endif
+	struct stat st;
+	return fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Remove all whiteouts below the directory open as fd. fd is closed.
+ */
+static int remove_below(int fd, uint64_t *removed) {
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		bool dir = is_dir(dp, de);
+		if (is_whiteout(de->d_name)) {
+			// directory whiteouts are always empty
+			if (unlinkat(dirfd(dp), de->d_name, dir ? AT_REMOVEDIR : 0) == 0) (*removed)++;
+			else if (errno != ENOENT) res = -errno;
+			continue;
+		}
+		if (!dir) continue;
+
+		int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (sub == -1) {
+			if (errno != ENOENT) res = -errno;
+			continue;
+		}
+		int r = remove_below(sub, removed);
+		if (r) res = r;
+
+		// fails if more than whiteouts were in it
+		unlinkat(dirfd(dp), de->d_name, AT_REMOVEDIR);
+	}
+
+	closedir(dp);
+	return res;
+}
+
+/**
+ * dir, relative to dirfd, is the meta directory of a directory that is
+ * hidden as a whole. Remove the whiteouts below it, and dir itself if it is
+ * empty then. The number of removed whiteouts is added to removed.
+ */
+int whiteout_collapse(int dirfd, const char *dir, uint64_t *removed) {
+	int fd = openat(dirfd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1) {
+		// nothing was removed below the directory
+		if (errno == ENOENT || errno == ENOTDIR) return 0;
+		return -errno;
+	}
+
+	int res = remove_below(fd, removed);
+	unlinkat(dirfd, dir, AT_REMOVEDIR);
+
+	return res;
+}
+
+/**
+ * Collapse the hidden directories below the directory of the meta directory
+ * open as fd, its fuse path is path. fd is closed.
+ */
+static int compact(int fd, char *path, whiteout_collapsed_t collapsed, void *arg, uint64_t *removed) {
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+
+	size_t len = strlen(path);
+	int res = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		// whiteouts themselves, cowolf maps and redirect records
+		if (is_whiteout(de->d_name) || !is_dir(dp, de)) continue;
+
+		size_t nlen = strlen(de->d_name);
+		if (len + nlen + strlen(HIDETAG) + 2 > PATHLEN_MAX) continue;
+
+		if (len > 1) path[len] = '/';
+		memcpy(path + (len > 1 ? len + 1 : len), de->d_name, nlen + 1);
+
+		char w[PATHLEN_MAX];
+		snprintf(w, PATHLEN_MAX, "%s%s", de->d_name, HIDETAG);
+
+		int r;
+		struct stat st;
+		if (fstatat(dirfd(dp), w, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			if (collapsed) collapsed(path, arg);
+			r = whiteout_collapse(dirfd(dp), de->d_name, removed);
+		} else {
+			int sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			r = sub == -1 ? -errno : compact(sub, path, collapsed, arg, removed);
+			if (r == -ENOENT) r = 0;
+		}
+		if (r) res = r;
+
+		path[len] = '\0';
+	}
+
+	closedir(dp);
+	return res;
+}
+
+/**
+ * Collapse all hidden directories of the meta directory metadir, relative to
+ * dirfd. collapsed is called for each of them before, it might be NULL.
+ */
+int whiteout_compact(int dirfd, const char *metadir, whiteout_collapsed_t collapsed, void *arg, uint64_t *removed) {
+	int fd = openat(dirfd, metadir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1) {
+		// a branch without meta directory
+		if (errno == ENOENT) return 0;
+		return -errno;
+	}
+
+	char path[PATHLEN_MAX] = "/";
+	return compact(fd, path, collapsed, arg, removed);
+}
@@ -0,0 +1,19 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef WHITEOUT_COMPACT_H
+#define WHITEOUT_COMPACT_H
+
+#include <stdint.h>
+
+/**
+ * Called for every directory whose whiteouts are going to be collapsed,
+ * with its path in the format of fuse.
+ */
+typedef void (*whiteout_collapsed_t)(const char *path, void *arg);
+
+int whiteout_collapse(int dirfd, const char *dir, uint64_t *removed);
+int whiteout_compact(int dirfd, const char *metadir, whiteout_collapsed_t collapsed, void *arg, uint64_t *removed);
+
+#endif
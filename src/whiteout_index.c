@@ -0,0 +1,306 @@
+/*
+* Description: in-memory index of whiteouts
+*
+* License: BSD-style license
+*
+* Details:
+*	Without the index path_hidden() checks for a whiteout of every path
+*	prefix in the meta directory of a branch, so a lookup of a path with
+*	n components costs n lstat() calls per branch, even if the branch does
+*	not have a single whiteout.
+*	With -o whiteout_index we scan the meta directories of all branches
+*	once on mount and keep a set of hidden paths per branch. The set uses
+*	the same path format as fuse, e.g. "/dir1/file" for the whiteout
+*	"branch/.unionfs/dir1/file_HIDDEN~". hide_file()/hide_dir() and
+*	remove_hidden() keep it up-to-date, branches added while mounted are
+*	scanned when they are added. Whiteouts created or removed
+*	directly on the branches while mounted are not noticed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "unionfs.h"
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "string.h"
+#include "usyslog.h"
+#include "whiteout_index.h"
+
+typedef struct {
+	struct hashtable *hidden;	// set of hidden paths
+	pthread_rwlock_t lock;
+} windex_t;
+
+static windex_t *windex;
+
+/**
+ * Add path to the index of branch, must be called with the lock held.
+ */
+static void do_add(windex_t *wi, const char *path) {
+	if (hashtable_search(wi->hidden, (void *)path)) return;
+
+	char *key = strdup(path);
+	if (key == NULL || !hashtable_insert(wi->hidden, key, key)) {
+		free(key);
+		USYSLOG(LOG_ERR, "%s: out of memory, %s not indexed\n", __func__, path);
+	}
+}
+
+/**
+ * Recursively walk the meta directory of a branch and add all whiteouts.
+ * @dir  - directory in the meta directory to scan
+ * @path - fuse path corresponding to dir
+ * @old  - path dir was renamed from, its whiteouts are removed, or NULL
+ * @add  - add the whiteouts found, otherwise remove them
+ */
+static int scan_metadir(windex_t *wi, const char *dir, const char *path, const char *old, bool add) {
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		if (errno == ENOENT) return 0; // branch without meta directory
+		return -errno;
+	}
+
+	int res = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		char p[PATHLEN_MAX];
+		char member[PATHLEN_MAX];
+		char old_member[PATHLEN_MAX];
+		if (BUILD_PATH(p, dir, de->d_name)) continue;
+		if (BUILD_PATH(member, path, de->d_name)) continue;
+		if (old && BUILD_PATH(old_member, old, de->d_name)) continue;
+
+		char *tag = whiteout_tag(member);
+		if (tag) {
+			*tag = '\0';
+			if (add) do_add(wi, member);
+			else hashtable_remove(wi->hidden, member);
+			if (old) {
+				*whiteout_tag(old_member) = '\0';
+				hashtable_remove(wi->hidden, old_member);
+			}
+			continue;
+		}
+
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = lstat(p, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir) {
+			res = scan_metadir(wi, p, member, old ? old_member : NULL, add);
+			if (res) break;
+		}
+	}
+
+	closedir(dp);
+	return res;
+}
+
+/**
+ * Build the whiteout index of branch, replacing the one it had before if it
+ * was added again while mounted. Must be called once we are in the chroot
+ * (if any), since branch paths are relative to it.
+ */
+int whiteout_index_branch_init(int branch) {
+	if (!uopt.whiteout_index) RETURN(0);
+
+	windex_t *wi = &windex[branch];
+	windex_t new = { .hidden = create_hashtable(16, string_hash, string_equal) };
+	if (new.hidden == NULL) RETURN(-ENOMEM);
+
+	char metadir[PATHLEN_MAX];
+	if (BUILD_PATH(metadir, uopt.branches[branch].path, METADIR)) {
+		hashtable_destroy(new.hidden, 0);
+		RETURN(-ENAMETOOLONG);
+	}
+
+	int res = scan_metadir(&new, metadir, "/", NULL, true);
+	if (res) {
+		USYSLOG(LOG_ERR, "Scanning whiteouts of %s failed: %s\n",
+			metadir, strerror(-res));
+		hashtable_destroy(new.hidden, 0);
+		RETURN(res);
+	}
+
+	DBG("branch %d: %u whiteouts\n", branch, hashtable_count(new.hidden));
+
+	if (wi->hidden == NULL) {
+		pthread_rwlock_init(&wi->lock, NULL);
+		wi->hidden = new.hidden;
+		RETURN(0);
+	}
+
+	pthread_rwlock_wrlock(&wi->lock);
+	struct hashtable *old = wi->hidden;
+	wi->hidden = new.hidden;
+	pthread_rwlock_unlock(&wi->lock);
+
+	// keys and values are the same strings
+	hashtable_destroy(old, 0);
+	RETURN(0);
+}
+
+/**
+ * Build the whiteout index of all branches. Must be called once we are in
+ * the chroot (if any), since branch paths are relative to it.
+ */
+int whiteout_index_init(void) {
+	if (!uopt.whiteout_index) RETURN(0);
+
+	windex = calloc(uopt.max_branches, sizeof(windex_t));
+	if (windex == NULL) RETURN(-ENOMEM);
+
+	int i;
+	for (i = 0; i < uopt.nbranches; i++) {
+		int res = whiteout_index_branch_init(i);
+		if (res) RETURN(res);
+	}
+
+	RETURN(0);
+}
+
+/**
+ * Same as path_hidden(), but check the index instead of the meta directory.
+ */
+int whiteout_index_hidden(const char *path, int branch) {
+	windex_t *wi = &windex[branch];
+	int res = 0;
+
+	pthread_rwlock_rdlock(&wi->lock);
+
+	// the common case, nothing was ever deleted from lower branches
+	if (hashtable_count(wi->hidden) == 0) goto out;
+
+	char p[PATHLEN_MAX];
+	if (strlen(path) >= PATHLEN_MAX) {
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+	strcpy(p, path);
+
+	// check all prefixes, "/dir1", "/dir1/dir2", ..., just like path_hidden()
+	char *walk = p;
+	while (*walk == '/') walk++;
+	while (*walk != '\0') {
+		while (*walk != '\0' && *walk != '/') walk++;
+
+		char c = *walk;
+		*walk = '\0';
+		bool hidden = hashtable_search(wi->hidden, p) != NULL;
+		*walk = c;
+
+		if (hidden) {
+			res = 1;
+			break;
+		}
+
+		while (*walk == '/') walk++;
+	}
+
+out:
+	pthread_rwlock_unlock(&wi->lock);
+	RETURN(res);
+}
+
+/**
+ * Check if there is a whiteout for exactly this path.
+ */
+bool whiteout_index_has(const char *path, int branch) {
+	windex_t *wi = &windex[branch];
+
+	pthread_rwlock_rdlock(&wi->lock);
+	bool res = hashtable_search(wi->hidden, (void *)path) != NULL;
+	pthread_rwlock_unlock(&wi->lock);
+
+	return res;
+}
+
+/**
+ * A whiteout for path was created on branch.
+ */
+void whiteout_index_add(const char *path, int branch) {
+	if (!uopt.whiteout_index) return;
+
+	DBG("%s: %d\n", path, branch);
+
+	windex_t *wi = &windex[branch];
+
+	pthread_rwlock_wrlock(&wi->lock);
+	do_add(wi, path);
+	pthread_rwlock_unlock(&wi->lock);
+}
+
+/**
+ * The whiteout of path on branch was removed.
+ */
+void whiteout_index_remove(const char *path, int branch) {
+	if (!uopt.whiteout_index) return;
+
+	DBG("%s: %d\n", path, branch);
+
+	windex_t *wi = &windex[branch];
+
+	pthread_rwlock_wrlock(&wi->lock);
+	// value and key are the same string, which hashtable_remove() frees
+	hashtable_remove(wi->hidden, (void *)path);
+	pthread_rwlock_unlock(&wi->lock);
+}
+
+/**
+ * The whiteouts below path on branch are going to be removed, path itself
+ * keeps its whiteout. Only the meta directory of path is scanned.
+ */
+void whiteout_index_remove_tree(const char *path, int branch) {
+	if (!uopt.whiteout_index) return;
+
+	DBG("%s: %d\n", path, branch);
+
+	char metadir[PATHLEN_MAX];
+	if (BUILD_PATH(metadir, uopt.branches[branch].path, METADIR, path)) return;
+
+	windex_t *wi = &windex[branch];
+
+	pthread_rwlock_wrlock(&wi->lock);
+	int res = scan_metadir(wi, metadir, path, NULL, false);
+	pthread_rwlock_unlock(&wi->lock);
+
+	if (res) {
+		USYSLOG(LOG_ERR, "Scanning whiteouts of %s failed: %s\n",
+			metadir, strerror(-res));
+	}
+}
+
+/**
+ * The meta directory of from was renamed to the one of to on branch, move
+ * the whiteouts below it. Only the moved directory is scanned.
+ */
+void whiteout_index_rename(const char *from, const char *to, int branch) {
+	if (!uopt.whiteout_index) return;
+
+	DBG("%s -> %s: %d\n", from, to, branch);
+
+	char metadir[PATHLEN_MAX];
+	if (BUILD_PATH(metadir, uopt.branches[branch].path, METADIR, to)) return;
+
+	windex_t *wi = &windex[branch];
+
+	pthread_rwlock_wrlock(&wi->lock);
+	int res = scan_metadir(wi, metadir, to, from, true);
+	pthread_rwlock_unlock(&wi->lock);
+
+	if (res) {
+		USYSLOG(LOG_ERR, "Scanning whiteouts of %s failed: %s\n",
+			metadir, strerror(-res));
+	}
+}
@@ -0,0 +1,19 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef WHITEOUT_INDEX_H
+#define WHITEOUT_INDEX_H
+
+#include <stdbool.h>
+
+int whiteout_index_init(void);
+int whiteout_index_branch_init(int branch);
+int whiteout_index_hidden(const char *path, int branch);
+bool whiteout_index_has(const char *path, int branch);
+void whiteout_index_add(const char *path, int branch);
+void whiteout_index_remove(const char *path, int branch);
+void whiteout_index_remove_tree(const char *path, int branch);
+void whiteout_index_rename(const char *from, const char *to, int branch);
+
+#endif
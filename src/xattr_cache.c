@@ -0,0 +1,284 @@
+/*
+* Description: cache of getxattr() results
+*
+* License: BSD-style license
+*
+* Details:
+*	The kernel asks for security.capability before every write and for
+*	the POSIX ACLs on lookups, nearly always to be told ENODATA. With
+*	-o xattr_cache=<ttl> we remember the result of getxattr() per path
+*	and name for ttl seconds, the negative ones included. An entry also
+*	keeps the branch the path was found on and is only used while the
+*	path is still served by this branch, so a copy-up of the file is
+*	noticed by the lookup alone.
+*
+*	setxattr(), removexattr(), chmod() and chown() drop the entries of
+*	their path, as do all operations invalidating the lookup cache for
+*	a path or a tree, see lookup_cache_invalidate(). Trees are dropped
+*	by bumping the generation and the sequence number protects against
+*	stale results, like in lookup_cache.c.
+*
+*	The entries are found by the path and the name. To drop all entries
+*	of a path we remember the names that were cached, there are only a
+*	few of them in practice. Beyond XATTR_CACHE_NAMES others are not
+*	cached. Values of up to XATTR_CACHE_VALUE_MAX bytes are cached, of
+*	larger ones only their size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "opts.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "string.h"
+#include "usyslog.h"
+#include "stats.h"
+#include "xattr_cache.h"
+
+#define XATTR_CACHE_NAMES 32
+
+typedef struct {
+	int branch;		// branch the path was found on
+	int res;		// size of the value or -errno
+	bool have_value;	// value holds the value, not only its size
+	uint64_t expires;	// CLOCK_MONOTONIC, in ns
+	unsigned long gen;	// cache generation the entry was added in
+	char value[XATTR_CACHE_VALUE_MAX];
+} xc_entry_t;
+
+static struct hashtable *cache;
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// all protected by cache_lock
+static unsigned long cache_gen;	// bumped on tree invalidations
+static unsigned long cache_seq;	// bumped on any invalidation
+static char *names[XATTR_CACHE_NAMES];	// of all entries ever cached
+static unsigned int nnames;
+
+/**
+ * The key is the path and the name, one after the other with their '\0'.
+ */
+static char *key_create(const char *path, const char *name, char *buf, size_t size) {
+	size_t plen = strlen(path) + 1;
+	size_t nlen = strlen(name) + 1;
+
+	char *key = plen + nlen <= size ? buf : malloc(plen + nlen);
+	if (key == NULL) return NULL;
+
+	memcpy(key, path, plen);
+	memcpy(key + plen, name, nlen);
+	return key;
+}
+
+static unsigned int key_hash(void *k) {
+	char *key = k;
+	return string_hash(key) * 31 + string_hash(key + strlen(key) + 1);
+}
+
+static int key_equal(void *k1, void *k2) {
+	char *key1 = k1, *key2 = k2;
+	if (strcmp(key1, key2) != 0) return 0;
+	return strcmp(key1 + strlen(key1) + 1, key2 + strlen(key2) + 1) == 0;
+}
+
+/**
+ * Only results telling about the xattr are cached, not errors of the
+ * branch like EIO.
+ */
+static bool cacheable(int res) {
+	return res >= 0 || res == -ENOXATTR || res == -ENOTSUP;
+}
+
+/**
+ * Remember that name is cached, return false if too many names are.
+ * Must be called with cache_lock write-locked.
+ */
+static bool name_add(const char *name) {
+	unsigned int i;
+	for (i = 0; i < nnames; i++) {
+		if (strcmp(names[i], name) == 0) return true;
+	}
+
+	if (nnames == XATTR_CACHE_NAMES) return false;
+
+	names[nnames] = strdup(name);
+	if (names[nnames] == NULL) return false;
+	nnames++;
+
+	return true;
+}
+
+/**
+ * The cache is full, drop everything. Must be called with cache_lock
+ * write-locked.
+ */
+static void cache_flush(void) {
+	DBG("xattr cache full, flushing it\n");
+
+	hashtable_destroy(cache, 1);
+	cache = create_hashtable(16, key_hash, key_equal);
+	if (cache == NULL) {
+		USYSLOG(LOG_ERR, "Failed to re-create the xattr cache, disabling it.\n");
+		uopt.xattr_cache_ttl = 0;
+	}
+}
+
+/**
+ * Set up the cache, does nothing if the cache is not enabled.
+ */
+void xattr_cache_init(void) {
+	if (uopt.xattr_cache_ttl <= 0) return;
+
+	cache = create_hashtable(16, key_hash, key_equal);
+	if (cache == NULL) {
+		fprintf(stderr, "Failed to create the xattr cache, disabling it.\n");
+		uopt.xattr_cache_ttl = 0;
+	}
+}
+
+/**
+ * Return a sequence number to be given to xattr_cache_put(), must be taken
+ * before the branches are looked at.
+ */
+unsigned long xattr_cache_begin(void) {
+	if (uopt.xattr_cache_ttl <= 0) return 0;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	unsigned long seq = cache_seq;
+	pthread_rwlock_unlock(&cache_lock);
+
+	return seq;
+}
+
+/**
+ * Look up the xattr name of path, which was found on branch. Return true on
+ * a hit and set res to what getxattr() returns, value is filled in if size
+ * is not 0.
+ */
+bool xattr_cache_get(const char *path, const char *name, int branch, char *value, size_t size, int *res) {
+	if (uopt.xattr_cache_ttl <= 0) return false;
+
+	char buf[PATHLEN_MAX];
+	char *key = key_create(path, name, buf, sizeof(buf));
+	if (key == NULL) return false;
+
+	bool found = false;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	xc_entry_t *e = hashtable_search(cache, key);
+	if (e && e->gen == cache_gen && e->expires > stats_now() && e->branch == branch) {
+		if (e->res < 0 || size == 0) {
+			*res = e->res;
+			found = true;
+		} else if (size < (size_t)e->res) {
+			*res = -ERANGE;
+			found = true;
+		} else if (e->have_value) {
+			memcpy(value, e->value, e->res);
+			*res = e->res;
+			found = true;
+		}
+	}
+	pthread_rwlock_unlock(&cache_lock);
+
+	if (key != buf) free(key);
+
+	DBG("%s %s: %s\n", path, name, found ? "hit" : "miss");
+	return found;
+}
+
+/**
+ * Remember res of getxattr() of name of path on branch. value is NULL if
+ * only the size was asked for.
+ */
+void xattr_cache_put(const char *path, const char *name, int branch, const char *value, int res, unsigned long seq) {
+	if (uopt.xattr_cache_ttl <= 0 || !cacheable(res)) return;
+
+	char buf[PATHLEN_MAX];
+	char *key = key_create(path, name, buf, sizeof(buf));
+	if (key == NULL) return;
+
+	pthread_rwlock_wrlock(&cache_lock);
+
+	// something was invalidated while we were looking, this might be stale
+	if (seq != cache_seq) goto out;
+
+	xc_entry_t *e = hashtable_search(cache, key);
+	if (e == NULL) {
+		if (!name_add(name)) goto out;
+
+		if (hashtable_count(cache) >= DEFAULT_XATTR_CACHE_SIZE) {
+			cache_flush();
+			if (uopt.xattr_cache_ttl <= 0) goto out;
+		}
+
+		e = malloc(sizeof(xc_entry_t));
+		char *k = key_create(path, name, NULL, 0); // owned by the cache
+		if (e == NULL || k == NULL || !hashtable_insert(cache, k, e)) {
+			free(e);
+			free(k);
+			goto out;
+		}
+	} else if (e->have_value && value == NULL && e->res == res && e->branch == branch
+	           && e->gen == cache_gen && e->expires > stats_now()) {
+		// keep the value, only the size was asked for this time
+		value = e->value;
+	}
+
+	e->branch = branch;
+	e->res = res;
+	e->have_value = res >= 0 && value != NULL && res <= XATTR_CACHE_VALUE_MAX;
+	if (e->have_value && value != e->value) memcpy(e->value, value, res);
+	e->expires = stats_now() + (uint64_t)(uopt.xattr_cache_ttl * 1e9);
+	e->gen = cache_gen;
+
+out:
+	pthread_rwlock_unlock(&cache_lock);
+	if (key != buf) free(key);
+}
+
+/**
+ * Drop the cached xattrs of path, the entries of all names cached so far.
+ */
+void xattr_cache_invalidate(const char *path) {
+	if (uopt.xattr_cache_ttl <= 0) return;
+
+	DBG("%s\n", path);
+
+	pthread_rwlock_wrlock(&cache_lock);
+	cache_seq++;
+
+	unsigned int i;
+	for (i = 0; i < nnames; i++) {
+		char buf[PATHLEN_MAX];
+		char *key = key_create(path, names[i], buf, sizeof(buf));
+		if (key == NULL) {
+			// we cannot tell which entries are of path
+			cache_gen++;
+			break;
+		}
+		free(hashtable_remove(cache, key));
+		if (key != buf) free(key);
+	}
+
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * Drop the cached xattrs of path and everything below it.
+ */
+void xattr_cache_invalidate_tree(const char *path) {
+	if (uopt.xattr_cache_ttl <= 0) return;
+
+	DBG("%s\n", path);
+
+	pthread_rwlock_wrlock(&cache_lock);
+	cache_seq++;
+	cache_gen++;
+	pthread_rwlock_unlock(&cache_lock);
+}
@@ -0,0 +1,29 @@
+/*
+* License: BSD-style license
+*/
+
+#ifndef XATTR_CACHE_H
+#define XATTR_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+
+#define DEFAULT_XATTR_CACHE_SIZE 65536
+#define XATTR_CACHE_VALUE_MAX 512	// larger values are only cached by their size
+
+// getxattr() of an xattr which does not exist
+#if __APPLE__
+	#define ENOXATTR ENOATTR
+#else
+	#define ENOXATTR ENODATA
+#endif
+
+void xattr_cache_init(void);
+unsigned long xattr_cache_begin(void);
+bool xattr_cache_get(const char *path, const char *name, int branch, char *value, size_t size, int *res);
+void xattr_cache_put(const char *path, const char *name, int branch, const char *value, int res, unsigned long seq);
+void xattr_cache_invalidate(const char *path);
+void xattr_cache_invalidate_tree(const char *path);
+
+#endif
@@ -7,6 +7,9 @@ import shutil
 import time
 import tempfile
 import stat
+import threading
+import mmap
+import struct
 
 
 def call(cmd):
@@ -238,6 +241,61 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
 		self.assertEqual(read_from_file('rw1/ro1_file'), 'something')
 
+	def test_parallel_copyup(self):
+		data = os.urandom(16 * 1024 * 1024)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(data)
+
+		# every thread copies up the file and writes one byte to it, a
+		# second copy-up would undo the writes done before
+		def write_byte(i):
+			with open('union/large_file', 'r+b') as f:
+				f.seek(i)
+				f.write(b'x')
+
+		threads = [threading.Thread(target=write_byte, args=(i,)) for i in range(8)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), b'x' * 8 + data[8:])
+
+	def test_cow_large_file(self):
+		# bigger than the copy buffers, and not a multiple of them
+		data = os.urandom(20 * 1024 * 1024 + 123)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(data)
+
+		with open('union/large_file', 'r+b') as f:
+			f.seek(0, os.SEEK_END)
+			f.write(b'end')
+
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), data + b'end')
+		with open('ro1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), data)
+
+	def test_cow_sparse_file(self):
+		with open('ro1/sparse_file', 'wb') as f:
+			f.truncate(256 * 1024 * 1024)
+			f.seek(100 * 1024 * 1024)
+			f.write(b'data')
+		if os.stat('ro1/sparse_file').st_blocks * 512 >= 1024 * 1024:
+			self.skipTest('file system without sparse files')
+
+		with open('union/sparse_file', 'r+b') as f:
+			f.write(b'start')
+
+		st = os.stat('rw1/sparse_file')
+		self.assertEqual(st.st_size, 256 * 1024 * 1024)
+		self.assertLess(st.st_blocks * 512, 1024 * 1024)
+		with open('rw1/sparse_file', 'rb') as f:
+			self.assertEqual(f.read(5), b'start')
+			f.seek(100 * 1024 * 1024)
+			self.assertEqual(f.read(4), b'data')
+
 	def test_cow_and_whiteout(self):
 		write_to_file('union/ro1_file', 'something')
 		os.remove('union/ro1_file')
@@ -252,6 +310,14 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		self.assertEqual(read_from_file('rw1/new_file'), 'something')
 		self.assertNotIn('new_file', os.listdir('ro1'))
 
+	def test_readlink(self):
+		os.symlink('ro1_dir/ro1_file', 'ro1/link')
+		self.assertEqual(os.readlink('union/link'), 'ro1_dir/ro1_file')
+		self.assertEqual(read_from_file('union/link'), 'ro1')
+		self.assertTrue(os.access('union/link', os.R_OK))
+		with self.assertRaises(OSError):
+			os.readlink('union/ro1_file')
+
 	def test_rename(self):
 		os.rename('union/rw1_file', 'union/rw1_file_renamed')
 		self.assertEqual(read_from_file('union/rw1_file_renamed'), 'rw1')
@@ -347,6 +413,39 @@ class UnionFS_RW_RO_COW_TestCase(Common, unittest.TestCase):
 		#os.rmdir('union/common_dir')
 		#self.assertFalse(os.path.isdir('union/common_dir'))
 
+	def test_rmtree_collapse(self):
+		os.makedirs('ro1/tree/sub')
+		for i in range(10):
+			write_to_file('ro1/tree/sub/file_%d' % i, '')
+		shutil.rmtree('union/tree')
+		self.assertFalse(os.path.exists('union/tree'))
+		# the whiteout of the directory replaced the ones of its members
+		self.assertTrue(os.path.isdir('rw1/.unionfs/tree_HIDDEN~'))
+		self.assertFalse(os.path.exists('rw1/.unionfs/tree'))
+
+		os.mkdir('union/tree')
+		self.assertEqual(os.listdir('union/tree'), [])
+		os.rmdir('union/tree')
+
+		# a directory renamed onto it does not show the old members either
+		os.makedirs('union/other/sub')
+		os.rename('union/other', 'union/tree')
+		self.assertEqual(os.listdir('union/tree/sub'), [])
+
+	def test_large_listing(self):
+		# more entries than fit into a single readdir buffer, from both branches
+		os.mkdir('ro1/large_dir')
+		os.mkdir('rw1/large_dir')
+		for i in range(3000):
+			write_to_file('ro1/large_dir/file_%d' % i, '')
+			if i % 2 == 0:
+				write_to_file('rw1/large_dir/file_%d' % i, '')
+		for i in range(0, 3000, 3):
+			os.remove('union/large_dir/file_%d' % i)
+		lst = os.listdir('union/large_dir')
+		self.assertEqual(len(lst), len(set(lst)))
+		self.assertEqual(set(lst), set('file_%d' % i for i in range(3000) if i % 3))
+
 
 class UnionFS_RO_RW_TestCase(Common, unittest.TestCase):
 	def setUp(self):
@@ -449,6 +548,870 @@ class UnionFS_RO_RW_COW_TestCase(Common, unittest.TestCase):
 		#self.assertFalse(os.path.isdir('union/common_dir'))
 
 
+class UnionFS_RW_RO_COW_LookupCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,lookup_cache=60 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_whiteout(self):
+		self.assertTrue(os.path.isfile('union/ro1_file'))
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		write_to_file('union/ro1_file', 'again')
+		self.assertEqual(read_from_file('union/ro1_file'), 'again')
+
+	def test_negative(self):
+		self.assertFalse(os.path.exists('union/new_file'))
+		write_to_file('union/new_file', 'something')
+		self.assertEqual(read_from_file('union/new_file'), 'something')
+
+	def test_cow(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		write_to_file('union/ro1_file', 'something')
+		self.assertEqual(read_from_file('union/ro1_file'), 'something')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'something')
+
+	def test_rename_dir(self):
+		self.assertTrue(os.path.isfile('union/ro1_dir/ro1_file'))
+		os.rename('union/ro1_dir', 'union/ro1_dir_renamed')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertEqual(read_from_file('union/ro1_dir_renamed/ro1_file'), 'ro1')
+
+	def test_rmdir(self):
+		self.assertTrue(os.path.isdir('union/common_empty_dir'))
+		os.rmdir('union/common_empty_dir')
+		self.assertFalse(os.path.exists('union/common_empty_dir'))
+		os.mkdir('union/common_empty_dir')
+		self.assertTrue(os.path.isdir('union/common_empty_dir'))
+
+
+class UnionFS_RW_RO_COW_WhiteoutIndex_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		# whiteouts existing before the mount must be picked up
+		os.makedirs('rw1/.unionfs/ro1_dir')
+		write_to_file('rw1/.unionfs/ro1_dir/ro1_file_HIDDEN~', '')
+		write_to_file('rw1/.unionfs/ro_common_file_HIDDEN~', '')
+		self.mount('%s -o cow,whiteout_index rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_existing(self):
+		self.assertNotIn('ro_common_file', os.listdir('union'))
+		self.assertNotIn('ro1_file', os.listdir('union/ro1_dir'))
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+
+	def test_whiteout(self):
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		self.assertTrue(os.path.isfile('rw1/.unionfs/ro1_file_HIDDEN~'))
+		write_to_file('union/ro1_file', 'again')
+		self.assertEqual(read_from_file('union/ro1_file'), 'again')
+		self.assertFalse(os.path.exists('rw1/.unionfs/ro1_file_HIDDEN~'))
+
+	def test_hidden_dir(self):
+		# ro1_dir looks empty, since its only file is hidden
+		os.rmdir('union/ro1_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir'))
+		os.mkdir('union/ro1_dir')
+		self.assertEqual(os.listdir('union/ro1_dir'), [])
+
+
+class UnionFS_RW_RO_COW_ReaddirCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,readdir_cache=1000 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_listing(self):
+		lst = ['ro1_file', 'rw1_file', 'ro_common_file', 'rw_common_file', 'common_file', 'ro1_dir', 'rw1_dir', 'common_dir', 'common_empty_dir', ]
+		self.assertEqual(set(lst), set(os.listdir('union')))
+		self.assertEqual(set(lst), set(os.listdir('union')))
+
+	def test_changes(self):
+		self.assertIn('ro1_file', os.listdir('union'))
+		write_to_file('union/new_file', 'something')
+		self.assertIn('new_file', os.listdir('union'))
+		os.remove('union/ro1_file')
+		self.assertNotIn('ro1_file', os.listdir('union'))
+		# changes done directly on a branch are noticed, too
+		write_to_file('ro1/ro1_new_file', 'ro1')
+		self.assertIn('ro1_new_file', os.listdir('union'))
+
+
+class UnionFS_RW_RO_COW_LowLevel_TestCase(UnionFS_RW_RO_COW_TestCase):
+	# same tests as for the path based interface
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lowlevel rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_refused_options(self):
+		# neither are supported by the low-level interface
+		for opt in ('manifest', 'max_branches=4'):
+			with self.assertRaises(subprocess.CalledProcessError):
+				call('%s -o cow,lowlevel,%s rw1=rw:ro1=ro union' % (self.unionfs_path, opt))
+
+	def test_rename_dir_contents(self):
+		os.rename('union/ro1_dir', 'union/renamed_dir')
+		self.assertFalse(os.path.exists('union/ro1_dir/ro1_file'))
+		self.assertEqual(read_from_file('union/renamed_dir/ro1_file'), 'ro1')
+
+
+class UnionFS_RW_RO_COW_DirCopyup_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		for d in range(4):
+			os.makedirs('ro1/tree/d%d/sub' % d)
+			for f in range(25):
+				write_to_file('ro1/tree/d%d/f%d' % (d, f), 'file %d %d' % (d, f))
+				write_to_file('ro1/tree/d%d/sub/f%d' % (d, f), 'sub %d %d' % (d, f))
+		os.symlink('d0/f0', 'ro1/tree/link')
+		self.mount('%s -o cow,dir_copyup=4 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_rename_tree(self):
+		os.rename('union/tree', 'union/renamed_tree')
+		self.assertFalse(os.path.exists('union/tree'))
+		for d in range(4):
+			for f in range(25):
+				self.assertEqual(read_from_file('union/renamed_tree/d%d/f%d' % (d, f)), 'file %d %d' % (d, f))
+				self.assertEqual(read_from_file('union/renamed_tree/d%d/sub/f%d' % (d, f)), 'sub %d %d' % (d, f))
+		self.assertEqual(os.readlink('union/renamed_tree/link'), 'd0/f0')
+
+
+class UnionFS_RW_RO_COW_RedirectDir_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		os.makedirs('ro1/tree/sub')
+		write_to_file('ro1/tree/file', 'file')
+		write_to_file('ro1/tree/sub/file', 'sub')
+		self.mount('%s -o cow,redirect_dir rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_rename(self):
+		os.rename('union/tree', 'union/renamed')
+		self.assertFalse(os.path.exists('union/tree'))
+		self.assertEqual(read_from_file('union/renamed/file'), 'file')
+		self.assertEqual(read_from_file('union/renamed/sub/file'), 'sub')
+		self.assertEqual(set(os.listdir('union/renamed')), {'file', 'sub'})
+		# nothing was copied
+		self.assertEqual(os.listdir('rw1/renamed'), [])
+		self.assertEqual(os.readlink('rw1/.unionfs/renamed_REDIRECT~'), '/tree')
+
+	def test_changes(self):
+		os.rename('union/tree', 'union/renamed')
+		os.remove('union/renamed/file')
+		self.assertFalse(os.path.exists('union/renamed/file'))
+		write_to_file('union/renamed/sub/file', 'changed')
+		self.assertEqual(read_from_file('ro1/tree/sub/file'), 'sub')
+
+		# whiteouts and redirects move along with the directory
+		os.rename('union/renamed', 'union/again')
+		self.assertEqual(os.listdir('union/again'), ['sub'])
+		self.assertEqual(read_from_file('union/again/sub/file'), 'changed')
+		os.rename('union/again/sub', 'union/sub')
+		self.assertEqual(read_from_file('union/sub/file'), 'changed')
+		self.assertEqual(os.listdir('union/again'), [])
+
+	def test_rmdir(self):
+		os.rename('union/tree/sub', 'union/sub')
+		os.remove('union/sub/file')
+		os.rmdir('union/sub')
+		self.assertFalse(os.path.exists('rw1/.unionfs/sub_REDIRECT~'))
+		os.mkdir('union/sub')
+		self.assertEqual(os.listdir('union/sub'), [])
+
+
+class UnionFS_RW_RO_COW_IOUring_TestCase(UnionFS_RW_RO_COW_TestCase):
+	# same tests with the data going through io_uring
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,io_uring=4 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_large_copyup(self):
+		data = os.urandom(1024 * 1024 + 5)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(data)
+
+		with open('union/large_file', 'r+b') as f:
+			f.seek(1000)
+			f.write(b'new data')
+
+		expected = data[:1000] + b'new data' + data[1008:]
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+
+
+class UnionFS_RW_RO_COW_AsyncCopyup_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.data = os.urandom(8 * 1024 * 1024 + 5)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(self.data)
+		self.mount('%s -o cow,async_copyup=2,cowolf_file_size=1k rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def wait_copyup(self):
+		for i in range(100):
+			out = call('%s -c union' % self.unionfsctl_path).decode()
+			if 'copying: 0 files' in out:
+				return out
+			time.sleep(0.1)
+		self.fail('background copy-up did not finish')
+
+	def test_copyup(self):
+		with open('union/large_file', 'r+b') as f:
+			f.seek(4096)
+			f.write(b'new data')
+			f.seek(0)
+			self.assertEqual(f.read(), self.data[:4096] + b'new data' + self.data[4104:])
+
+		out = self.wait_copyup()
+		self.assertIn('finished: 1 files', out)
+
+		expected = self.data[:4096] + b'new data' + self.data[4104:]
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+		with open('ro1/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data)
+
+	def test_truncate(self):
+		with open('union/large_file', 'r+b') as f:
+			f.truncate(1000)
+		self.wait_copyup()
+
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data[:1000])
+
+
+class UnionFS_RW_RO_COW_BlockSize_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.data = os.urandom(1024 * 1024 + 5)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(self.data)
+		self.mount('%s -o cow,cowolf_block_size=64k,cowolf_file_size=1k rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_write(self):
+		expected = bytearray(self.data)
+		with open('union/large_file', 'r+b') as f:
+			for offset in (100, 70000, 70010, 1024 * 1024):
+				f.seek(offset)
+				f.write(b'new data')
+				expected[offset:offset + 8] = b'new data'
+
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+
+		# the written blocks are complete on the rw branch
+		with open('rw1/large_file', 'rb') as f:
+			self.assertEqual(f.read(128 * 1024), expected[:128 * 1024])
+			f.seek(1024 * 1024)
+			self.assertEqual(f.read(), expected[1024 * 1024:])
+
+
+class UnionFS_RW_RO_RO_COW_Cowolf_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.data = os.urandom(256 * 1024)
+		with open('ro2/large_file', 'wb') as f:
+			f.write(self.data)
+		self.mount('%s -o cow,cowolf,cowolf_file_size=1k rw1=rw:ro1=ro:ro2=ro union' % self.unionfs_path)
+
+	def test_write(self):
+		expected = bytearray(self.data)
+		with open('union/large_file', 'r+b') as f:
+			f.seek(1000)
+			f.write(b'new data')
+			expected[1000:1008] = b'new data'
+
+		# the unwritten ranges are read from ro2, the branch below ro1
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+
+		with open('ro2/large_file', 'rb') as f:
+			self.assertEqual(f.read(), self.data)
+
+	def test_rename(self):
+		with open('union/large_file', 'r+b') as f:
+			f.write(b'new data')
+		os.rename('union/large_file', 'union/renamed_file')
+
+		with open('union/renamed_file', 'rb') as f:
+			self.assertEqual(f.read(), b'new data' + self.data[8:])
+
+
+class UnionFS_RW_RO_COW_CowolfMap_TestCase(Common, unittest.TestCase):
+	# the data-range map file of drm_file.c: a header, the snapshot
+	# records and the log records
+	HEADER = '=8sIIQQ'
+	REC = '=QQ'
+	LOG = '=QQQQ'
+
+	def setUp(self):
+		super().setUp()
+		self.data = os.urandom(256 * 1024)
+		with open('ro1/large_file', 'wb') as f:
+			f.write(self.data)
+		self.map_fn = 'rw1/.unionfs/large_file_DRMAP~'
+		self.mount_union()
+
+	def mount_union(self):
+		self.mount('%s -o cow,cowolf,cowolf_file_size=1k rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def unmount_union(self):
+		# the map is written back when the last handle is released
+		call('fusermount -u union')
+		self.mounted = False
+
+	def write_union(self, expected, offsets, data=b'new data'):
+		with open('union/large_file', 'r+b') as f:
+			for offset in offsets:
+				f.seek(offset)
+				f.write(data)
+				expected[offset:offset + len(data)] = data
+
+	def map_header(self):
+		with open(self.map_fn, 'rb') as f:
+			return struct.unpack(self.HEADER, f.read(struct.calcsize(self.HEADER)))
+
+	def map_log_len(self):
+		(_, _, _, _, snap_cnt) = self.map_header()
+		log = os.path.getsize(self.map_fn) - struct.calcsize(self.HEADER) - snap_cnt * struct.calcsize(self.REC)
+		self.assertEqual(log % struct.calcsize(self.LOG), 0)
+		return log // struct.calcsize(self.LOG)
+
+	def assertUnion(self, expected):
+		with open('union/large_file', 'rb') as f:
+			self.assertEqual(f.read(), expected)
+
+	def test_log_replay(self):
+		expected = bytearray(self.data)
+		self.write_union(expected, (1000, 5000, 9000))
+		self.unmount_union()
+
+		(magic, version, _, gen, snap_cnt) = self.map_header()
+		self.assertEqual(magic, b'DRMAPLG\0')
+		self.assertEqual(version, 2)
+		self.assertEqual(gen, 1)
+		self.assertEqual(snap_cnt, 1)
+		self.assertGreater(self.map_log_len(), 0)
+
+		# only the log has the ranges written
+		self.mount_union()
+		self.assertUnion(expected)
+
+		self.write_union(expected, (20000,))
+		self.unmount_union()
+		self.mount_union()
+		self.assertUnion(expected)
+
+	def test_torn_log(self):
+		expected = bytearray(self.data)
+		self.write_union(expected, (1000, 5000))
+		self.unmount_union()
+		size = os.path.getsize(self.map_fn)
+
+		# a crash in the middle of appending a record
+		with open(self.map_fn, 'ab') as f:
+			f.write(b'\xff' * (struct.calcsize(self.LOG) // 2))
+
+		self.mount_union()
+		self.assertUnion(expected)
+		self.assertEqual(os.path.getsize(self.map_fn), size)
+
+		# later records must not end up behind the torn one
+		self.write_union(expected, (9000,))
+		self.unmount_union()
+		self.mount_union()
+		self.assertUnion(expected)
+
+	def test_v1_map(self):
+		expected = bytearray(self.data)
+		self.write_union(expected, (1000,))
+		self.unmount_union()
+
+		# the old format, a bare array of the records
+		with open(self.map_fn, 'wb') as f:
+			f.write(struct.pack(self.REC, 1000, 1007))
+			f.write(struct.pack(self.REC, len(self.data), 2**64 - 1))
+
+		self.mount_union()
+		self.assertUnion(expected)
+		self.unmount_union()
+		self.assertEqual(os.path.getsize(self.map_fn), 2 * struct.calcsize(self.REC))
+
+		# converted by the first write-back
+		self.mount_union()
+		self.write_union(expected, (5000,))
+		self.unmount_union()
+		(magic, version, _, _, snap_cnt) = self.map_header()
+		self.assertEqual(magic, b'DRMAPLG\0')
+		self.assertEqual(version, 2)
+		self.assertEqual(snap_cnt, 3)
+		self.assertEqual(self.map_log_len(), 0)
+
+		self.mount_union()
+		self.assertUnion(expected)
+
+	def test_compaction(self):
+		expected = bytearray(self.data)
+		# keeps the map open while it is replaced
+		keep = open('union/large_file', 'r+b')
+		fd = os.open('union/large_file', os.O_RDWR)
+		try:
+			# more records than DRMF_LOG_MIN, every fsync appends them
+			for i in range(1100):
+				os.pwrite(fd, b'x', i * 64)
+				expected[i * 64] = ord('x')
+				if i % 100 == 99:
+					os.fsync(fd)
+			os.fsync(fd)
+
+			(_, _, _, gen, snap_cnt) = self.map_header()
+			self.assertEqual(gen, 2)
+			self.assertGreater(snap_cnt, 1100)
+			self.assertEqual(self.map_log_len(), 0)
+
+			# the other handle appends to the new file
+			keep.seek(100000)
+			keep.write(b'new data')
+			keep.flush()
+			os.fsync(keep.fileno())
+			expected[100000:100008] = b'new data'
+			self.assertEqual(self.map_header()[3], 2)
+			self.assertEqual(self.map_log_len(), 1)
+		finally:
+			os.close(fd)
+			keep.close()
+
+		self.assertUnion(expected)
+		self.unmount_union()
+		self.mount_union()
+		self.assertUnion(expected)
+
+
+class UnionFS_RW_RO_COW_KeepCacheRO_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,keep_cache_ro rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_copyup(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+
+		# the data written to the copy is read back, not the cached one
+		write_to_file('union/ro1_file', 'new')
+		self.assertEqual(read_from_file('union/ro1_file'), 'new')
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'ro1')
+
+
+class UnionFS_RW_IMM_COW_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow rw1=rw:ro1=imm union' % self.unionfs_path)
+
+	def test_read(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		self.assertEqual(os.stat('union/ro1_file').st_size, 3)
+
+	def test_copy_up(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_file'), 'changed')
+		self.assertEqual(os.stat('union/ro1_file').st_size, 7)
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'changed')
+
+	def test_unlink(self):
+		os.stat('union/ro1_file')
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+
+
+class UnionFS_RW_IMM_COW_LowLevel_TestCase(UnionFS_RW_IMM_COW_TestCase):
+	# with the long timeouts of the low-level interface
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,lowlevel rw1=rw:ro1=imm union' % self.unionfs_path)
+
+
+class UnionFS_RW_RO_COW_Threads_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,clone_fd,min_idle_threads=2,max_idle_threads=4,pin_threads rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_parallel_access(self):
+		# more threads than the workers kept idle
+		def access(i):
+			for j in range(20):
+				write_to_file('union/file_%d' % i, '%d %d' % (i, j))
+				self.assertEqual(read_from_file('union/file_%d' % i), '%d %d' % (i, j))
+				self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+
+		threads = [threading.Thread(target=access, args=(i,)) for i in range(16)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+
+		for i in range(16):
+			self.assertEqual(read_from_file('rw1/file_%d' % i), '%d 19' % i)
+
+	def test_wrong_idle_threads(self):
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -o min_idle_threads=8,max_idle_threads=2 rw1=rw:ro1=ro rw2 2>/dev/null' % self.unionfs_path)
+
+
+class UnionFS_RW_RO_COW_CopyupQoS_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		write_to_file('ro1/big', 'x' * (2 * 1024 * 1024))
+		self.mount('%s -o cow,copyup_bwlimit=1m,copyup_ioprio=idle rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_bwlimit(self):
+		start = time.time()
+		with open('union/big', 'a') as f:
+			f.write('y')
+		self.assertGreater(time.time() - start, 1.5)
+
+		self.assertEqual(read_from_file('rw1/big'), 'x' * (2 * 1024 * 1024) + 'y')
+
+	def test_unlimited(self):
+		call('%s -b 0 union' % self.unionfsctl_path)
+
+		start = time.time()
+		with open('union/big', 'a') as f:
+			f.write('y')
+		self.assertLess(time.time() - start, 1.5)
+
+		self.assertEqual(read_from_file('rw1/big'), 'x' * (2 * 1024 * 1024) + 'y')
+
+	def test_wrong_ioprio(self):
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -o copyup_ioprio=8 rw1=rw:ro1=ro rw2 2>/dev/null' % self.unionfs_path)
+
+
+class UnionFS_RW_RO_COW_CopyupStreams_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.data = os.urandom(5 * 64 * 1024 + 123)
+		with open('ro1/big', 'wb') as f:
+			f.write(self.data)
+		self.mount('%s -o cow,copyup_streams=4,copyup_chunk=64k rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_copyup(self):
+		with open('union/big', 'ab') as f:
+			f.write(b'y')
+
+		with open('rw1/big', 'rb') as f:
+			self.assertEqual(f.read(), self.data + b'y')
+
+	def test_small_file(self):
+		# less than two chunks, copied sequentially
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'changed')
+
+
+class UnionFS_RW_RO_COW_DirectIO_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,direct_io_paths=*.db:/ro1_dir/* rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_direct_io_paths(self):
+		write_to_file('union/test.db', 'db')
+		self.assertEqual(read_from_file('union/test.db'), 'db')
+		self.assertEqual(read_from_file('rw1/test.db'), 'db')
+
+		write_to_file('union/ro1_dir/file', 'direct')
+		self.assertEqual(read_from_file('union/ro1_dir/file'), 'direct')
+
+	def test_o_direct(self):
+		try:
+			fd = os.open('rw1/probe', os.O_CREAT | os.O_WRONLY | os.O_DIRECT, 0o644)
+			os.close(fd)
+		except OSError:
+			self.skipTest('the branch does not support O_DIRECT')
+
+		# page aligned, as O_DIRECT wants it
+		data = mmap.mmap(-1, 4096)
+		data.write(b'x' * 4096)
+		fd = os.open('union/direct', os.O_CREAT | os.O_RDWR | os.O_DIRECT, 0o644)
+		self.assertEqual(os.write(fd, data), 4096)
+
+		got = mmap.mmap(-1, 4096)
+		self.assertEqual(os.preadv(fd, [got], 0), 4096)
+		os.close(fd)
+
+		self.assertEqual(got[:], b'x' * 4096)
+		with open('rw1/direct', 'rb') as f:
+			self.assertEqual(f.read(), b'x' * 4096)
+
+
+class UnionFS_RW_RO_COW_XattrCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		try:
+			os.setxattr('rw1/rw1_file', 'user.test', b'rw1')
+		except OSError:
+			self.tearDown()
+			self.skipTest('the branches do not support user xattrs')
+		self.mount('%s -o cow,xattr_cache=3600,skip_capability rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_cached(self):
+		self.assertEqual(os.getxattr('union/rw1_file', 'user.test'), b'rw1')
+		self.assertEqual(os.getxattr('union/rw1_file', 'user.test'), b'rw1')
+
+	def test_negative(self):
+		for i in range(2):
+			with self.assertRaises(OSError):
+				os.getxattr('union/rw1_file', 'user.none')
+
+		# set through the union, the negative entry is dropped
+		os.setxattr('union/rw1_file', 'user.none', b'now')
+		self.assertEqual(os.getxattr('union/rw1_file', 'user.none'), b'now')
+
+		os.removexattr('union/rw1_file', 'user.none')
+		with self.assertRaises(OSError):
+			os.getxattr('union/rw1_file', 'user.none')
+
+	def test_recreated(self):
+		self.assertEqual(os.getxattr('union/rw1_file', 'user.test'), b'rw1')
+		os.remove('union/rw1_file')
+		write_to_file('union/rw1_file', 'new')
+		with self.assertRaises(OSError):
+			os.getxattr('union/rw1_file', 'user.test')
+
+	def test_skip_capability(self):
+		with self.assertRaises(OSError):
+			os.getxattr('union/rw1_file', 'security.capability')
+
+
+class UnionFS_RW_RO_COW_LiveBranches_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,max_branches=3 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_add_remove(self):
+		self.assertNotIn('ro2_file', os.listdir('union'))
+
+		out = call('%s -a ro2 union' % self.unionfsctl_path).decode()
+		self.assertIn('added branch 2', out)
+		self.assertEqual(read_from_file('union/ro2_file'), 'ro2')
+		# upper branches still win
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+
+		call('%s -r 2 union' % self.unionfsctl_path)
+		self.assertNotIn('ro2_file', os.listdir('union'))
+
+	def test_remove_not_lowest(self):
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -r 0 union 2>/dev/null' % self.unionfsctl_path)
+
+	def test_no_room(self):
+		call('%s -a ro2 union' % self.unionfsctl_path)
+		with self.assertRaises(subprocess.CalledProcessError):
+			call('%s -a rw2=rw union 2>/dev/null' % self.unionfsctl_path)
+
+	def test_set_mode(self):
+		call('%s -m 1=rw union' % self.unionfsctl_path)
+		write_to_file('union/ro1_file', 'changed')
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'changed')
+		self.assertFalse(os.path.exists('rw1/ro1_file'))
+
+		call('%s -m 1=ro union' % self.unionfsctl_path)
+		write_to_file('union/ro1_file', 'copied')
+		self.assertEqual(read_from_file('ro1/ro1_file'), 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_file'), 'copied')
+
+
+class UnionFS_RW_RO_COW_LiveBranches_Caches_TestCase(UnionFS_RW_RO_COW_LiveBranches_TestCase):
+	# only the entries of the changed branch are dropped from the caches
+	def setUp(self):
+		Common.setUp(self)
+		self.mount('%s -o cow,max_branches=3,lookup_cache=3600,readdir_cache=1000 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+
+class UnionFS_RW_RO_COW_WatchBranches_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,watch_branches,entry_timeout=3600,attr_timeout=3600,negative_timeout=3600 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def wait_for(self, cond):
+		# the notification is sent asynchronously
+		for i in range(50):
+			if cond():
+				return
+			time.sleep(0.1)
+		self.fail('change on the branch not noticed')
+
+	def test_new_file(self):
+		self.assertFalse(os.path.exists('union/new_file'))
+		write_to_file('ro1/new_file', 'ro1')
+		self.wait_for(lambda: os.path.exists('union/new_file'))
+		self.assertEqual(read_from_file('union/new_file'), 'ro1')
+
+	def test_removed_file(self):
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'ro1')
+		os.remove('ro1/ro1_dir/ro1_file')
+		self.wait_for(lambda: not os.path.exists('union/ro1_dir/ro1_file'))
+
+	def test_changed_attributes(self):
+		os.stat('union/ro1_file')
+		os.chmod('ro1/ro1_file', 0o600)
+		self.wait_for(lambda: os.stat('union/ro1_file').st_mode & 0o777 == 0o600)
+
+
+class UnionFS_RW_RO_StatsFile_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.stats_fn = '%s/unionfs.prom' % self.tmpdir
+		self.mount('%s -o stats_file=%s rw1=rw:ro1=ro union' % (self.unionfs_path, self.stats_fn))
+
+	def test_stats_file(self):
+		# written right after mounting
+		for i in range(50):
+			if os.path.isfile(self.stats_fn):
+				break
+			time.sleep(0.1)
+		out = read_from_file(self.stats_fn)
+		self.assertIn('# TYPE unionfs_op_duration_seconds histogram', out)
+		self.assertRegex(out, r'unionfs_branch_read_bytes_total\{branch="1",path="[^"]*/ro1/"\} 0')
+
+
+class UnionFS_RW_RO_COW_Record_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.record_fn = '%s/unionfs.rec' % self.tmpdir
+		self.replay_path = '%s/unionfs-replay' % os.path.dirname(self.unionfs_path)
+		self.mount('%s -o cow,record_file=%s rw1=rw:ro1=ro union' % (self.unionfs_path, self.record_fn))
+
+	def test_record_replay(self):
+		self.assertEqual(read_from_file('union/ro1_file'), 'ro1')
+		write_to_file('union/new_file', 'new')
+		os.listdir('union/common_dir')
+		os.unlink('union/ro1_file')
+
+		# the rest is written when unmounting
+		call('fusermount -u union')
+		self.mounted = False
+		with open(self.record_fn, 'rb') as f:
+			self.assertEqual(f.read(8), b'UFSRECRD')
+
+		# the same operations on a union of the same state
+		self.mount('%s -o cow rw2=rw:ro1=ro union' % self.unionfs_path)
+		out = call('%s -j 2 %s union' % (self.replay_path, self.record_fn)).decode()
+		self.assertRegex(out, r'\nopen +[1-9]')
+		self.assertRegex(out, r'\nreaddir +[1-9]')
+		self.assertRegex(out, r'\nunlink +1 +0 +0 ')
+		self.assertIn('operations replayed', out)
+		self.assertEqual(read_from_file('rw2/new_file'), '\0\0\0')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+
+
+class UnionFS_RW_RO_StatfsCache_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o statfs_cache=0.2 rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_statfs(self):
+		# both branches are on the same file system, which is counted once
+		for i in range(3):
+			self.assertEqual(os.statvfs('union').f_blocks, os.statvfs('rw1').f_blocks)
+			time.sleep(0.3)
+
+
+class UnionFS_RW_RO_COW_BloomFilter_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		self.mount('%s -o cow,bloom_filter rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_lookup(self):
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'ro1')
+		self.assertEqual(read_from_file('union/common_file'), 'rw1')
+		self.assertFalse(os.path.exists('union/no_file'))
+
+	def test_create(self):
+		write_to_file('union/new_file', 'new')
+		self.assertEqual(read_from_file('union/new_file'), 'new')
+		os.mkdir('union/new_dir')
+		write_to_file('union/new_dir/new_file', 'new')
+		self.assertEqual(os.listdir('union/new_dir'), ['new_file'])
+
+	def test_rename_dir(self):
+		os.rename('union/rw1_dir', 'union/renamed_dir')
+		self.assertEqual(read_from_file('union/renamed_dir/rw1_file'), 'rw1')
+		self.assertFalse(os.path.exists('union/rw1_dir'))
+
+	def test_copy_up(self):
+		write_to_file('union/ro1_dir/ro1_file', 'changed')
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'changed')
+		self.assertEqual(read_from_file('rw1/ro1_dir/ro1_file'), 'changed')
+
+
+class UnionFS_RW_RO_COW_Manifest_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		call('%s/unionfs-mkmanifest ro1' % os.path.dirname(self.unionfs_path))
+		self.mount('%s -o cow,manifest rw1=rw:ro1=ro union' % self.unionfs_path)
+
+	def test_lookup(self):
+		self.assertEqual(read_from_file('union/ro1_dir/ro1_file'), 'ro1')
+		self.assertEqual(os.stat('union/ro1_file').st_size, 3)
+		self.assertFalse(os.path.exists('union/no_file'))
+
+	def test_listdir(self):
+		self.assertEqual(set(os.listdir('union/common_dir')), {'common_file', 'rw1_file', 'ro1_file'})
+		self.assertNotIn('manifest', os.listdir('union/.unionfs'))
+
+	def test_unlink(self):
+		os.remove('union/ro1_file')
+		self.assertFalse(os.path.exists('union/ro1_file'))
+		self.assertTrue(os.path.exists('ro1/ro1_file'))
+
+	def test_stale_manifest(self):
+		# files added to the root later are not in the manifest
+		self.assertFalse(os.path.exists('union/new_file'))
+		call('fusermount -u union')
+		self.mounted = False
+		write_to_file('ro1/new_file', 'ro1')
+		self.mount('%s -o cow,manifest rw1=rw:ro1=ro union' % self.unionfs_path)
+		self.assertEqual(read_from_file('union/new_file'), 'ro1')
+
+
+class UnionFS_RW_RO_COW_CompactWhiteouts_TestCase(Common, unittest.TestCase):
+	def setUp(self):
+		super().setUp()
+		# left by an older version, which did not collapse them
+		os.makedirs('rw1/.unionfs/ro1_dir/ro1_file_HIDDEN~')
+		os.makedirs('rw1/.unionfs/common_dir')
+		write_to_file('rw1/.unionfs/common_dir/ro1_file_HIDDEN~', '')
+		write_to_file('rw1/.unionfs/common_dir/common_file_HIDDEN~', '')
+		os.mkdir('rw1/.unionfs/common_dir_HIDDEN~')
+		os.rmdir('rw1/common_dir')
+
+	def test_online(self):
+		self.mount('%s -o cow,whiteout_index rw1=rw:ro1=ro union' % self.unionfs_path)
+		self.assertFalse(os.path.exists('union/common_dir'))
+
+		out = call('%s -w union' % self.unionfsctl_path).decode()
+		self.assertEqual(out, '2 whiteouts removed\n')
+		self.assertFalse(os.path.exists('rw1/.unionfs/common_dir'))
+		self.assertFalse(os.path.exists('union/common_dir'))
+		# ro1_dir itself is not hidden
+		self.assertTrue(os.path.isdir('rw1/.unionfs/ro1_dir/ro1_file_HIDDEN~'))
+		self.assertNotIn('ro1_file', os.listdir('union/ro1_dir'))
+
+		os.mkdir('union/common_dir')
+		self.assertEqual(os.listdir('union/common_dir'), [])
+
+	def test_offline(self):
+		out = call('%s/unionfs-compact rw1' % os.path.dirname(self.unionfs_path)).decode()
+		self.assertEqual(out, 'rw1: 2 whiteouts removed\n')
+		self.assertFalse(os.path.exists('rw1/.unionfs/common_dir'))
+
+		self.mount('%s -o cow rw1=rw:ro1=ro union' % self.unionfs_path)
+		self.assertFalse(os.path.exists('union/common_dir'))
+
+
 @unittest.skipIf(os.environ.get('RUNNING_ON_TRAVIS_CI'), 'Not supported on Travis')
 class IOCTL_TestCase(Common, unittest.TestCase):
 	def setUp(self):
@@ -469,6 +1432,22 @@ class IOCTL_TestCase(Common, unittest.TestCase):
 		self.assertRegex(read_from_file(debug_fn), 'unionfs_unlink')
 		self.assertTrue(os.stat(debug_fn).st_size > 0)
 
+	def test_stats(self):
+		write_to_file('union/rw_common_file', 'hello')
+		self.assertEqual(read_from_file('union/rw_common_file'), 'hello')
+		out = call('%s -s union' % self.unionfsctl_path).decode()
+		self.assertRegex(out, r'\nwrite +[1-9]')
+		self.assertRegex(out, r'branch 0: [1-9][0-9]* bytes read, [1-9][0-9]* bytes written')
+		self.assertRegex(out, r'all branches: [1-9][0-9]* bytes read, [1-9][0-9]* bytes written')
+
+	def test_trace(self):
+		call('%s -d trace union' % self.unionfsctl_path)
+		write_to_file('union/rw_common_file', 'hello')
+		out = call('%s -t union' % self.unionfsctl_path).decode()
+		call('%s -d off union' % self.unionfsctl_path)
+		# the write of 5 bytes, found on branch 0
+		self.assertRegex(out, r'\n +[0-9.]+ +[0-9]+ write +[0-9a-f]{8} +0 +[0-9.]+ 5\n')
+
 	def test_wrong_args(self):
 		with self.assertRaises(subprocess.CalledProcessError) as contextmanager:
 			call('%s -xxxx 2>/dev/null' % self.unionfsctl_path)